@@ -0,0 +1,113 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ndnet_core/pointclouds.h>
+#include <ndnet_core/voxel.h>
+#include <ndnet_core/normal_distributions.h>
+
+// the hot loops of the voxelization, the divergences and the export, specialized at compile time by "kernels.hpp".
+// each stage selects the instantiation matching its inputs once per call, and keeps its generic loop for the other inputs
+
+struct nd_output_t;
+
+// compute the voxel key and the point index of the points from "start" to "end". negative if any point falls outside the grid
+typedef int (*voxel_key_kernel_t)(const struct point_cloud_view_t *point_cloud, const struct voxel_grid_t *grid,
+                                    unsigned long start, unsigned long end,
+                                    unsigned long *keys, unsigned long *point_indexes);
+
+// reduce the sorted voxel runs from "first_run" to "last_run" into store entries, at their run number when "compact" or at their voxel index otherwise
+typedef void (*run_reduce_kernel_t)(const struct point_cloud_view_t *point_cloud,
+                                    const unsigned short *classes, unsigned short num_classes, unsigned int *class_counts,
+                                    const unsigned long *keys, const unsigned long *point_indexes, const unsigned long *run_starts,
+                                    unsigned long first_run, unsigned long last_run, bool compact,
+                                    struct nd_store_t *store);
+
+// compute the divergences of the store entries from "start" to "end" to their neighbors at the even stencil slots, and of the neighbors back
+typedef void (*kl_pair_kernel_t)(const struct nd_store_t *store, const long *offsets,
+                                    unsigned long start, unsigned long end,
+                                    double *divergences, uint32_t *neighbors);
+
+// write the valid store entries from "start" to "end" to the output, from row "row" on
+typedef void (*export_kernel_t)(const struct nd_store_t *store, const struct nd_output_t *output,
+                                    unsigned long start, unsigned long end, unsigned long row);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Enable or disable the specialized kernels. Disabled kernels leave every stage on its generic loop, such as to compare both.
+    \param enabled Whether the stages use the specialized kernels. Enabled by default.
+*/
+void kernels_set_enabled(bool enabled);
+
+/*! \brief Get whether the stages use the specialized kernels.
+    \return True if the specialized kernels are enabled.
+*/
+bool kernels_enabled(void);
+
+/*! \brief Select the voxel key kernel of a point cloud layout.
+    Specialized for float32 and float64 points of 3 or 4 interleaved values, and for separate columns.
+    \param point_cloud Pointer to the point cloud view.
+    \return The kernel, or NULL for the generic loop.
+*/
+voxel_key_kernel_t kernels_select_voxel_keys(const struct point_cloud_view_t *point_cloud);
+
+/*! \brief Select the voxel run reduction kernel of a point cloud layout and a class estimator, reducing into a store.
+    Specialized for the layouts of "kernels_select_voxel_keys" without extra channels, without classes or with either class estimator.
+    \param point_cloud Pointer to the point cloud view.
+    \param with_classes Whether the points have classes.
+    \param class_estimator Estimator of the most frequent class of each voxel.
+    \return The kernel, or NULL for the generic loop.
+*/
+run_reduce_kernel_t kernels_select_run_reduce(const struct point_cloud_view_t *point_cloud, bool with_classes, enum class_estimator_t class_estimator);
+
+/*! \brief Select the divergence kernel of a neighborhood and a store layout.
+    Specialized for every neighborhood on dense stores. Sparse stores spend their time finding the neighbors, which the kernels do not speed up.
+    \param neighborhood Neighborhood compared by the divergences.
+    \param dense Whether the store is dense.
+    \return The kernel, or NULL for the generic loop.
+*/
+kl_pair_kernel_t kernels_select_kl_pairs(enum neighborhood_t neighborhood, bool dense);
+
+/*! \brief Select the export kernel of an output, writing the distributions of a store.
+    Specialized for the model features of "nd_output_init_features" on sparse stores, and for the point clouds of "nd_output_init" without extra channels.
+    Dense stores spend their feature exports skipping the empty voxels, which the kernels do not speed up.
+    \param output Pointer to the output.
+    \param store Pointer to the exported store.
+    \return The kernel, or NULL for the generic loop.
+*/
+export_kernel_t kernels_select_export(const struct nd_output_t *output, const struct nd_store_t *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KERNELS_H_
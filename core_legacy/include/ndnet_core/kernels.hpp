@@ -0,0 +1,456 @@
+#ifndef KERNELS_HPP_
+#define KERNELS_HPP_
+
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+// header-only C++17 kernels of the voxelization, the divergences and the export, specialized at compile time
+// on the point layout, the class estimator, the neighborhood stencil and the output format.
+// the C API selects the instantiations of "src/kernels.cpp" through "kernels.h", and other
+// instantiations can be made for the layouts of a particular pipeline
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <ndnet_core/kernels.h>
+#include <ndnet_core/ndt.h>
+
+namespace ndnet::kernels {
+
+template<typename Scalar>
+constexpr point_type_t point_type_of = std::is_same_v<Scalar, float> ? POINT_TYPE_FLOAT32 : POINT_TYPE_FLOAT64;
+
+/* point layouts: read the xyz coordinates of a point as double */
+
+// points of "Dim" interleaved values, the xyz coordinates first
+template<typename Scalar, unsigned int Dim>
+struct interleaved_points {
+    static_assert(Dim >= 3, "the points need the xyz coordinates");
+    const Scalar *data;
+
+    explicit interleaved_points(const point_cloud_view_t &view) : data(static_cast<const Scalar *>(view.x)) {}
+
+    static bool matches(const point_cloud_view_t &view) {
+        const char *x = static_cast<const char *>(view.x);
+        return view.type == point_type_of<Scalar> && view.stride == Dim * sizeof(Scalar) &&
+                static_cast<const char *>(view.y) == x + sizeof(Scalar) && static_cast<const char *>(view.z) == x + 2 * sizeof(Scalar);
+    }
+
+    void get(unsigned long i, double *point) const {
+        const Scalar *values = data + i * Dim;
+        point[0] = values[0];
+        point[1] = values[1];
+        point[2] = values[2];
+    }
+};
+
+// points with a separate contiguous column per coordinate
+template<typename Scalar>
+struct column_points {
+    const Scalar *x;
+    const Scalar *y;
+    const Scalar *z;
+
+    explicit column_points(const point_cloud_view_t &view) :
+        x(static_cast<const Scalar *>(view.x)), y(static_cast<const Scalar *>(view.y)), z(static_cast<const Scalar *>(view.z)) {}
+
+    static bool matches(const point_cloud_view_t &view) {
+        return view.type == point_type_of<Scalar> && view.stride == sizeof(Scalar);
+    }
+
+    void get(unsigned long i, double *point) const {
+        point[0] = x[i];
+        point[1] = y[i];
+        point[2] = z[i];
+    }
+};
+
+// any view, read through its runtime type and stride like the generic loops
+struct view_points {
+    const point_cloud_view_t *view;
+
+    explicit view_points(const point_cloud_view_t &view) : view(&view) {}
+
+    static bool matches(const point_cloud_view_t &) {
+        return true;
+    }
+
+    void get(unsigned long i, double *point) const {
+        point_cloud_view_get(view, i, point);
+    }
+};
+
+/* class estimators: the most frequent class of the points of a voxel */
+
+// points without classes
+struct no_labels {
+    static constexpr bool enabled = false;
+
+    no_labels(const unsigned short *, unsigned short, unsigned int *) {}
+    void begin() {}
+    void add(unsigned long) {}
+    unsigned short label() const { return 0; }
+};
+
+// streaming majority vote, as "CLASS_ESTIMATOR_STREAMING_MAJORITY"
+struct vote_labels {
+    static constexpr bool enabled = true;
+    const unsigned short *classes;
+    unsigned short candidate = 0;
+    unsigned long votes = 0;
+
+    vote_labels(const unsigned short *classes, unsigned short, unsigned int *) : classes(classes) {}
+
+    void begin() {
+        candidate = 0;
+        votes = 0;
+    }
+
+    void add(unsigned long i) {
+        unsigned short point_class = classes[i];
+        bool empty = votes == 0;
+        bool same = point_class == candidate;
+        candidate = empty ? point_class : candidate;
+        votes = empty ? 1 : (same ? votes + 1 : votes - 1);
+    }
+
+    unsigned short label() const { return candidate; }
+};
+
+// class sample counters, as "CLASS_ESTIMATOR_HISTOGRAM". ties go to the lowest class
+struct histogram_labels {
+    static constexpr bool enabled = true;
+    const unsigned short *classes;
+    unsigned short num_classes;
+    unsigned int *counts; // "num_classes + 1" counters of the worker
+
+    histogram_labels(const unsigned short *classes, unsigned short num_classes, unsigned int *counts) :
+        classes(classes), num_classes(num_classes), counts(counts) {}
+
+    void begin() {
+        std::memset(counts, 0, (num_classes + 1) * sizeof(unsigned int));
+    }
+
+    void add(unsigned long i) {
+        counts[classes[i]]++;
+    }
+
+    unsigned short label() const {
+        unsigned short label = 0;
+        unsigned int max_samples = 0;
+        for(unsigned short j = 0; j <= num_classes; j++) {
+            bool more = counts[j] > max_samples;
+            label = more ? j : label;
+            max_samples = more ? counts[j] : max_samples;
+        }
+        return label;
+    }
+};
+
+/* voxelization */
+
+// compute the voxel key and the point index of the points from "start" to "end".
+// the range check is folded over the chunk, so the loop has no branch. negative if any point falls outside the grid
+template<typename Points>
+int voxel_keys(const point_cloud_view_t &view, const voxel_grid_t &grid, unsigned long start, unsigned long end,
+                unsigned long *keys, unsigned long *point_indexes) {
+
+    Points points(view);
+    unsigned long len_x = grid.len_x;
+    unsigned long len_xy = len_x * grid.len_y;
+    bool outside = false;
+
+    for(unsigned long i = start; i < end; i++) {
+        double point[3];
+        points.get(i, point);
+        long voxel_x = static_cast<long>(std::floor((point[0] - grid.x_offset) / grid.voxel_size));
+        long voxel_y = static_cast<long>(std::floor((point[1] - grid.y_offset) / grid.voxel_size));
+        long voxel_z = static_cast<long>(std::floor((point[2] - grid.z_offset) / grid.voxel_size));
+        outside |= (static_cast<unsigned long>(voxel_x) >= len_x) | (static_cast<unsigned long>(voxel_y) >= grid.len_y) |
+                    (static_cast<unsigned long>(voxel_z) >= grid.len_z);
+        keys[i] = static_cast<unsigned long>(voxel_z) * len_xy + static_cast<unsigned long>(voxel_y) * len_x + static_cast<unsigned long>(voxel_x);
+        point_indexes[i] = i;
+    }
+
+    return outside ? -1 : 0;
+}
+
+// accumulate the sufficient statistics of the points at "point_indexes", in the same order as "nd_moments_accumulate"
+template<typename Points>
+void accumulate_moments(const Points &points, const unsigned long *point_indexes, unsigned long num_points, nd_moments_t *moments) {
+
+    if(num_points == 0)
+        return;
+    if(moments->num_samples == 0)
+        points.get(point_indexes[0], moments->shift);
+
+    double sx = 0, sy = 0, sz = 0;
+    double sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0, szz = 0;
+
+    double x[MOMENTS_BLOCK_SIZE], y[MOMENTS_BLOCK_SIZE], z[MOMENTS_BLOCK_SIZE];
+    for(unsigned long start = 0; start < num_points; start += MOMENTS_BLOCK_SIZE) {
+
+        unsigned long block = num_points - start < MOMENTS_BLOCK_SIZE ? num_points - start : MOMENTS_BLOCK_SIZE;
+        for(unsigned long i = 0; i < block; i++) {
+            double point[3];
+            points.get(point_indexes[start+i], point);
+            x[i] = point[0] - moments->shift[0];
+            y[i] = point[1] - moments->shift[1];
+            z[i] = point[2] - moments->shift[2];
+        }
+
+        #pragma omp simd reduction(+:sx,sy,sz,sxx,sxy,sxz,syy,syz,szz)
+        for(unsigned long i = 0; i < block; i++) {
+            sx += x[i];
+            sy += y[i];
+            sz += z[i];
+            sxx += x[i] * x[i];
+            sxy += x[i] * y[i];
+            sxz += x[i] * z[i];
+            syy += y[i] * y[i];
+            syz += y[i] * z[i];
+            szz += z[i] * z[i];
+        }
+    }
+
+    moments->num_samples += num_points;
+    moments->sum[0] += sx;
+    moments->sum[1] += sy;
+    moments->sum[2] += sz;
+    moments->sum_sq[0] += sxx;
+    moments->sum_sq[1] += sxy;
+    moments->sum_sq[2] += sxz;
+    moments->sum_sq[3] += syy;
+    moments->sum_sq[4] += syz;
+    moments->sum_sq[5] += szz;
+}
+
+// reduce the sorted voxel runs from "first_run" to "last_run" into store entries. the store has no extra channels
+template<typename Points, typename Labels>
+void reduce_runs(const point_cloud_view_t &view, const unsigned short *classes, unsigned short num_classes, unsigned int *class_counts,
+                const unsigned long *keys, const unsigned long *point_indexes, const unsigned long *run_starts,
+                unsigned long first_run, unsigned long last_run, bool compact, nd_store_t *store) {
+
+    Points points(view);
+    Labels labels(classes, num_classes, class_counts);
+
+    for(unsigned long r = first_run; r < last_run; r++) {
+
+        unsigned long start = run_starts[r];
+        unsigned long end = run_starts[r+1];
+        unsigned long index = keys[start];
+
+        nd_moments_t moments;
+        std::memset(&moments, 0, sizeof(nd_moments_t));
+        accumulate_moments(points, &point_indexes[start], end - start, &moments);
+
+        unsigned long entry = compact ? r : index;
+        store->num_samples[entry] = moments.num_samples;
+        nd_moments_finalize(&moments, &store->mean[entry*3], &store->covariance[entry*9]);
+        store->index[entry] = index;
+
+        if constexpr(Labels::enabled) {
+            labels.begin();
+            for(unsigned long i = start; i < end; i++)
+                labels.add(point_indexes[i]);
+            store->classes[entry] = labels.label();
+        }
+    }
+}
+
+/* divergences */
+
+// offsets of the neighbors of a voxel, in the order of "neighbor_stencil"
+constexpr signed char stencil_offsets[NEIGHBORHOOD_MAX_LEN][3] = {
+    {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1},
+    {1, 1, 0}, {-1, -1, 0}, {-1, 1, 0}, {1, -1, 0}, {1, 0, 1}, {-1, 0, -1},
+    {-1, 0, 1}, {1, 0, -1}, {0, 1, 1}, {0, -1, -1}, {0, -1, 1}, {0, 1, -1},
+    {1, 1, 1}, {-1, -1, -1}, {-1, 1, 1}, {1, -1, -1}, {1, -1, 1}, {-1, 1, -1}, {-1, -1, 1}, {1, 1, -1}
+};
+
+constexpr uint32_t no_neighbor = UINT32_MAX;
+
+// find the entry of a voxel "offset" indexes ahead of entry "i", as the generic loop
+template<bool Dense>
+inline bool find_ahead(const nd_store_t *store, unsigned long i, unsigned long offset, unsigned long *entry) {
+
+    unsigned long index = store->index[i] + offset;
+    if constexpr(Dense) {
+        *entry = index;
+        return true;
+    } else {
+        unsigned long lo = i + 1;
+        unsigned long hi = offset < store->num_nds - lo ? lo + offset : store->num_nds;
+        while(lo < hi) {
+            unsigned long mid = lo + (hi - lo) / 2;
+            if(store->index[mid] < index)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        *entry = lo;
+        return lo < store->num_nds && store->index[lo] == index;
+    }
+}
+
+// evaluate the gathered pairs in both directions and write them to their neighbor slots
+template<unsigned int NumSlots>
+inline void flush_pairs(const nd_store_t *store, const unsigned long *p, const unsigned long *q, const unsigned char *slots,
+                        unsigned long num_pairs, double *divergences, uint32_t *neighbors) {
+
+    double divergences_pq[KL_BATCH_SIZE], divergences_qp[KL_BATCH_SIZE];
+    kl_divergence_batch_symmetric(store->mean, store->covariance, store->inverse_covariance, store->log_determinant,
+                                p, q, num_pairs, divergences_pq, divergences_qp);
+
+    for(unsigned long k = 0; k < num_pairs; k++) {
+        divergences[p[k]*NumSlots+slots[k]] = divergences_pq[k];
+        neighbors[p[k]*NumSlots+slots[k]] = static_cast<uint32_t>(q[k]);
+        divergences[q[k]*NumSlots+slots[k]+1] = divergences_qp[k];
+        neighbors[q[k]*NumSlots+slots[k]+1] = static_cast<uint32_t>(p[k]);
+    }
+}
+
+// compute the divergences of the entries from "start" to "end" to their neighbors at the even stencil slots, as the generic loop.
+// the stencil is unrolled, and dense stores find their neighbors without a search
+template<neighborhood_t Neighborhood, bool Dense>
+void kl_pairs(const nd_store_t *store, const long *offsets, unsigned long start, unsigned long end,
+                double *divergences, uint32_t *neighbors) {
+
+    constexpr unsigned int num_slots = static_cast<unsigned int>(Neighborhood);
+    unsigned long p[KL_BATCH_SIZE], q[KL_BATCH_SIZE];
+    unsigned char slots[KL_BATCH_SIZE];
+    unsigned long num_pairs = 0;
+
+    long len_x = store->len_x, len_y = store->len_y, len_z = store->len_z;
+    unsigned long len_xy = static_cast<unsigned long>(len_x) * len_y;
+
+    for(unsigned long i = start; i < end; i++) {
+
+        if(store->num_samples[i] == 0)
+            continue;
+
+        unsigned long index = store->index[i];
+        long x = static_cast<long>(index % len_x);
+        long y = static_cast<long>((index / len_x) % len_y);
+        long z = static_cast<long>(index / len_xy);
+        bool interior = x > 0 && x + 1 < len_x && y > 0 && y + 1 < len_y && z > 0 && z + 1 < len_z;
+
+        for(unsigned int s = 0; s < num_slots; s += 2) {
+
+            if(!interior) {
+                long nx = x + stencil_offsets[s][0];
+                long ny = y + stencil_offsets[s][1];
+                long nz = z + stencil_offsets[s][2];
+                if(nx < 0 || nx >= len_x || ny < 0 || ny >= len_y || nz < 0 || nz >= len_z)
+                    continue;
+            }
+
+            unsigned long neighbor;
+            if(!find_ahead<Dense>(store, i, static_cast<unsigned long>(offsets[s]), &neighbor) || store->num_samples[neighbor] == 0)
+                continue;
+
+            // distributions without enough samples keep a null divergence to their neighbors
+            if(store->num_samples[i] <= 1 || store->num_samples[neighbor] <= 1) {
+                divergences[i*num_slots+s] = 0;
+                neighbors[i*num_slots+s] = static_cast<uint32_t>(neighbor);
+                divergences[neighbor*num_slots+s+1] = 0;
+                neighbors[neighbor*num_slots+s+1] = static_cast<uint32_t>(i);
+                continue;
+            }
+            if(!store->invertible[i] || !store->invertible[neighbor])
+                continue;
+
+            p[num_pairs] = i;
+            q[num_pairs] = neighbor;
+            slots[num_pairs] = static_cast<unsigned char>(s);
+            if(++num_pairs == KL_BATCH_SIZE) {
+                flush_pairs<num_slots>(store, p, q, slots, num_pairs, divergences, neighbors);
+                num_pairs = 0;
+            }
+        }
+    }
+
+    flush_pairs<num_slots>(store, p, q, slots, num_pairs, divergences, neighbors);
+}
+
+/* export */
+
+// write values to an output column, converting them to the output type
+template<typename Out, bool Sanitize, unsigned int NumValues>
+inline void export_values(Out *dst, const double *src) {
+    for(unsigned int k = 0; k < NumValues; k++) {
+        if constexpr(Sanitize)
+            dst[k] = static_cast<Out>(std::isfinite(src[k]) ? src[k] : 0.0);
+        else
+            dst[k] = static_cast<Out>(src[k]);
+    }
+}
+
+// write the valid store entries from "start" to "end" from row "row" on, as the generic loop. the store has no extra channels to write
+template<typename Out, covariance_layout_t Layout, bool OneHot, bool Classes, bool Sanitize>
+void export_rows(const nd_store_t *store, const nd_output_t *output, unsigned long start, unsigned long end, unsigned long row) {
+
+    char *points = static_cast<char *>(output->points);
+    char *covariances = static_cast<char *>(output->covariances);
+    char *one_hot = static_cast<char *>(output->one_hot);
+    char *classes = reinterpret_cast<char *>(output->classes);
+
+    for(unsigned long i = start; i < end; i++) {
+
+        if(store->num_samples[i] == 0)
+            continue;
+
+        unsigned short nd_class = store->classes != nullptr ? store->classes[i] : 0;
+        export_values<Out, Sanitize, 3>(reinterpret_cast<Out *>(points + row * output->point_stride), &store->mean[i*3]);
+
+        const double *covariance = &store->covariance[i*9];
+        Out *dst = reinterpret_cast<Out *>(covariances + row * output->covariance_stride);
+        if constexpr(Layout == COVARIANCE_UPPER) {
+            double upper[6] = {covariance[0], covariance[1], covariance[2], covariance[4], covariance[5], covariance[8]};
+            export_values<Out, Sanitize, 6>(dst, upper);
+        } else {
+            export_values<Out, Sanitize, 9>(dst, covariance);
+        }
+
+        if constexpr(Classes)
+            *reinterpret_cast<unsigned short *>(classes + row * output->class_stride) = nd_class;
+
+        if constexpr(OneHot) {
+            Out *labels = reinterpret_cast<Out *>(one_hot + row * output->one_hot_stride);
+            std::memset(labels, 0, output->num_labels * sizeof(Out));
+            if(nd_class < output->num_labels)
+                labels[nd_class] = 1;
+        }
+
+        row++;
+    }
+}
+
+} // namespace ndnet::kernels
+
+#endif // KERNELS_HPP_
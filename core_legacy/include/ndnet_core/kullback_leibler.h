@@ -29,13 +29,23 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <math.h>
 
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h>
+#include <gsl/gsl_blas.h>
 #include <omp.h>
 
 #include <ndnet_core/voxel.h>
 #include <ndnet_core/normal_distributions.h>
+#include <ndnet_core/thread_pool.h>
+
+#define KL_CHUNK_SIZE 256 // number of distributions taken at once by a pool worker
+#define KL_BATCH_SIZE 64 // number of pairs of distributions evaluated at once by the batched kernel
+#define KL_MAX_ENTRIES UINT32_MAX // largest number of distributions addressed by the divergences
+#define KL_NO_NEIGHBOR UINT32_MAX // marks a neighbor slot without divergence
 
 struct kl_divergence_t {
     double divergence; // divergence value
@@ -43,6 +53,15 @@ struct kl_divergence_t {
     struct normal_distribution_t *q; // pointer to the second normal distribution
 };
 
+// divergence between two distributions of a store, identified by their store entries
+// the entries are also the positions of the distributions in arrays materialized from the store
+// without pointers, the divergences can be serialized or shared between processes
+struct kl_edge_t {
+    double divergence; // divergence value
+    uint32_t p; // store entry of the first normal distribution
+    uint32_t q; // store entry of the second normal distribution
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,23 +70,140 @@ extern "C" {
     \param p Pointer to the first normal distribution.
     \param q Pointer to the second normal distribution.
     \param divergence Pointer to the divergence value. Will be overwritten.
-    \return 0 if successful, -1 otherwise.
+    \return 0 if successful, -1 if a distribution has not enough samples, -2 if a covariance matrix is singular.
 */
 int kl_divergence(struct normal_distribution_t *p, struct normal_distribution_t *q, double *divergence);
 
-/*! \brief Calculate the Kullback-Leibler divergences between all pairs of valid normal distributions.
-    \param nd_array Pointer to the array of normal distributions.
-    \param num_nds Number of normal distributions.
+/*! \brief Compute the multivariate Kullback-Leibler divergence between two 3-d normal distributions in closed form.
+    Only the upper triangles of the covariances are read, and nothing is allocated or written besides the divergence.
+    \param p_mean Pointer to the mean of the first distribution (3-d).
+    \param p_covariance Pointer to the flattened symmetric covariance of the first distribution (9-d).
+    \param q_mean Pointer to the mean of the second distribution (3-d).
+    \param q_covariance Pointer to the flattened symmetric covariance of the second distribution (9-d).
+    \param divergence Pointer to the divergence value. Will be overwritten.
+    \return 0 if successful, -2 if a covariance matrix is singular.
+*/
+int kl_divergence_3x3(const double *p_mean, const double *p_covariance,
+                        const double *q_mean, const double *q_covariance,
+                        double *divergence);
+
+/*! \brief Compute the Kullback-Leibler divergences between many pairs of 3-d normal distributions at once.
+    The pairs are evaluated in blocks of "KL_BATCH_SIZE" with SIMD. The number of samples is not checked.
+    \param means Pointer to the means of the distributions (3 per distribution).
+    \param covariances Pointer to the flattened symmetric covariances of the distributions (9 per distribution).
+    \param p Pointer to the indexes of the first distribution of each pair.
+    \param q Pointer to the indexes of the second distribution of each pair.
+    \param num_pairs Number of pairs.
+    \param divergences Pointer to the divergence of each pair, NaN if a covariance matrix is singular. Will be overwritten.
+*/
+void kl_divergence_batch(const double *means, const double *covariances,
+                        const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                        double *divergences);
+
+/*! \brief Compute the Kullback-Leibler divergences between many pairs of 3-d normal distributions with cached factors.
+    The pairs are evaluated in blocks of "KL_BATCH_SIZE" with SIMD, without any division or logarithm.
+    The caller must skip the pairs with a distribution that is not invertible.
+    \param means Pointer to the means of the distributions (3 per distribution).
+    \param covariances Pointer to the flattened symmetric covariances of the distributions (9 per distribution).
+    \param inverse_covariances Pointer to the flattened inverse covariances of the distributions (9 per distribution).
+    \param log_determinants Pointer to the logarithms of the covariance determinants of the distributions.
+    \param p Pointer to the indexes of the first distribution of each pair.
+    \param q Pointer to the indexes of the second distribution of each pair.
+    \param num_pairs Number of pairs.
+    \param divergences Pointer to the divergence of each pair. Will be overwritten.
+*/
+void kl_divergence_batch_factored(const double *means, const double *covariances,
+                                const double *inverse_covariances, const double *log_determinants,
+                                const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                                double *divergences);
+
+/*! \brief Compute the Kullback-Leibler divergences between many pairs of 3-d normal distributions in both directions with cached factors.
+    Both directions share the gathers, the mean difference and the log-determinant ratio.
+    The caller must skip the pairs with a distribution that is not invertible.
+    \param means Pointer to the means of the distributions (3 per distribution).
+    \param covariances Pointer to the flattened symmetric covariances of the distributions (9 per distribution).
+    \param inverse_covariances Pointer to the flattened inverse covariances of the distributions (9 per distribution).
+    \param log_determinants Pointer to the logarithms of the covariance determinants of the distributions.
+    \param p Pointer to the indexes of the first distribution of each pair.
+    \param q Pointer to the indexes of the second distribution of each pair.
+    \param num_pairs Number of pairs.
+    \param divergences_pq Pointer to the divergence of the first distribution from the second, for each pair. Will be overwritten.
+    \param divergences_qp Pointer to the divergence of the second distribution from the first, for each pair. Will be overwritten.
+*/
+void kl_divergence_batch_symmetric(const double *means, const double *covariances,
+                                const double *inverse_covariances, const double *log_determinants,
+                                const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                                double *divergences_pq, double *divergences_qp);
+
+/*! \brief Compute the multivariate Kullback-Leibler divergence between two normal distributions with GSL.
+    Reference implementation of "kl_divergence", kept for validation and benchmarking.
+    \param p Pointer to the first normal distribution.
+    \param q Pointer to the second normal distribution.
+    \param divergence Pointer to the divergence value. Will be overwritten.
+    \return 0 if successful, -1 if a distribution has not enough samples, -2 if a covariance matrix is singular.
+*/
+int kl_divergence_gsl(const struct normal_distribution_t *p, const struct normal_distribution_t *q, double *divergence);
+
+/*! \brief Calculate the Kullback-Leibler divergences between all pairs of valid neighboring normal distributions.
+    \param nd_array Pointer to the array of normal distributions. Either a dense grid or a sparse grid sorted by voxel index.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
     \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
     \param kl_divergences Pointer to the array of Kullback-Leibler divergences. Will be overwritten.
     \param num_kl_divergences Pointer to the number of Kullback-Leibler divergences. Will be overwritten.
     \return 0 if successful, -1 otherwise.
 */
-int calculate_kl_divergences(struct normal_distribution_t *nd_array,
+int calculate_kl_divergences(struct normal_distribution_t *nd_array, unsigned long num_nds,
                             unsigned int len_x, unsigned int len_y, unsigned int len_z,
                             unsigned long *num_valid_nds,
                             struct kl_divergence_t *kl_divergences, unsigned long *num_kl_divergences);
 
+/*! \brief Calculate the Kullback-Leibler divergences between all pairs of valid neighboring normal distributions of a store.
+    The divergences are ranked from the largest to the smallest.
+    \param store Pointer to the store of normal distributions, factored with "factor_nd_store". At most "KL_MAX_ENTRIES" entries.
+    \param neighborhood Neighbors compared around each distribution.
+    \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of divergences, sized to the number of divergences. Will be allocated and overwritten. Free with "free_kl_edges", unless it was taken from the scratch memory of the store.
+    \param num_kl_edges Pointer to the number of divergences. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int calculate_kl_edges(const struct nd_store_t *store, enum neighborhood_t neighborhood,
+                        unsigned long *num_valid_nds,
+                        struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Rank the divergences of the neighbor slots of a store, from the largest to the smallest.
+    Pairs with the same divergence keep their entry and neighbor slot order.
+    \param store Pointer to the store of normal distributions. Only its number of samples and its scratch memory are used.
+    \param num_slots Number of neighbor slots of each distribution.
+    \param divergences Pointer to the divergence of each distribution to each neighbor slot ("num_slots" per distribution).
+    \param neighbors Pointer to the store entry of each neighbor slot, "KL_NO_NEIGHBOR" if there is no divergence.
+    \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of ranked divergences. Will be allocated and overwritten, as in "calculate_kl_edges".
+    \param num_kl_edges Pointer to the number of divergences. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int rank_kl_edges(const struct nd_store_t *store, unsigned int num_slots,
+                    const double *divergences, const uint32_t *neighbors,
+                    unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Convert store divergences to divergences between the distributions of an array materialized from the same store.
+    \param kl_edges Pointer to the array of store divergences.
+    \param num_kl_edges Number of store divergences.
+    \param nd_array Pointer to the array of normal distributions, with the same entries as the store.
+    \param kl_divergences Pointer to the array of divergences, with room for "num_kl_edges". Will be overwritten.
+*/
+void kl_edges_to_divergences(struct kl_edge_t *kl_edges, unsigned long num_kl_edges,
+                                struct normal_distribution_t *nd_array,
+                                struct kl_divergence_t *kl_divergences);
+
+/*! \brief Free the memory allocated for the store divergences.
+    \param kl_edges Pointer to the array of store divergences.
+*/
+void free_kl_edges(struct kl_edge_t *kl_edges);
+
 /*! \brief Free the memory allocated for the Kullback-Leibler divergences.
     \param kl_divergences Pointer to the array of Kullback-Leibler divergences.
 */
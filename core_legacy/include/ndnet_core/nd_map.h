@@ -0,0 +1,145 @@
+#ifndef ND_MAP_H_
+#define ND_MAP_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+
+#include <ndnet_core/voxel.h>
+#include <ndnet_core/pointclouds.h>
+#include <ndnet_core/normal_distributions.h>
+#include <ndnet_core/kullback_leibler.h>
+#include <ndnet_core/radix_sort.h>
+#include <ndnet_core/scratch.h>
+#include <ndnet_core/thread_pool.h>
+
+#define ND_MAP_COORD_BITS 21 // bits of each voxel coordinate in the packed voxel keys
+#define ND_MAP_COORD_LIMIT (1L << (ND_MAP_COORD_BITS - 1)) // voxel coordinates range from "-ND_MAP_COORD_LIMIT" to "ND_MAP_COORD_LIMIT - 1"
+#define ND_MAP_NO_ENTRY ULONG_MAX // marks a free slot of the hash table of a map
+#define ND_MAP_MIN_CAPACITY 1024 // smallest number of entries allocated by a map
+#define ND_MAP_CHUNK_SIZE 1024 // number of points or voxels taken at once by a pool worker
+
+// map of normal distributions accumulated over many point clouds, such as the sweeps of a sliding window.
+// the voxels are anchored at a fixed world origin, so every cloud inserted in the map shares the same voxels.
+// each voxel keeps the sufficient statistics of its points, so a batch of points can be inserted and later removed
+// exactly, without rebuilding the map from the remaining points. the voxels changed by the batches are tracked,
+// and "nd_map_update" recomputes the divergences of the changed voxels and of their neighbors only.
+// the entries are kept in a store in insertion order, which the export and ranking functions of stores read directly
+struct nd_map_t {
+    double voxel_size; // voxel size
+    double origin[3]; // world coordinates of the corner of voxel (0, 0, 0)
+    enum neighborhood_t neighborhood; // neighbors compared by the divergences
+    struct nd_store_t store; // distribution of each entry. the index column holds the packed voxel key of each entry, and the store is always factored
+    struct nd_moments_t *moments; // sufficient statistics of each entry
+    double *divergences; // divergence of each entry to each neighbor slot, "neighborhood" per entry
+    uint32_t *neighbors; // entry of each neighbor slot, "KL_NO_NEIGHBOR" if there is no divergence
+    unsigned long capacity; // number of entries the columns have room for
+    unsigned long max_entries; // largest number of entries, "KL_MAX_ENTRIES" after "nd_map_init". Lower it to bound the memory of the map
+    unsigned long *table; // entry of each slot of the open addressing hash table of the voxel keys, "ND_MAP_NO_ENTRY" for free slots
+    unsigned long table_len; // number of slots of the hash table, a power of two
+    bool *changed; // whether each entry changed since the last update
+    unsigned long *changed_entries; // entries changed since the last update, in order of change
+    unsigned long num_changed; // number of entries changed since the last update
+    struct scratch_t scratch; // scratch memory of the temporaries of the batches, reused by the next batches
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Initialize an empty map.
+    \param map Pointer to the map. Will be overwritten.
+    \param voxel_size Voxel size.
+    \param origin World coordinates of the corner of voxel (0, 0, 0). NULL for the world origin.
+    \param neighborhood Neighbors compared by the divergences.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nd_map_init(struct nd_map_t *map, double voxel_size, const double *origin, enum neighborhood_t neighborhood);
+
+/*! \brief Free a map.
+    \param map Pointer to the map.
+*/
+void nd_map_free(struct nd_map_t *map);
+
+/*! \brief Insert a batch of points in the map. Runs on the library thread pool.
+    The points are sorted by voxel, and the statistics of each voxel run are merged into its entry, which is created if needed.
+    The means and covariances of the changed entries are updated right away. Their divergences wait for "nd_map_update".
+    Entries of voxels emptied before the last update may be compacted away, moving the other entries.
+    \param map Pointer to the map.
+    \param point_cloud Pointer to the point cloud view. Its extra channels are ignored.
+    \param num_points Number of points in the point cloud.
+    \return 0 if successful, -1 if a point falls outside the voxel coordinates of the map or is not finite, -2 if the new entries exceed "max_entries" or the memory, another negative value otherwise. The map is left untouched on errors.
+*/
+int nd_map_insert(struct nd_map_t *map, const struct point_cloud_view_t *point_cloud, unsigned long num_points);
+
+/*! \brief Remove a batch of points previously inserted in the map, such as an expired sweep. Runs on the library thread pool.
+    The statistics of each voxel run are subtracted from its entry, which is exact up to rounding. Emptied voxels keep their entries with no samples.
+    \param map Pointer to the map.
+    \param point_cloud Pointer to the point cloud view, with the same points as when they were inserted, in any order.
+    \param num_points Number of points in the point cloud.
+    \return 0 if successful, -1 if a point falls outside the voxel coordinates of the map or is not finite, -3 if a voxel has less samples than the removed points, another negative value otherwise. The map is left untouched on errors.
+*/
+int nd_map_remove(struct nd_map_t *map, const struct point_cloud_view_t *point_cloud, unsigned long num_points);
+
+/*! \brief Factor the changed entries and recompute their divergences to their neighbors, in both directions. Runs on the library thread pool.
+    Pairs of unchanged neighbors keep their divergences.
+    \param map Pointer to the map.
+    \param num_updated Pointer to the number of updated entries. Will be overwritten. Can be NULL.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nd_map_update(struct nd_map_t *map, unsigned long *num_updated);
+
+/*! \brief Rank the divergences between the neighboring distributions of the map, as "calculate_kl_edges" does for a store.
+    \param map Pointer to the map, updated since the last batch.
+    \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of divergences between map entries. Will be allocated and overwritten. Free with "free_kl_edges".
+    \param num_kl_edges Pointer to the number of divergences. Will be overwritten.
+    \return 0 if successful, -3 if the map changed since the last update, another negative value otherwise.
+*/
+int nd_map_kl_edges(const struct nd_map_t *map, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Find the entry of the voxel of a point.
+    \param map Pointer to the map.
+    \param point Pointer to the xyz point.
+    \param entry Pointer to the entry. Will be overwritten.
+    \return 0 if the voxel has an entry, -1 otherwise. Entries of emptied voxels have no samples.
+*/
+int nd_map_find(const struct nd_map_t *map, const double *point, unsigned long *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ND_MAP_H_
@@ -1,5 +1,5 @@
 #ifndef NDT_H_
-#define NDH_H_
+#define NDT_H_
 
 /*
  MIT License
@@ -30,10 +30,12 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <omp.h>
 
 #include <ndnet_core/normal_distributions.h>
 #include <ndnet_core/kullback_leibler.h>
+#include <ndnet_core/pruning.h>
 
 #define DOWNSAMPLE_UPPER_THRESHOLD 0.2 // upper threshold for downsampled point cloud size
 #define MIN_POINTS_GUESS 1 // minumum number of points to guess the number of normal distributions
@@ -41,29 +43,210 @@
 #define MIN_VOXEL_GUESS 0.01 // minimum voxel size guess
 #define MAX_VOXEL_GUESS 30.0 // maximum voxel size guess
 #define MAX_GUESS_ITERATIONS 15 // maximum number of iterations to guess the number of normal distributions
+#define MAX_SOLVER_EVALUATIONS 30 // maximum number of occupancy evaluations of the voxel size solver
+#define DEFAULT_OCCUPANCY_EXPONENT 2.0 // initial decay of the occupied voxels with the voxel size, as for points sampled on surfaces
+#define MIN_OCCUPANCY_EXPONENT 0.25 // smallest accepted estimate of the occupancy decay
+#define MAX_OCCUPANCY_EXPONENT 6.0 // largest accepted estimate of the occupancy decay
+#define DEFAULT_DENSE_GRID_BUDGET (256UL << 20) // largest dense grid footprint in bytes before switching to a sparse grid
+#define EXPORT_CHUNK_SIZE 4096 // number of distributions counted and written at once by a pool worker
+#define BATCH_MIN_SPLIT_POINTS 16384 // smallest cloud of a batch worth splitting across the pool
+
+enum voxel_search_t {
+    VOXEL_SEARCH_COUNT, // count the occupied voxels of each voxel size guess, then estimate the distributions once at the chosen size
+    VOXEL_SEARCH_FULL // estimate the distributions for each voxel size guess
+};
+
+// voxel size search state carried across consecutive frames. the occupied voxels are modeled as a power of the voxel size around the last chosen size
+struct voxel_size_solver_t {
+    bool warm; // true once a frame was solved
+    unsigned long num_desired_points; // number of desired points of the last solved frame
+    double voxel_size; // voxel size chosen for the last frame
+    double exponent; // local decay of the occupied voxels with the voxel size, "occupied ~ voxel_size^-exponent"
+    unsigned int num_evaluations; // number of occupancy evaluations of the last frame
+};
+
+// layout of the covariance written to each row
+enum covariance_layout_t {
+    COVARIANCE_FULL, // the 9 values of the matrix, row by row
+    COVARIANCE_UPPER // the 6 values of the upper triangle: xx, xy, xz, yy, yz, zz
+};
+
+// rows written after the distributions when they do not fill the rows of an output
+enum padding_t {
+    PADDING_NONE, // leave the remaining rows untouched
+    PADDING_ZERO, // fill the remaining rows with zeros, and class 0
+    PADDING_REPEAT // repeat the written rows cyclically, or zeros if none was written
+};
+
+// writable destination of the valid distributions, such as a row range of a caller batch tensor. each row receives
+// a mean, a covariance, a class and the extra channels at their own strides, so the outputs can be separate arrays
+// or the columns of a single interleaved buffer
+struct nd_output_t {
+    enum point_type_t type; // type of the means, covariances and channels
+    void *points; // pointer to the "x" coordinate of the mean of row 0
+    unsigned long point_stride; // bytes between the means of consecutive rows
+    void *covariances; // pointer to the first covariance value of row 0, followed by the other 8. NULL to skip them
+    unsigned long covariance_stride; // bytes between the covariances of consecutive rows
+    unsigned short *classes; // pointer to the class of row 0. NULL to skip them
+    unsigned long class_stride; // bytes between the classes of consecutive rows
+    void *channels; // pointer to the first extra channel of row 0, followed by the others. NULL to skip them
+    unsigned long channel_stride; // bytes between the channels of consecutive rows
+    unsigned long first_row; // row of the first written distribution
+    unsigned long num_rows; // number of rows available from the first row
+    enum covariance_layout_t covariance_layout; // values written for each covariance
+    void *one_hot; // pointer to the one-hot class of row 0, "num_labels" values of the output type. NULL to skip them
+    unsigned long one_hot_stride; // bytes between the one-hot classes of consecutive rows
+    unsigned short num_labels; // number of one-hot values of each row. classes from "num_labels" on are all zeros
+    bool sanitize; // write non-finite means, covariances and channels as zeros
+    enum padding_t padding; // rows written after the distributions, up to "num_rows"
+};
+
+// order in which the distributions of an array are pruned, computed once for any number of kept distributions.
+// pruning is greedy, so the kept subsets are nested: keeping "k" distributions keeps the last "k" of the order
+struct nd_removal_order_t {
+    unsigned long num_nds; // number of distributions in the array
+    unsigned long num_ordered; // number of valid distributions when the order was computed
+    uint32_t *order; // entries in removal order, "num_ordered" long
+    uint32_t *ranks; // removal rank of each entry, "KL_PRUNER_NOT_QUEUED" for the distributions that were already invalid
+    unsigned long *num_samples; // number of samples of each distribution when the order was computed, restored when growing back
+};
+
+struct ndt_config_t {
+    enum voxelization_engine_t voxelization_engine; // engine used by "ndt_downsample" to estimate the normal distributions
+    unsigned long dense_grid_budget; // largest dense grid footprint in bytes. bigger grids only store the occupied voxels
+    enum class_estimator_t class_estimator; // estimator of the most frequent class of each voxel
+    enum voxel_search_t voxel_search; // how the voxel size guesses are evaluated
+    enum neighborhood_t neighborhood; // neighbors compared by the divergences. wider neighborhoods also compare diagonal neighbors
+};
+
+// frames downsampled with reused memory and configuration. opaque, see "ndt_context_create"
+struct ndt_context_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*! \brief Get the configuration used by "ndt_downsample".
+    \param config Pointer to the configuration. Will be overwritten.
+*/
+void ndt_get_config(struct ndt_config_t *config);
+
+/*! \brief Set the configuration used by subsequent "ndt_downsample" calls.
+    \param config Pointer to the new configuration.
+*/
+void ndt_set_config(const struct ndt_config_t *config);
+
+/*! \brief Initialize a voxel size solver, without a previous frame.
+    \param solver Pointer to the solver. Will be overwritten.
+*/
+void voxel_size_solver_init(struct voxel_size_solver_t *solver);
+
 /*! \brief Prune normal distributions with small divergence until the desired number is reached.
+    The distribution with the smallest divergence to a remaining neighbor is removed first, and its neighbors are rescored. Runs in O(k log n) after a linear setup.
     \param nd_array Pointer to the array of normal distributions.
-    \param len_x Number of voxels in the "x" dimension.
-    \param len_y Number of voxels in the "y" dimension.
-    \param len_z Number of voxels in the "z" dimension.
+    \param num_nds Number of normal distributions in the array.
     \param num_desired_nds Number of desired normal distributions.
     \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
-    \param kl_divergences Pointer to the array of Kullback-Leibler divergences. Will be overwritten.
-    \param num_kl_divergences Pointer to the number of Kullback-Leibler divergences. Will be overwritten.
+    \param kl_edges Pointer to the array of divergences, indexing the array of normal distributions. Those of removed distributions are ignored, so the array can be reused by later calls.
+    \param num_kl_edges Number of divergences.
+    \return 0 if successful, a negative value otherwise.
 */
-int prune_nds(struct normal_distribution_t *nd_array, 
-                    unsigned int len_x, unsigned int len_y, unsigned int len_z,
+int prune_nds(struct normal_distribution_t *nd_array, unsigned long num_nds,
                     unsigned long num_desired_nds, unsigned long *num_valid_nds,
-                    struct kl_divergence_t *kl_divergences, unsigned long *num_kl_divergences);
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges);
 
+/*! \brief Prune the distributions of a store with small divergence until the desired number is reached.
+    Same ordering as "prune_nds".
+    \param store Pointer to the store of normal distributions.
+    \param num_desired_nds Number of desired normal distributions.
+    \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of store divergences. Those of removed distributions are ignored.
+    \param num_kl_edges Number of store divergences.
+    \return 0 if successful, a negative value otherwise.
+*/
+int prune_nd_store(struct nd_store_t *store,
+                    unsigned long num_desired_nds, unsigned long *num_valid_nds,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges);
 
-/*! \brief Get a point cloud, covariances and classes from an array of normal distributions. 
+/*! \brief Compute the order in which all the valid distributions of an array are pruned, to select any number of them later with "select_nds".
+    Same ordering as "prune_nds". The array is left untouched.
+    \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array.
+    \param kl_edges Pointer to the array of divergences, indexing the array of normal distributions.
+    \param num_kl_edges Number of divergences.
+    \param removal_order Pointer to the removal order. Will be allocated and overwritten. Free with "free_nd_removal_order".
+    \return 0 if successful, a negative value otherwise.
+*/
+int order_nds(const struct normal_distribution_t *nd_array, unsigned long num_nds,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges,
+                    struct nd_removal_order_t *removal_order);
+
+/*! \brief Keep a number of distributions of an array following a removal order, invalidating the others.
+    Can be called any number of times, with smaller or larger numbers: removed distributions get their samples back.
+    \param nd_array Pointer to the array of normal distributions the order was computed for.
+    \param removal_order Pointer to the removal order.
+    \param num_kept_nds Number of distributions to keep. At most the number of ordered distributions.
+    \param num_valid_nds Pointer to the number of valid normal distributions. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int select_nds(struct normal_distribution_t *nd_array, const struct nd_removal_order_t *removal_order,
+                    unsigned long num_kept_nds, unsigned long *num_valid_nds);
+
+/*! \brief Free a removal order.
+    \param removal_order Pointer to the removal order.
+*/
+void free_nd_removal_order(struct nd_removal_order_t *removal_order);
+
+/*! \brief Initialize an output with contiguous arrays of means, covariances, classes and channels, starting at row 0 and without a row limit.
+    \param output Pointer to the output. Will be overwritten.
+    \param type Type of the means, covariances and channels.
+    \param points Pointer to the array of means, 3 per row.
+    \param covariances Pointer to the array of covariances, 9 per row. NULL to skip them.
+    \param classes Pointer to the array of classes. NULL to skip them.
+    \param channels Pointer to the array of extra channels, "num_channels" per row. NULL to skip them.
+    \param num_channels Number of extra channels of each row.
+*/
+void nd_output_init(struct nd_output_t *output, enum point_type_t type,
+                    void *points, void *covariances, unsigned short *classes,
+                    void *channels, unsigned short num_channels);
+
+/*! \brief Initialize an output of packed feature rows, for a fixed number of rows such as a sample of a batch.
+    Each row holds the mean, the covariance in the given layout and, with labels, the one-hot class: 12 or 9 values, plus "num_labels".
+    The values are sanitized and the rows after the distributions are zeros.
+    \param output Pointer to the output. Will be overwritten.
+    \param type Type of the features.
+    \param features Pointer to the features of row 0.
+    \param num_rows Number of rows.
+    \param covariance_layout Values written for each covariance.
+    \param num_labels Number of one-hot class values after the covariance of each row. 0 to skip them.
+    \return Number of values of each row.
+*/
+unsigned long nd_output_init_features(struct nd_output_t *output, enum point_type_t type, void *features, unsigned long num_rows,
+                                    enum covariance_layout_t covariance_layout, unsigned short num_labels);
+
+/*! \brief Write the valid distributions of a store to an output, in entry order. Runs on the library thread pool.
+    The valid distributions are counted per block, their rows are given by a prefix sum of the counts, and the blocks are written in parallel.
+    \param store Pointer to the store of normal distributions.
+    \param output Pointer to the output. Nothing is written if the valid distributions do not fit its rows. The padding follows them.
+    \param num_points Pointer to the number of written distributions, without the padding. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nd_store_export(const struct nd_store_t *store, const struct nd_output_t *output, unsigned long *num_points);
+
+/*! \brief Write the valid distributions of an array to an output, in array order. Same as "nd_store_export", without channels.
     \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array.
+    \param output Pointer to the output. Its channels are skipped.
+    \param num_points Pointer to the number of written distributions, without the padding. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nds_export(const struct normal_distribution_t *nd_array, unsigned long num_nds,
+                const struct nd_output_t *output, unsigned long *num_points);
+
+/*! \brief Get a point cloud, covariances and classes from an array of normal distributions. 
+    The grid dimensions, offsets and voxel size are unused, and only kept for compatibility.
+    \param nd_array Pointer to the array of normal distributions. Either a dense grid or a sparse grid sorted by voxel index.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids.
     \param len_x Number of voxels in the "x" dimension.
     \param len_y Number of voxels in the "y" dimension.
     \param len_z Number of voxels in the "z" dimension.
@@ -73,7 +256,7 @@ int prune_nds(struct normal_distribution_t *nd_array,
     \param covariances Pointer to the array of covariances. Will be overwritten.
     \param classes Pointer to the array of classes. Will be overwritten.
 */
-int to_point_cloud(struct normal_distribution_t *nd_array, 
+int to_point_cloud(struct normal_distribution_t *nd_array, unsigned long num_nds,
                     unsigned int len_x, unsigned int len_y, unsigned int len_z,
                     double offset_x, double offset_y, double offset_z,
                     double voxel_size,
@@ -81,7 +264,47 @@ int to_point_cloud(struct normal_distribution_t *nd_array,
                     double *covariances,
                     unsigned short *classes);
 
+/*! \brief Get a single precision point cloud, covariances and classes from an array of normal distributions.
+    \param nd_array Pointer to the array of normal distributions. Either a dense grid or a sparse grid sorted by voxel index.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids.
+    \param point_cloud Pointer to the point cloud. Will be overwritten.
+    \param num_points Pointer to the number of points in the point cloud. Will be overwritten.
+    \param covariances Pointer to the array of covariances. Will be overwritten.
+    \param classes Pointer to the array of classes. Will be overwritten.
+*/
+int to_point_cloud_f32(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                    float *point_cloud, unsigned long *num_points,
+                    float *covariances,
+                    unsigned short *classes);
+
+/*! \brief Get a point cloud, covariances and classes from the valid distributions of a store.
+    \param store Pointer to the store of normal distributions.
+    \param point_cloud Pointer to the point cloud. Will be overwritten.
+    \param num_points Pointer to the number of points in the point cloud. Will be overwritten.
+    \param covariances Pointer to the array of covariances. Will be overwritten.
+    \param classes Pointer to the array of classes. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nd_store_to_point_cloud(const struct nd_store_t *store,
+                            double *point_cloud, unsigned long *num_points,
+                            double *covariances,
+                            unsigned short *classes);
+
+/*! \brief Get a single precision point cloud, covariances and classes from the valid distributions of a store.
+    \param store Pointer to the store of normal distributions.
+    \param point_cloud Pointer to the point cloud. Will be overwritten.
+    \param num_points Pointer to the number of points in the point cloud. Will be overwritten.
+    \param covariances Pointer to the array of covariances. Will be overwritten.
+    \param classes Pointer to the array of classes. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int nd_store_to_point_cloud_f32(const struct nd_store_t *store,
+                            float *point_cloud, unsigned long *num_points,
+                            float *covariances,
+                            unsigned short *classes);
+
 /*! \brief Downsample the input point cloud with NDT.
+    The grid only stores the occupied voxels when the dense grid would exceed the configured "dense_grid_budget".
     \param point_cloud Pointer to the point cloud.
     \param point_dim Point dimension. (Example: 3 for xyz points).
     \param num_points Number of points in the input point cloud.
@@ -96,6 +319,11 @@ int to_point_cloud(struct normal_distribution_t *nd_array,
     \param num_downsampled_points Number of points in the downsampled point cloud. Will be overwritten.
     \param covariances Pointer to the array of covariances. Will be overwritten.
     \param downsampled_classes Pointer to the downsampled point classes. Will be overwritten.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten. Pass NULL to skip building the array.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids. Will be overwritten.
+    \param num_valid_nds Number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of Kullback-Leibler divergences between the distributions of "nd_array", by their positions in the array. Will be allocated and overwritten. Free with "free_kl_edges". Pass NULL to skip it.
+    \param num_kl_edges Number of Kullback-Leibler divergences. Will be overwritten.
  */
 int ndt_downsample(double *point_cloud, unsigned short point_dim, unsigned long num_points, 
                     unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
@@ -106,14 +334,192 @@ int ndt_downsample(double *point_cloud, unsigned short point_dim, unsigned long
                     double *downsampled_point_cloud, unsigned long *num_downsampled_points,
                     double *covariances,
                     unsigned short *downsampled_classes,
-                    struct normal_distribution_t **nd_array, unsigned long *num_valid_nds,
-                    struct kl_divergence_t **kl_divergences, unsigned long *num_kl_divergences);
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
 
-/*! \brief Free the normal distributions array and its class samples. 
-    \param nd_array Pointer to the array of normal distributions.
-    \param num_nds Number of normal distributions.
+/*! \brief Downsample a single precision point cloud with NDT. Same as "ndt_downsample", without converting the input or the output to double.
+    The distributions are accumulated in double, so the means and covariances only lose precision when written to the output.
+    \param point_cloud Pointer to the point cloud.
+    \param point_dim Point dimension. (Example: 3 for xyz points).
+    \param num_points Number of points in the input point cloud.
+    \param len_x Number of voxels in the "x" dimension. Will be overwritten.
+    \param len_y Number of voxels in the "y" dimension. Will be overwritten.
+    \param len_z Number of voxels in the "z" dimension. Will be overwritten.
+    \param voxel_size Voxel size of the grid.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param num_desired_points Number of desired points after sampling.
+    \param downsampled_point_cloud Pointer to the downsampled point cloud. Will be overwritten.
+    \param num_downsampled_points Number of points in the downsampled point cloud. Will be overwritten.
+    \param covariances Pointer to the array of covariances. Will be overwritten.
+    \param downsampled_classes Pointer to the downsampled point classes. Will be overwritten.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten. Pass NULL to skip building the array.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids. Will be overwritten.
+    \param num_valid_nds Number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of Kullback-Leibler divergences between the distributions of "nd_array", by their positions in the array. Will be allocated and overwritten. Free with "free_kl_edges". Pass NULL to skip it.
+    \param num_kl_edges Number of Kullback-Leibler divergences. Will be overwritten.
+ */
+int ndt_downsample_f32(float *point_cloud, unsigned short point_dim, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    float *downsampled_point_cloud, unsigned long *num_downsampled_points,
+                    float *covariances,
+                    unsigned short *downsampled_classes,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Downsample a point cloud view with NDT. Same as "ndt_downsample", reading the points in place from any layout described by the view.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the input point cloud.
+    \param len_x Number of voxels in the "x" dimension. Will be overwritten.
+    \param len_y Number of voxels in the "y" dimension. Will be overwritten.
+    \param len_z Number of voxels in the "z" dimension. Will be overwritten.
+    \param voxel_size Voxel size of the grid.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param num_desired_points Number of desired points after sampling.
+    \param output_type Type of the downsampled point cloud, covariances and channels.
+    \param downsampled_point_cloud Pointer to the downsampled point cloud. Will be overwritten.
+    \param num_downsampled_points Number of points in the downsampled point cloud. Will be overwritten.
+    \param covariances Pointer to the array of covariances. Will be overwritten.
+    \param downsampled_classes Pointer to the downsampled point classes. Will be overwritten.
+    \param downsampled_channels Pointer to the mean of the extra channels of the view for each downsampled point. Will be overwritten. Pass NULL to skip them.
+    \param solver Pointer to a voxel size solver, to start the voxel size search from the previous frame. Will be updated. Pass NULL to search from scratch.
+        The solver only counts occupied voxels and, when no voxel size gives the desired occupancy, prunes from the closest voxel size above it instead of failing.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten. Pass NULL to skip building the array.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids. Will be overwritten.
+    \param num_valid_nds Number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of Kullback-Leibler divergences between the distributions of "nd_array", by their positions in the array. Will be allocated and overwritten. Free with "free_kl_edges". Pass NULL to skip it.
+    \param num_kl_edges Number of Kullback-Leibler divergences. Will be overwritten.
+ */
+int ndt_downsample_view(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    enum point_type_t output_type,
+                    void *downsampled_point_cloud, unsigned long *num_downsampled_points,
+                    void *covariances,
+                    unsigned short *downsampled_classes,
+                    void *downsampled_channels,
+                    struct voxel_size_solver_t *solver,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Downsample a point cloud view with NDT into an output. Same as "ndt_downsample_view", writing the downsampled distributions at the rows and strides of the output.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the input point cloud.
+    \param len_x Number of voxels in the "x" dimension. Will be overwritten.
+    \param len_y Number of voxels in the "y" dimension. Will be overwritten.
+    \param len_z Number of voxels in the "z" dimension. Will be overwritten.
+    \param voxel_size Voxel size of the grid.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param num_desired_points Number of desired points after sampling. At most the number of rows of the output.
+    \param output Pointer to the output, such as the rows of a sample in a batch tensor.
+    \param num_downsampled_points Number of points in the downsampled point cloud. Will be overwritten.
+    \param solver Pointer to a voxel size solver, to start the voxel size search from the previous frame. Will be updated. Pass NULL to search from scratch.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten. Pass NULL to skip building the array.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids. Will be overwritten.
+    \param num_valid_nds Number of valid normal distributions. Will be overwritten.
+    \param kl_edges Pointer to the array of Kullback-Leibler divergences between the distributions of "nd_array", by their positions in the array. Will be allocated and overwritten. Free with "free_kl_edges". Pass NULL to skip it.
+    \param num_kl_edges Number of Kullback-Leibler divergences. Will be overwritten.
+ */
+int ndt_downsample_output(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points,
+                    struct voxel_size_solver_t *solver,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges);
+
+/*! \brief Create a context to downsample a sequence of frames, such as the scans of a sensor.
+    The context owns the memory of the store, the divergences, the pruner and every temporary, which grows to fit the largest frame and is reused by the next ones.
+    Once it fits, frames of similar size are downsampled without heap allocations. The voxel size search starts from the previous frame.
+    \param config Pointer to the configuration of the context. If NULL, the library configuration is copied.
+    \param num_threads Number of workers of the library thread pool, which is shared by every context. If zero, the pool is left as is.
+    \return Pointer to the context, NULL if the creation failed. Destroy with "ndt_context_destroy".
 */
-void free_nds(struct normal_distribution_t *nd_array, unsigned long num_nds);
+struct ndt_context_t *ndt_context_create(const struct ndt_config_t *config, unsigned int num_threads);
+
+/*! \brief Destroy a context, releasing its memory.
+    \param context Pointer to the context, or NULL.
+*/
+void ndt_context_destroy(struct ndt_context_t *context);
+
+/*! \brief Grow the memory of a context ahead of the first frames.
+    \param context Pointer to the context.
+    \param num_bytes Size of the memory in bytes.
+    \return 0 if successful, a negative value otherwise.
+*/
+int ndt_context_reserve(struct ndt_context_t *context, unsigned long num_bytes);
+
+/*! \brief Release the memory of a context, which grows again on the next frame. The memory never shrinks otherwise.
+    \param context Pointer to the context.
+*/
+void ndt_context_trim(struct ndt_context_t *context);
+
+/*! \brief Get the memory use of a context.
+    \param context Pointer to the context.
+    \param capacity Size of the reused memory in bytes. Will be overwritten.
+    \param num_allocations Number of heap allocations done by the context memory so far. Will be overwritten.
+*/
+void ndt_context_memory(const struct ndt_context_t *context, unsigned long *capacity, unsigned long *num_allocations);
+
+/*! \brief Downsample a frame with a context. Same as "ndt_downsample_output" with the configuration and the voxel size solver of the context, without the array interface.
+    \param context Pointer to the context.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the input point cloud.
+    \param len_x Number of voxels in the "x" dimension. Will be overwritten.
+    \param len_y Number of voxels in the "y" dimension. Will be overwritten.
+    \param len_z Number of voxels in the "z" dimension. Will be overwritten.
+    \param voxel_size Voxel size of the grid.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param num_desired_points Number of desired points after sampling. At most the number of rows of the output.
+    \param output Pointer to the output, such as the rows of a sample in a batch tensor.
+    \param num_downsampled_points Number of points in the downsampled point cloud. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+ */
+int ndt_context_downsample(struct ndt_context_t *context,
+                    const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points);
+
+/*! \brief Downsample a batch of clouds with a context, into consecutive rows of a single output.
+    Clouds bigger than the fair share of a pool worker are split across the pool one at a time, and the others are downsampled concurrently, one per worker, in the scratch memory of the worker.
+    Each cloud searches its voxel size from scratch, so the results do not depend on the schedule or on the other clouds.
+    \param context Pointer to the context.
+    \param points Pointer to the view of the points of every cloud, one cloud after the other.
+    \param cloud_offsets First point of each cloud in the view, "num_clouds + 1" offsets. The last one ends the last cloud.
+    \param num_clouds Number of clouds.
+    \param classes Class of each point of the view. NULL without classes.
+    \param num_classes Number of classes.
+    \param num_desired_points Number of desired points of each cloud. Each cloud owns that many rows of the output, after the rows of the previous clouds, and pads them following the output.
+    \param output Pointer to the output, such as a batch tensor.
+    \param num_downsampled_points Number of downsampled points of each cloud, without the padding. Will be overwritten.
+    \param cloud_statuses Status of each cloud, 0 or the negative value "ndt_context_downsample" returns for it. Will be overwritten.
+    A failed cloud has no downsampled points and only padding in its rows, and the other clouds are still downsampled.
+    NULL to fail the whole batch instead.
+    \return 0 if successful, -4 if a cloud failed and "cloud_statuses" is NULL, another negative value otherwise.
+ */
+int ndt_context_downsample_batch(struct ndt_context_t *context,
+                    const struct point_cloud_view_t *points, const unsigned long *cloud_offsets, unsigned long num_clouds,
+                    unsigned short *classes, unsigned short num_classes,
+                    const unsigned long *num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points,
+                    int *cloud_statuses);
 
 #ifdef __cplusplus
 }
@@ -35,8 +35,33 @@
 #include <ndnet_core/voxel.h>
 #include <ndnet_core/pointclouds.h>
 #include <ndnet_core/matrix.h>
+#include <ndnet_core/radix_sort.h>
+#include <ndnet_core/scratch.h>
+#include <ndnet_core/thread_pool.h>
 
-#define NUM_PCL_WORKERS 8 // number of workers for bulk point cloud processing tasks
+#define PCL_CHUNK_SIZE 1024 // number of points taken at once by a pool worker
+#define VOXEL_RUN_CHUNK_SIZE 64 // number of voxel runs taken at once by a pool worker
+#define MOMENTS_BLOCK_SIZE 64 // number of points gathered at once by the moments accumulation kernel
+#define FACTOR_CHUNK_SIZE 1024 // number of distributions factored at once by a pool worker
+#define OCCUPANCY_BITMAP_MAX_BYTES (64UL << 20) // largest occupancy bitmap. bigger grids count the occupied voxels by sorting the voxel keys
+
+enum voxelization_engine_t {
+    VOXELIZATION_LOCKING, // workers update the voxels directly, serialized by per-voxel mutexes
+    VOXELIZATION_SORT_REDUCE // points are sorted by voxel and each voxel is reduced by a single worker, without locks
+};
+
+enum class_estimator_t {
+    CLASS_ESTIMATOR_HISTOGRAM, // count the samples of every class and keep the most frequent one
+    CLASS_ESTIMATOR_STREAMING_MAJORITY // streaming majority vote with constant memory per voxel. exact when a class holds more than half of the samples
+};
+
+// sufficient statistics of a set of point samples, accumulated relative to a shift for numerical stability
+struct nd_moments_t {
+    unsigned long num_samples; // number of samples
+    double shift[3]; // first sample, subtracted from every sample before accumulating
+    double sum[3]; // sum of the shifted samples
+    double sum_sq[6]; // sum of the outer products of the shifted samples (xx, xy, xz, yy, yz, zz)
+};
 
 struct normal_distribution_t {
     unsigned long index; // index of the distribution
@@ -45,19 +70,46 @@ struct normal_distribution_t {
     double covariance[9]; // flattened covariance matrix (9-d)
     double m2[3]; // sum of squared differences. used to compute variances
     unsigned long num_samples; // number of samples
+#ifdef __cplusplus
+    unsigned short class_; // most frequent class of the distribution ("class" is reserved in C++)
+#else
     unsigned short class; // most frequent class of the distribution
-    unsigned int *num_class_samples; // number of samples per class
+#endif
+    unsigned int *num_class_samples; // number of samples per class. NULL for empty voxels. the counters of an array share one arena
     bool being_updated; // flag to indicate if the distribution is being updated
 };
 
+// structure-of-arrays store of normal distributions, used internally by the downsampling pipeline
+// the accumulation results ("num_samples", "mean", "covariance") are kept apart from the rarely read columns
+struct nd_store_t {
+    unsigned long num_nds; // number of stored distributions
+    bool dense; // if true, the store has one entry per voxel of the grid, at its voxel index
+    unsigned int len_x; // number of voxels in the "x" dimension
+    unsigned int len_y; // number of voxels in the "y" dimension
+    unsigned int len_z; // number of voxels in the "z" dimension
+    unsigned long *num_samples; // number of samples of each distribution. zero for empty or removed distributions
+    double *mean; // xyz mean of each distribution (3 per distribution)
+    double *covariance; // flattened covariance matrix of each distribution (9 per distribution)
+    unsigned long *index; // voxel index of each distribution, in increasing order
+    unsigned short *classes; // most frequent class of each distribution. NULL if no classes were provided
+    unsigned short num_channels; // number of extra channels of each distribution
+    double *channels; // mean of the extra channels of the points of each distribution (num_channels per distribution). NULL without extra channels
+    double *inverse_covariance; // flattened inverse covariance matrix of each distribution (9 per distribution). NULL until the store is factored
+    double *log_determinant; // natural logarithm of the covariance determinant of each distribution. NULL until the store is factored
+    bool *invertible; // whether each distribution has enough samples and a non-singular covariance. NULL until the store is factored
+    struct scratch_t *scratch; // scratch memory of the columns, also used by the consumers of the store. NULL for heap columns
+};
+
 struct pcl_worker_args_t {
-    double *point_cloud; // pointer to the point cloud
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
     unsigned long num_points; // number of points in the point cloud
     unsigned short *classes; // pointer to the point classes
     unsigned short num_classes;
     struct normal_distribution_t *nd_array; // pointer to the array of normal distributions
     pthread_mutex_t *mutex_array; // pointer to the array of mutexes
     pthread_cond_t *cond_array; // pointer to the array of condition variables
+    struct nd_moments_t *moments_array; // pointer to the array of sufficient statistics, one per voxel
+    double *channel_sums; // pointer to the sums of the extra channels of each voxel. NULL to skip the extra channels
     double voxel_size; // voxel size for distribution sampling
     int len_x; // number of voxels in the "x" dimension
     int len_y; // number of voxels in the "y" dimension
@@ -65,15 +117,58 @@ struct pcl_worker_args_t {
     double x_offset; // offset in the "x" dimension
     double y_offset; // offset in the "y" dimension
     double z_offset; // offset in the "z" dimension
-    int worker_id; // worker id
+    unsigned int *class_arena; // class sample counters of the occupied voxels (num_classes + 1 per voxel)
+    unsigned long *next_class_slot; // next free slot of the class arena. updated atomically
+    int status; // 0 on success, negative if any worker failed
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/*! \brief Worker routine for normal distribution update. */
-void *pcl_worker(void *arg);
+/*! \brief Worker routine for normal distribution update. Loop body for "thread_pool_parallel_for" over the points. */
+void pcl_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id);
+
+/*! \brief Reset sufficient statistics.
+    \param moments Pointer to the sufficient statistics. Will be overwritten.
+*/
+void nd_moments_init(struct nd_moments_t *moments);
+
+/*! \brief Add a point sample to sufficient statistics.
+    \param moments Pointer to the sufficient statistics.
+    \param point Pointer to the xyz point.
+*/
+void nd_moments_add(struct nd_moments_t *moments, const double *point);
+
+/*! \brief Add a set of point samples to sufficient statistics. The points are gathered in blocks and accumulated with SIMD reductions.
+    \param moments Pointer to the sufficient statistics.
+    \param point_cloud Pointer to the point cloud view.
+    \param point_indexes Indexes of the points to add. If NULL, the first "num_points" points are added.
+    \param num_points Number of points to add.
+*/
+void nd_moments_accumulate(struct nd_moments_t *moments, const struct point_cloud_view_t *point_cloud,
+                            const unsigned long *point_indexes, unsigned long num_points);
+
+/*! \brief Get the mean and the population covariance from sufficient statistics.
+    \param moments Pointer to the sufficient statistics.
+    \param mean Pointer to the xyz mean. Will be overwritten.
+    \param covariance Pointer to the flattened covariance matrix. Will be overwritten.
+*/
+void nd_moments_finalize(const struct nd_moments_t *moments, double *mean, double *covariance);
+
+/*! \brief Add the samples of other sufficient statistics, accumulated around any shift.
+    \param moments Pointer to the sufficient statistics.
+    \param other Pointer to the sufficient statistics of the added samples.
+*/
+void nd_moments_merge(struct nd_moments_t *moments, const struct nd_moments_t *other);
+
+/*! \brief Remove the samples of other sufficient statistics, previously added to these ones. The inverse of "nd_moments_merge".
+    The remaining samples are centered on their mean. Removing every sample leaves empty statistics.
+    \param moments Pointer to the sufficient statistics.
+    \param other Pointer to the sufficient statistics of the removed samples.
+    \return 0 if successful, -1 if there are more samples to remove than samples.
+*/
+int nd_moments_remove(struct nd_moments_t *moments, const struct nd_moments_t *other);
 
 /*! \brief Estimate the normal distributions on the point cloud. Estimate a normal distribution per voxel of size "voxel_size".
     \param point_cloud Pointer to the point cloud.
@@ -95,6 +190,176 @@ int estimate_ndt(double *point_cloud, unsigned long num_points,
                     struct normal_distribution_t *nd_array,
                     unsigned long *num_nds);
 
+/*! \brief Estimate the normal distributions on the point cloud without locks. The points are sorted by voxel index and each run of points sharing a voxel is reduced by a single worker.
+    Produces the same distributions as "estimate_ndt", with the points of each voxel accumulated in point cloud order.
+    \param point_cloud Pointer to the point cloud.
+    \param num_points Number of points in the point cloud.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param voxel_size Voxel size for distribution sampling.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param nd_array Pointer to the array of normal distributions. Will be overwritten.
+    \param num_nds Number of normal distributions. Will be overwritten.
+*/
+int estimate_ndt_sort_reduce(double *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    struct normal_distribution_t *nd_array,
+                    unsigned long *num_nds);
+
+/*! \brief Estimate the normal distributions on a sparse grid. Only the occupied voxels are allocated, so memory scales with the number of distributions instead of the grid size.
+    The distributions are the same as in a dense grid, stored contiguously in increasing voxel index order.
+    \param point_cloud Pointer to the point cloud.
+    \param num_points Number of points in the point cloud.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param voxel_size Voxel size for distribution sampling.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten.
+    \param num_nds Number of normal distributions in the array. Will be overwritten.
+*/
+int estimate_ndt_sparse(double *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    struct normal_distribution_t **nd_array,
+                    unsigned long *num_nds);
+
+/*! \brief Find the normal distribution of a voxel. The array is either a dense grid, with one distribution per voxel, or a sparse grid sorted by voxel index.
+    \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param index Index of the voxel.
+    \return Pointer to the normal distribution, or NULL if the voxel is not stored.
+*/
+struct normal_distribution_t *find_nd(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                                        unsigned int len_x, unsigned int len_y, unsigned int len_z,
+                                        unsigned long index);
+
+/*! \brief Free the class samples arena of an array of normal distributions, leaving the array allocated.
+    \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array.
+*/
+void free_nd_class_samples(struct normal_distribution_t *nd_array, unsigned long num_nds);
+
+/*! \brief Free the normal distributions array and its class samples. 
+    \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array.
+*/
+void free_nds(struct normal_distribution_t *nd_array, unsigned long num_nds);
+
+/*! \brief Allocate the columns of a normal distribution store on the heap.
+    \param store Pointer to the store. Will be overwritten.
+    \param num_nds Number of distributions.
+    \param with_classes Whether to allocate the class column.
+    \param num_channels Number of extra channels of each distribution.
+    \return 0 if successful, -1 otherwise.
+*/
+int alloc_nd_store(struct nd_store_t *store, unsigned long num_nds, bool with_classes, unsigned short num_channels);
+
+/*! \brief Free the columns of a normal distribution store. Scratch columns are left to their scratch memory.
+    \param store Pointer to the store.
+*/
+void free_nd_store(struct nd_store_t *store);
+
+/*! \brief Estimate the normal distributions on the point cloud into a structure-of-arrays store.
+    The points are read in their own type and layout and accumulated in double. The extra channels of the view are averaged into the "channels" column.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the point cloud.
+    \param classes Point classes array.
+    \param num_classes Number of classes.
+    \param voxel_size Voxel size for distribution sampling.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param dense If true, store every voxel of the grid. Otherwise, only the occupied voxels.
+    \param engine Voxelization engine. The locking engine is only available on dense stores.
+    \param class_estimator Estimator of the most frequent class. The locking engine always counts every class.
+    \param store Pointer to the store. Will be allocated and overwritten.
+    \param num_occupied Number of occupied voxels. Will be overwritten.
+    \param scratch Scratch memory of the columns and the temporaries, kept by the store. If NULL, they are allocated on the heap.
+    \return 0 if successful, a negative value otherwise.
+*/
+int estimate_nd_store(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    bool dense, enum voxelization_engine_t engine, enum class_estimator_t class_estimator,
+                    struct nd_store_t *store, unsigned long *num_occupied, struct scratch_t *scratch);
+
+/*! \brief Factor the covariances of a store once, for the consumers that need their inverses and determinants.
+    Fills the "inverse_covariance", "log_determinant" and "invertible" columns, allocating them on the first call from the scratch memory of the store.
+    Distributions with less than two samples or a singular covariance are marked as not invertible.
+    Must be called again after the means or covariances change.
+    \param store Pointer to the store.
+    \return 0 if successful, a negative value otherwise.
+*/
+int factor_nd_store(struct nd_store_t *store);
+
+/*! \brief Factor the covariances of some entries of a store again, after their means or covariances changed.
+    \param store Pointer to the store, already factored with "factor_nd_store".
+    \param entries Pointer to the entries to factor.
+    \param num_entries Number of entries to factor.
+    \return 0 if successful, a negative value otherwise.
+*/
+int factor_nd_store_entries(struct nd_store_t *store, const unsigned long *entries, unsigned long num_entries);
+
+/*! \brief Count the occupied voxels of a grid, without estimating the normal distributions.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the point cloud.
+    \param voxel_size Voxel size.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param num_occupied Number of occupied voxels. Will be overwritten.
+    \param scratch Scratch memory of the temporaries, released before returning. If NULL, they are allocated on the heap.
+    \return 0 if successful, a negative value otherwise.
+*/
+int count_occupied_voxels(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    unsigned long *num_occupied, struct scratch_t *scratch);
+
+/*! \brief Find the store entry of a voxel.
+    \param store Pointer to the store.
+    \param index Index of the voxel.
+    \param entry Entry of the voxel in the store. Will be overwritten.
+    \return 0 if the voxel is stored, -1 otherwise.
+*/
+int find_nd_store_entry(const struct nd_store_t *store, unsigned long index, unsigned long *entry);
+
+/*! \brief Copy an array of normal distributions to a store. The array is either a dense grid or a sparse grid sorted by voxel index.
+    \param nd_array Pointer to the array of normal distributions.
+    \param num_nds Number of normal distributions in the array. Equal to the grid size for dense grids.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param len_z Number of voxels in the "z" dimension.
+    \param store Pointer to the store. Will be allocated and overwritten.
+    \return 0 if successful, -1 otherwise.
+*/
+int nd_array_to_store(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                        unsigned int len_x, unsigned int len_y, unsigned int len_z,
+                        struct nd_store_t *store);
+
+/*! \brief Materialize a store as an array of normal distributions, for callers of the array interface.
+    The class sample counts of the array are not filled.
+    \param store Pointer to the store.
+    \param nd_array Pointer to the array of normal distributions. Will be allocated and overwritten. Free with "free_nds".
+    \return 0 if successful, -1 otherwise.
+*/
+int nd_store_to_array(const struct nd_store_t *store, struct normal_distribution_t **nd_array);
+
 /*! \brief Print the normal distribution.
     \param nd Normal distribution.
 */
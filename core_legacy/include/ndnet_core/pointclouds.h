@@ -27,8 +27,27 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <float.h>
 
+enum point_type_t {
+    POINT_TYPE_FLOAT64, // coordinates stored as double
+    POINT_TYPE_FLOAT32 // coordinates stored as float
+};
+
+// read-only view of a point cloud, without copying it. the coordinates are either interleaved with other values of the points,
+// as in xyz, xyzi or xyzrgb buffers, or in separate columns. any other layout is described by filling the view directly
+struct point_cloud_view_t {
+    const void *x; // pointer to the "x" coordinate of the first point
+    const void *y; // pointer to the "y" coordinate of the first point
+    const void *z; // pointer to the "z" coordinate of the first point
+    unsigned long stride; // bytes between the same value of consecutive points
+    enum point_type_t type; // type of the coordinates and of the extra channels
+    const void *channels; // pointer to the first extra channel of the first point, such as intensity. NULL without extra channels
+    unsigned long channel_stride; // bytes between consecutive extra channels of a point
+    unsigned short num_channels; // number of extra channels, averaged into each distribution
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,6 +72,33 @@ double minf(double a, double b);
 */
 double absf(double n);
 
+/*! \brief Get the size in bytes of a point type.
+    \param type Point type.
+    \return Size of a single value of the type.
+*/
+unsigned long point_type_size(enum point_type_t type);
+
+/*! \brief Initialize a view of a point cloud with interleaved points. The xyz coordinates come first, followed by the extra channels.
+    \param point_cloud Pointer to the point cloud view. Will be overwritten.
+    \param data Pointer to the point cloud.
+    \param type Type of the values of the point cloud.
+    \param point_dim Point dimension. (Example: 3 for xyz points, 4 for xyzi points).
+    \param num_channels Number of values after the xyz coordinates to average into each distribution.
+    \return 0 if successful, -1 if the point dimension does not fit the coordinates and the channels.
+*/
+int point_cloud_view_init(struct point_cloud_view_t *point_cloud, const void *data, enum point_type_t type,
+                            unsigned short point_dim, unsigned short num_channels);
+
+/*! \brief Initialize a view of a point cloud with a separate contiguous column per coordinate.
+    \param point_cloud Pointer to the point cloud view. Will be overwritten.
+    \param x Pointer to the "x" coordinates.
+    \param y Pointer to the "y" coordinates.
+    \param z Pointer to the "z" coordinates.
+    \param type Type of the coordinates.
+*/
+void point_cloud_view_init_columns(struct point_cloud_view_t *point_cloud, const void *x, const void *y, const void *z,
+                                    enum point_type_t type);
+
 /*! \brief Get the point cloud limits in each dimension. The values will be assigned by reference.
     \param point_cloud Pointer to the point cloud.
     \param point_dim Point dimension. (Example: 3 for xyz points).
@@ -68,6 +114,51 @@ void get_pointcloud_limits(double *point_cloud, short point_dim, unsigned long n
                         double *max_x, double *max_y, double *max_z,
                         double *min_x, double *min_y, double *min_z);
 
+/*! \brief Get the limits of a point cloud view in each dimension. The values will be assigned by reference.
+    \param point_cloud Pointer to the point cloud view.
+    \param num_points Number of points in the point cloud.
+    \param max_x Maximum value in the "x" dimension. Will be overwritten.
+    \param max_y Maximum value in the "y" dimension. Will be overwritten.
+    \param max_z Maximum value in the "z" dimension. Will be overwritten.
+    \param min_x Minimum value in the "x" dimension. Will be overwritten.
+    \param min_y Minimum value in the "y" dimension. Will be overwritten.
+    \param min_z Minimum value in the "z" dimension. Will be overwritten.
+*/
+void get_point_cloud_view_limits(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                        double *max_x, double *max_y, double *max_z,
+                        double *min_x, double *min_y, double *min_z);
+
+/*! \brief Read a point of a point cloud view as double.
+    \param point_cloud Pointer to the point cloud view.
+    \param i Index of the point.
+    \param point Pointer to the xyz point. Will be overwritten.
+*/
+static inline void point_cloud_view_get(const struct point_cloud_view_t *point_cloud, unsigned long i, double *point) {
+    unsigned long offset = i * point_cloud->stride;
+    if(point_cloud->type == POINT_TYPE_FLOAT32) {
+        point[0] = *(const float *) ((const char *) point_cloud->x + offset);
+        point[1] = *(const float *) ((const char *) point_cloud->y + offset);
+        point[2] = *(const float *) ((const char *) point_cloud->z + offset);
+    } else {
+        point[0] = *(const double *) ((const char *) point_cloud->x + offset);
+        point[1] = *(const double *) ((const char *) point_cloud->y + offset);
+        point[2] = *(const double *) ((const char *) point_cloud->z + offset);
+    }
+}
+
+/*! \brief Read an extra channel of a point of a point cloud view as double.
+    \param point_cloud Pointer to the point cloud view.
+    \param i Index of the point.
+    \param channel Index of the channel.
+    \return Value of the channel.
+*/
+static inline double point_cloud_view_get_channel(const struct point_cloud_view_t *point_cloud, unsigned long i, unsigned short channel) {
+    const char *value = (const char *) point_cloud->channels + i * point_cloud->stride + channel * point_cloud->channel_stride;
+    if(point_cloud->type == POINT_TYPE_FLOAT32)
+        return *(const float *) value;
+    return *(const double *) value;
+}
+
 #ifdef __cplusplus
 }
 #endif
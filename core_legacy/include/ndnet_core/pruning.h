@@ -0,0 +1,104 @@
+#ifndef PRUNING_H_
+#define PRUNING_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <ndnet_core/kullback_leibler.h>
+
+#define KL_PRUNER_NOT_QUEUED UINT32_MAX // heap position of the distributions out of the queue
+
+// priority queue of the distributions to prune, ordered by redundancy
+// the redundancy score of a distribution is its smallest divergence to a remaining neighbor: the distribution
+// with the smallest score is the one best explained by a neighbor, so it introduces the least new information.
+// removing a distribution only changes the scores of its neighbors, which are updated in place
+struct kl_pruner_t {
+    unsigned long num_nds; // number of distributions
+    unsigned long *edge_offsets; // first divergence of each distribution, "num_nds + 1" offsets
+    uint32_t *edge_neighbors; // neighbor of each divergence, grouped by first distribution
+    double *edge_divergences; // value of each divergence, grouped by first distribution
+    unsigned long *reverse_offsets; // first reverse divergence of each distribution, "num_nds + 1" offsets
+    uint32_t *reverse_neighbors; // distributions with a divergence to each distribution
+    double *reverse_divergences; // value of each reverse divergence
+    double *scores; // redundancy score of each distribution, "INFINITY" without remaining neighbors
+    uint32_t *heap; // binary min-heap of the queued distributions, by score and then by entry
+    uint32_t *heap_positions; // position of each distribution in the heap, "KL_PRUNER_NOT_QUEUED" when removed or invalid
+    unsigned long heap_size; // number of queued distributions
+    struct scratch_t *scratch; // scratch memory of the arrays. NULL for heap arrays
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Initialize a pruner from the divergences between neighboring distributions. Runs in linear time.
+    Distributions without samples are never queued. Queued distributions without divergences are removed last, by entry.
+    \param pruner Pointer to the pruner. Will be overwritten.
+    \param num_nds Number of distributions.
+    \param num_samples Pointer to the number of samples of each distribution.
+    \param kl_edges Pointer to the array of divergences, in any order.
+    \param num_kl_edges Number of divergences.
+    \param scratch Scratch memory of the arrays of the pruner. If NULL, they are allocated on the heap.
+    \return 0 if successful, a negative value otherwise.
+*/
+int kl_pruner_init(struct kl_pruner_t *pruner, unsigned long num_nds, const unsigned long *num_samples,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges, struct scratch_t *scratch);
+
+/*! \brief Remove the most redundant queued distribution, and rescore its neighbors. Runs in O(log n).
+    \param pruner Pointer to the pruner.
+    \param entry Pointer to the removed distribution. Will be overwritten.
+    \return 0 if successful, a negative value if no distribution is left.
+*/
+int kl_pruner_pop(struct kl_pruner_t *pruner, unsigned long *entry);
+
+/*! \brief Remove all the queued distributions, recording the order of removal.
+    Pruning is greedy, so keeping the last "k" distributions of the order gives the same subset as removing all but "k" one at a time.
+    \param pruner Pointer to the pruner. Will be left empty.
+    \param order Pointer to the array of entries in removal order, as long as the number of queued distributions. Will be overwritten.
+    \param ranks Pointer to the removal rank of each distribution, "KL_PRUNER_NOT_QUEUED" for those never queued or already removed. Will be overwritten.
+    \param num_ordered Pointer to the number of ordered distributions. Will be overwritten.
+    \return 0 if successful, a negative value otherwise.
+*/
+int kl_pruner_order(struct kl_pruner_t *pruner, uint32_t *order, uint32_t *ranks, unsigned long *num_ordered);
+
+/*! \brief Free a pruner.
+    \param pruner Pointer to the pruner.
+*/
+void kl_pruner_free(struct kl_pruner_t *pruner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PRUNING_H_
@@ -0,0 +1,60 @@
+#ifndef RADIX_SORT_H_
+#define RADIX_SORT_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <ndnet_core/thread_pool.h>
+#include <ndnet_core/scratch.h>
+
+#define RADIX_SORT_DIGIT_BITS 8 // number of key bits sorted per pass
+#define RADIX_SORT_NUM_BUCKETS (1 << RADIX_SORT_DIGIT_BITS) // number of buckets per pass
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Sort key/value pairs by key with a stable, parallel least-significant-digit radix sort. Runs on the library thread pool.
+    Pairs with the same key keep their relative order.
+    \param keys Pointer to the array of keys. Will be overwritten with the sorted keys.
+    \param values Pointer to the array of values. Will be overwritten following the keys.
+    \param num_pairs Number of key/value pairs.
+    \param max_key Largest key in the array. Bounds the number of passes.
+    \param scratch Scratch memory of the temporary buffers, released before returning. If NULL, they are allocated on the heap.
+    \return 0 if successful, a negative value otherwise.
+*/
+int radix_sort_pairs(unsigned long *keys, unsigned long *values, unsigned long num_pairs, unsigned long max_key, struct scratch_t *scratch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RADIX_SORT_H_
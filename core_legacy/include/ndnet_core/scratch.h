@@ -0,0 +1,124 @@
+#ifndef SCRATCH_H_
+#define SCRATCH_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+
+#define SCRATCH_ALIGNMENT 64 // alignment of every scratch allocation, a cache line
+
+// block allocated when an allocation does not fit the scratch memory. freed by the next reset
+struct scratch_block_t {
+    struct scratch_block_t *next; // next overflow block
+};
+
+// grow-only scratch memory, reused by the allocations of successive runs.
+// allocations are taken in order from a single block, and freeing them does nothing: the whole memory is reused after a reset.
+// allocations that do not fit get their own overflow blocks, and the next reset grows the memory to fit them all.
+// once the memory fits a run, the next runs of similar size do no heap allocations.
+// functions taking a NULL scratch memory allocate on the heap instead
+struct scratch_t {
+    char *data; // scratch memory
+    unsigned long capacity; // size of the scratch memory in bytes
+    unsigned long used; // bytes of the scratch memory in use
+    struct scratch_block_t *overflow; // overflow blocks since the last reset
+    unsigned long overflow_bytes; // bytes of the overflow blocks since the last reset
+    unsigned long peak; // most bytes in use at once since the last reset, including the overflow blocks
+    unsigned long num_allocations; // number of heap allocations done by the scratch memory
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Initialize an empty scratch memory.
+    \param scratch Pointer to the scratch memory. Will be overwritten.
+*/
+void scratch_init(struct scratch_t *scratch);
+
+/*! \brief Release the memory of a scratch memory, which is left empty.
+    \param scratch Pointer to the scratch memory.
+*/
+void scratch_destroy(struct scratch_t *scratch);
+
+/*! \brief Grow a scratch memory to at least a size. Discards the current allocations.
+    \param scratch Pointer to the scratch memory.
+    \param capacity Size in bytes.
+    \return 0 if successful, a negative value otherwise.
+*/
+int scratch_reserve(struct scratch_t *scratch, unsigned long capacity);
+
+/*! \brief Discard the allocations of a scratch memory. If there were overflow blocks, the memory grows geometrically to fit all the allocations at once.
+    \param scratch Pointer to the scratch memory.
+    \return 0 if successful, a negative value otherwise.
+*/
+int scratch_reset(struct scratch_t *scratch);
+
+/*! \brief Allocate memory, aligned to "SCRATCH_ALIGNMENT" bytes.
+    \param scratch Pointer to the scratch memory. If NULL, the memory is allocated on the heap.
+    \param size Size in bytes.
+    \return Pointer to the memory, NULL if the allocation failed.
+*/
+void *scratch_alloc(struct scratch_t *scratch, unsigned long size);
+
+/*! \brief Allocate zeroed memory for an array.
+    \param scratch Pointer to the scratch memory. If NULL, the memory is allocated on the heap.
+    \param count Number of elements.
+    \param size Size of each element in bytes.
+    \return Pointer to the memory, NULL if the allocation failed.
+*/
+void *scratch_calloc(struct scratch_t *scratch, unsigned long count, unsigned long size);
+
+/*! \brief Free memory allocated by "scratch_alloc" or "scratch_calloc". Does nothing for a scratch memory, whose memory is reused after a reset.
+    \param scratch Pointer to the scratch memory the memory was allocated from, or NULL for heap memory.
+    \param ptr Pointer to the memory.
+*/
+void scratch_free(struct scratch_t *scratch, void *ptr);
+
+/*! \brief Mark the allocations made so far, so the later ones can be released together.
+    \param scratch Pointer to the scratch memory, or NULL.
+    \return The mark.
+*/
+unsigned long scratch_mark(const struct scratch_t *scratch);
+
+/*! \brief Release the allocations made after a mark. Their memory is reused by the next allocations.
+    Heap allocations, with a NULL scratch memory, still have to be freed.
+    \param scratch Pointer to the scratch memory, or NULL.
+    \param mark Mark returned by "scratch_mark".
+*/
+void scratch_release(struct scratch_t *scratch, unsigned long mark);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SCRATCH_H_
@@ -0,0 +1,91 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define THREAD_POOL_ENV "NDNET_NUM_THREADS" // environment variable with the number of workers of the pool
+#define THREAD_POOL_MAX_WORKERS 1024 // maximum number of workers of the pool
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Initialize the library thread pool. Called implicitly by the first parallel loop if not called before.
+    Re-initializing with a different size replaces the workers. A forked child drops the workers of its parent and starts its own pool on demand.
+    \param num_workers Number of workers, including the calling thread. If zero, "NDNET_NUM_THREADS" is read, falling back to the number of online processors.
+    \return 0 if successful, a negative value otherwise.
+*/
+int thread_pool_init(unsigned int num_workers);
+
+/*! \brief Stop and join the workers of the library thread pool. */
+void thread_pool_destroy(void);
+
+/*! \brief Get the number of workers of the library thread pool, initializing it if needed.
+    Another thread may resize the pool right after this returns, so storage indexed by worker id and sized from this value
+    must be passed as the bound of "thread_pool_parallel_for_bounded".
+    \return The number of workers.
+*/
+unsigned int thread_pool_num_workers(void);
+
+/*! \brief Run a parallel loop on the library thread pool. The items are split evenly between the workers, which take them in chunks and steal chunks from the other workers once their own share is done.
+    Nested calls, from inside a loop body, run on the calling worker.
+    \param num_items Number of items of the loop.
+    \param chunk_size Number of consecutive items taken at once by a worker.
+    \param body Loop body. Called with the argument, an item range [start, end) and the id of the worker running it.
+    \param arg Argument passed to the body.
+    \return 0 if successful, a negative value otherwise.
+*/
+int thread_pool_parallel_for(unsigned long num_items, unsigned long chunk_size,
+                            void (*body)(void *arg, unsigned long start, unsigned long end, unsigned int worker_id),
+                            void *arg);
+
+/*! \brief Run a parallel loop on at most "max_workers" workers of the library thread pool, as "thread_pool_parallel_for".
+    Worker ids passed to the body are always smaller than "max_workers", even if the pool is resized meanwhile.
+    \param num_items Number of items of the loop.
+    \param chunk_size Number of consecutive items taken at once by a worker.
+    \param max_workers Bound of the worker ids, such as the length of per-worker storage. At least 1.
+    \param body Loop body. Called with the argument, an item range [start, end) and the id of the worker running it.
+    \param arg Argument passed to the body.
+    \return 0 if successful, a negative value otherwise.
+*/
+int thread_pool_parallel_for_bounded(unsigned long num_items, unsigned long chunk_size, unsigned int max_workers,
+                            void (*body)(void *arg, unsigned long start, unsigned long end, unsigned int worker_id),
+                            void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THREAD_POOL_H_
@@ -42,10 +42,42 @@ enum direction_t {
     DIRECTION_LEN
 };
 
+// neighbors compared around each voxel, by the number of neighbors
+enum neighborhood_t {
+    NEIGHBORHOOD_FACES = 6, // voxels sharing a face, in "direction_t" order
+    NEIGHBORHOOD_EDGES = 18, // voxels sharing a face or an edge
+    NEIGHBORHOOD_CORNERS = 26 // voxels sharing a face, an edge or a corner
+};
+
+#define NEIGHBORHOOD_MAX_LEN 26 // number of neighbors of the widest neighborhood
+
+// offset of a neighbor, in voxels
+struct stencil_offset_t {
+    signed char x;
+    signed char y;
+    signed char z;
+};
+
+// a voxel grid in metric space
+struct voxel_grid_t {
+    double voxel_size; // voxel size
+    unsigned int len_x; // number of voxels in the "x" dimension
+    unsigned int len_y; // number of voxels in the "y" dimension
+    unsigned int len_z; // number of voxels in the "z" dimension
+    double x_offset; // metric "x" coordinate of the first voxel corner
+    double y_offset; // metric "y" coordinate of the first voxel corner
+    double z_offset; // metric "z" coordinate of the first voxel corner
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// offsets of the neighbors of a voxel. the first 6, 18 or 26 offsets are the neighbors of each neighborhood,
+// starting with the faces in "direction_t" order. each even offset is followed by its opposite, and the even
+// offsets lead to larger voxel indexes, so each pair of neighbors is visited once from its smaller index
+extern const struct stencil_offset_t neighbor_stencil[NEIGHBORHOOD_MAX_LEN];
+
 /*! \brief Estimate voxel size for a number of desired points considering the limits. Also calculates the lengths in each dimension. Assumes the (0,0,0) metric point is within the limits.
     \param num_desired_voxels Number of desired voxels.
     \param max_x Maximum value in the "x" dimension.
@@ -72,7 +104,7 @@ void estimate_voxel_size(unsigned long num_desired_voxels,
 void estimate_voxel_grid(double max_x, double max_y, double max_z,
                         double min_x, double min_y, double min_z,
                         double voxel_size,
-                        int *len_x, int *len_y, int *len_z,
+                        unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
                         double *x_offset, double *y_offset, double *z_offset);
 
 
@@ -119,6 +151,16 @@ void voxel_to_metric_space(unsigned int voxel_x, unsigned int voxel_y, unsigned
 */
 int get_neighbor_index(unsigned long index, unsigned int len_x, unsigned int len_y, unsigned int len_z, enum direction_t direction, unsigned long *neighbor_index);
 
+/*! \brief Get the index offsets of the neighbors of a neighborhood on a grid, so the neighbors are found without index divisions.
+    The offsets are only valid for neighbors inside the grid.
+    \param neighborhood Neighborhood.
+    \param len_x Number of voxels in the "x" dimension.
+    \param len_y Number of voxels in the "y" dimension.
+    \param offsets Pointer to the array of index offsets, in "neighbor_stencil" order. Will be overwritten.
+    \return The number of neighbors of the neighborhood. A negative value for an invalid neighborhood.
+*/
+int stencil_index_offsets(enum neighborhood_t neighborhood, unsigned int len_x, unsigned int len_y, long *offsets);
+
 /*! \brief Convert a voxel position in (x,y,z) to its sequential index in the array.
     \param voxel_x Voxel index in the "x" dimension.
     \param voxel_y Voxel index in the "y" dimension.
@@ -0,0 +1,780 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+// Python bindings of the downsampling context. Arrays are read from the buffer protocol (numpy) or from DLPack (torch)
+// without copies, the core runs without the GIL, and the features come back in memory owned by the module,
+// exported again through the buffer protocol and DLPack
+
+#include <stdint.h>
+#include <ndnet_core/ndt.h>
+#include <ndnet_core/pointclouds.h>
+#include <ndnet_core/thread_pool.h>
+
+// DLPack ABI, as exchanged by "__dlpack__" capsules
+#define DL_CPU 1
+#define DL_INT 0
+#define DL_UINT 1
+#define DL_FLOAT 2
+
+typedef struct {
+    int32_t device_type;
+    int32_t device_id;
+} DLDevice;
+
+typedef struct {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+} DLDataType;
+
+typedef struct {
+    void *data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t *shape;
+    int64_t *strides; // in values. NULL when contiguous
+    uint64_t byte_offset;
+} DLTensor;
+
+typedef struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void *manager_ctx;
+    void (*deleter)(struct DLManagedTensor *self);
+} DLManagedTensor;
+
+// a 1D or 2D array borrowed from a buffer or from a DLPack tensor
+struct input_t {
+    Py_buffer buffer;
+    bool has_buffer; // release the buffer
+    PyObject *capsule;
+    DLManagedTensor *managed; // consumed tensor, deleted on release
+    char *data;
+    char kind; // 'f' for floats, 'i' for signed and 'u' for unsigned integers
+    Py_ssize_t itemsize;
+    int ndim;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2]; // in bytes
+};
+
+// get the kind and the size of the values of a buffer format
+static int format_kind(const char *format, char *kind, Py_ssize_t *itemsize) {
+
+    if(format == NULL)
+        format = "B";
+    if(*format == '@' || *format == '=' || *format == '<')
+        format++;
+    if(format[0] == '\0' || format[1] != '\0')
+        return -1;
+
+    switch(*format) {
+        case 'f': *kind = 'f'; *itemsize = 4; return 0;
+        case 'd': *kind = 'f'; *itemsize = 8; return 0;
+        case 'h': *kind = 'i'; *itemsize = 2; return 0;
+        case 'H': *kind = 'u'; *itemsize = 2; return 0;
+        default: return -1;
+    }
+}
+
+// release an input. the GIL is held
+static void input_release(struct input_t *input) {
+
+    if(input->has_buffer)
+        PyBuffer_Release(&input->buffer);
+    if(input->managed != NULL && input->managed->deleter != NULL)
+        input->managed->deleter(input->managed);
+    Py_XDECREF(input->capsule);
+    memset(input, 0, sizeof(struct input_t));
+}
+
+// borrow the values of an array, from the buffer protocol or from DLPack
+static int input_get(PyObject *obj, struct input_t *input, const char *name, bool writable) {
+
+    memset(input, 0, sizeof(struct input_t));
+
+    // numpy arrays and other buffers
+    if(PyObject_CheckBuffer(obj)) {
+        if(PyObject_GetBuffer(obj, &input->buffer, PyBUF_STRIDES | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) < 0)
+            return -1;
+        input->has_buffer = true;
+        if(input->buffer.ndim < 1 || input->buffer.ndim > 2 || format_kind(input->buffer.format, &input->kind, &input->itemsize) < 0) {
+            PyErr_Format(PyExc_TypeError, "\"%s\" must be a 1D or 2D array of float32, float64, int16 or uint16 values", name);
+            input_release(input);
+            return -1;
+        }
+        input->data = (char *) input->buffer.buf;
+        input->ndim = input->buffer.ndim;
+        for(int d = 0; d < input->ndim; d++) {
+            input->shape[d] = input->buffer.shape[d];
+            input->strides[d] = input->buffer.strides[d];
+        }
+        return 0;
+    }
+
+    // torch tensors and other DLPack producers
+    if(!PyObject_HasAttrString(obj, "__dlpack__")) {
+        PyErr_Format(PyExc_TypeError, "\"%s\" must support the buffer protocol or DLPack", name);
+        return -1;
+    }
+    input->capsule = PyObject_CallMethod(obj, "__dlpack__", NULL);
+    if(input->capsule == NULL)
+        return -1;
+    input->managed = (DLManagedTensor *) PyCapsule_GetPointer(input->capsule, "dltensor");
+    if(input->managed == NULL) {
+        input_release(input);
+        return -1;
+    }
+    // the capsule is consumed, so the tensor is deleted here
+    PyCapsule_SetName(input->capsule, "used_dltensor");
+
+    DLTensor *tensor = &input->managed->dl_tensor;
+    input->itemsize = tensor->dtype.bits / 8;
+    input->kind = tensor->dtype.code == DL_FLOAT ? 'f' : tensor->dtype.code == DL_INT ? 'i' : tensor->dtype.code == DL_UINT ? 'u' : 0;
+    if(tensor->device.device_type != DL_CPU || tensor->ndim < 1 || tensor->ndim > 2 || tensor->dtype.lanes != 1 || input->kind == 0 ||
+        (input->kind == 'f' && input->itemsize != 4 && input->itemsize != 8) || (input->kind != 'f' && input->itemsize != 2)) {
+        PyErr_Format(PyExc_TypeError, "\"%s\" must be a 1D or 2D CPU tensor of float32, float64, int16 or uint16 values", name);
+        input_release(input);
+        return -1;
+    }
+    input->data = (char *) tensor->data + tensor->byte_offset;
+    input->ndim = tensor->ndim;
+    Py_ssize_t stride = input->itemsize;
+    for(int d = input->ndim - 1; d >= 0; d--) {
+        input->shape[d] = (Py_ssize_t) tensor->shape[d];
+        input->strides[d] = tensor->strides != NULL ? (Py_ssize_t) tensor->strides[d] * input->itemsize : stride;
+        stride *= input->shape[d];
+    }
+
+    return 0;
+}
+
+// view the points of an input, interleaved in rows or in separate columns
+static int input_view(const struct input_t *input, struct point_cloud_view_t *view) {
+
+    if(input->ndim != 2 || input->kind != 'f' || input->shape[1] < 3) {
+        PyErr_SetString(PyExc_ValueError, "The points must be a float32 or float64 array of at least 3 columns");
+        return -1;
+    }
+    enum point_type_t type = input->itemsize == 4 ? POINT_TYPE_FLOAT32 : POINT_TYPE_FLOAT64;
+
+    if(input->strides[1] == input->itemsize && input->strides[0] >= input->shape[1] * input->itemsize) {
+        point_cloud_view_init(view, input->data, type, (unsigned short) input->shape[1], 0);
+        view->stride = (unsigned long) input->strides[0];
+        return 0;
+    }
+    if(input->strides[0] == input->itemsize && input->strides[1] > 0) {
+        point_cloud_view_init_columns(view, input->data, input->data + input->strides[1], input->data + 2 * input->strides[1], type);
+        return 0;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "The points must be contiguous in rows or in columns");
+    return -1;
+}
+
+// get the classes of the points. None without classes. the classes index the class counters of each voxel, so they are checked once here
+static int input_classes(PyObject *obj, struct input_t *input, Py_ssize_t num_points, unsigned short num_classes) {
+
+    memset(input, 0, sizeof(struct input_t));
+    if(obj == Py_None)
+        return 0;
+    if(input_get(obj, input, "classes", false) < 0)
+        return -1;
+    if(input->ndim != 1 || input->kind == 'f' || input->strides[0] != 2 || input->shape[0] != num_points) {
+        PyErr_SetString(PyExc_ValueError, "The classes must be a contiguous int16 or uint16 array with a class per point");
+        input_release(input);
+        return -1;
+    }
+
+    for(Py_ssize_t i = 0; i < num_points; i++) {
+        long class = input->kind == 'i' ? ((const int16_t *) input->data)[i] : ((const uint16_t *) input->data)[i];
+        if(class < 0 || class > num_classes) {
+            PyErr_Format(PyExc_ValueError, "The classes must be in [0, %u], got %ld!", (unsigned int) num_classes, class);
+            input_release(input);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// check the output options before they are cast to their enums
+static int check_output_options(int covariance_layout, int padding) {
+    if(covariance_layout != COVARIANCE_FULL && covariance_layout != COVARIANCE_UPPER) {
+        PyErr_SetString(PyExc_ValueError, "The covariance layout must be COVARIANCE_FULL or COVARIANCE_UPPER");
+        return -1;
+    }
+    if(padding != PADDING_NONE && padding != PADDING_ZERO && padding != PADDING_REPEAT) {
+        PyErr_SetString(PyExc_ValueError, "The padding must be PADDING_NONE, PADDING_ZERO or PADDING_REPEAT");
+        return -1;
+    }
+    return 0;
+}
+
+// number of values in each row of the features
+static Py_ssize_t feature_width(int covariance_layout, int num_labels) {
+    return 3 + (covariance_layout == COVARIANCE_UPPER ? 6 : 9) + num_labels;
+}
+
+/* Array: features owned by the module */
+
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    char format[2];
+    DLDataType dtype;
+    int ndim;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} ArrayObject;
+
+// exported DLPack tensor, keeping the array alive
+struct array_export_t {
+    DLManagedTensor managed;
+    int64_t shape[2];
+    int64_t strides[2];
+};
+
+static PyTypeObject ArrayType;
+
+// create a contiguous array of "rows" by "cols" values. "cols" 0 for 1D arrays
+static ArrayObject *array_new(char format, Py_ssize_t rows, Py_ssize_t cols) {
+
+    ArrayObject *array = PyObject_New(ArrayObject, &ArrayType);
+    if(array == NULL)
+        return NULL;
+
+    Py_ssize_t itemsize = format == 'f' ? 4 : 8;
+    array->format[0] = format;
+    array->format[1] = '\0';
+    array->dtype.code = format == 'Q' ? DL_UINT : DL_FLOAT;
+    array->dtype.bits = (uint8_t) (itemsize * 8);
+    array->dtype.lanes = 1;
+    array->ndim = cols > 0 ? 2 : 1;
+    array->shape[0] = rows;
+    array->shape[1] = cols;
+    array->strides[0] = cols > 0 ? cols * itemsize : itemsize;
+    array->strides[1] = itemsize;
+    array->data = (char *) PyMem_RawMalloc(rows * array->strides[0] + 1);
+    if(array->data == NULL) {
+        Py_DECREF(array);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return array;
+}
+
+static void array_dealloc(ArrayObject *self) {
+    PyMem_RawFree(self->data);
+    PyObject_Free(self);
+}
+
+static int array_getbuffer(ArrayObject *self, Py_buffer *view, int flags) {
+
+    (void) flags;
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->shape[0] * self->strides[0];
+    view->readonly = 0;
+    view->itemsize = self->strides[self->ndim - 1];
+    view->format = self->format;
+    view->ndim = self->ndim;
+    view->shape = self->shape;
+    view->strides = self->strides;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+static PyBufferProcs array_as_buffer = {
+    (getbufferproc) array_getbuffer,
+    NULL
+};
+
+// delete an exported tensor, from any thread
+static void array_export_delete(DLManagedTensor *managed) {
+    PyGILState_STATE state = PyGILState_Ensure();
+    Py_XDECREF((PyObject *) managed->manager_ctx);
+    PyMem_RawFree(managed);
+    PyGILState_Release(state);
+}
+
+// delete the tensor of a capsule nobody consumed
+static void array_capsule_destructor(PyObject *capsule) {
+    if(!PyCapsule_IsValid(capsule, "dltensor"))
+        return;
+    DLManagedTensor *managed = (DLManagedTensor *) PyCapsule_GetPointer(capsule, "dltensor");
+    managed->deleter(managed);
+}
+
+static PyObject *array_dlpack(ArrayObject *self, PyObject *args, PyObject *kwargs) {
+
+    // the stream and the version requests do not apply to CPU memory. the unversioned capsule is understood by every consumer
+    (void) args;
+    (void) kwargs;
+
+    struct array_export_t *export = (struct array_export_t *) PyMem_RawCalloc(1, sizeof(struct array_export_t));
+    if(export == NULL)
+        return PyErr_NoMemory();
+    for(int d = 0; d < self->ndim; d++) {
+        export->shape[d] = self->shape[d];
+        export->strides[d] = self->strides[d] / self->strides[self->ndim - 1];
+    }
+    DLTensor *tensor = &export->managed.dl_tensor;
+    tensor->data = self->data;
+    tensor->device.device_type = DL_CPU;
+    tensor->ndim = self->ndim;
+    tensor->dtype = self->dtype;
+    tensor->shape = export->shape;
+    tensor->strides = export->strides;
+    export->managed.manager_ctx = self;
+    export->managed.deleter = array_export_delete;
+    Py_INCREF(self);
+
+    PyObject *capsule = PyCapsule_New(&export->managed, "dltensor", array_capsule_destructor);
+    if(capsule == NULL)
+        array_export_delete(&export->managed);
+
+    return capsule;
+}
+
+static PyObject *array_dlpack_device(ArrayObject *self, PyObject *unused) {
+    (void) self;
+    (void) unused;
+    return Py_BuildValue("(ii)", DL_CPU, 0);
+}
+
+static PyObject *array_shape(ArrayObject *self, void *closure) {
+    (void) closure;
+    return self->ndim == 2 ? Py_BuildValue("(nn)", self->shape[0], self->shape[1]) : Py_BuildValue("(n)", self->shape[0]);
+}
+
+static PyMethodDef array_methods[] = {
+    {"__dlpack__", (PyCFunction) (void (*)(void)) array_dlpack, METH_VARARGS | METH_KEYWORDS, "Export the array as a DLPack capsule."},
+    {"__dlpack_device__", (PyCFunction) array_dlpack_device, METH_NOARGS, "Device of the array, always the CPU."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef array_getset[] = {
+    {"shape", (getter) array_shape, NULL, "Shape of the array.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject ArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_ndnet_core.Array",
+    .tp_doc = "Values owned by the module, readable with numpy.asarray or torch.from_dlpack without copies.",
+    .tp_basicsize = sizeof(ArrayObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) array_dealloc,
+    .tp_as_buffer = &array_as_buffer,
+    .tp_methods = array_methods,
+    .tp_getset = array_getset,
+};
+
+/* Context: a downsampling context, used by one thread at a time */
+
+typedef struct {
+    PyObject_HEAD
+    struct ndt_context_t *context;
+    PyThread_type_lock lock; // held while the context is used without the GIL
+} ContextObject;
+
+static int context_init(ContextObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *keywords[] = {"num_threads", NULL};
+    unsigned int num_threads = 0;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|I", keywords, &num_threads))
+        return -1;
+
+    if(self->lock == NULL) {
+        self->lock = PyThread_allocate_lock();
+        if(self->lock == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    if(self->context != NULL)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->context = ndt_context_create(NULL, num_threads);
+    Py_END_ALLOW_THREADS
+    if(self->context == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Error creating the NDT context!");
+        return -1;
+    }
+
+    return 0;
+}
+
+// destroy the context once the calls in other threads are done
+static void context_close_locked(ContextObject *self) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    if(self->context != NULL)
+        ndt_context_destroy(self->context);
+    self->context = NULL;
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+}
+
+static void context_dealloc(ContextObject *self) {
+    if(self->lock != NULL) {
+        context_close_locked(self);
+        PyThread_free_lock(self->lock);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int context_check(ContextObject *self) {
+    if(self->context == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "The NDT context is closed");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *context_close(ContextObject *self, PyObject *unused) {
+    (void) unused;
+    context_close_locked(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *context_trim(ContextObject *self, PyObject *unused) {
+    (void) unused;
+    if(context_check(self) < 0)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    ndt_context_trim(self->context);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *context_memory(ContextObject *self, PyObject *unused) {
+    (void) unused;
+    if(context_check(self) < 0)
+        return NULL;
+    unsigned long capacity, num_allocations;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    ndt_context_memory(self->context, &capacity, &num_allocations);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("(kk)", capacity, num_allocations);
+}
+
+// downsample a point cloud into the rows of an output, without the GIL
+static int context_downsample_output(ContextObject *self, const struct point_cloud_view_t *view, unsigned long num_points,
+                                    unsigned short *classes, unsigned short num_classes, unsigned long num_desired_points,
+                                    const struct nd_output_t *output, unsigned long *num_downsampled_points) {
+
+    unsigned int len_x, len_y, len_z;
+    double offset_x, offset_y, offset_z, voxel_size;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    status = self->context == NULL ? -1 : ndt_context_downsample(self->context, view, num_points, &len_x, &len_y, &len_z,
+                                                                &offset_x, &offset_y, &offset_z, &voxel_size,
+                                                                classes, num_classes, num_desired_points, output, num_downsampled_points);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    if(status < 0)
+        PyErr_SetString(PyExc_RuntimeError, "Error downsampling the point cloud!");
+
+    return status;
+}
+
+static PyObject *context_downsample(ContextObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *keywords[] = {"points", "num_desired_points", "classes", "num_classes", "num_labels", "covariance_layout", "padding", "double", NULL};
+    PyObject *points_obj, *classes_obj = Py_None;
+    unsigned long num_desired_points;
+    unsigned short num_classes = 0, num_labels = 0;
+    int covariance_layout = COVARIANCE_FULL, padding = PADDING_ZERO, use_double = 0;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Ok|$OHHiip", keywords, &points_obj, &num_desired_points,
+                                    &classes_obj, &num_classes, &num_labels, &covariance_layout, &padding, &use_double))
+        return NULL;
+    if(context_check(self) < 0 || check_output_options(covariance_layout, padding) < 0)
+        return NULL;
+
+    struct input_t points, classes;
+    struct point_cloud_view_t view;
+    if(input_get(points_obj, &points, "points", false) < 0)
+        return NULL;
+    if(input_view(&points, &view) < 0 || input_classes(classes_obj, &classes, points.shape[0], num_classes) < 0) {
+        input_release(&points);
+        return NULL;
+    }
+
+    PyObject *result = NULL;
+    ArrayObject *features = array_new(use_double ? 'd' : 'f', (Py_ssize_t) num_desired_points, feature_width(covariance_layout, num_labels));
+    if(features != NULL) {
+        struct nd_output_t output;
+        nd_output_init_features(&output, use_double ? POINT_TYPE_FLOAT64 : POINT_TYPE_FLOAT32, features->data, num_desired_points,
+                                (enum covariance_layout_t) covariance_layout, num_labels);
+        output.padding = (enum padding_t) padding;
+        unsigned long num_downsampled_points = 0;
+        if(context_downsample_output(self, &view, (unsigned long) points.shape[0], (unsigned short *) classes.data, num_classes,
+                                    num_desired_points, &output, &num_downsampled_points) == 0)
+            result = Py_BuildValue("(Ok)", (PyObject *) features, num_downsampled_points);
+        Py_DECREF(features);
+    }
+
+    input_release(&classes);
+    input_release(&points);
+    return result;
+}
+
+static PyObject *context_downsample_into(ContextObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *keywords[] = {"points", "num_desired_points", "out", "classes", "num_classes", "num_labels", "covariance_layout", "padding", NULL};
+    PyObject *points_obj, *out_obj, *classes_obj = Py_None;
+    unsigned long num_desired_points;
+    unsigned short num_classes = 0, num_labels = 0;
+    int covariance_layout = COVARIANCE_FULL, padding = PADDING_ZERO;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OkO|$OHHii", keywords, &points_obj, &num_desired_points, &out_obj,
+                                    &classes_obj, &num_classes, &num_labels, &covariance_layout, &padding))
+        return NULL;
+    if(context_check(self) < 0 || check_output_options(covariance_layout, padding) < 0)
+        return NULL;
+
+    struct input_t points, classes, out;
+    struct point_cloud_view_t view;
+    if(input_get(points_obj, &points, "points", false) < 0)
+        return NULL;
+    if(input_view(&points, &view) < 0 || input_classes(classes_obj, &classes, points.shape[0], num_classes) < 0) {
+        input_release(&points);
+        return NULL;
+    }
+    if(input_get(out_obj, &out, "out", true) < 0) {
+        input_release(&classes);
+        input_release(&points);
+        return NULL;
+    }
+
+    PyObject *result = NULL;
+    Py_ssize_t width = feature_width(covariance_layout, num_labels);
+    if(out.ndim != 2 || out.kind != 'f' || out.shape[1] != width || out.shape[0] < (Py_ssize_t) num_desired_points ||
+        out.strides[1] != out.itemsize || out.strides[0] != width * out.itemsize) {
+        PyErr_Format(PyExc_ValueError, "Expected a contiguous float buffer of at least (%lu, %zd)!", num_desired_points, width);
+    } else {
+        struct nd_output_t output;
+        nd_output_init_features(&output, out.itemsize == 4 ? POINT_TYPE_FLOAT32 : POINT_TYPE_FLOAT64, out.data, (unsigned long) out.shape[0],
+                                (enum covariance_layout_t) covariance_layout, num_labels);
+        output.padding = (enum padding_t) padding;
+        unsigned long num_downsampled_points = 0;
+        if(context_downsample_output(self, &view, (unsigned long) points.shape[0], (unsigned short *) classes.data, num_classes,
+                                    num_desired_points, &output, &num_downsampled_points) == 0)
+            result = PyLong_FromUnsignedLong(num_downsampled_points);
+    }
+
+    input_release(&out);
+    input_release(&classes);
+    input_release(&points);
+    return result;
+}
+
+// read a sequence of counts
+static unsigned long *read_counts(PyObject *obj, Py_ssize_t *len, const char *name) {
+
+    PyObject *sequence = PySequence_Fast(obj, name);
+    if(sequence == NULL)
+        return NULL;
+    *len = PySequence_Fast_GET_SIZE(sequence);
+    unsigned long *counts = (unsigned long *) PyMem_Malloc((*len + 1) * sizeof(unsigned long));
+    if(counts == NULL) {
+        Py_DECREF(sequence);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for(Py_ssize_t i = 0; i < *len; i++) {
+        // any integer, such as the items of a numpy array, through "__index__"
+        PyObject *item = PyNumber_Index(PySequence_Fast_GET_ITEM(sequence, i));
+        counts[i] = item != NULL ? PyLong_AsUnsignedLong(item) : 0;
+        Py_XDECREF(item);
+        if(PyErr_Occurred()) {
+            PyMem_Free(counts);
+            counts = NULL;
+            break;
+        }
+    }
+    Py_DECREF(sequence);
+
+    return counts;
+}
+
+static PyObject *context_downsample_batch(ContextObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *keywords[] = {"points", "offsets", "num_desired_points", "classes", "num_classes", "num_labels", "covariance_layout", "padding", "double", NULL};
+    PyObject *points_obj, *offsets_obj, *targets_obj, *classes_obj = Py_None;
+    unsigned short num_classes = 0, num_labels = 0;
+    int covariance_layout = COVARIANCE_FULL, padding = PADDING_ZERO, use_double = 0;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|$OHHiip", keywords, &points_obj, &offsets_obj, &targets_obj,
+                                    &classes_obj, &num_classes, &num_labels, &covariance_layout, &padding, &use_double))
+        return NULL;
+    if(context_check(self) < 0 || check_output_options(covariance_layout, padding) < 0)
+        return NULL;
+
+    Py_ssize_t num_offsets, num_clouds;
+    unsigned long *offsets = read_counts(offsets_obj, &num_offsets, "The offsets must be a sequence");
+    if(offsets == NULL)
+        return NULL;
+    unsigned long *targets = read_counts(targets_obj, &num_clouds, "The numbers of desired points must be a sequence");
+    if(targets == NULL) {
+        PyMem_Free(offsets);
+        return NULL;
+    }
+
+    struct input_t points, classes;
+    struct point_cloud_view_t view;
+    memset(&classes, 0, sizeof(struct input_t));
+    PyObject *result = NULL;
+    ArrayObject *features = NULL, *counts = NULL;
+    if(input_get(points_obj, &points, "points", false) < 0)
+        goto free_counts;
+    if(input_view(&points, &view) < 0 || input_classes(classes_obj, &classes, points.shape[0], num_classes) < 0)
+        goto release_points;
+
+    // the offsets split the points in consecutive clouds
+    unsigned long num_rows = 0;
+    bool valid = num_offsets == num_clouds + 1 && offsets[num_clouds] <= (unsigned long) points.shape[0];
+    for(Py_ssize_t b = 0; b < num_clouds && valid; b++) {
+        valid = offsets[b] <= offsets[b+1];
+        num_rows += targets[b];
+    }
+    if(!valid) {
+        PyErr_Format(PyExc_ValueError, "Expected %zd increasing offsets into the %zd points!", num_clouds + 1, points.shape[0]);
+        goto release_points;
+    }
+
+    features = array_new(use_double ? 'd' : 'f', (Py_ssize_t) num_rows, feature_width(covariance_layout, num_labels));
+    counts = array_new('Q', num_clouds, 0);
+    if(features == NULL || counts == NULL)
+        goto release_points;
+    // a cloud that fails is left with no rows, so one degenerate cloud does not drop the batch
+    int *statuses = (int *) PyMem_Malloc((num_clouds + 1) * sizeof(int));
+    if(statuses == NULL) {
+        PyErr_NoMemory();
+        goto release_points;
+    }
+    struct nd_output_t output;
+    nd_output_init_features(&output, use_double ? POINT_TYPE_FLOAT64 : POINT_TYPE_FLOAT32, features->data, num_rows,
+                            (enum covariance_layout_t) covariance_layout, num_labels);
+    output.padding = (enum padding_t) padding;
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    status = self->context == NULL ? -1 : ndt_context_downsample_batch(self->context, &view, offsets, (unsigned long) num_clouds,
+                                                                        (unsigned short *) classes.data, num_classes, targets,
+                                                                        &output, (unsigned long *) counts->data, statuses);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    PyMem_Free(statuses);
+    if(status < 0)
+        PyErr_SetString(PyExc_RuntimeError, "Error downsampling the batch!");
+    else
+        result = Py_BuildValue("(OO)", (PyObject *) features, (PyObject *) counts);
+
+release_points:
+    Py_XDECREF(features);
+    Py_XDECREF(counts);
+    input_release(&classes);
+    input_release(&points);
+free_counts:
+    PyMem_Free(targets);
+    PyMem_Free(offsets);
+    return result;
+}
+
+static PyMethodDef context_methods[] = {
+    {"downsample", (PyCFunction) (void (*)(void)) context_downsample, METH_VARARGS | METH_KEYWORDS,
+        "downsample(points, num_desired_points, *, classes=None, num_classes=0, num_labels=0, covariance_layout=COVARIANCE_FULL, padding=PADDING_ZERO, double=False)\n"
+        "Downsample a point cloud. Returns the features, an Array of \"num_desired_points\" rows, and the number of downsampled rows."},
+    {"downsample_into", (PyCFunction) (void (*)(void)) context_downsample_into, METH_VARARGS | METH_KEYWORDS,
+        "downsample_into(points, num_desired_points, out, *, classes=None, num_classes=0, num_labels=0, covariance_layout=COVARIANCE_FULL, padding=PADDING_ZERO)\n"
+        "Downsample a point cloud into the rows of a writable contiguous float array. Returns the number of downsampled rows."},
+    {"downsample_batch", (PyCFunction) (void (*)(void)) context_downsample_batch, METH_VARARGS | METH_KEYWORDS,
+        "downsample_batch(points, offsets, num_desired_points, *, classes=None, num_classes=0, num_labels=0, covariance_layout=COVARIANCE_FULL, padding=PADDING_ZERO, double=False)\n"
+        "Downsample consecutive clouds of the points, split by \"len(num_desired_points) + 1\" offsets, with a single call.\n"
+        "Returns the features of every cloud, one after the other, and an Array with the number of downsampled rows of each cloud.\n"
+        "A cloud that can not be downsampled, such as one with less points than desired, gets 0 rows and only padding."},
+    {"trim", (PyCFunction) context_trim, METH_NOARGS, "Release the memory of the context, which grows again on the next downsample."},
+    {"memory", (PyCFunction) context_memory, METH_NOARGS, "Size of the reused memory in bytes, and the number of heap allocations done so far."},
+    {"close", (PyCFunction) context_close, METH_NOARGS, "Release the context and its memory."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ContextType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_ndnet_core.Context",
+    .tp_doc = "Context(num_threads=0)\nDownsamples a sequence of point clouds, reusing the memory and the voxel size of the previous one.\n"
+              "The core runs without the GIL. A context is used by one thread at a time, and other threads wait for it.",
+    .tp_basicsize = sizeof(ContextObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) context_init,
+    .tp_dealloc = (destructor) context_dealloc,
+    .tp_methods = context_methods,
+};
+
+static struct PyModuleDef ndnet_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_ndnet_core",
+    .m_doc = "Native bindings of the NDT downsampling core.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__ndnet_core(void) {
+
+    if(PyType_Ready(&ArrayType) < 0 || PyType_Ready(&ContextType) < 0)
+        return NULL;
+
+    PyObject *module = PyModule_Create(&ndnet_module);
+    if(module == NULL)
+        return NULL;
+
+    if(PyModule_AddObjectRef(module, "Array", (PyObject *) &ArrayType) < 0 ||
+        PyModule_AddObjectRef(module, "Context", (PyObject *) &ContextType) < 0 ||
+        PyModule_AddIntConstant(module, "COVARIANCE_FULL", COVARIANCE_FULL) < 0 ||
+        PyModule_AddIntConstant(module, "COVARIANCE_UPPER", COVARIANCE_UPPER) < 0 ||
+        PyModule_AddIntConstant(module, "PADDING_NONE", PADDING_NONE) < 0 ||
+        PyModule_AddIntConstant(module, "PADDING_ZERO", PADDING_ZERO) < 0 ||
+        PyModule_AddIntConstant(module, "PADDING_REPEAT", PADDING_REPEAT) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
@@ -0,0 +1,156 @@
+#include <ndnet_core/kernels.hpp>
+
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <atomic>
+
+// instantiations of the kernels used by the downsampling pipeline, behind the C API of "kernels.h"
+
+using namespace ndnet::kernels;
+
+static std::atomic<bool> enabled(true);
+
+// call "select" with the layout of a point cloud view among the specialized ones. NULL for other layouts
+template<typename Select>
+static auto select_points(const point_cloud_view_t *point_cloud, Select select) -> decltype(select(column_points<float>(*point_cloud))) {
+
+    if(interleaved_points<float, 3>::matches(*point_cloud))
+        return select(interleaved_points<float, 3>(*point_cloud));
+    if(interleaved_points<float, 4>::matches(*point_cloud))
+        return select(interleaved_points<float, 4>(*point_cloud));
+    if(interleaved_points<double, 3>::matches(*point_cloud))
+        return select(interleaved_points<double, 3>(*point_cloud));
+    if(interleaved_points<double, 4>::matches(*point_cloud))
+        return select(interleaved_points<double, 4>(*point_cloud));
+    if(column_points<float>::matches(*point_cloud))
+        return select(column_points<float>(*point_cloud));
+    if(column_points<double>::matches(*point_cloud))
+        return select(column_points<double>(*point_cloud));
+
+    return nullptr;
+}
+
+template<typename Points>
+static int voxel_key_kernel(const point_cloud_view_t *point_cloud, const voxel_grid_t *grid, unsigned long start, unsigned long end,
+                            unsigned long *keys, unsigned long *point_indexes) {
+    return voxel_keys<Points>(*point_cloud, *grid, start, end, keys, point_indexes);
+}
+
+template<typename Points, typename Labels>
+static void run_reduce_kernel(const point_cloud_view_t *point_cloud, const unsigned short *classes, unsigned short num_classes, unsigned int *class_counts,
+                            const unsigned long *keys, const unsigned long *point_indexes, const unsigned long *run_starts,
+                            unsigned long first_run, unsigned long last_run, bool compact, nd_store_t *store) {
+    reduce_runs<Points, Labels>(*point_cloud, classes, num_classes, class_counts, keys, point_indexes, run_starts, first_run, last_run, compact, store);
+}
+
+template<typename Out, covariance_layout_t Layout, bool OneHot, bool Classes, bool Sanitize>
+static export_kernel_t export_kernel() {
+    return export_rows<Out, Layout, OneHot, Classes, Sanitize>;
+}
+
+void kernels_set_enabled(bool value) {
+    enabled.store(value, std::memory_order_relaxed);
+}
+
+bool kernels_enabled(void) {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+voxel_key_kernel_t kernels_select_voxel_keys(const point_cloud_view_t *point_cloud) {
+
+    if(!kernels_enabled())
+        return nullptr;
+
+    return select_points(point_cloud, [](auto points) -> voxel_key_kernel_t {
+        return voxel_key_kernel<decltype(points)>;
+    });
+}
+
+run_reduce_kernel_t kernels_select_run_reduce(const point_cloud_view_t *point_cloud, bool with_classes, class_estimator_t class_estimator) {
+
+    if(!kernels_enabled() || point_cloud->num_channels > 0)
+        return nullptr;
+
+    return select_points(point_cloud, [=](auto points) -> run_reduce_kernel_t {
+        using Points = decltype(points);
+        if(!with_classes)
+            return run_reduce_kernel<Points, no_labels>;
+        if(class_estimator == CLASS_ESTIMATOR_HISTOGRAM)
+            return run_reduce_kernel<Points, histogram_labels>;
+        return run_reduce_kernel<Points, vote_labels>;
+    });
+}
+
+kl_pair_kernel_t kernels_select_kl_pairs(neighborhood_t neighborhood, bool dense) {
+
+    // the sparse kernels are no faster than the generic loop in "kernels_benchmark"
+    if(!kernels_enabled() || !dense)
+        return nullptr;
+
+    switch(neighborhood) {
+        case NEIGHBORHOOD_FACES:
+            return kl_pairs<NEIGHBORHOOD_FACES, true>;
+        case NEIGHBORHOOD_EDGES:
+            return kl_pairs<NEIGHBORHOOD_EDGES, true>;
+        case NEIGHBORHOOD_CORNERS:
+            return kl_pairs<NEIGHBORHOOD_CORNERS, true>;
+    }
+
+    return nullptr;
+}
+
+export_kernel_t kernels_select_export(const nd_output_t *output, const nd_store_t *store) {
+
+    if(!kernels_enabled() || output->covariances == nullptr || (output->channels != nullptr && store->num_channels > 0))
+        return nullptr;
+
+    bool f32 = output->type == POINT_TYPE_FLOAT32;
+    bool upper = output->covariance_layout == COVARIANCE_UPPER;
+
+    // model features: packed rows with an optional one-hot class, sanitized. the dense kernels are no faster than the generic loop
+    if(output->sanitize && output->classes == nullptr) {
+        if(store->dense)
+            return nullptr;
+        bool one_hot = output->one_hot != nullptr;
+        if(f32)
+            return upper ? (one_hot ? export_kernel<float, COVARIANCE_UPPER, true, false, true>() : export_kernel<float, COVARIANCE_UPPER, false, false, true>())
+                         : (one_hot ? export_kernel<float, COVARIANCE_FULL, true, false, true>() : export_kernel<float, COVARIANCE_FULL, false, false, true>());
+        return upper ? (one_hot ? export_kernel<double, COVARIANCE_UPPER, true, false, true>() : export_kernel<double, COVARIANCE_UPPER, false, false, true>())
+                     : (one_hot ? export_kernel<double, COVARIANCE_FULL, true, false, true>() : export_kernel<double, COVARIANCE_FULL, false, false, true>());
+    }
+
+    // point clouds: the means, the full covariances and optionally the classes, as written
+    if(!output->sanitize && output->one_hot == nullptr && !upper) {
+        bool classes = output->classes != nullptr;
+        if(f32)
+            return classes ? export_kernel<float, COVARIANCE_FULL, false, true, false>() : export_kernel<float, COVARIANCE_FULL, false, false, false>();
+        return classes ? export_kernel<double, COVARIANCE_FULL, false, true, false>() : export_kernel<double, COVARIANCE_FULL, false, false, false>();
+    }
+
+    return nullptr;
+}
@@ -1,4 +1,5 @@
 #include <ndnet_core/kullback_leibler.h>
+#include <ndnet_core/kernels.h>
 
 /*
  MIT License
@@ -25,180 +26,720 @@
 
  */
 
-int kl_divergence(struct normal_distribution_t *p, struct normal_distribution_t *q, double *divergence) {
 
-    // calculate the divergence between two normal distributions
-    // the divergence is the multivariate Kullback-Leibler divergence
+struct kl_divergence_worker_args_t {
+    const struct nd_store_t *store; // pointer to the store of normal distributions
+    unsigned int num_slots; // number of neighbors of each distribution
+    long offsets[NEIGHBORHOOD_MAX_LEN]; // voxel index offset of each neighbor
+    double *divergences; // divergence of each distribution to each neighbor
+    uint32_t *neighbors; // store entry of each neighbor, "KL_NO_NEIGHBOR" if there is no divergence
+    kl_pair_kernel_t kernel; // specialized kernel of the neighborhood and the store layout. NULL for the generic loop
+};
+
+struct kl_ranking_args_t {
+    const struct nd_store_t *store; // pointer to the store of normal distributions
+    unsigned int num_slots; // number of neighbors of each distribution
+    const double *divergences; // divergence of each distribution to each neighbor
+    const uint32_t *neighbors; // store entry of each neighbor, "KL_NO_NEIGHBOR" if there is no divergence
+    unsigned long num_blocks; // number of blocks of "KL_CHUNK_SIZE" entries
+    unsigned long *block_edges; // number of divergences of each block, then the offset of its first divergence
+    unsigned long *block_valid; // number of valid distributions of each block
+    unsigned long *keys; // sort key of each divergence
+    unsigned long *slots; // neighbor slot of each divergence
+    struct kl_edge_t *kl_edges; // ranked divergences
+};
+
+// closed-form terms of the divergence between two 3-d normal distributions with symmetric covariances
+// "terms" receives tr(inv(q) * p) + (mean difference)' * inv(q) * (mean difference) - 3
+// "p_det" and "q_det" receive the determinants of the covariances
+// the logarithm and the singularity check are left out, so the callers can do them out of the vectorized loops
+static inline void kl_closed_form(double dx, double dy, double dz,
+                                    double p00, double p01, double p02, double p11, double p12, double p22,
+                                    double q00, double q01, double q02, double q11, double q12, double q22,
+                                    double *terms, double *p_det, double *q_det) {
+
+    // cofactors of the q covariance. the inverse is the cofactor matrix divided by the determinant
+    double c00 = q11 * q22 - q12 * q12;
+    double c01 = q02 * q12 - q01 * q22;
+    double c02 = q01 * q12 - q02 * q11;
+    double c11 = q00 * q22 - q02 * q02;
+    double c12 = q01 * q02 - q00 * q12;
+    double c22 = q00 * q11 - q01 * q01;
+    *q_det = q00 * c00 + q01 * c01 + q02 * c02;
+
+    // determinant of the p covariance
+    *p_det = p00 * (p11 * p22 - p12 * p12) - p01 * (p01 * p22 - p02 * p12) + p02 * (p01 * p12 - p02 * p11);
+
+    // trace of the product of the q inverse and the p covariance
+    double trace = c00 * p00 + c11 * p11 + c22 * p22 + 2.0 * (c01 * p01 + c02 * p02 + c12 * p12);
+
+    // squared Mahalanobis distance between the means
+    double mahalanobis = c00 * dx * dx + c11 * dy * dy + c22 * dz * dz + 2.0 * (c01 * dx * dy + c02 * dx * dz + c12 * dy * dz);
+
+    *terms = (trace + mahalanobis) / *q_det - 3.0;
+}
 
-    *divergence = 0;
+int kl_divergence_3x3(const double *p_mean, const double *p_covariance,
+                        const double *q_mean, const double *q_covariance,
+                        double *divergence) {
+
+    double terms, p_det, q_det;
+    kl_closed_form(q_mean[0] - p_mean[0], q_mean[1] - p_mean[1], q_mean[2] - p_mean[2],
+                    p_covariance[0], p_covariance[1], p_covariance[2], p_covariance[4], p_covariance[5], p_covariance[8],
+                    q_covariance[0], q_covariance[1], q_covariance[2], q_covariance[4], q_covariance[5], q_covariance[8],
+                    &terms, &p_det, &q_det);
+
+    // covariances are positive semi-definite, so a non-positive determinant means a singular matrix
+    if(!(p_det > 0) || !(q_det > 0)) {
+        *divergence = 0;
+        return -2;
+    }
+
+    *divergence = 0.5 * (terms + log(q_det / p_det));
+
+    return 0;
+}
+
+void kl_divergence_batch(const double *means, const double *covariances,
+                        const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                        double *divergences) {
+
+    // the pairs are gathered in blocks of structure-of-arrays, so the closed form runs in SIMD lanes
+    double dx[KL_BATCH_SIZE], dy[KL_BATCH_SIZE], dz[KL_BATCH_SIZE];
+    double p_cov[6][KL_BATCH_SIZE], q_cov[6][KL_BATCH_SIZE];
+    double terms[KL_BATCH_SIZE], p_det[KL_BATCH_SIZE], q_det[KL_BATCH_SIZE];
+    // upper triangle of a flattened 3x3 matrix
+    static const unsigned short upper[6] = {0, 1, 2, 4, 5, 8};
+
+    for(unsigned long block = 0; block < num_pairs; block += KL_BATCH_SIZE) {
+
+        unsigned long n = num_pairs - block < KL_BATCH_SIZE ? num_pairs - block : KL_BATCH_SIZE;
+
+        // gather the block
+        for(unsigned long k = 0; k < n; k++) {
+            const double *p_mean = &means[p[block+k]*3];
+            const double *q_mean = &means[q[block+k]*3];
+            dx[k] = q_mean[0] - p_mean[0];
+            dy[k] = q_mean[1] - p_mean[1];
+            dz[k] = q_mean[2] - p_mean[2];
+            for(short e = 0; e < 6; e++) {
+                p_cov[e][k] = covariances[p[block+k]*9+upper[e]];
+                q_cov[e][k] = covariances[q[block+k]*9+upper[e]];
+            }
+        }
+
+        #pragma omp simd
+        for(unsigned long k = 0; k < n; k++) {
+            kl_closed_form(dx[k], dy[k], dz[k],
+                            p_cov[0][k], p_cov[1][k], p_cov[2][k], p_cov[3][k], p_cov[4][k], p_cov[5][k],
+                            q_cov[0][k], q_cov[1][k], q_cov[2][k], q_cov[3][k], q_cov[4][k], q_cov[5][k],
+                            &terms[k], &p_det[k], &q_det[k]);
+        }
+
+        // the logarithm does not vectorize without a vector math library, and comparisons may trap
+        for(unsigned long k = 0; k < n; k++) {
+            if(!(p_det[k] > 0) || !(q_det[k] > 0)) {
+                divergences[block+k] = NAN;
+                continue;
+            }
+            divergences[block+k] = 0.5 * (terms[k] + log(q_det[k] / p_det[k]));
+        }
+    }
+}
+
+void kl_divergence_batch_factored(const double *means, const double *covariances,
+                                const double *inverse_covariances, const double *log_determinants,
+                                const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                                double *divergences) {
+
+    // with the factors cached, the divergence is pure arithmetic and the whole block runs in SIMD lanes
+    double dx[KL_BATCH_SIZE], dy[KL_BATCH_SIZE], dz[KL_BATCH_SIZE];
+    double p_cov[6][KL_BATCH_SIZE], q_inv[6][KL_BATCH_SIZE];
+    double log_det_ratio[KL_BATCH_SIZE];
+    // upper triangle of a flattened 3x3 matrix
+    static const unsigned short upper[6] = {0, 1, 2, 4, 5, 8};
+
+    for(unsigned long block = 0; block < num_pairs; block += KL_BATCH_SIZE) {
+
+        unsigned long n = num_pairs - block < KL_BATCH_SIZE ? num_pairs - block : KL_BATCH_SIZE;
+
+        // gather the block
+        for(unsigned long k = 0; k < n; k++) {
+            const double *p_mean = &means[p[block+k]*3];
+            const double *q_mean = &means[q[block+k]*3];
+            dx[k] = q_mean[0] - p_mean[0];
+            dy[k] = q_mean[1] - p_mean[1];
+            dz[k] = q_mean[2] - p_mean[2];
+            for(short e = 0; e < 6; e++) {
+                p_cov[e][k] = covariances[p[block+k]*9+upper[e]];
+                q_inv[e][k] = inverse_covariances[q[block+k]*9+upper[e]];
+            }
+            log_det_ratio[k] = log_determinants[q[block+k]] - log_determinants[p[block+k]];
+        }
+
+        double *out = &divergences[block];
+        #pragma omp simd
+        for(unsigned long k = 0; k < n; k++) {
+            // trace of the product of the q inverse and the p covariance
+            double trace = q_inv[0][k] * p_cov[0][k] + q_inv[3][k] * p_cov[3][k] + q_inv[5][k] * p_cov[5][k] +
+                            2.0 * (q_inv[1][k] * p_cov[1][k] + q_inv[2][k] * p_cov[2][k] + q_inv[4][k] * p_cov[4][k]);
+            // squared Mahalanobis distance between the means
+            double mahalanobis = q_inv[0][k] * dx[k] * dx[k] + q_inv[3][k] * dy[k] * dy[k] + q_inv[5][k] * dz[k] * dz[k] +
+                                2.0 * (q_inv[1][k] * dx[k] * dy[k] + q_inv[2][k] * dx[k] * dz[k] + q_inv[4][k] * dy[k] * dz[k]);
+            out[k] = 0.5 * (trace + mahalanobis - 3.0 + log_det_ratio[k]);
+        }
+    }
+}
+
+void kl_divergence_batch_symmetric(const double *means, const double *covariances,
+                                const double *inverse_covariances, const double *log_determinants,
+                                const unsigned long *p, const unsigned long *q, unsigned long num_pairs,
+                                double *divergences_pq, double *divergences_qp) {
+
+    // both directions share the mean difference, the log-determinant ratio and the gathers
+    double dx[KL_BATCH_SIZE], dy[KL_BATCH_SIZE], dz[KL_BATCH_SIZE];
+    double p_cov[6][KL_BATCH_SIZE], q_cov[6][KL_BATCH_SIZE];
+    double p_inv[6][KL_BATCH_SIZE], q_inv[6][KL_BATCH_SIZE];
+    double log_det_ratio[KL_BATCH_SIZE];
+    // upper triangle of a flattened 3x3 matrix
+    static const unsigned short upper[6] = {0, 1, 2, 4, 5, 8};
+
+    for(unsigned long block = 0; block < num_pairs; block += KL_BATCH_SIZE) {
+
+        unsigned long n = num_pairs - block < KL_BATCH_SIZE ? num_pairs - block : KL_BATCH_SIZE;
+
+        // gather the block
+        for(unsigned long k = 0; k < n; k++) {
+            const double *p_mean = &means[p[block+k]*3];
+            const double *q_mean = &means[q[block+k]*3];
+            dx[k] = q_mean[0] - p_mean[0];
+            dy[k] = q_mean[1] - p_mean[1];
+            dz[k] = q_mean[2] - p_mean[2];
+            for(short e = 0; e < 6; e++) {
+                p_cov[e][k] = covariances[p[block+k]*9+upper[e]];
+                q_cov[e][k] = covariances[q[block+k]*9+upper[e]];
+                p_inv[e][k] = inverse_covariances[p[block+k]*9+upper[e]];
+                q_inv[e][k] = inverse_covariances[q[block+k]*9+upper[e]];
+            }
+            log_det_ratio[k] = log_determinants[q[block+k]] - log_determinants[p[block+k]];
+        }
+
+        double *out_pq = &divergences_pq[block];
+        double *out_qp = &divergences_qp[block];
+        #pragma omp simd
+        for(unsigned long k = 0; k < n; k++) {
+            // same operation order as "kl_divergence_batch_factored", so both kernels give the same values
+            double trace_pq = q_inv[0][k] * p_cov[0][k] + q_inv[3][k] * p_cov[3][k] + q_inv[5][k] * p_cov[5][k] +
+                                2.0 * (q_inv[1][k] * p_cov[1][k] + q_inv[2][k] * p_cov[2][k] + q_inv[4][k] * p_cov[4][k]);
+            double mahalanobis_pq = q_inv[0][k] * dx[k] * dx[k] + q_inv[3][k] * dy[k] * dy[k] + q_inv[5][k] * dz[k] * dz[k] +
+                                    2.0 * (q_inv[1][k] * dx[k] * dy[k] + q_inv[2][k] * dx[k] * dz[k] + q_inv[4][k] * dy[k] * dz[k]);
+            out_pq[k] = 0.5 * (trace_pq + mahalanobis_pq - 3.0 + log_det_ratio[k]);
+
+            // the reversed mean difference gives the same products
+            double trace_qp = p_inv[0][k] * q_cov[0][k] + p_inv[3][k] * q_cov[3][k] + p_inv[5][k] * q_cov[5][k] +
+                                2.0 * (p_inv[1][k] * q_cov[1][k] + p_inv[2][k] * q_cov[2][k] + p_inv[4][k] * q_cov[4][k]);
+            double mahalanobis_qp = p_inv[0][k] * dx[k] * dx[k] + p_inv[3][k] * dy[k] * dy[k] + p_inv[5][k] * dz[k] * dz[k] +
+                                    2.0 * (p_inv[1][k] * dx[k] * dy[k] + p_inv[2][k] * dx[k] * dz[k] + p_inv[4][k] * dy[k] * dz[k]);
+            out_qp[k] = 0.5 * (trace_qp + mahalanobis_qp - 3.0 - log_det_ratio[k]);
+        }
+    }
+}
 
-    /*
-    printf("CALCULATING DIVERGENCE BETWEEN %lu AND %lu\n", p->index, q->index);
-    print_nd(*p);
-    print_nd(*q);
-    printf("--------------------------------\n");
-    */
+int kl_divergence_gsl(const struct normal_distribution_t *p, const struct normal_distribution_t *q, double *divergence) {
+
+    *divergence = 0;
 
     if(p->num_samples <= 1 || q->num_samples <= 1) {
-        // fprintf(stderr, "Not enough samples!\n");
         return -1;
     }
 
-    // create GSL matrices from the covariance matrices
-    gsl_matrix_view p_covariance = gsl_matrix_view_array(p->covariance, 3, 3);
-    gsl_matrix_view q_covariance = gsl_matrix_view_array(q->covariance, 3, 3);
+    // the LU decomposition is done in place, so work on copies of the covariance matrices
+    double p_covariance_data[9], q_covariance_data[9];
+    memcpy(p_covariance_data, p->covariance, 9 * sizeof(double));
+    memcpy(q_covariance_data, q->covariance, 9 * sizeof(double));
+    gsl_matrix_view p_covariance = gsl_matrix_view_array(p_covariance_data, 3, 3);
+    gsl_matrix_view q_covariance = gsl_matrix_view_array(q_covariance_data, 3, 3);
+    // the p covariance is needed intact for the trace
+    double p_original_data[9];
+    memcpy(p_original_data, p->covariance, 9 * sizeof(double));
+    gsl_matrix_view p_original = gsl_matrix_view_array(p_original_data, 3, 3);
 
-    // make the LU decomposition of the covariance matrices
-    gsl_matrix *p_LU = gsl_matrix_alloc(3, 3);
-    gsl_matrix *q_LU = gsl_matrix_alloc(3, 3);
     gsl_permutation *p_permutation = gsl_permutation_alloc(3);
     gsl_permutation *q_permutation = gsl_permutation_alloc(3);
+    gsl_matrix *mean_diff = gsl_matrix_alloc(3, 1);
+    gsl_matrix *mean_diff_transpose = gsl_matrix_alloc(1, 3);
+    gsl_matrix *q_inverse = gsl_matrix_alloc(3, 3);
+    gsl_matrix *trace_matrix = gsl_matrix_alloc(3, 3);
+    gsl_matrix *first_part = gsl_matrix_alloc(1, 3);
+
+    int status = 0;
+
+    // make the LU decomposition of the covariance matrices
     int p_signum, q_signum;
     gsl_linalg_LU_decomp(&(p_covariance.matrix), p_permutation, &p_signum);
     gsl_linalg_LU_decomp(&(q_covariance.matrix), q_permutation, &q_signum);
-    gsl_permutation_free(p_permutation);
 
     // calculate the determinant of the covariance matrices
     double p_det = gsl_linalg_LU_det(&(p_covariance.matrix), p_signum);
     double q_det = gsl_linalg_LU_det(&(q_covariance.matrix), q_signum);
 
-    // check if the determinants are zero
-    if(p_det == 0 || q_det == 0) {
-        // fprintf(stderr, "The covariance matrix is singular!\n");
-        return -2;
-    }
-    // check if the matrices are invertible by the rank
-    if(gsl_linalg_LU_sgndet(&(p_covariance.matrix), p_signum) == 0 || gsl_linalg_LU_sgndet(&(q_covariance.matrix), q_signum) == 0) {
-        // fprintf(stderr, "The \"p\" covariance matrix is singular!\n");
-        return -2;
-    }
-    if(gsl_linalg_LU_sgndet(&(q_covariance.matrix), q_signum) == 0 || gsl_linalg_LU_sgndet(&(q_covariance.matrix), q_signum) == 0) {
-        // fprintf(stderr, "The \"q\"covariance matrix is singular!\n");
-        return -2;
+    if(!(p_det > 0) || !(q_det > 0)) {
+        // the covariance matrix is singular
+        status = -2;
+        goto cleanup;
     }
 
     // calculate the difference between the means
-    gsl_matrix *mean_diff = gsl_matrix_alloc(3, 1); // allocate the mean difference vector
-    gsl_matrix_view p_mean = gsl_matrix_view_array(p->mean, 3, 1);
-    gsl_matrix_view q_mean = gsl_matrix_view_array(q->mean, 3, 1);
-    gsl_matrix_memcpy(mean_diff, &q_mean.matrix); // copy the p mean to the difference
-    gsl_matrix_sub(mean_diff, &p_mean.matrix); // subtract the q mean from the difference
-    // transpose the mean difference vector in a copy
-    gsl_matrix *mean_diff_transpose = gsl_matrix_alloc(1, 3);
+    double p_mean_copy[3], q_mean_copy[3];
+    memcpy(p_mean_copy, p->mean, 3 * sizeof(double));
+    memcpy(q_mean_copy, q->mean, 3 * sizeof(double));
+    gsl_matrix_view p_mean = gsl_matrix_view_array(p_mean_copy, 3, 1);
+    gsl_matrix_view q_mean = gsl_matrix_view_array(q_mean_copy, 3, 1);
+    gsl_matrix_memcpy(mean_diff, &q_mean.matrix);
+    gsl_matrix_sub(mean_diff, &p_mean.matrix);
     gsl_matrix_transpose_memcpy(mean_diff_transpose, mean_diff);
 
     // calculate the inverse of the q covariance matrix
-    gsl_matrix *q_inverse = gsl_matrix_alloc(3, 3);
     gsl_linalg_LU_invert(&q_covariance.matrix, q_permutation, q_inverse);
-    gsl_permutation_free(q_permutation);
 
     // calculate the trace of the multiplication of the inverse of the q covariance matrix and the p covariance matrix
-    gsl_matrix *trace_matrix = gsl_matrix_alloc(3, 3);
-    gsl_matrix_memcpy(trace_matrix, q_inverse); // copy the q inverse to the trace matrix
-    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, q_inverse, &p_covariance.matrix, 0.0, trace_matrix); // multiply the q inverse by the p covariance matrix
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, q_inverse, &p_original.matrix, 0.0, trace_matrix);
     double trace = 0;
     for(int i = 0; i < 3; i++) {
         trace += gsl_matrix_get(trace_matrix, i, i);
     }
 
-    // fist part of the divergence (mean difference transposed * q inverse * mean difference)
-    gsl_matrix *first_part = gsl_matrix_alloc(1, 3);
-    gsl_matrix_memcpy(first_part, mean_diff_transpose); // copy the mean difference transpose to the first part
-    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, first_part, q_inverse, 0.0, first_part); // multiply the first part by the q inverse
+    // first part of the divergence (mean difference transposed * q inverse * mean difference)
+    gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, mean_diff_transpose, q_inverse, 0.0, first_part);
     double first_part_result = 0;
-    // convert the first part and mean difference to a GSL vector
     gsl_vector_view first_part_view = gsl_vector_view_array(first_part->data, 3);
     gsl_vector_view mean_diff_view = gsl_vector_view_array(mean_diff->data, 3);
-    gsl_blas_ddot(&(first_part_view.vector), &(mean_diff_view.vector), &first_part_result); // calculate the dot product of the first part and the mean difference
+    gsl_blas_ddot(&(first_part_view.vector), &(mean_diff_view.vector), &first_part_result);
 
     // calculate the divergence
-    *divergence = 0.5 * (first_part_result + trace - log(q_det/p_det) - 3);
+    *divergence = 0.5 * (first_part_result + trace + log(q_det/p_det) - 3);
 
-    // free the allocated memory
-    gsl_matrix_free(p_LU);
-    gsl_matrix_free(q_LU);
+cleanup:
+    gsl_permutation_free(p_permutation);
+    gsl_permutation_free(q_permutation);
     gsl_matrix_free(mean_diff);
     gsl_matrix_free(mean_diff_transpose);
     gsl_matrix_free(q_inverse);
     gsl_matrix_free(trace_matrix);
     gsl_matrix_free(first_part);
 
-    return 0;
+    return status;
+}
+
+int kl_divergence(struct normal_distribution_t *p, struct normal_distribution_t *q, double *divergence) {
+
+    *divergence = 0;
+
+    if(p->num_samples <= 1 || q->num_samples <= 1) {
+        // fprintf(stderr, "Not enough samples!\n");
+        return -1;
+    }
+
+    return kl_divergence_3x3(p->mean, p->covariance, q->mean, q->covariance, divergence);
+}
+
+// write the divergences of a pair at an even neighbor slot and of the reversed pair at the opposite slot
+static inline void kl_set_edge(struct kl_divergence_worker_args_t *args, unsigned long p, unsigned long q, short slot,
+                                double divergence_pq, double divergence_qp) {
+
+    args->divergences[p*args->num_slots+slot] = divergence_pq;
+    args->neighbors[p*args->num_slots+slot] = (uint32_t) q;
+    args->divergences[q*args->num_slots+slot+1] = divergence_qp;
+    args->neighbors[q*args->num_slots+slot+1] = (uint32_t) p;
+}
+
+// evaluate the gathered pairs of a worker in both directions and write them to their neighbor slots
+// each slot belongs to a single pair, so the workers never write the same slot
+static void kl_divergence_flush(struct kl_divergence_worker_args_t *args,
+                                const unsigned long *p, const unsigned long *q, const short *slots,
+                                unsigned long num_pairs) {
+
+    const struct nd_store_t *store = args->store;
+    double divergences_pq[KL_BATCH_SIZE], divergences_qp[KL_BATCH_SIZE];
+    kl_divergence_batch_symmetric(store->mean, store->covariance, store->inverse_covariance, store->log_determinant,
+                                p, q, num_pairs, divergences_pq, divergences_qp);
+
+    for(unsigned long k = 0; k < num_pairs; k++) {
+        kl_set_edge(args, p[k], q[k], slots[k], divergences_pq[k], divergences_qp[k]);
+    }
+}
+
+// find the entry of a voxel ahead of entry "i". sparse entries are sorted by voxel index, so a voxel "offset" indexes
+// ahead is at most "offset" entries ahead, and the search only spans those
+static inline int kl_find_ahead(const struct nd_store_t *store, unsigned long i, unsigned long offset, unsigned long *entry) {
+
+    unsigned long index = store->index[i] + offset;
+    if(store->dense) {
+        *entry = index;
+        return 0;
+    }
+
+    unsigned long lo = i + 1;
+    unsigned long hi = offset < store->num_nds - lo ? lo + offset : store->num_nds;
+    while(lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if(store->index[mid] < index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < store->num_nds && store->index[lo] == index) {
+        *entry = lo;
+        return 0;
+    }
+
+    return -1;
+}
+
+// compute the divergences between the distributions of the chunk and their neighbors at the even stencil slots
+// the pair of the opposite slot is the same pair seen from the neighbor, so both are written at once
+static void kl_divergence_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct kl_divergence_worker_args_t *args = (struct kl_divergence_worker_args_t *) arg;
+    const struct nd_store_t *store = args->store;
+    (void) worker_id;
+
+    if(args->kernel != NULL) {
+        args->kernel(store, args->offsets, start, end, args->divergences, args->neighbors);
+        return;
+    }
+
+    // pairs waiting for a batched evaluation
+    unsigned long p[KL_BATCH_SIZE], q[KL_BATCH_SIZE];
+    short slots[KL_BATCH_SIZE];
+    unsigned long num_pairs = 0;
+
+    unsigned long len_xy = (unsigned long) store->len_x * store->len_y;
+
+    for(unsigned long i = start; i < end; i++) {
+
+        // verify if the voxel has samples
+        if(store->num_samples[i] == 0)
+            continue;
+
+        // voxels away from the grid faces have all their neighbors inside, and skip the bounds checks
+        unsigned long index = store->index[i];
+        long x = (long) (index % store->len_x);
+        long y = (long) ((index / store->len_x) % store->len_y);
+        long z = (long) (index / len_xy);
+        bool interior = x > 0 && x + 1 < store->len_x &&
+                        y > 0 && y + 1 < store->len_y &&
+                        z > 0 && z + 1 < store->len_z;
+
+        for(short s = 0; s < (short) args->num_slots; s += 2) {
+
+            if(!interior) {
+                long nx = x + neighbor_stencil[s].x;
+                long ny = y + neighbor_stencil[s].y;
+                long nz = z + neighbor_stencil[s].z;
+                if(nx < 0 || nx >= store->len_x || ny < 0 || ny >= store->len_y || nz < 0 || nz >= store->len_z)
+                    continue;
+            }
+
+            // verify if the other voxel exists and has samples
+            unsigned long neighbor;
+            if(kl_find_ahead(store, i, (unsigned long) args->offsets[s], &neighbor) < 0)
+                continue;
+            if(store->num_samples[neighbor] == 0)
+                continue;
+
+            // distributions without enough samples keep a null divergence to their neighbors
+            if(store->num_samples[i] <= 1 || store->num_samples[neighbor] <= 1) {
+                kl_set_edge(args, i, neighbor, s, 0, 0);
+                continue;
+            }
+
+            // the pairs with a singular covariance matrix have no divergence
+            if(!store->invertible[i] || !store->invertible[neighbor])
+                continue;
+
+            // gather the pair, and evaluate the divergences once a batch is full
+            p[num_pairs] = i;
+            q[num_pairs] = neighbor;
+            slots[num_pairs] = s;
+            if(++num_pairs == KL_BATCH_SIZE) {
+                kl_divergence_flush(args, p, q, slots, num_pairs);
+                num_pairs = 0;
+            }
+        }
+    }
+
+    kl_divergence_flush(args, p, q, slots, num_pairs);
+}
+
+// map a divergence to a key whose increasing order is the decreasing order of the divergences
+static inline unsigned long kl_rank_key(double divergence) {
+
+    // both zeros rank together
+    if(divergence == 0)
+        divergence = 0.0;
+
+    // flip the sign bit of positive values and every bit of negative ones, so the keys order as the values
+    unsigned long bits;
+    memcpy(&bits, &divergence, sizeof(bits));
+    bits = (bits >> 63) ? ~bits : bits | (1UL << 63);
+
+    return ~bits;
+}
+
+// count the valid distributions and the divergences of the blocks of entries
+static void kl_count_worker(void *arg, unsigned long first_block, unsigned long last_block, unsigned int worker_id) {
+
+    struct kl_ranking_args_t *args = (struct kl_ranking_args_t *) arg;
+    const struct nd_store_t *store = args->store;
+    (void) worker_id;
+
+    for(unsigned long b = first_block; b < last_block; b++) {
+        unsigned long end = (b + 1) * KL_CHUNK_SIZE < store->num_nds ? (b + 1) * KL_CHUNK_SIZE : store->num_nds;
+        unsigned long num_edges = 0, num_valid = 0;
+        for(unsigned long i = b * KL_CHUNK_SIZE; i < end; i++) {
+            if(store->num_samples[i] == 0)
+                continue;
+            num_valid++;
+            for(unsigned int s = 0; s < args->num_slots; s++) {
+                if(args->neighbors[i*args->num_slots+s] != KL_NO_NEIGHBOR)
+                    num_edges++;
+            }
+        }
+        args->block_edges[b] = num_edges;
+        args->block_valid[b] = num_valid;
+    }
+}
+
+// write the sort keys and neighbor slots of the divergences of the blocks at their offsets
+static void kl_gather_worker(void *arg, unsigned long first_block, unsigned long last_block, unsigned int worker_id) {
+
+    struct kl_ranking_args_t *args = (struct kl_ranking_args_t *) arg;
+    const struct nd_store_t *store = args->store;
+    (void) worker_id;
+
+    for(unsigned long b = first_block; b < last_block; b++) {
+        unsigned long end = (b + 1) * KL_CHUNK_SIZE < store->num_nds ? (b + 1) * KL_CHUNK_SIZE : store->num_nds;
+        unsigned long pos = args->block_edges[b];
+        for(unsigned long i = b * KL_CHUNK_SIZE; i < end; i++) {
+            if(store->num_samples[i] == 0)
+                continue;
+            for(unsigned int s = 0; s < args->num_slots; s++) {
+                unsigned long slot = i*args->num_slots+s;
+                if(args->neighbors[slot] == KL_NO_NEIGHBOR)
+                    continue;
+                args->keys[pos] = kl_rank_key(args->divergences[slot]);
+                args->slots[pos] = slot;
+                pos++;
+            }
+        }
+    }
+}
+
+// materialize the ranked divergences
+static void kl_edge_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct kl_ranking_args_t *args = (struct kl_ranking_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long j = start; j < end; j++) {
+        unsigned long slot = args->slots[j];
+        args->kl_edges[j].divergence = args->divergences[slot];
+        args->kl_edges[j].p = (uint32_t) (slot / args->num_slots);
+        args->kl_edges[j].q = args->neighbors[slot];
+    }
+}
+
+int calculate_kl_edges(const struct nd_store_t *store, enum neighborhood_t neighborhood,
+                        unsigned long *num_valid_nds,
+                        struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    // initialize the counts to zero
+    *num_valid_nds = 0;
+    *kl_edges = NULL;
+    *num_kl_edges = 0;
+
+    if(store->num_nds > KL_MAX_ENTRIES) {
+        fprintf(stderr, "Too many distributions for 32-bit divergence indexes!\n");
+        return -5;
+    }
+
+    if(store->num_nds > 0 && store->inverse_covariance == NULL) {
+        fprintf(stderr, "The store must be factored before computing divergences!\n");
+        return -3;
+    }
+
+    // the neighbors are found by adding the offsets of the stencil to the voxel indexes
+    struct kl_divergence_worker_args_t args;
+    args.store = store;
+    int num_slots = stencil_index_offsets(neighborhood, store->len_x, store->len_y, args.offsets);
+    if(num_slots < 0) {
+        fprintf(stderr, "Invalid neighborhood for the divergences!\n");
+        return -6;
+    }
+    args.num_slots = (unsigned int) num_slots;
+    args.kernel = kernels_select_kl_pairs(neighborhood, store->dense);
+
+    // allocate the divergence of each distribution to each neighbor
+    args.divergences = (double *) scratch_alloc(store->scratch, store->num_nds * args.num_slots * sizeof(double));
+    args.neighbors = (uint32_t *) scratch_alloc(store->scratch, store->num_nds * args.num_slots * sizeof(uint32_t));
+    if(store->num_nds > 0 && (args.divergences == NULL || args.neighbors == NULL)) {
+        fprintf(stderr, "Error allocating memory for neighbor divergences: %s\n", strerror(errno));
+        scratch_free(store->scratch, args.divergences);
+        scratch_free(store->scratch, args.neighbors);
+        return -1;
+    }
+    // the workers also write the slots of the neighbors of their chunk, so every slot starts without a neighbor
+    memset(args.neighbors, 0xFF, store->num_nds * args.num_slots * sizeof(uint32_t));
+
+    // calculate the divergences between each pair of neighboring distributions on the thread pool
+    if(thread_pool_parallel_for(store->num_nds, KL_CHUNK_SIZE, kl_divergence_worker, &args) < 0) {
+        scratch_free(store->scratch, args.divergences);
+        scratch_free(store->scratch, args.neighbors);
+        return -2;
+    }
+
+    int status = rank_kl_edges(store, args.num_slots, args.divergences, args.neighbors, num_valid_nds, kl_edges, num_kl_edges);
+
+    scratch_free(store->scratch, args.divergences);
+    scratch_free(store->scratch, args.neighbors);
+
+    return status;
+}
+
+int rank_kl_edges(const struct nd_store_t *store, unsigned int num_slots,
+                    const double *divergences, const uint32_t *neighbors,
+                    unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    *num_valid_nds = 0;
+    *kl_edges = NULL;
+    *num_kl_edges = 0;
+
+    // count the valid distributions and the divergences of each block of entries
+    struct kl_ranking_args_t ranking;
+    ranking.store = store;
+    ranking.num_slots = num_slots;
+    ranking.divergences = divergences;
+    ranking.neighbors = neighbors;
+    ranking.num_blocks = (store->num_nds + KL_CHUNK_SIZE - 1) / KL_CHUNK_SIZE;
+    ranking.block_edges = (unsigned long *) scratch_alloc(store->scratch, ranking.num_blocks * sizeof(unsigned long));
+    ranking.block_valid = (unsigned long *) scratch_alloc(store->scratch, ranking.num_blocks * sizeof(unsigned long));
+    ranking.keys = NULL;
+    ranking.slots = NULL;
+    ranking.kl_edges = NULL;
+    int status = 0;
+    if(ranking.num_blocks > 0 && (ranking.block_edges == NULL || ranking.block_valid == NULL)) {
+        fprintf(stderr, "Error allocating memory for the divergence ranking: %s\n", strerror(errno));
+        status = -1;
+        goto cleanup;
+    }
+    if(thread_pool_parallel_for(ranking.num_blocks, 1, kl_count_worker, &ranking) < 0) {
+        status = -2;
+        goto cleanup;
+    }
+
+    // turn the counts into the offsets of each block
+    unsigned long num_edges = 0;
+    for(unsigned long b = 0; b < ranking.num_blocks; b++) {
+        unsigned long count = ranking.block_edges[b];
+        ranking.block_edges[b] = num_edges;
+        num_edges += count;
+        *num_valid_nds += ranking.block_valid[b];
+    }
+
+    // gather the sort keys of the divergences, in entry and neighbor slot order
+    // the divergences are sized to the pairs that actually exist
+    ranking.keys = (unsigned long *) scratch_alloc(store->scratch, num_edges * sizeof(unsigned long));
+    ranking.slots = (unsigned long *) scratch_alloc(store->scratch, num_edges * sizeof(unsigned long));
+    ranking.kl_edges = (struct kl_edge_t *) scratch_alloc(store->scratch, num_edges * sizeof(struct kl_edge_t));
+    if(num_edges > 0 && (ranking.keys == NULL || ranking.slots == NULL || ranking.kl_edges == NULL)) {
+        fprintf(stderr, "Error allocating memory for the divergence ranking: %s\n", strerror(errno));
+        status = -1;
+        goto cleanup;
+    }
+    if(thread_pool_parallel_for(ranking.num_blocks, 1, kl_gather_worker, &ranking) < 0) {
+        status = -2;
+        goto cleanup;
+    }
+
+    // rank the divergences from the largest to the smallest. the radix sort is stable, so equal divergences keep
+    // the entry and neighbor slot order, and the ranking does not depend on the number of workers
+    if(radix_sort_pairs(ranking.keys, ranking.slots, num_edges, ULONG_MAX, store->scratch) < 0) {
+        fprintf(stderr, "Error sorting the divergences!\n");
+        status = -4;
+        goto cleanup;
+    }
+
+    if(thread_pool_parallel_for(num_edges, KL_CHUNK_SIZE, kl_edge_worker, &ranking) < 0) {
+        status = -2;
+        goto cleanup;
+    }
+    *kl_edges = ranking.kl_edges;
+    ranking.kl_edges = NULL;
+    *num_kl_edges = num_edges;
+
+cleanup:
+    scratch_free(store->scratch, ranking.block_edges);
+    scratch_free(store->scratch, ranking.block_valid);
+    scratch_free(store->scratch, ranking.keys);
+    scratch_free(store->scratch, ranking.slots);
+    scratch_free(store->scratch, ranking.kl_edges);
+
+    if(status < 0)
+        *num_valid_nds = 0;
+
+    return status;
+}
+
+void kl_edges_to_divergences(struct kl_edge_t *kl_edges, unsigned long num_kl_edges,
+                                struct normal_distribution_t *nd_array,
+                                struct kl_divergence_t *kl_divergences) {
+
+    for(unsigned long i = 0; i < num_kl_edges; i++) {
+        kl_divergences[i].divergence = kl_edges[i].divergence;
+        kl_divergences[i].p = &nd_array[kl_edges[i].p];
+        kl_divergences[i].q = &nd_array[kl_edges[i].q];
+    }
 }
 
-int calculate_kl_divergences(struct normal_distribution_t *nd_array,
+int calculate_kl_divergences(struct normal_distribution_t *nd_array, unsigned long num_nds,
                             unsigned int len_x, unsigned int len_y, unsigned int len_z,
                             unsigned long *num_valid_nds,
                             struct kl_divergence_t *kl_divergences, unsigned long *num_kl_divergences) {
 
-    // initialize the counts to zero
     *num_valid_nds = 0;
     *num_kl_divergences = 0;
 
-    // calculate the divergences between each pair of neighboring distributions
-    // also, count the valid normal distributions
-    #pragma omp parallel for
-    for(int z = 0; z < len_z; z++) {
-        for(int y = 0; y < len_y; y++) {
-            for(int x = 0; x < len_x; x++) {
-
-                // get the index of the current voxel
-                unsigned long index;
-                if(voxel_pos_to_index(x, y, z, len_x, len_y, len_z, &index) < 0) {
-                    fprintf(stderr, "Error converting voxel position to index!\n");
-                    return -1;
-                }
-
-                // verify if the voxel has samples
-                if(nd_array[index].num_samples == 0)
-                    continue;
-                (*num_valid_nds)++;
-
-                // calculate the divergence between the current voxel and the neighbors in each direction
-                for(short i = 0; i < DIRECTION_LEN; i++) {
-
-                    // get the neighbor index
-                    unsigned long neighbor_index;
-                    if(get_neighbor_index(index, len_x, len_y, len_z, i, &neighbor_index) == -4) { // neighbor out of bounds
-                        continue;
-                    } else if (neighbor_index < 0) {
-                        fprintf(stderr, "Error getting neighbor index!\n");
-                        return -2;
-                    }
-
-                    // verify if the other voxel has samples
-                    if(nd_array[neighbor_index].num_samples == 0)
-                        continue;
-                    
-                    // calculate the divergence between the distributions
-                    double div = 0;
-                    if(kl_divergence(&nd_array[index], &nd_array[neighbor_index], &div) == -2) {
-                        // the q covariance matrix is singular
-                        continue;
-                    }
-
-                    // insert the divergence in the ordered array
-                    unsigned long j = 0;
-                    while(j < *num_kl_divergences) {
-                        if(kl_divergences[j].divergence < div)
-                            break;
-                        j++;
-                    }
-                    // shift the divergences to the right
-                    for(unsigned long k = *num_kl_divergences; k > j; k--) {
-                        kl_divergences[k] = kl_divergences[k-1];
-                    }
-                    // insert the divergence
-                    kl_divergences[j].divergence = div;
-                    kl_divergences[j].p = &nd_array[index];
-                    kl_divergences[j].q = &nd_array[neighbor_index];
-                    (*num_kl_divergences)++;
-                }
-            }
-        }
+    // compute the divergences on a store copy of the array. the store entries are at the same positions as the array
+    struct nd_store_t store;
+    if(nd_array_to_store(nd_array, num_nds, len_x, len_y, len_z, &store) < 0) {
+        fprintf(stderr, "Error copying normal distributions to a store!\n");
+        return -1;
     }
 
-    return 0;
+    if(factor_nd_store(&store) < 0) {
+        fprintf(stderr, "Error factoring the normal distributions!\n");
+        free_nd_store(&store);
+        return -1;
+    }
+
+    struct kl_edge_t *kl_edges;
+    int status = 0;
+    if(calculate_kl_edges(&store, NEIGHBORHOOD_FACES, num_valid_nds, &kl_edges, num_kl_divergences) < 0) {
+        status = -2;
+    } else {
+        kl_edges_to_divergences(kl_edges, *num_kl_divergences, nd_array, kl_divergences);
+    }
+
+    free(kl_edges);
+    free_nd_store(&store);
+
+    return status;
+}
+
+void free_kl_edges(struct kl_edge_t *kl_edges) {
+    free(kl_edges);
 }
 
 void free_kl_divergences(struct kl_divergence_t *kl_divergences) {
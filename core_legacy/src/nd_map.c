@@ -0,0 +1,556 @@
+#include <ndnet_core/nd_map.h>
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+
+struct nd_map_key_worker_args_t {
+    const struct nd_map_t *map; // pointer to the map
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
+    unsigned long *keys; // packed voxel key of each point. Will be overwritten
+    unsigned long *point_indexes; // index of each point. Will be overwritten
+    int status; // 0 on success, negative if any point fell outside the voxel coordinates of the map
+};
+
+struct nd_map_run_worker_args_t {
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
+    const unsigned long *point_indexes; // point indexes, sorted by voxel
+    const unsigned long *run_starts; // first sorted point of each voxel run, followed by the number of points
+    struct nd_moments_t *run_moments; // sufficient statistics of the points of each run. Will be overwritten
+};
+
+struct nd_map_divergence_worker_args_t {
+    const struct nd_map_t *map; // pointer to the map
+    double *divergences; // divergence of each entry to each neighbor slot
+    uint32_t *neighbors; // entry of each neighbor slot
+};
+
+// pack voxel coordinates, each within the coordinate limits, into a voxel key
+static inline unsigned long nd_map_pack(const long *coords) {
+    return (unsigned long) (coords[0] + ND_MAP_COORD_LIMIT) |
+            (unsigned long) (coords[1] + ND_MAP_COORD_LIMIT) << ND_MAP_COORD_BITS |
+            (unsigned long) (coords[2] + ND_MAP_COORD_LIMIT) << (2 * ND_MAP_COORD_BITS);
+}
+
+static inline void nd_map_unpack(unsigned long key, long *coords) {
+    unsigned long mask = (1UL << ND_MAP_COORD_BITS) - 1;
+    for(int j = 0; j < 3; j++)
+        coords[j] = (long) ((key >> (j * ND_MAP_COORD_BITS)) & mask) - ND_MAP_COORD_LIMIT;
+}
+
+// get the voxel key of a point. negative if the point falls outside the voxel coordinates or is not finite
+static inline int nd_map_point_key(const struct nd_map_t *map, const double *point, unsigned long *key) {
+
+    long coords[3];
+    for(int j = 0; j < 3; j++) {
+        double coord = floor((point[j] - map->origin[j]) / map->voxel_size);
+        // written so that NaN fails the check too
+        if(!(coord >= -ND_MAP_COORD_LIMIT && coord < ND_MAP_COORD_LIMIT))
+            return -1;
+        coords[j] = (long) coord;
+    }
+    *key = nd_map_pack(coords);
+
+    return 0;
+}
+
+// first hash table slot of a voxel key. the multiplication spreads the coordinate bits over the high bits, folded back down
+static inline unsigned long nd_map_hash(unsigned long key, unsigned long table_len) {
+    unsigned long hash = key * 0x9E3779B97F4A7C15UL;
+    return (hash ^ (hash >> 32)) & (table_len - 1);
+}
+
+// find the entry of a voxel key. "ND_MAP_NO_ENTRY" if the voxel has no entry
+static inline unsigned long nd_map_lookup(const struct nd_map_t *map, unsigned long key) {
+
+    if(map->table_len == 0)
+        return ND_MAP_NO_ENTRY;
+
+    // the table is at most half full, so the probing always reaches a free slot
+    for(unsigned long slot = nd_map_hash(key, map->table_len); ; slot = (slot + 1) & (map->table_len - 1)) {
+        unsigned long entry = map->table[slot];
+        if(entry == ND_MAP_NO_ENTRY || map->store.index[entry] == key)
+            return entry;
+    }
+}
+
+static inline void nd_map_table_insert(struct nd_map_t *map, unsigned long entry) {
+    unsigned long slot = nd_map_hash(map->store.index[entry], map->table_len);
+    while(map->table[slot] != ND_MAP_NO_ENTRY)
+        slot = (slot + 1) & (map->table_len - 1);
+    map->table[slot] = entry;
+}
+
+static int nd_map_realloc(void **column, unsigned long size) {
+    void *grown = realloc(*column, size);
+    if(grown == NULL)
+        return -1;
+    *column = grown;
+    return 0;
+}
+
+// drop the entries of the voxels emptied before the last update, keeping the order of the others.
+// those entries have no divergences left, so no neighbor slot points at them
+static int nd_map_compact(struct nd_map_t *map) {
+
+    unsigned long num_entries = map->store.num_nds;
+    unsigned long num_slots = (unsigned long) map->neighborhood;
+    unsigned long *remap = (unsigned long *) scratch_alloc(&map->scratch, num_entries * sizeof(unsigned long));
+    if(num_entries > 0 && remap == NULL) {
+        fprintf(stderr, "Error allocating memory for the map compaction: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // entries only move to lower positions, so they are moved in increasing order
+    struct nd_store_t *store = &map->store;
+    unsigned long num_kept = 0;
+    for(unsigned long i = 0; i < num_entries; i++) {
+        if(store->num_samples[i] == 0 && !map->changed[i]) {
+            remap[i] = ND_MAP_NO_ENTRY;
+            continue;
+        }
+        remap[i] = num_kept;
+        if(num_kept != i) {
+            store->num_samples[num_kept] = store->num_samples[i];
+            store->index[num_kept] = store->index[i];
+            memcpy(&store->mean[num_kept*3], &store->mean[i*3], 3 * sizeof(double));
+            memcpy(&store->covariance[num_kept*9], &store->covariance[i*9], 9 * sizeof(double));
+            memcpy(&store->inverse_covariance[num_kept*9], &store->inverse_covariance[i*9], 9 * sizeof(double));
+            store->log_determinant[num_kept] = store->log_determinant[i];
+            store->invertible[num_kept] = store->invertible[i];
+            map->moments[num_kept] = map->moments[i];
+            memcpy(&map->divergences[num_kept*num_slots], &map->divergences[i*num_slots], num_slots * sizeof(double));
+            memcpy(&map->neighbors[num_kept*num_slots], &map->neighbors[i*num_slots], num_slots * sizeof(uint32_t));
+            map->changed[num_kept] = map->changed[i];
+        }
+        num_kept++;
+    }
+    store->num_nds = num_kept;
+
+    for(unsigned long i = 0; i < num_kept * num_slots; i++) {
+        if(map->neighbors[i] != KL_NO_NEIGHBOR)
+            map->neighbors[i] = remap[map->neighbors[i]] != ND_MAP_NO_ENTRY ? (uint32_t) remap[map->neighbors[i]] : KL_NO_NEIGHBOR;
+    }
+    for(unsigned long i = 0; i < map->num_changed; i++)
+        map->changed_entries[i] = remap[map->changed_entries[i]];
+
+    return 0;
+}
+
+// make room for new entries, dropping the emptied entries first and growing the columns if still needed.
+// everything that can fail is allocated before the entries move, and the hash table is rebuilt once they moved
+static int nd_map_reserve(struct nd_map_t *map, unsigned long num_new) {
+
+    if(map->store.num_nds + num_new <= map->capacity)
+        return 0;
+
+    // entries kept by the compaction
+    unsigned long num_entries = num_new;
+    for(unsigned long i = 0; i < map->store.num_nds; i++)
+        num_entries += map->store.num_samples[i] > 0 || map->changed[i];
+    if(num_entries > map->max_entries) {
+        fprintf(stderr, "Too many voxels for the map!\n");
+        return -2;
+    }
+
+    // grow once compacting leaves less than a quarter of the capacity free, so full maps do not compact on every batch
+    unsigned long capacity = map->capacity * 2 > ND_MAP_MIN_CAPACITY ? map->capacity * 2 : ND_MAP_MIN_CAPACITY;
+    if(capacity < num_entries)
+        capacity = num_entries;
+    if(capacity > map->max_entries)
+        capacity = map->max_entries;
+    if(num_entries > map->capacity - map->capacity / 4 && capacity > map->capacity) {
+
+        // the grown columns keep their contents, so a failure halfway leaves a consistent map of the old capacity
+        unsigned long num_slots = (unsigned long) map->neighborhood;
+        struct nd_store_t *store = &map->store;
+        if(nd_map_realloc((void **) &store->num_samples, capacity * sizeof(unsigned long)) < 0 ||
+            nd_map_realloc((void **) &store->index, capacity * sizeof(unsigned long)) < 0 ||
+            nd_map_realloc((void **) &store->mean, capacity * 3 * sizeof(double)) < 0 ||
+            nd_map_realloc((void **) &store->covariance, capacity * 9 * sizeof(double)) < 0 ||
+            nd_map_realloc((void **) &store->inverse_covariance, capacity * 9 * sizeof(double)) < 0 ||
+            nd_map_realloc((void **) &store->log_determinant, capacity * sizeof(double)) < 0 ||
+            nd_map_realloc((void **) &store->invertible, capacity * sizeof(bool)) < 0 ||
+            nd_map_realloc((void **) &map->moments, capacity * sizeof(struct nd_moments_t)) < 0 ||
+            nd_map_realloc((void **) &map->divergences, capacity * num_slots * sizeof(double)) < 0 ||
+            nd_map_realloc((void **) &map->neighbors, capacity * num_slots * sizeof(uint32_t)) < 0 ||
+            nd_map_realloc((void **) &map->changed, capacity * sizeof(bool)) < 0 ||
+            nd_map_realloc((void **) &map->changed_entries, capacity * sizeof(unsigned long)) < 0) {
+            fprintf(stderr, "Error allocating memory for the map entries: %s\n", strerror(errno));
+            return -1;
+        }
+        map->capacity = capacity;
+    }
+
+    // the table is at least twice the capacity, so it is never more than half full.
+    // the grown table keeps the slots of the old one, which stay valid until the rebuild
+    unsigned long table_len = map->table_len > 0 ? map->table_len : 1;
+    while(table_len < 2 * map->capacity)
+        table_len *= 2;
+    if(table_len > map->table_len && nd_map_realloc((void **) &map->table, table_len * sizeof(unsigned long)) < 0) {
+        fprintf(stderr, "Error allocating memory for the map table: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(nd_map_compact(map) < 0)
+        return -1;
+
+    map->table_len = table_len;
+    memset(map->table, 0xFF, map->table_len * sizeof(unsigned long));
+    for(unsigned long i = 0; i < map->store.num_nds; i++)
+        nd_map_table_insert(map, i);
+
+    return 0;
+}
+
+// append the entry of a voxel without samples
+static unsigned long nd_map_add_entry(struct nd_map_t *map, unsigned long key) {
+
+    struct nd_store_t *store = &map->store;
+    unsigned long num_slots = (unsigned long) map->neighborhood;
+    unsigned long entry = store->num_nds++;
+
+    store->num_samples[entry] = 0;
+    store->index[entry] = key;
+    memset(&store->mean[entry*3], 0, 3 * sizeof(double));
+    memset(&store->covariance[entry*9], 0, 9 * sizeof(double));
+    memset(&store->inverse_covariance[entry*9], 0, 9 * sizeof(double));
+    store->log_determinant[entry] = 0;
+    store->invertible[entry] = false;
+    nd_moments_init(&map->moments[entry]);
+    memset(&map->neighbors[entry*num_slots], 0xFF, num_slots * sizeof(uint32_t));
+    map->changed[entry] = false;
+    nd_map_table_insert(map, entry);
+
+    return entry;
+}
+
+// compute the voxel key of each point of the chunk
+static void nd_map_key_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct nd_map_key_worker_args_t *args = (struct nd_map_key_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        double point[3];
+        point_cloud_view_get(args->point_cloud, i, point);
+        if(nd_map_point_key(args->map, point, &args->keys[i]) < 0) {
+            args->status = -1;
+            return;
+        }
+        args->point_indexes[i] = i;
+    }
+}
+
+// accumulate the sufficient statistics of the voxel runs of the chunk
+static void nd_map_run_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct nd_map_run_worker_args_t *args = (struct nd_map_run_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long r = start; r < end; r++) {
+        nd_moments_init(&args->run_moments[r]);
+        nd_moments_accumulate(&args->run_moments[r], args->point_cloud, &args->point_indexes[args->run_starts[r]],
+                                args->run_starts[r+1] - args->run_starts[r]);
+    }
+}
+
+// add or remove a batch of points, one voxel run at a time
+static int nd_map_apply(struct nd_map_t *map, const struct point_cloud_view_t *point_cloud, unsigned long num_points, bool remove) {
+
+    // the temporaries of the previous batch are discarded
+    if(scratch_reset(&map->scratch) < 0)
+        return -2;
+
+    // sort the points by voxel key
+    struct nd_map_key_worker_args_t key_args;
+    key_args.map = map;
+    key_args.point_cloud = point_cloud;
+    key_args.keys = (unsigned long *) scratch_alloc(&map->scratch, num_points * sizeof(unsigned long));
+    key_args.point_indexes = (unsigned long *) scratch_alloc(&map->scratch, num_points * sizeof(unsigned long));
+    key_args.status = 0;
+    if(num_points > 0 && (key_args.keys == NULL || key_args.point_indexes == NULL)) {
+        fprintf(stderr, "Error allocating memory for the map batch: %s\n", strerror(errno));
+        return -2;
+    }
+    if(thread_pool_parallel_for(num_points, ND_MAP_CHUNK_SIZE, nd_map_key_worker, &key_args) < 0)
+        return -2;
+    if(key_args.status < 0) {
+        fprintf(stderr, "Point outside the voxel coordinates of the map!\n");
+        return -1;
+    }
+    unsigned long max_key = 0;
+    for(unsigned long i = 0; i < num_points; i++)
+        max_key = key_args.keys[i] > max_key ? key_args.keys[i] : max_key;
+    if(radix_sort_pairs(key_args.keys, key_args.point_indexes, num_points, max_key, &map->scratch) < 0) {
+        fprintf(stderr, "Error sorting the points of the map batch!\n");
+        return -2;
+    }
+
+    // find the runs of points of the same voxel, and accumulate the statistics of each run
+    unsigned long *run_starts = (unsigned long *) scratch_alloc(&map->scratch, (num_points + 1) * sizeof(unsigned long));
+    if(run_starts == NULL) {
+        fprintf(stderr, "Error allocating memory for the map batch: %s\n", strerror(errno));
+        return -2;
+    }
+    unsigned long num_runs = 0;
+    for(unsigned long i = 0; i < num_points; i++) {
+        if(i == 0 || key_args.keys[i] != key_args.keys[i-1])
+            run_starts[num_runs++] = i;
+    }
+    run_starts[num_runs] = num_points;
+
+    struct nd_map_run_worker_args_t run_args;
+    run_args.point_cloud = point_cloud;
+    run_args.point_indexes = key_args.point_indexes;
+    run_args.run_starts = run_starts;
+    run_args.run_moments = (struct nd_moments_t *) scratch_alloc(&map->scratch, num_runs * sizeof(struct nd_moments_t));
+    if(num_runs > 0 && run_args.run_moments == NULL) {
+        fprintf(stderr, "Error allocating memory for the map batch: %s\n", strerror(errno));
+        return -2;
+    }
+    if(thread_pool_parallel_for(num_runs, ND_MAP_CHUNK_SIZE / 16, nd_map_run_worker, &run_args) < 0)
+        return -2;
+
+    // verify the whole batch before changing the map, so that errors leave it untouched
+    unsigned long num_new = 0;
+    for(unsigned long r = 0; r < num_runs; r++) {
+        unsigned long entry = nd_map_lookup(map, key_args.keys[run_starts[r]]);
+        if(entry == ND_MAP_NO_ENTRY)
+            num_new++;
+        if(remove && (entry == ND_MAP_NO_ENTRY || map->moments[entry].num_samples < run_args.run_moments[r].num_samples)) {
+            fprintf(stderr, "Removing points that were not inserted in the map!\n");
+            return -3;
+        }
+    }
+    if(nd_map_reserve(map, num_new) < 0)
+        return -2;
+
+    for(unsigned long r = 0; r < num_runs; r++) {
+
+        unsigned long key = key_args.keys[run_starts[r]];
+        unsigned long entry = nd_map_lookup(map, key);
+        if(entry == ND_MAP_NO_ENTRY)
+            entry = nd_map_add_entry(map, key);
+
+        if(remove)
+            nd_moments_remove(&map->moments[entry], &run_args.run_moments[r]);
+        else
+            nd_moments_merge(&map->moments[entry], &run_args.run_moments[r]);
+        map->store.num_samples[entry] = map->moments[entry].num_samples;
+        nd_moments_finalize(&map->moments[entry], &map->store.mean[entry*3], &map->store.covariance[entry*9]);
+
+        if(!map->changed[entry]) {
+            map->changed[entry] = true;
+            map->changed_entries[map->num_changed++] = entry;
+        }
+    }
+
+    return 0;
+}
+
+int nd_map_init(struct nd_map_t *map, double voxel_size, const double *origin, enum neighborhood_t neighborhood) {
+
+    memset(map, 0, sizeof(struct nd_map_t));
+
+    if(!(voxel_size > 0)) {
+        fprintf(stderr, "Invalid voxel size for the map!\n");
+        return -1;
+    }
+    if(neighborhood != NEIGHBORHOOD_FACES && neighborhood != NEIGHBORHOOD_EDGES && neighborhood != NEIGHBORHOOD_CORNERS) {
+        fprintf(stderr, "Invalid neighborhood for the map!\n");
+        return -1;
+    }
+
+    map->voxel_size = voxel_size;
+    if(origin != NULL)
+        memcpy(map->origin, origin, 3 * sizeof(double));
+    map->neighborhood = neighborhood;
+    map->max_entries = KL_MAX_ENTRIES;
+    scratch_init(&map->scratch);
+
+    return 0;
+}
+
+void nd_map_free(struct nd_map_t *map) {
+
+    free_nd_store(&map->store);
+    free(map->moments);
+    free(map->divergences);
+    free(map->neighbors);
+    free(map->table);
+    free(map->changed);
+    free(map->changed_entries);
+    scratch_destroy(&map->scratch);
+
+    memset(map, 0, sizeof(struct nd_map_t));
+}
+
+int nd_map_insert(struct nd_map_t *map, const struct point_cloud_view_t *point_cloud, unsigned long num_points) {
+    return nd_map_apply(map, point_cloud, num_points, false);
+}
+
+int nd_map_remove(struct nd_map_t *map, const struct point_cloud_view_t *point_cloud, unsigned long num_points) {
+    return nd_map_apply(map, point_cloud, num_points, true);
+}
+
+static inline void nd_map_set_pair(struct nd_map_divergence_worker_args_t *args, unsigned long p, unsigned long q, unsigned int slot,
+                                    uint32_t neighbor_p, uint32_t neighbor_q, double divergence_pq, double divergence_qp) {
+
+    unsigned long num_slots = (unsigned long) args->map->neighborhood;
+    args->divergences[p*num_slots+slot] = divergence_pq;
+    args->neighbors[p*num_slots+slot] = neighbor_p;
+    args->divergences[q*num_slots+(slot^1)] = divergence_qp;
+    args->neighbors[q*num_slots+(slot^1)] = neighbor_q;
+}
+
+// evaluate the gathered pairs in both directions, as the divergences of a store do
+static void nd_map_divergence_flush(struct nd_map_divergence_worker_args_t *args,
+                                    const unsigned long *p, const unsigned long *q, const unsigned int *slots,
+                                    unsigned long num_pairs) {
+
+    const struct nd_store_t *store = &args->map->store;
+    double divergences_pq[KL_BATCH_SIZE], divergences_qp[KL_BATCH_SIZE];
+    kl_divergence_batch_symmetric(store->mean, store->covariance, store->inverse_covariance, store->log_determinant,
+                                p, q, num_pairs, divergences_pq, divergences_qp);
+
+    for(unsigned long k = 0; k < num_pairs; k++)
+        nd_map_set_pair(args, p[k], q[k], slots[k], (uint32_t) q[k], (uint32_t) p[k], divergences_pq[k], divergences_qp[k]);
+}
+
+// recompute every neighbor slot of the changed entries of the chunk, and the opposite slots of their neighbors.
+// a pair of changed entries is recomputed by the smaller entry only, so each slot is written by a single worker
+static void nd_map_divergence_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct nd_map_divergence_worker_args_t *args = (struct nd_map_divergence_worker_args_t *) arg;
+    const struct nd_map_t *map = args->map;
+    const struct nd_store_t *store = &map->store;
+    (void) worker_id;
+
+    // pairs waiting for a batched evaluation
+    unsigned long p[KL_BATCH_SIZE], q[KL_BATCH_SIZE];
+    unsigned int slots[KL_BATCH_SIZE];
+    unsigned long num_pairs = 0;
+
+    for(unsigned long j = start; j < end; j++) {
+
+        unsigned long i = map->changed_entries[j];
+        long coords[3];
+        nd_map_unpack(store->index[i], coords);
+
+        for(unsigned int s = 0; s < (unsigned int) map->neighborhood; s++) {
+
+            long neighbor_coords[3] = {coords[0] + neighbor_stencil[s].x, coords[1] + neighbor_stencil[s].y, coords[2] + neighbor_stencil[s].z};
+            unsigned long neighbor = ND_MAP_NO_ENTRY;
+            if(neighbor_coords[0] >= -ND_MAP_COORD_LIMIT && neighbor_coords[0] < ND_MAP_COORD_LIMIT &&
+                neighbor_coords[1] >= -ND_MAP_COORD_LIMIT && neighbor_coords[1] < ND_MAP_COORD_LIMIT &&
+                neighbor_coords[2] >= -ND_MAP_COORD_LIMIT && neighbor_coords[2] < ND_MAP_COORD_LIMIT)
+                neighbor = nd_map_lookup(map, nd_map_pack(neighbor_coords));
+
+            if(neighbor == ND_MAP_NO_ENTRY) {
+                args->neighbors[i*map->neighborhood+s] = KL_NO_NEIGHBOR;
+                continue;
+            }
+            if(map->changed[neighbor] && neighbor < i)
+                continue;
+
+            // emptied voxels, and pairs with a singular covariance matrix, have no divergence
+            if(store->num_samples[i] == 0 || store->num_samples[neighbor] == 0 ||
+                (store->num_samples[i] > 1 && store->num_samples[neighbor] > 1 && (!store->invertible[i] || !store->invertible[neighbor]))) {
+                nd_map_set_pair(args, i, neighbor, s, KL_NO_NEIGHBOR, KL_NO_NEIGHBOR, 0, 0);
+                continue;
+            }
+
+            // distributions without enough samples keep a null divergence to their neighbors
+            if(store->num_samples[i] <= 1 || store->num_samples[neighbor] <= 1) {
+                nd_map_set_pair(args, i, neighbor, s, (uint32_t) neighbor, (uint32_t) i, 0, 0);
+                continue;
+            }
+
+            p[num_pairs] = i;
+            q[num_pairs] = neighbor;
+            slots[num_pairs] = s;
+            if(++num_pairs == KL_BATCH_SIZE) {
+                nd_map_divergence_flush(args, p, q, slots, num_pairs);
+                num_pairs = 0;
+            }
+        }
+    }
+
+    nd_map_divergence_flush(args, p, q, slots, num_pairs);
+}
+
+int nd_map_update(struct nd_map_t *map, unsigned long *num_updated) {
+
+    if(num_updated != NULL)
+        *num_updated = 0;
+    if(map->num_changed == 0)
+        return 0;
+
+    if(factor_nd_store_entries(&map->store, map->changed_entries, map->num_changed) < 0)
+        return -2;
+
+    struct nd_map_divergence_worker_args_t args;
+    args.map = map;
+    args.divergences = map->divergences;
+    args.neighbors = map->neighbors;
+    if(thread_pool_parallel_for(map->num_changed, KL_CHUNK_SIZE, nd_map_divergence_worker, &args) < 0) {
+        fprintf(stderr, "Error computing the divergences of the map!\n");
+        return -2;
+    }
+
+    for(unsigned long j = 0; j < map->num_changed; j++)
+        map->changed[map->changed_entries[j]] = false;
+    if(num_updated != NULL)
+        *num_updated = map->num_changed;
+    map->num_changed = 0;
+
+    return 0;
+}
+
+int nd_map_kl_edges(const struct nd_map_t *map, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    if(map->num_changed > 0) {
+        *num_valid_nds = 0;
+        *kl_edges = NULL;
+        *num_kl_edges = 0;
+        fprintf(stderr, "The map must be updated before ranking its divergences!\n");
+        return -3;
+    }
+
+    return rank_kl_edges(&map->store, (unsigned int) map->neighborhood, map->divergences, map->neighbors,
+                            num_valid_nds, kl_edges, num_kl_edges);
+}
+
+int nd_map_find(const struct nd_map_t *map, const double *point, unsigned long *entry) {
+
+    unsigned long key;
+    if(nd_map_point_key(map, point, &key) < 0)
+        return -1;
+    *entry = nd_map_lookup(map, key);
+
+    return *entry != ND_MAP_NO_ENTRY ? 0 : -1;
+}
@@ -1,4 +1,5 @@
 #include <ndnet_core/ndt.h>
+#include <ndnet_core/kernels.h>
 
 /*
  MIT License
@@ -25,10 +26,50 @@
 
  */
 
-int prune_nds(struct normal_distribution_t *nd_array, 
-                    unsigned int len_x, unsigned int len_y, unsigned int len_z,
+// library configuration, see "ndt_set_config"
+static struct ndt_config_t ndt_config = {
+    .voxelization_engine = VOXELIZATION_SORT_REDUCE,
+    .dense_grid_budget = DEFAULT_DENSE_GRID_BUDGET,
+    .class_estimator = CLASS_ESTIMATOR_HISTOGRAM,
+    .voxel_search = VOXEL_SEARCH_COUNT,
+    .neighborhood = NEIGHBORHOOD_FACES
+};
+
+// state reused by the frames downsampled with a context, see "ndt_context_create"
+struct ndt_context_t {
+    struct ndt_config_t config; // configuration of the context, fixed at creation
+    struct voxel_size_solver_t solver; // voxel size search state of the previous frame
+    struct scratch_t scratch; // store, divergences, pruner and temporaries of each frame
+    struct scratch_t *worker_scratch; // scratch memory of each pool worker, for the clouds of a batch downsampled concurrently
+    unsigned int num_workers; // number of worker scratch memories
+};
+
+// clouds of a batch downsampled by a loop, and where their results go
+struct ndt_batch_args_t {
+    struct ndt_context_t *context;
+    const struct point_cloud_view_t *points; // view of the points of every cloud
+    const unsigned long *cloud_offsets; // first point of each cloud, "num_clouds + 1" offsets
+    unsigned short *classes; // class of each point of the batch. NULL without classes
+    unsigned short num_classes;
+    const unsigned long *num_desired_points; // number of desired points of each cloud
+    const unsigned long *row_offsets; // first output row of each cloud, relative to the first row of the output
+    const struct nd_output_t *output;
+    unsigned long *num_downsampled_points; // number of downsampled points of each cloud
+    const unsigned long *clouds; // clouds downsampled by the loop
+    int *statuses; // status of each cloud
+};
+
+void ndt_get_config(struct ndt_config_t *config) {
+    *config = ndt_config;
+}
+
+void ndt_set_config(const struct ndt_config_t *config) {
+    ndt_config = *config;
+}
+
+int prune_nds(struct normal_distribution_t *nd_array, unsigned long num_nds,
                     unsigned long num_desired_nds, unsigned long *num_valid_nds,
-                    struct kl_divergence_t *kl_divergences, unsigned long *num_kl_divergences) {
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges) {
 
     // compare the divergences in neighboring voxels
     // the distributions with the lowest divergence will be removed, because they introduce the least new information
@@ -38,41 +79,389 @@ int prune_nds(struct normal_distribution_t *nd_array,
         return -1;
     }
 
-    // debug the normal distributions
-    // print_nds(nd_array, len_x, len_y, len_z);    
+    unsigned long *num_samples = (unsigned long *) malloc(num_nds * sizeof(unsigned long));
+    if(num_nds > 0 && num_samples == NULL) {
+        fprintf(stderr, "Error allocating memory for the number of samples: %s\n", strerror(errno));
+        return -3;
+    }
+    for(unsigned long i = 0; i < num_nds; i++)
+        num_samples[i] = nd_array[i].num_samples;
+
+    struct kl_pruner_t pruner;
+    int status = kl_pruner_init(&pruner, num_nds, num_samples, kl_edges, num_kl_edges, NULL);
+    free(num_samples);
+    if(status < 0) {
+        fprintf(stderr, "Error initializing the pruner!\n");
+        return -3;
+    }
 
     // remove the distributions with the smallest divergence until the desired number is reached
-    unsigned int to_remove = *num_valid_nds - num_desired_nds;
-    unsigned long idx_to_remove = 0;
+    unsigned long to_remove = *num_valid_nds - num_desired_nds;
+    for(unsigned long i = 0; i < to_remove; i++) {
+        unsigned long entry;
+        if(kl_pruner_pop(&pruner, &entry) < 0) {
+            fprintf(stderr, "Ran out of normal distributions to prune!\n");
+            kl_pruner_free(&pruner);
+            return -2;
+        }
+        // set the number of samples to 0, invalidating the normal distribution
+        nd_array[entry].num_samples = 0;
+        (*num_valid_nds)--;
+    }
+    kl_pruner_free(&pruner);
+
+    return 0;
+}
 
-    // remove the distributions with the smallest divergence
-    for(unsigned long i = 0; i < to_remove; idx_to_remove++) {
+int prune_nd_store(struct nd_store_t *store,
+                    unsigned long num_desired_nds, unsigned long *num_valid_nds,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges) {
 
-        // printf("div: %p\n", kl_divergences);
+    if(num_desired_nds > *num_valid_nds) {
+        fprintf(stderr, "Number of desired normal distributions is greater than the number valid distributions!\n");
+        return -1;
+    }
 
-        if(idx_to_remove >= *num_kl_divergences) {
-            fprintf(stderr, "Reached the end of the divergences array!\n");
-            return -2;
-        }
+    // the pruner shares the scratch memory of the store, and is released once done
+    unsigned long mark = scratch_mark(store->scratch);
+    struct kl_pruner_t pruner;
+    if(kl_pruner_init(&pruner, store->num_nds, store->num_samples, kl_edges, num_kl_edges, store->scratch) < 0) {
+        fprintf(stderr, "Error initializing the pruner!\n");
+        return -3;
+    }
 
-        // if it was already removed or has no samples, skip this
-        if(kl_divergences[idx_to_remove].p->num_samples == 0) {
-            continue;
+    // remove the distributions with the smallest divergence until the desired number is reached
+    int status = 0;
+    unsigned long to_remove = *num_valid_nds - num_desired_nds;
+    for(unsigned long i = 0; i < to_remove; i++) {
+        unsigned long entry;
+        if(kl_pruner_pop(&pruner, &entry) < 0) {
+            fprintf(stderr, "Ran out of normal distributions to prune!\n");
+            status = -2;
+            break;
         }
         // set the number of samples to 0, invalidating the normal distribution
-        kl_divergences[idx_to_remove].p->num_samples = 0;
+        store->num_samples[entry] = 0;
         (*num_valid_nds)--;
-        (*num_kl_divergences)--;
-        i++;
     }
+    kl_pruner_free(&pruner);
+    scratch_release(store->scratch, mark);
+
+    return status;
+}
+
+int order_nds(const struct normal_distribution_t *nd_array, unsigned long num_nds,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges,
+                    struct nd_removal_order_t *removal_order) {
+
+    *removal_order = (struct nd_removal_order_t) {0};
+    removal_order->num_nds = num_nds;
+    removal_order->order = (uint32_t *) malloc(num_nds * sizeof(uint32_t));
+    removal_order->ranks = (uint32_t *) malloc(num_nds * sizeof(uint32_t));
+    removal_order->num_samples = (unsigned long *) malloc(num_nds * sizeof(unsigned long));
+    if(num_nds > 0 && (removal_order->order == NULL || removal_order->ranks == NULL || removal_order->num_samples == NULL)) {
+        fprintf(stderr, "Error allocating memory for the removal order: %s\n", strerror(errno));
+        free_nd_removal_order(removal_order);
+        return -1;
+    }
+    for(unsigned long i = 0; i < num_nds; i++)
+        removal_order->num_samples[i] = nd_array[i].num_samples;
+
+    // remove every distribution once, so any number of kept distributions is a suffix of the order
+    struct kl_pruner_t pruner;
+    if(kl_pruner_init(&pruner, num_nds, removal_order->num_samples, kl_edges, num_kl_edges, NULL) < 0) {
+        fprintf(stderr, "Error initializing the pruner!\n");
+        free_nd_removal_order(removal_order);
+        return -2;
+    }
+    int status = kl_pruner_order(&pruner, removal_order->order, removal_order->ranks, &removal_order->num_ordered);
+    kl_pruner_free(&pruner);
+    if(status < 0) {
+        fprintf(stderr, "Error ordering the normal distributions!\n");
+        free_nd_removal_order(removal_order);
+        return -3;
+    }
+
+    return 0;
+}
+
+int select_nds(struct normal_distribution_t *nd_array, const struct nd_removal_order_t *removal_order,
+                    unsigned long num_kept_nds, unsigned long *num_valid_nds) {
+
+    if(num_kept_nds > removal_order->num_ordered) {
+        fprintf(stderr, "Number of kept normal distributions is greater than the number of ordered distributions!\n");
+        return -1;
+    }
+
+    // the distributions removed first have the smallest ranks
+    unsigned long first_kept = removal_order->num_ordered - num_kept_nds;
+    for(unsigned long i = 0; i < removal_order->num_nds; i++) {
+        uint32_t rank = removal_order->ranks[i];
+        bool kept = rank != KL_PRUNER_NOT_QUEUED && rank >= first_kept;
+        nd_array[i].num_samples = kept ? removal_order->num_samples[i] : 0;
+    }
+    *num_valid_nds = num_kept_nds;
+
+    return 0;
+}
+
+void free_nd_removal_order(struct nd_removal_order_t *removal_order) {
+    free(removal_order->order);
+    free(removal_order->ranks);
+    free(removal_order->num_samples);
+    *removal_order = (struct nd_removal_order_t) {0};
+}
+
+struct nd_export_args_t {
+    const struct nd_store_t *store; // store to export, NULL when exporting an array
+    const struct normal_distribution_t *nd_array; // array to export, NULL when exporting a store
+    unsigned long num_nds; // number of distributions to export
+    const struct nd_output_t *output; // destination of the valid distributions
+    unsigned long *block_rows; // number of valid distributions of each block, then the output row of its first one
+    export_kernel_t kernel; // specialized kernel of the output, when exporting a store. NULL for the generic loop
+};
+
+static inline bool nd_export_valid(const struct nd_export_args_t *args, unsigned long i) {
+    return args->store != NULL ? args->store->num_samples[i] > 0 : args->nd_array[i].num_samples > 0;
+}
+
+// write values to an output column, converting them to the output type
+static inline void nd_export_values(const struct nd_output_t *output, void *dst, const double *src, unsigned int num_values) {
+    for(unsigned int k = 0; k < num_values; k++) {
+        double value = output->sanitize && !isfinite(src[k]) ? 0.0 : src[k];
+        if(output->type == POINT_TYPE_FLOAT32)
+            ((float *) dst)[k] = (float) value;
+        else
+            ((double *) dst)[k] = value;
+    }
+}
+
+static inline unsigned int nd_output_covariance_len(const struct nd_output_t *output) {
+    return output->covariance_layout == COVARIANCE_UPPER ? 6 : 9;
+}
+
+// write the one-hot encoding of a class. classes without a label are all zeros
+static inline void nd_export_one_hot(const struct nd_output_t *output, void *dst, unsigned short class) {
+    memset(dst, 0, output->num_labels * point_type_size(output->type));
+    if(class >= output->num_labels)
+        return;
+    if(output->type == POINT_TYPE_FLOAT32)
+        ((float *) dst)[class] = 1.0f;
+    else
+        ((double *) dst)[class] = 1.0;
+}
+
+// fill the rows after the written distributions following the padding of the output
+static void nd_output_pad(const struct nd_output_t *output, unsigned long num_written, unsigned short num_channels) {
+
+    // outputs without a row limit have nothing to pad
+    if(output->padding == PADDING_NONE || output->num_rows == ULONG_MAX)
+        return;
+
+    unsigned long value_size = point_type_size(output->type);
+    struct {
+        char *base;
+        unsigned long stride;
+        unsigned long size;
+    } columns[5] = {
+        {(char *) output->points, output->point_stride, 3 * value_size},
+        {(char *) output->covariances, output->covariance_stride, nd_output_covariance_len(output) * value_size},
+        {(char *) output->classes, output->class_stride, sizeof(unsigned short)},
+        {(char *) output->one_hot, output->one_hot_stride, output->num_labels * value_size},
+        {(char *) output->channels, output->channel_stride, num_channels * value_size}
+    };
+
+    for(unsigned long r = num_written; r < output->num_rows; r++) {
+        unsigned long row = output->first_row + r;
+        unsigned long source = output->first_row + (num_written > 0 ? r % num_written : 0);
+        for(int c = 0; c < 5; c++) {
+            if(columns[c].base == NULL)
+                continue;
+            if(output->padding == PADDING_REPEAT && num_written > 0)
+                memcpy(columns[c].base + row * columns[c].stride, columns[c].base + source * columns[c].stride, columns[c].size);
+            else
+                memset(columns[c].base + row * columns[c].stride, 0, columns[c].size);
+        }
+    }
+}
+
+// count the valid distributions of the blocks
+static void nd_export_count_worker(void *arg, unsigned long first_block, unsigned long last_block, unsigned int worker_id) {
+
+    struct nd_export_args_t *args = (struct nd_export_args_t *) arg;
+    (void) worker_id;
 
-    // move the divergences array idx_to_remove positions to the left
-    for(unsigned long i = 0; i < *num_kl_divergences; i++) {
-        kl_divergences[i] = kl_divergences[i+idx_to_remove];
+    for(unsigned long b = first_block; b < last_block; b++) {
+        unsigned long end = (b + 1) * EXPORT_CHUNK_SIZE < args->num_nds ? (b + 1) * EXPORT_CHUNK_SIZE : args->num_nds;
+        unsigned long count = 0;
+        for(unsigned long i = b * EXPORT_CHUNK_SIZE; i < end; i++)
+            count += nd_export_valid(args, i);
+        args->block_rows[b] = count;
     }
 }
 
-int to_point_cloud(struct normal_distribution_t *nd_array,
+// write the valid distributions of the blocks from the first row of each block. the blocks own disjoint rows
+static void nd_export_write_worker(void *arg, unsigned long first_block, unsigned long last_block, unsigned int worker_id) {
+
+    struct nd_export_args_t *args = (struct nd_export_args_t *) arg;
+    const struct nd_output_t *output = args->output;
+    const struct nd_store_t *store = args->store;
+    (void) worker_id;
+
+    for(unsigned long b = first_block; b < last_block; b++) {
+        unsigned long end = (b + 1) * EXPORT_CHUNK_SIZE < args->num_nds ? (b + 1) * EXPORT_CHUNK_SIZE : args->num_nds;
+        unsigned long row = output->first_row + args->block_rows[b];
+        if(args->kernel != NULL) {
+            args->kernel(store, output, b * EXPORT_CHUNK_SIZE, end, row);
+            continue;
+        }
+        for(unsigned long i = b * EXPORT_CHUNK_SIZE; i < end; i++) {
+
+            if(!nd_export_valid(args, i))
+                continue;
+
+            const double *mean = store != NULL ? &store->mean[i*3] : args->nd_array[i].mean;
+            const double *covariance = store != NULL ? &store->covariance[i*9] : args->nd_array[i].covariance;
+            unsigned short class = store != NULL ? (store->classes != NULL ? store->classes[i] : 0) : args->nd_array[i].class;
+            nd_export_values(output, (char *) output->points + row * output->point_stride, mean, 3);
+            if(output->covariances != NULL) {
+                void *dst = (char *) output->covariances + row * output->covariance_stride;
+                if(output->covariance_layout == COVARIANCE_UPPER) {
+                    double upper[6] = {covariance[0], covariance[1], covariance[2], covariance[4], covariance[5], covariance[8]};
+                    nd_export_values(output, dst, upper, 6);
+                } else {
+                    nd_export_values(output, dst, covariance, 9);
+                }
+            }
+            if(output->classes != NULL)
+                *(unsigned short *) ((char *) output->classes + row * output->class_stride) = class;
+            if(output->one_hot != NULL)
+                nd_export_one_hot(output, (char *) output->one_hot + row * output->one_hot_stride, class);
+            if(output->channels != NULL && store != NULL && store->num_channels > 0)
+                nd_export_values(output, (char *) output->channels + row * output->channel_stride,
+                                &store->channels[i * store->num_channels], store->num_channels);
+            row++;
+        }
+    }
+}
+
+// count, offset and write the valid distributions
+static int nd_export(struct nd_export_args_t *args, unsigned long *num_points) {
+
+    *num_points = 0;
+    args->kernel = args->store != NULL ? kernels_select_export(args->output, args->store) : NULL;
+
+    // stores take the offsets from their scratch memory
+    struct scratch_t *scratch = args->store != NULL ? args->store->scratch : NULL;
+    unsigned long num_blocks = (args->num_nds + EXPORT_CHUNK_SIZE - 1) / EXPORT_CHUNK_SIZE;
+    args->block_rows = (unsigned long *) scratch_alloc(scratch, num_blocks * sizeof(unsigned long));
+    if(num_blocks > 0 && args->block_rows == NULL) {
+        fprintf(stderr, "Error allocating memory for the export offsets: %s\n", strerror(errno));
+        return -1;
+    }
+    if(thread_pool_parallel_for(num_blocks, 1, nd_export_count_worker, args) < 0) {
+        scratch_free(scratch, args->block_rows);
+        return -3;
+    }
+
+    // exclusive prefix sum of the counts, so each block knows its first row
+    unsigned long num_rows = 0;
+    for(unsigned long b = 0; b < num_blocks; b++) {
+        unsigned long count = args->block_rows[b];
+        args->block_rows[b] = num_rows;
+        num_rows += count;
+    }
+    if(num_rows > args->output->num_rows) {
+        fprintf(stderr, "The %lu valid distributions do not fit the %lu output rows!\n", num_rows, args->output->num_rows);
+        scratch_free(scratch, args->block_rows);
+        return -2;
+    }
+
+    if(thread_pool_parallel_for(num_blocks, 1, nd_export_write_worker, args) < 0) {
+        scratch_free(scratch, args->block_rows);
+        return -3;
+    }
+    *num_points = num_rows;
+
+    // fixed size outputs get defined rows after the distributions
+    nd_output_pad(args->output, num_rows, args->store != NULL ? args->store->num_channels : 0);
+
+    scratch_free(scratch, args->block_rows);
+
+    return 0;
+}
+
+void nd_output_init(struct nd_output_t *output, enum point_type_t type,
+                    void *points, void *covariances, unsigned short *classes,
+                    void *channels, unsigned short num_channels) {
+
+    unsigned long value_size = point_type_size(type);
+    output->type = type;
+    output->points = points;
+    output->point_stride = 3 * value_size;
+    output->covariances = covariances;
+    output->covariance_stride = 9 * value_size;
+    output->classes = classes;
+    output->class_stride = sizeof(unsigned short);
+    output->channels = channels;
+    output->channel_stride = num_channels * value_size;
+    output->first_row = 0;
+    output->num_rows = ULONG_MAX;
+    output->covariance_layout = COVARIANCE_FULL;
+    output->one_hot = NULL;
+    output->one_hot_stride = 0;
+    output->num_labels = 0;
+    output->sanitize = false;
+    output->padding = PADDING_NONE;
+}
+
+unsigned long nd_output_init_features(struct nd_output_t *output, enum point_type_t type, void *features, unsigned long num_rows,
+                                    enum covariance_layout_t covariance_layout, unsigned short num_labels) {
+
+    nd_output_init(output, type, features, NULL, NULL, NULL, 0);
+
+    // the covariance and the one-hot class follow the mean of each row
+    unsigned long value_size = point_type_size(type);
+    unsigned long covariance_len = covariance_layout == COVARIANCE_UPPER ? 6 : 9;
+    unsigned long row_len = 3 + covariance_len + num_labels;
+    output->point_stride = row_len * value_size;
+    output->covariances = (char *) features + 3 * value_size;
+    output->covariance_stride = row_len * value_size;
+    output->covariance_layout = covariance_layout;
+    if(num_labels > 0) {
+        output->one_hot = (char *) features + (3 + covariance_len) * value_size;
+        output->one_hot_stride = row_len * value_size;
+        output->num_labels = num_labels;
+    }
+    output->num_rows = num_rows;
+    output->sanitize = true;
+    output->padding = PADDING_ZERO;
+
+    return row_len;
+}
+
+int nd_store_export(const struct nd_store_t *store, const struct nd_output_t *output, unsigned long *num_points) {
+
+    struct nd_export_args_t args = {0};
+    args.store = store;
+    args.num_nds = store->num_nds;
+    args.output = output;
+
+    return nd_export(&args, num_points);
+}
+
+int nds_export(const struct normal_distribution_t *nd_array, unsigned long num_nds,
+                const struct nd_output_t *output, unsigned long *num_points) {
+
+    struct nd_export_args_t args = {0};
+    args.nd_array = nd_array;
+    args.num_nds = num_nds;
+    args.output = output;
+
+    return nd_export(&args, num_points);
+}
+
+int to_point_cloud(struct normal_distribution_t *nd_array, unsigned long num_nds,
                     unsigned int len_x, unsigned int len_y, unsigned int len_z,
                     double x_offset, double y_offset, double z_offset,
                     double voxel_size,
@@ -80,111 +469,280 @@ int to_point_cloud(struct normal_distribution_t *nd_array,
                     double *covariances,
                     unsigned short *classes) {
 
+    // the distributions already hold their means, so the grid is not needed
+    (void) len_x;
+    (void) len_y;
+    (void) len_z;
+    (void) x_offset;
+    (void) y_offset;
+    (void) z_offset;
+    (void) voxel_size;
 
-    *num_points = 0;
+    // downsample the point cloud, in voxel index order
+    struct nd_output_t output;
+    nd_output_init(&output, POINT_TYPE_FLOAT64, point_cloud, covariances, classes, NULL, 0);
+    return nds_export(nd_array, num_nds, &output, num_points);
+}
 
-    // downsample the point cloud, iterating the voxels
-    #pragma omp parallel for
-    for(int z = 0; z < len_z; z++) {
-        for(int y = 0; y < len_y; y++) {
-            for(int x = 0; x < len_x; x++) {
-
-                // get the index of the current voxel
-                unsigned long index;
-                if(voxel_pos_to_index(x, y, z, len_x, len_y, len_z, &index) < 0) {
-                    fprintf(stderr, "Error converting voxel position to index!\n");
-                    return -1;
-                }
+int to_point_cloud_f32(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                    float *point_cloud, unsigned long *num_points,
+                    float *covariances,
+                    unsigned short *classes) {
 
-                // verify if the voxel has samples
-                if(nd_array[index].num_samples == 0)
-                    continue;
+    struct nd_output_t output;
+    nd_output_init(&output, POINT_TYPE_FLOAT32, point_cloud, covariances, classes, NULL, 0);
+    return nds_export(nd_array, num_nds, &output, num_points);
+}
 
-                // copy the point to the downsampled point cloud
-                memcpy(&point_cloud[(*num_points)*3], nd_array[index].mean, 3 * sizeof(double));
+int nd_store_to_point_cloud(const struct nd_store_t *store,
+                            double *point_cloud, unsigned long *num_points,
+                            double *covariances,
+                            unsigned short *classes) {
 
-                // copy the covariance matrix
-                memcpy(&covariances[(*num_points)*9], nd_array[index].covariance, 9 * sizeof(double));
-                // copy the class
-                if(classes != NULL) {
-                    classes[*num_points] = nd_array[index].class;
-                }
+    struct nd_output_t output;
+    nd_output_init(&output, POINT_TYPE_FLOAT64, point_cloud, covariances, classes, NULL, 0);
+    return nd_store_export(store, &output, num_points);
+}
 
-                (*num_points)++;
-            }
+int nd_store_to_point_cloud_f32(const struct nd_store_t *store,
+                            float *point_cloud, unsigned long *num_points,
+                            float *covariances,
+                            unsigned short *classes) {
+
+    struct nd_output_t output;
+    nd_output_init(&output, POINT_TYPE_FLOAT32, point_cloud, covariances, classes, NULL, 0);
+    return nd_store_export(store, &output, num_points);
+}
+
+// estimate the memory needed to downsample on a dense grid, from voxelization to the divergences
+static unsigned long dense_grid_footprint(unsigned long grid_size, unsigned short *classes, unsigned short num_classes,
+                                            unsigned short num_channels, const struct ndt_config_t *config) {
+
+    // store columns, covariance factors, divergences and the per-neighbor divergence buffers
+    unsigned long voxel_bytes = 2 * sizeof(unsigned long) + 22 * sizeof(double) + sizeof(bool) +
+                                config->neighborhood * (sizeof(struct kl_edge_t) + sizeof(double) + sizeof(uint32_t));
+    if(classes != NULL)
+        voxel_bytes += sizeof(unsigned short);
+    voxel_bytes += num_channels * sizeof(double);
+    // the locking engine also needs a dense array of distributions with their locks
+    if(config->voxelization_engine == VOXELIZATION_LOCKING) {
+        voxel_bytes += sizeof(struct normal_distribution_t) + sizeof(struct nd_moments_t) + sizeof(pthread_mutex_t) + sizeof(pthread_cond_t);
+        if(classes != NULL)
+            voxel_bytes += (num_classes + 1) * sizeof(unsigned int);
+    }
+
+    // saturate instead of wrapping around on huge grids
+    if(grid_size > ULONG_MAX / voxel_bytes)
+        return ULONG_MAX;
+    return grid_size * voxel_bytes;
+}
+
+void voxel_size_solver_init(struct voxel_size_solver_t *solver) {
+    solver->warm = false;
+    solver->num_desired_points = 0;
+    solver->voxel_size = (double) (MAX_VOXEL_GUESS - MIN_VOXEL_GUESS) / 2.0;
+    solver->exponent = DEFAULT_OCCUPANCY_EXPONENT;
+    solver->num_evaluations = 0;
+}
+
+// find a voxel size with between "num_desired_points" and the upper threshold occupied voxels.
+// the occupancy is modeled locally as a power of the voxel size, so each step is a secant step in log-log space, kept inside the bracket
+static int solve_voxel_size(struct voxel_size_solver_t *solver,
+                            const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                            double max_x, double max_y, double max_z,
+                            double min_x, double min_y, double min_z,
+                            unsigned long num_desired_points, double *voxel_size, struct scratch_t *scratch) {
+
+    double lower = (double) num_desired_points;
+    double upper = num_desired_points * (1+DOWNSAMPLE_UPPER_THRESHOLD);
+    double target = sqrt(lower * upper);
+
+    // start from the previous voxel size when the target did not change
+    double guess = solver->warm && solver->num_desired_points == num_desired_points ?
+                    solver->voxel_size : (double) (MAX_VOXEL_GUESS - MIN_VOXEL_GUESS) / 2.0;
+    double exponent = solver->exponent;
+
+    // voxel sizes known to give too many and too few occupied voxels
+    double too_small = MIN_VOXEL_GUESS;
+    double too_big = MAX_VOXEL_GUESS;
+
+    // smallest occupancy that still allows pruning down to the desired number
+    double best = -1.0;
+    unsigned long best_occupied = ULONG_MAX;
+
+    double prev_guess = 0.0;
+    unsigned long prev_occupied = 0;
+    solver->num_evaluations = 0;
+
+    for(unsigned int iter = 0; iter < MAX_SOLVER_EVALUATIONS; iter++) {
+
+        unsigned int len_x, len_y, len_z;
+        double offset_x, offset_y, offset_z;
+        estimate_voxel_grid(max_x, max_y, max_z, min_x, min_y, min_z, guess, &len_x, &len_y, &len_z,
+                            &offset_x, &offset_y, &offset_z);
+        unsigned long num_occupied;
+        if(count_occupied_voxels(point_cloud, num_points, guess, len_x, len_y, len_z,
+                                offset_x, offset_y, offset_z, &num_occupied, scratch) < 0) {
+            fprintf(stderr, "Error counting occupied voxels!\n");
+            return -1;
         }
+        solver->num_evaluations++;
+
+        if(num_occupied >= num_desired_points && num_occupied < best_occupied) {
+            best = guess;
+            best_occupied = num_occupied;
+        }
+        if(num_occupied >= lower && num_occupied <= upper)
+            break;
+
+        // shrink the bracket
+        if(num_occupied > upper)
+            too_small = guess;
+        else
+            too_big = guess;
+
+        // refine the local exponent from the last two evaluations
+        if(prev_occupied > 0 && num_occupied > 0 && prev_occupied != num_occupied && prev_guess != guess) {
+            double slope = -log((double) num_occupied / prev_occupied) / log(guess / prev_guess);
+            if(slope > MIN_OCCUPANCY_EXPONENT && slope < MAX_OCCUPANCY_EXPONENT)
+                exponent = slope;
+        }
+        prev_guess = guess;
+        prev_occupied = num_occupied;
+
+        // step to the target occupancy, bisecting in log space when the step leaves the bracket
+        double next = guess * pow((num_occupied > 0 ? num_occupied : 0.5) / target, 1.0 / exponent);
+        if(!(next > too_small && next < too_big))
+            next = sqrt(too_small * too_big);
+        if(next == guess)
+            break;
+        guess = next;
     }
+
+    // the occupancy may jump over the target range. prune down from the closest voxel size above it instead of failing
+    if(best < 0) {
+        fprintf(stderr, "No voxel size gives %lu occupied voxels!\n", num_desired_points);
+        return -2;
+    }
+    if(best_occupied > upper)
+        guess = best;
+
+    solver->warm = true;
+    solver->num_desired_points = num_desired_points;
+    solver->voxel_size = guess;
+    solver->exponent = exponent;
+    *voxel_size = guess;
+
+    return 0;
 }
 
-int ndt_downsample(double *point_cloud, unsigned short point_dim, unsigned long num_points,
+// downsample with a configuration, taking the store and the temporaries from a scratch memory or from the heap.
+// divergences handed out with a scratch memory belong to it, and are only valid until it is reset
+static int ndt_downsample_scratch(const struct ndt_config_t *config, struct scratch_t *scratch,
+                    const struct point_cloud_view_t *point_cloud, unsigned long num_points,
                     unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
                     double *offset_x, double *offset_y, double *offset_z,
                     double *voxel_size,
                     unsigned short *classes, unsigned short num_classes,
                     unsigned long num_desired_points,
-                    double *downsampled_point_cloud, unsigned long *num_downsampled_points,
-                    double *covariances,
-                    unsigned short *downsampled_classes,
-                    struct normal_distribution_t **nd_array, unsigned long *num_valid_nds,
-                    struct kl_divergence_t **kl_divergences, unsigned long *num_kl_divergences) {
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points,
+                    struct voxel_size_solver_t *solver,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    if(num_desired_points > output->num_rows) {
+        fprintf(stderr, "The desired points do not fit the output rows!\n");
+        return -1;
+    }
 
     // get the point cloud limits
     double max_x, max_y, max_z;
     double min_x, min_y, min_z;
-    get_pointcloud_limits(point_cloud, point_dim, num_points, &max_x, &max_y, &max_z, &min_x, &min_y, &min_z);
+    get_point_cloud_view_limits(point_cloud, num_points, &max_x, &max_y, &max_z, &min_x, &min_y, &min_z);
 
     double guess = (double) (MAX_VOXEL_GUESS - MIN_VOXEL_GUESS) / 2.0;
     double min_guess = MIN_VOXEL_GUESS;
     double max_guess = MAX_VOXEL_GUESS;
 
-    *nd_array = NULL;
+    if(nd_array != NULL)
+        *nd_array = NULL;
+    if(kl_edges != NULL)
+        *kl_edges = NULL;
+    *num_nds = 0;
 
-    unsigned long num_nds;
+    struct nd_store_t store;
+    unsigned long num_occupied;
+    bool dense = true;
+    bool full_search = config->voxel_search == VOXEL_SEARCH_FULL;
     unsigned int iter = 0;
-    do {
+    if(solver != NULL) {
 
-        // estimate the voxel grid size, dimensions and offsets
+        // pick the voxel size from occupancy counts, starting from the previous frame
+        if(solve_voxel_size(solver, point_cloud, num_points, max_x, max_y, max_z, min_x, min_y, min_z,
+                            num_desired_points, &guess, scratch) < 0) {
+            fprintf(stderr, "Error solving the voxel size!\n");
+            return -3;
+        }
         estimate_voxel_grid(max_x, max_y, max_z, min_x, min_y, min_z, guess, len_x, len_y, len_z,
                             offset_x, offset_y, offset_z);
+        unsigned long grid_size = (unsigned long) (*len_x) * (*len_y) * (*len_z);
+        dense = dense_grid_footprint(grid_size, classes, num_classes, point_cloud->num_channels, config) <= config->dense_grid_budget;
+        full_search = false;
 
-        // allocate the normal distributions
-        *nd_array = (struct normal_distribution_t *) malloc((*len_x) * (*len_y) * (*len_z) * sizeof(struct normal_distribution_t));
-        if(*nd_array == NULL) {
-            fprintf(stderr, "Error allocating memory for normal distributions: %s\n", strerror(errno));
-            return -1;
-        }
+    } else {
 
-        // estimate the normal distributions, voxelizing the point cloud
-        if(estimate_ndt(point_cloud, num_points, 
-                        classes, num_classes, 
-                        guess, 
-                        *len_x, *len_y, *len_z, 
-                        *offset_x, *offset_y, *offset_z, 
-                        *nd_array, &num_nds) < 0) {
-            fprintf(stderr, "Error estimating normal distributions!\n");
-            return -2;
-        }
+        do {
 
-        // adjust the voxel size guess limits for binary search
-        if(num_nds > num_desired_points * (1+DOWNSAMPLE_UPPER_THRESHOLD)) {
-            min_guess = guess;
-        } else if(num_nds < num_desired_points) {
-            max_guess = guess;
-        } else {
-            // reached a valid number of normal distributions
-            break;
-        }
+            // estimate the voxel grid size, dimensions and offsets
+            estimate_voxel_grid(max_x, max_y, max_z, min_x, min_y, min_z, guess, len_x, len_y, len_z,
+                                offset_x, offset_y, offset_z);
 
-        // free the normal distribution array
-        free_nds(*nd_array, (*len_x) * (*len_y) * (*len_z));
-        *nd_array = NULL;
+            unsigned long grid_size = (unsigned long) (*len_x) * (*len_y) * (*len_z);
 
-        // get the next guess
-        guess = min_guess + (max_guess - min_guess) / 2.0;
+            // only store the occupied voxels if the dense grid would not fit the budget
+            dense = dense_grid_footprint(grid_size, classes, num_classes, point_cloud->num_channels, config) <= config->dense_grid_budget;
 
-        iter++;
+            if(full_search) {
+                // estimate the normal distributions, voxelizing the point cloud
+                if(estimate_nd_store(point_cloud, num_points,
+                                    classes, num_classes,
+                                    guess,
+                                    *len_x, *len_y, *len_z,
+                                    *offset_x, *offset_y, *offset_z,
+                                    dense, config->voxelization_engine, config->class_estimator,
+                                    &store, &num_occupied, scratch) < 0) {
+                    fprintf(stderr, "Error estimating normal distributions!\n");
+                    return -2;
+                }
+            } else if(count_occupied_voxels(point_cloud, num_points, guess,
+                                            *len_x, *len_y, *len_z,
+                                            *offset_x, *offset_y, *offset_z,
+                                            &num_occupied, scratch) < 0) {
+                fprintf(stderr, "Error counting occupied voxels!\n");
+                return -2;
+            }
+
+            // adjust the voxel size guess limits for binary search
+            if(num_occupied > num_desired_points * (1+DOWNSAMPLE_UPPER_THRESHOLD)) {
+                min_guess = guess;
+            } else if(num_occupied < num_desired_points) {
+                max_guess = guess;
+            } else {
+                // reached a valid number of normal distributions
+                break;
+            }
 
-    } while(iter < MAX_GUESS_ITERATIONS);
+            // free the normal distributions
+            if(full_search)
+                free_nd_store(&store);
+
+            // get the next guess
+            guess = min_guess + (max_guess - min_guess) / 2.0;
+
+            iter++;
+
+        } while(iter < MAX_GUESS_ITERATIONS);
+    }
 
     *voxel_size = guess;
 
@@ -193,47 +751,374 @@ int ndt_downsample(double *point_cloud, unsigned short point_dim, unsigned long
         return -3;
     }
 
-    // compute the divergences
-    // allocate the divergences array
-    *kl_divergences = (struct kl_divergence_t *) malloc((*len_x) * (*len_y) * (*len_z) * DIRECTION_LEN * sizeof(struct kl_divergence_t));
-    if(*kl_divergences == NULL) {
-        fprintf(stderr, "Error allocating memory for divergences: %s\n", strerror(errno));
-        return -4;
+    // estimate the normal distributions once, at the chosen voxel size
+    if(!full_search && estimate_nd_store(point_cloud, num_points,
+                                        classes, num_classes,
+                                        guess,
+                                        *len_x, *len_y, *len_z,
+                                        *offset_x, *offset_y, *offset_z,
+                                        dense, config->voxelization_engine, config->class_estimator,
+                                        &store, &num_occupied, scratch) < 0) {
+        fprintf(stderr, "Error estimating normal distributions!\n");
+        return -2;
     }
-    if(calculate_kl_divergences(*nd_array, *len_x, *len_y, *len_z, num_valid_nds, *kl_divergences, num_kl_divergences) < 0) {
+
+    // factor the covariances once, so the divergences reuse the inverses and determinants of each distribution
+    if(factor_nd_store(&store) < 0) {
+        fprintf(stderr, "Error factoring the normal distributions!\n");
+        free_nd_store(&store);
+        return -9;
+    }
+
+    // compute the divergences, in an array sized to the neighboring pairs
+    struct kl_edge_t *edges;
+    if(calculate_kl_edges(&store, config->neighborhood, num_valid_nds, &edges, num_kl_edges) < 0) {
         fprintf(stderr, "Error calculating divergences!\n");
+        free_nd_store(&store);
         return -5;
     }
-    
-    // remove the distributions with the smallest divergence
-    prune_nds(*nd_array, *len_x, *len_y, *len_z, num_desired_points, num_valid_nds, *kl_divergences, num_kl_divergences);
 
-    // convert to point cloud
-    to_point_cloud(*nd_array, *len_x, *len_y, *len_z, 
-                    *offset_x, *offset_y, *offset_z, 
-                    *voxel_size, 
-                    downsampled_point_cloud, num_downsampled_points, 
-                    covariances, 
-                    downsampled_classes);
+    // remove the distributions with the smallest divergence. the output only fits the desired number of points
+    if(prune_nd_store(&store, num_desired_points, num_valid_nds, edges, *num_kl_edges) < 0) {
+        fprintf(stderr, "Error pruning normal distributions!\n");
+        scratch_free(scratch, edges);
+        free_nd_store(&store);
+        return -8;
+    }
+
+    // write the point cloud straight to the output rows
+    if(nd_store_export(&store, output, num_downsampled_points) < 0) {
+        fprintf(stderr, "Error writing the downsampled point cloud!\n");
+        scratch_free(scratch, edges);
+        free_nd_store(&store);
+        return -10;
+    }
 
     // print_matrix(downsampled_point_cloud, *num_downsampled_points, 3);
 
+    // build the array of normal distributions for the array interface
+    // the divergences index the store entries, which are also the positions in the array
+    int status = 0;
+    if(nd_array != NULL) {
+        if(nd_store_to_array(&store, nd_array) < 0) {
+            status = -6;
+        } else {
+            *num_nds = store.num_nds;
+        }
+    }
+    if(status == 0 && kl_edges != NULL) {
+        *kl_edges = edges;
+        edges = NULL;
+    }
+
+    scratch_free(scratch, edges);
+    free_nd_store(&store);
+
+    return status;
+}
+
+int ndt_downsample_output(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points,
+                    struct voxel_size_solver_t *solver,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    return ndt_downsample_scratch(&ndt_config, NULL, point_cloud, num_points, len_x, len_y, len_z, offset_x, offset_y, offset_z, voxel_size,
+                                classes, num_classes, num_desired_points, output, num_downsampled_points, solver,
+                                nd_array, num_nds, num_valid_nds, kl_edges, num_kl_edges);
+}
+
+int ndt_downsample_view(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    enum point_type_t output_type,
+                    void *downsampled_point_cloud, unsigned long *num_downsampled_points,
+                    void *covariances,
+                    unsigned short *downsampled_classes,
+                    void *downsampled_channels,
+                    struct voxel_size_solver_t *solver,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    // contiguous outputs sized to the desired points
+    struct nd_output_t output;
+    nd_output_init(&output, output_type, downsampled_point_cloud, covariances, downsampled_classes,
+                    downsampled_channels, point_cloud->num_channels);
+    output.num_rows = num_desired_points;
+    return ndt_downsample_output(point_cloud, num_points, len_x, len_y, len_z, offset_x, offset_y, offset_z, voxel_size,
+                                classes, num_classes, num_desired_points,
+                                &output, num_downsampled_points, solver,
+                                nd_array, num_nds, num_valid_nds, kl_edges, num_kl_edges);
+}
+
+int ndt_downsample(double *point_cloud, unsigned short point_dim, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    double *downsampled_point_cloud, unsigned long *num_downsampled_points,
+                    double *covariances,
+                    unsigned short *downsampled_classes,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    struct point_cloud_view_t view;
+    if(point_cloud_view_init(&view, point_cloud, POINT_TYPE_FLOAT64, point_dim, 0) < 0)
+        return -1;
+    return ndt_downsample_view(&view, num_points, len_x, len_y, len_z, offset_x, offset_y, offset_z, voxel_size,
+                            classes, num_classes, num_desired_points,
+                            POINT_TYPE_FLOAT64, downsampled_point_cloud, num_downsampled_points, covariances, downsampled_classes, NULL, NULL,
+                            nd_array, num_nds, num_valid_nds, kl_edges, num_kl_edges);
+}
+
+int ndt_downsample_f32(float *point_cloud, unsigned short point_dim, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    float *downsampled_point_cloud, unsigned long *num_downsampled_points,
+                    float *covariances,
+                    unsigned short *downsampled_classes,
+                    struct normal_distribution_t **nd_array, unsigned long *num_nds, unsigned long *num_valid_nds,
+                    struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+
+    struct point_cloud_view_t view;
+    if(point_cloud_view_init(&view, point_cloud, POINT_TYPE_FLOAT32, point_dim, 0) < 0)
+        return -1;
+    return ndt_downsample_view(&view, num_points, len_x, len_y, len_z, offset_x, offset_y, offset_z, voxel_size,
+                            classes, num_classes, num_desired_points,
+                            POINT_TYPE_FLOAT32, downsampled_point_cloud, num_downsampled_points, covariances, downsampled_classes, NULL, NULL,
+                            nd_array, num_nds, num_valid_nds, kl_edges, num_kl_edges);
+}
+
+struct ndt_context_t *ndt_context_create(const struct ndt_config_t *config, unsigned int num_threads) {
+
+    // the workers are shared by every context
+    if(num_threads > 0 && thread_pool_init(num_threads) < 0) {
+        fprintf(stderr, "Error initializing the thread pool!\n");
+        return NULL;
+    }
+
+    struct ndt_context_t *context = (struct ndt_context_t *) malloc(sizeof(struct ndt_context_t));
+    if(context == NULL) {
+        fprintf(stderr, "Error allocating memory for the context: %s\n", strerror(errno));
+        return NULL;
+    }
+    context->config = config != NULL ? *config : ndt_config;
+    voxel_size_solver_init(&context->solver);
+    scratch_init(&context->scratch);
+    context->worker_scratch = NULL;
+    context->num_workers = 0;
+
+    return context;
+}
+
+void ndt_context_destroy(struct ndt_context_t *context) {
+
+    if(context == NULL)
+        return;
+
+    scratch_destroy(&context->scratch);
+    for(unsigned int w = 0; w < context->num_workers; w++)
+        scratch_destroy(&context->worker_scratch[w]);
+    free(context->worker_scratch);
+    free(context);
+}
+
+int ndt_context_reserve(struct ndt_context_t *context, unsigned long num_bytes) {
+    return scratch_reserve(&context->scratch, num_bytes);
+}
+
+void ndt_context_trim(struct ndt_context_t *context) {
+    scratch_destroy(&context->scratch);
+    for(unsigned int w = 0; w < context->num_workers; w++)
+        scratch_destroy(&context->worker_scratch[w]);
+}
+
+void ndt_context_memory(const struct ndt_context_t *context, unsigned long *capacity, unsigned long *num_allocations) {
+    *capacity = context->scratch.capacity;
+    *num_allocations = context->scratch.num_allocations;
+    for(unsigned int w = 0; w < context->num_workers; w++) {
+        *capacity += context->worker_scratch[w].capacity;
+        *num_allocations += context->worker_scratch[w].num_allocations;
+    }
+}
+
+int ndt_context_downsample(struct ndt_context_t *context,
+                    const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
+                    double *offset_x, double *offset_y, double *offset_z,
+                    double *voxel_size,
+                    unsigned short *classes, unsigned short num_classes,
+                    unsigned long num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points) {
+
+    // the previous frame is done with the scratch memory, which grows here if it overflowed
+    if(scratch_reset(&context->scratch) < 0) {
+        fprintf(stderr, "Error growing the context memory!\n");
+        return -11;
+    }
+
+    unsigned long num_nds, num_valid_nds, num_kl_edges;
+    return ndt_downsample_scratch(&context->config, &context->scratch,
+                                point_cloud, num_points, len_x, len_y, len_z, offset_x, offset_y, offset_z, voxel_size,
+                                classes, num_classes, num_desired_points, output, num_downsampled_points, &context->solver,
+                                NULL, &num_nds, &num_valid_nds, NULL, &num_kl_edges);
+}
+
+// give every worker of the pool its own scratch memory
+static int ndt_context_init_workers(struct ndt_context_t *context, unsigned int num_workers) {
+
+    if(num_workers <= context->num_workers)
+        return 0;
+
+    struct scratch_t *worker_scratch = (struct scratch_t *) realloc(context->worker_scratch, num_workers * sizeof(struct scratch_t));
+    if(worker_scratch == NULL) {
+        fprintf(stderr, "Error allocating memory for the worker scratch memories: %s\n", strerror(errno));
+        return -1;
+    }
+    for(unsigned int w = context->num_workers; w < num_workers; w++)
+        scratch_init(&worker_scratch[w]);
+    context->worker_scratch = worker_scratch;
+    context->num_workers = num_workers;
+
     return 0;
 }
 
-void free_nds(struct normal_distribution_t *nd_array, unsigned long num_nds) {
+// downsample a cloud of a batch into its rows of the output
+static int ndt_batch_cloud(const struct ndt_batch_args_t *args, unsigned long cloud, struct scratch_t *scratch) {
+
+    // the view of the cloud starts at its first point
+    unsigned long first = args->cloud_offsets[cloud];
+    unsigned long skip = first * args->points->stride;
+    struct point_cloud_view_t view = *args->points;
+    view.x = (const char *) view.x + skip;
+    view.y = (const char *) view.y + skip;
+    view.z = (const char *) view.z + skip;
+    if(view.channels != NULL)
+        view.channels = (const char *) view.channels + skip;
 
-    // iterate the normal distributions to free the class samples array
-    for(unsigned long i = 0; i < num_nds; i++) {
-        if(nd_array[i].num_class_samples != NULL) {
-            free(nd_array[i].num_class_samples);
-            nd_array[i].num_class_samples = NULL;
+    struct nd_output_t output = *args->output;
+    output.first_row += args->row_offsets[cloud];
+    output.num_rows = args->num_desired_points[cloud];
+
+    // the clouds are unrelated, so each one searches its voxel size from scratch. the results do not depend on the schedule
+    struct voxel_size_solver_t solver;
+    voxel_size_solver_init(&solver);
+    unsigned int len_x, len_y, len_z;
+    double offset_x, offset_y, offset_z, voxel_size;
+    unsigned long num_nds, num_valid_nds, num_kl_edges;
+    return ndt_downsample_scratch(&args->context->config, scratch,
+                                &view, args->cloud_offsets[cloud+1] - first, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                args->classes != NULL ? &args->classes[first] : NULL, args->num_classes,
+                                args->num_desired_points[cloud], &output, &args->num_downsampled_points[cloud], &solver,
+                                NULL, &num_nds, &num_valid_nds, NULL, &num_kl_edges);
+}
+
+// downsample whole clouds on each worker. the nested loops of a pipeline run on the worker that started it
+static void ndt_batch_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct ndt_batch_args_t *args = (struct ndt_batch_args_t *) arg;
+    struct scratch_t *scratch = &args->context->worker_scratch[worker_id];
+
+    for(unsigned long i = start; i < end; i++) {
+        unsigned long cloud = args->clouds[i];
+        args->statuses[cloud] = scratch_reset(scratch) < 0 ? -11 : ndt_batch_cloud(args, cloud, scratch);
+    }
+}
+
+int ndt_context_downsample_batch(struct ndt_context_t *context,
+                    const struct point_cloud_view_t *points, const unsigned long *cloud_offsets, unsigned long num_clouds,
+                    unsigned short *classes, unsigned short num_classes,
+                    const unsigned long *num_desired_points,
+                    const struct nd_output_t *output, unsigned long *num_downsampled_points,
+                    int *cloud_statuses) {
+
+    unsigned int num_workers = thread_pool_num_workers();
+    if(ndt_context_init_workers(context, num_workers) < 0)
+        return -1;
+    if(scratch_reset(&context->scratch) < 0) {
+        fprintf(stderr, "Error growing the context memory!\n");
+        return -11;
+    }
+
+    unsigned long *row_offsets = (unsigned long *) scratch_alloc(&context->scratch, (num_clouds + 1) * sizeof(unsigned long));
+    unsigned long *clouds = (unsigned long *) scratch_alloc(&context->scratch, num_clouds * sizeof(unsigned long));
+    int *statuses = (int *) scratch_alloc(&context->scratch, num_clouds * sizeof(int));
+    if(row_offsets == NULL || clouds == NULL || statuses == NULL) {
+        fprintf(stderr, "Error allocating memory for the batch: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // the clouds take consecutive rows of the output
+    row_offsets[0] = 0;
+    for(unsigned long b = 0; b < num_clouds; b++)
+        row_offsets[b+1] = row_offsets[b] + num_desired_points[b];
+    if(output->num_rows != ULONG_MAX && row_offsets[num_clouds] > output->num_rows) {
+        fprintf(stderr, "The desired points of the batch do not fit the output rows!\n");
+        return -2;
+    }
+
+    struct ndt_batch_args_t args;
+    args.context = context;
+    args.points = points;
+    args.cloud_offsets = cloud_offsets;
+    args.classes = classes;
+    args.num_classes = num_classes;
+    args.num_desired_points = num_desired_points;
+    args.row_offsets = row_offsets;
+    args.output = output;
+    args.num_downsampled_points = num_downsampled_points;
+    args.clouds = clouds;
+    args.statuses = statuses;
+
+    // a cloud bigger than the fair share of a worker would hold up the others, so the big clouds are split across the pool
+    // one at a time. the others are downsampled concurrently, one per worker
+    unsigned long total_points = cloud_offsets[num_clouds] - cloud_offsets[0];
+    unsigned long num_small = 0;
+    for(unsigned long b = 0; b < num_clouds; b++) {
+        unsigned long num_points = cloud_offsets[b+1] - cloud_offsets[b];
+        num_downsampled_points[b] = 0;
+        statuses[b] = 0;
+        if(num_points < BATCH_MIN_SPLIT_POINTS || num_points <= total_points / num_workers) {
+            clouds[num_small++] = b;
+            continue;
         }
+        unsigned long mark = scratch_mark(&context->scratch);
+        statuses[b] = ndt_batch_cloud(&args, b, &context->scratch);
+        scratch_release(&context->scratch, mark);
+    }
+    // the worker memories are indexed by worker id, so the loop is bounded by their number
+    if(thread_pool_parallel_for_bounded(num_small, 1, num_workers, ndt_batch_worker, &args) < 0) {
+        fprintf(stderr, "Error downsampling the batch!\n");
+        return -3;
     }
 
-    // free the normal distributions array
-    free(nd_array);
+    // a failed cloud leaves the rows of the others usable, so it only pads its own rows
+    int status = 0;
+    for(unsigned long b = 0; b < num_clouds; b++) {
+        if(cloud_statuses != NULL)
+            cloud_statuses[b] = statuses[b];
+        if(statuses[b] >= 0)
+            continue;
+        fprintf(stderr, "Error downsampling cloud %lu of the batch!\n", b);
+        struct nd_output_t cloud_output = *output;
+        cloud_output.first_row += row_offsets[b];
+        cloud_output.num_rows = num_desired_points[b];
+        nd_output_pad(&cloud_output, 0, points->num_channels);
+        num_downsampled_points[b] = 0;
+        status = -4;
+    }
 
-    // assign the pointer to NULL for clarity
-    nd_array = NULL;
+    return cloud_statuses != NULL ? 0 : status;
 }
@@ -1,4 +1,5 @@
 #include <ndnet_core/normal_distributions.h>
+#include <ndnet_core/kernels.h>
 
 /*
  MIT License
@@ -25,16 +26,357 @@
 
  */
 
-void *pcl_worker(void *arg) {
+struct voxel_key_worker_args_t {
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
+    struct voxel_grid_t grid; // voxel grid of the points
+    voxel_key_kernel_t kernel; // specialized kernel of the point cloud layout. NULL for the generic loop
+    unsigned long *keys; // voxel index of each point. Will be overwritten
+    unsigned long *point_indexes; // index of each point. Will be overwritten
+    int status; // 0 on success, negative if any point fell outside the grid
+};
+
+struct occupancy_worker_args_t {
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
+    double voxel_size; // voxel size for distribution sampling
+    int len_x; // number of voxels in the "x" dimension
+    int len_y; // number of voxels in the "y" dimension
+    int len_z; // number of voxels in the "z" dimension
+    double x_offset; // offset in the "x" dimension
+    double y_offset; // offset in the "y" dimension
+    double z_offset; // offset in the "z" dimension
+    unsigned long *bitmap; // one bit per voxel, set if the voxel is occupied
+    int status; // 0 on success, negative if any point fell outside the grid
+};
+
+struct sort_reduce_worker_args_t {
+    const struct point_cloud_view_t *point_cloud; // pointer to the point cloud view
+    unsigned short *classes; // pointer to the point classes
+    unsigned short num_classes; // number of classes
+    unsigned long *keys; // voxel indexes, sorted
+    unsigned long *point_indexes; // point indexes, in the order of the sorted keys
+    unsigned long *run_starts; // sorted position of the first point of each voxel run, followed by the number of points
+    struct normal_distribution_t *nd_array; // pointer to the array of normal distributions. NULL when reducing into a store
+    struct nd_store_t *store; // pointer to the store of normal distributions. NULL when reducing into an array
+    bool compact; // if true, each voxel run is stored at its run number instead of at its voxel index
+    unsigned int *class_scratch; // class sample counters of each worker (num_classes + 1 per worker), when reducing into a store
+    unsigned int *class_arena; // class sample counters of each voxel run (num_classes + 1 per run), when reducing into an array
+    enum class_estimator_t class_estimator; // how the most frequent class is estimated, when reducing into a store
+    run_reduce_kernel_t kernel; // specialized kernel of the point cloud layout and the class estimator, when reducing into a store. NULL for the generic loop
+    int status; // 0 on success, negative if any worker failed
+};
+
+struct store_index_worker_args_t {
+    struct nd_store_t *store; // pointer to the store of normal distributions
+};
+
+struct factor_worker_args_t {
+    struct nd_store_t *store; // pointer to the store of normal distributions
+    const unsigned long *entries; // entries to factor. NULL to factor every entry
+};
+
+struct array_store_worker_args_t {
+    struct normal_distribution_t *nd_array; // pointer to the array of normal distributions
+    struct nd_store_t *store; // pointer to the store of normal distributions
+};
+
+struct init_nds_worker_args_t {
+    struct normal_distribution_t *nd_array; // pointer to the array of normal distributions
+};
+
+struct nd_finalize_worker_args_t {
+    struct normal_distribution_t *nd_array; // pointer to the array of normal distributions
+    struct nd_moments_t *moments_array; // pointer to the array of sufficient statistics
+    unsigned short *classes; // pointer to the point classes
+    unsigned short num_classes; // number of classes
+};
+
+struct init_sync_worker_args_t {
+    pthread_mutex_t *mutex_array; // pointer to the array of mutexes
+    pthread_cond_t *cond_array; // pointer to the array of condition variables
+    int status; // 0 on success, negative if any worker failed
+};
+
+void nd_moments_init(struct nd_moments_t *moments) {
+    memset(moments, 0, sizeof(struct nd_moments_t));
+}
+
+void nd_moments_add(struct nd_moments_t *moments, const double *point) {
+
+    // the first sample is the shift, keeping the sums small relative to the spread of the samples
+    if(moments->num_samples == 0)
+        memcpy(moments->shift, point, 3 * sizeof(double));
+    moments->num_samples++;
+
+    double x = point[0] - moments->shift[0];
+    double y = point[1] - moments->shift[1];
+    double z = point[2] - moments->shift[2];
+
+    moments->sum[0] += x;
+    moments->sum[1] += y;
+    moments->sum[2] += z;
+    moments->sum_sq[0] += x * x;
+    moments->sum_sq[1] += x * y;
+    moments->sum_sq[2] += x * z;
+    moments->sum_sq[3] += y * y;
+    moments->sum_sq[4] += y * z;
+    moments->sum_sq[5] += z * z;
+}
+
+void nd_moments_accumulate(struct nd_moments_t *moments, const struct point_cloud_view_t *point_cloud,
+                            const unsigned long *point_indexes, unsigned long num_points) {
+
+    if(num_points == 0)
+        return;
+    if(moments->num_samples == 0)
+        point_cloud_view_get(point_cloud, point_indexes != NULL ? point_indexes[0] : 0, moments->shift);
+
+    double sx = 0, sy = 0, sz = 0;
+    double sxx = 0, sxy = 0, sxz = 0, syy = 0, syz = 0, szz = 0;
+
+    // gather the shifted points of each block as contiguous coordinates, then reduce the block with SIMD
+    double x[MOMENTS_BLOCK_SIZE], y[MOMENTS_BLOCK_SIZE], z[MOMENTS_BLOCK_SIZE];
+    for(unsigned long start = 0; start < num_points; start += MOMENTS_BLOCK_SIZE) {
+
+        unsigned long block = num_points - start < MOMENTS_BLOCK_SIZE ? num_points - start : MOMENTS_BLOCK_SIZE;
+        for(unsigned long i = 0; i < block; i++) {
+            double point[3];
+            point_cloud_view_get(point_cloud, point_indexes != NULL ? point_indexes[start+i] : start + i, point);
+            x[i] = point[0] - moments->shift[0];
+            y[i] = point[1] - moments->shift[1];
+            z[i] = point[2] - moments->shift[2];
+        }
+
+        #pragma omp simd reduction(+:sx,sy,sz,sxx,sxy,sxz,syy,syz,szz)
+        for(unsigned long i = 0; i < block; i++) {
+            sx += x[i];
+            sy += y[i];
+            sz += z[i];
+            sxx += x[i] * x[i];
+            sxy += x[i] * y[i];
+            sxz += x[i] * z[i];
+            syy += y[i] * y[i];
+            syz += y[i] * z[i];
+            szz += z[i] * z[i];
+        }
+    }
+
+    moments->num_samples += num_points;
+    moments->sum[0] += sx;
+    moments->sum[1] += sy;
+    moments->sum[2] += sz;
+    moments->sum_sq[0] += sxx;
+    moments->sum_sq[1] += sxy;
+    moments->sum_sq[2] += sxz;
+    moments->sum_sq[3] += syy;
+    moments->sum_sq[4] += syz;
+    moments->sum_sq[5] += szz;
+}
+
+void nd_moments_finalize(const struct nd_moments_t *moments, double *mean, double *covariance) {
+
+    if(moments->num_samples == 0) {
+        memset(mean, 0, 3 * sizeof(double));
+        memset(covariance, 0, 9 * sizeof(double));
+        return;
+    }
+
+    double n = (double) moments->num_samples;
+    // position of each pair of dimensions in the outer product sums
+    static const int sum_sq_index[9] = {0, 1, 2, 1, 3, 4, 2, 4, 5};
+
+    for(int j = 0; j < 3; j++) {
+        mean[j] = moments->shift[j] + moments->sum[j] / n;
+        for(int k = 0; k < 3; k++) {
+            covariance[j*3+k] = (moments->sum_sq[sum_sq_index[j*3+k]] - moments->sum[j] * moments->sum[k] / n) / n;
+        }
+        // rounding may leave a tiny negative variance on constant coordinates
+        if(covariance[j*3+j] < 0)
+            covariance[j*3+j] = 0;
+    }
+}
+
+// express sufficient statistics around another shift: with e = old shift - new shift, every shifted sample gains e
+static void nd_moments_reshift(struct nd_moments_t *moments, const double *shift) {
+
+    double e[3];
+    for(int j = 0; j < 3; j++)
+        e[j] = moments->shift[j] - shift[j];
+    double n = (double) moments->num_samples;
+    const double *sum = moments->sum;
+
+    moments->sum_sq[0] += 2 * sum[0] * e[0] + n * e[0] * e[0];
+    moments->sum_sq[1] += sum[0] * e[1] + e[0] * sum[1] + n * e[0] * e[1];
+    moments->sum_sq[2] += sum[0] * e[2] + e[0] * sum[2] + n * e[0] * e[2];
+    moments->sum_sq[3] += 2 * sum[1] * e[1] + n * e[1] * e[1];
+    moments->sum_sq[4] += sum[1] * e[2] + e[1] * sum[2] + n * e[1] * e[2];
+    moments->sum_sq[5] += 2 * sum[2] * e[2] + n * e[2] * e[2];
+    for(int j = 0; j < 3; j++) {
+        moments->sum[j] += n * e[j];
+        moments->shift[j] = shift[j];
+    }
+}
+
+void nd_moments_merge(struct nd_moments_t *moments, const struct nd_moments_t *other) {
+
+    if(other->num_samples == 0)
+        return;
+    if(moments->num_samples == 0) {
+        *moments = *other;
+        return;
+    }
+
+    // bring the other samples to the shift of these ones, then add the sums
+    struct nd_moments_t shifted = *other;
+    nd_moments_reshift(&shifted, moments->shift);
+    moments->num_samples += shifted.num_samples;
+    for(int j = 0; j < 3; j++)
+        moments->sum[j] += shifted.sum[j];
+    for(int j = 0; j < 6; j++)
+        moments->sum_sq[j] += shifted.sum_sq[j];
+}
+
+int nd_moments_remove(struct nd_moments_t *moments, const struct nd_moments_t *other) {
+
+    if(other->num_samples > moments->num_samples)
+        return -1;
+    if(other->num_samples == 0)
+        return 0;
+
+    // removing every sample leaves exactly empty statistics, without rounding leftovers
+    if(other->num_samples == moments->num_samples) {
+        nd_moments_init(moments);
+        return 0;
+    }
+
+    struct nd_moments_t shifted = *other;
+    nd_moments_reshift(&shifted, moments->shift);
+    moments->num_samples -= shifted.num_samples;
+    for(int j = 0; j < 3; j++)
+        moments->sum[j] -= shifted.sum[j];
+    for(int j = 0; j < 6; j++)
+        moments->sum_sq[j] -= shifted.sum_sq[j];
+
+    // the removed samples may have included the shift, so center the remaining ones on their mean to keep the sums small
+    double mean[3];
+    for(int j = 0; j < 3; j++)
+        mean[j] = moments->shift[j] + moments->sum[j] / (double) moments->num_samples;
+    nd_moments_reshift(moments, mean);
+
+    return 0;
+}
+
+// write finalized sufficient statistics to a normal distribution
+static inline void moments_to_nd(const struct nd_moments_t *moments, struct normal_distribution_t *nd) {
+
+    nd->num_samples = moments->num_samples;
+    nd_moments_finalize(moments, nd->mean, nd->covariance);
+    for(int j = 0; j < 3; j++) {
+        nd->old_mean[j] = nd->mean[j];
+        nd->m2[j] = nd->covariance[j*3+j] * nd->num_samples;
+    }
+}
+
+// get the most frequent class from the class sample counts. ties go to the lowest class
+static inline unsigned short majority_class(unsigned int *num_class_samples, unsigned short num_classes) {
+
+    unsigned short nd_class = 0;
+    unsigned int max_class_samples = 0;
+    for(unsigned short j = 0; j <= num_classes; j++) {
+        if(num_class_samples[j] > max_class_samples) {
+            max_class_samples = num_class_samples[j];
+            nd_class = j;
+        }
+    }
+
+    return nd_class;
+}
+
+// set the distribution class to the most frequent class
+static inline void update_nd_class(struct normal_distribution_t *nd, unsigned short num_classes) {
+    nd->class = majority_class(nd->num_class_samples, num_classes);
+}
+
+// reset the sample count, mean and covariance of a normal distribution
+static inline void reset_nd_moments(struct normal_distribution_t *nd) {
+
+    nd->num_samples = 0;
+    for(int j = 0; j < 3; j++) {
+        nd->mean[j] = 0;
+        nd->m2[j] = 0;
+        for(int k = 0; k < 3; k++) {
+            nd->covariance[j*3+k] = 0;
+        }
+    }
+}
+
+// reset a normal distribution before a new estimation. the class sample counters are assigned when the voxel gets its first point
+static inline void init_nd(struct normal_distribution_t *nd, unsigned long index) {
+
+    reset_nd_moments(nd);
+    nd->index = index;
+    nd->class = 0;
+    nd->num_class_samples = NULL;
+    nd->being_updated = false;
+}
+
+static void init_nds_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct init_nds_worker_args_t *args = (struct init_nds_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        init_nd(&args->nd_array[i], i);
+    }
+}
+
+// reset the normal distributions of the grid before a new estimation
+static void init_nds(struct normal_distribution_t *nd_array, unsigned long num_nds) {
+
+    struct init_nds_worker_args_t args;
+    args.nd_array = nd_array;
+
+    thread_pool_parallel_for(num_nds, PCL_CHUNK_SIZE, init_nds_worker, &args);
+}
+
+// finalize the mean, covariance and class of the occupied voxels once all the points were accumulated
+static void nd_finalize_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct nd_finalize_worker_args_t *args = (struct nd_finalize_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        if(args->moments_array[i].num_samples == 0)
+            continue;
+        moments_to_nd(&args->moments_array[i], &args->nd_array[i]);
+        if(args->classes != NULL)
+            update_nd_class(&args->nd_array[i], args->num_classes);
+    }
+}
+
+static void init_sync_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct init_sync_worker_args_t *args = (struct init_sync_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        if(pthread_mutex_init(&args->mutex_array[i], NULL) != 0) {
+            fprintf(stderr, "Error initializing distribution mutex: %s\n", strerror(errno));
+            args->status = -1;
+        }
+        if(pthread_cond_init(&args->cond_array[i], NULL) != 0) {
+            fprintf(stderr, "Error initializing condition variable: %s\n", strerror(errno));
+            args->status = -2;
+        }
+    }
+}
+
+void pcl_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
 
     // get the worker arguments
     struct pcl_worker_args_t *args = (struct pcl_worker_args_t *) arg;
+    (void) worker_id;
 
-    // get the point range for the worker from the worker id
-    unsigned long start = args->worker_id * (args->num_points/ NUM_PCL_WORKERS);
-    unsigned long end = (args->worker_id + 1) * (args->num_points / NUM_PCL_WORKERS);
-
-    // iterate over the points
+    // iterate over the points of the chunk
     for(unsigned long i = start; i < end; i++) {
 
         // check if the point cloud is finished
@@ -42,82 +384,58 @@ void *pcl_worker(void *arg) {
             break;
 
         // get the voxel indexes for the point
+        double point[3];
+        point_cloud_view_get(args->point_cloud, i, point);
         unsigned int voxel_x, voxel_y, voxel_z;
-        double x_offset = 0, y_offset = 0, z_offset = 0;
-        if(metric_to_voxel_space(&args->point_cloud[i*3], args->voxel_size, args->len_x, args->len_y, args->len_z, 
+        if(metric_to_voxel_space(point, args->voxel_size, args->len_x, args->len_y, args->len_z, 
                                 args->x_offset, args->y_offset, args->z_offset,
                                 &voxel_x, &voxel_y, &voxel_z) < 0) {
             fprintf(stderr, "Error converting point to voxel space!\n");
-            return NULL;
+            args->status = -1;
+            return;
         }
         unsigned long voxel_index;
         if(voxel_pos_to_index(voxel_x, voxel_y, voxel_z, args->len_x, args->len_y, args->len_z, &voxel_index) < 0) {
             fprintf(stderr, "Error converting voxel position to index!\n");
-            return NULL;
+            args->status = -2;
+            return;
         }
 
         // lock the mutex for the voxel
         if(pthread_mutex_lock(&args->mutex_array[voxel_index]) != 0) {
             fprintf(stderr, "Error locking distribution mutex: %s\n", strerror(errno));
-            return NULL;
+            args->status = -3;
+            return;
         }
 
         // wait for the condition variable
         while(args->nd_array[voxel_index].being_updated) {
             if(pthread_cond_wait(&args->cond_array[voxel_index], &args->mutex_array[voxel_index]) != 0) {
                 fprintf(stderr, "Error waiting for condition variable: %s\n", strerror(errno));
-                return NULL;
+                args->status = -3;
+                return;
             }
         }
 
         args->nd_array[voxel_index].being_updated = true;
 
-        // update the normal distribution for the voxel
-        args->nd_array[voxel_index].num_samples++;
-        // iterate the 3 dimensions of the point sample
-        for(int j = 0; j < 3; j++) {
-            // copy the old mean
-            args->nd_array[voxel_index].old_mean[j] = args->nd_array[voxel_index].mean[j];
-            // update the mean
-            args->nd_array[voxel_index].mean[j] += (args->point_cloud[i*3+j] - args->nd_array[voxel_index].mean[j]) / args->nd_array[voxel_index].num_samples;
-            // update the sum of squared differences for the variances
-            args->nd_array[voxel_index].m2[j] += (args->point_cloud[i*3+j] - args->nd_array[voxel_index].old_mean[j]) * (args->point_cloud[i*3+j] - args->nd_array[voxel_index].mean[j]);
-            // update the variances
-            args->nd_array[voxel_index].covariance[j*3+j] = args->nd_array[voxel_index].m2[j] / args->nd_array[voxel_index].num_samples;
-            if(isnan(args->nd_array[voxel_index].covariance[j*3+j])) {
-                args->nd_array[voxel_index].covariance[j*3+j] = 0.0;
-            }
-
-            // iterate the other dimensions to update the covariance matrix
-            for(int k = j + 1; k < 3; k++) {
-                // it's the diagonal, it's the variance, already updated
-                if(j == k)
-                    continue;
-                // update the covariance matrix
-                args->nd_array[voxel_index].covariance[j*3+k] += (args->point_cloud[i*3+j] - args->nd_array[voxel_index].mean[j]) * (args->point_cloud[i*3+k] - args->nd_array[voxel_index].mean[k]) / args->nd_array[voxel_index].num_samples;
-                if(isnan(args->nd_array[voxel_index].covariance[j*3+k])) {
-                    args->nd_array[voxel_index].covariance[j*3+k] = 0.0;
-                }
-                // mirror the covariance to the other half of the matrix
-                args->nd_array[voxel_index].covariance[k*3+j] = args->nd_array[voxel_index].covariance[j*3+k];
-            }
+        // add the point to the sufficient statistics of the voxel
+        nd_moments_add(&args->moments_array[voxel_index], point);
+        if(args->channel_sums != NULL) {
+            unsigned short num_channels = args->point_cloud->num_channels;
+            for(unsigned short c = 0; c < num_channels; c++)
+                args->channel_sums[voxel_index * num_channels + c] += point_cloud_view_get_channel(args->point_cloud, i, c);
         }
 
-        // update the class if classes were provided
+        // count the class if classes were provided. the most frequent class is found once all the points were counted
         if(args->classes != NULL) {
-            // get the class of the point
-            unsigned short point_class = args->classes[i];
-            // update the class of the distribution
-            args->nd_array[voxel_index].num_class_samples[point_class]++;
-
-            // find the most frequent class
-            unsigned int max_class_samples = 0;
-            for(unsigned short j = 0; j <= args->num_classes; j++) {
-                if(args->nd_array[voxel_index].num_class_samples[j] > max_class_samples) {
-                    max_class_samples = args->nd_array[voxel_index].num_class_samples[j];
-                    args->nd_array[voxel_index].class = j;
-                }
+            // the first point of the voxel takes the next slot of the class arena
+            if(args->nd_array[voxel_index].num_class_samples == NULL) {
+                unsigned long slot = __atomic_fetch_add(args->next_class_slot, 1, __ATOMIC_RELAXED);
+                args->nd_array[voxel_index].num_class_samples = &args->class_arena[slot * (args->num_classes + 1)];
             }
+            // update the class samples of the distribution
+            args->nd_array[voxel_index].num_class_samples[args->classes[i]]++;
         }
 
         args->nd_array[voxel_index].being_updated = false;
@@ -125,15 +443,354 @@ void *pcl_worker(void *arg) {
         // unlock the mutex for the voxel
         if(pthread_mutex_unlock(&args->mutex_array[voxel_index]) != 0) {
             fprintf(stderr, "Error unlocking distribution mutex: %s\n", strerror(errno));
-            return NULL;
+            args->status = -3;
+            return;
         }
 
         // signal the condition variable
         if(pthread_cond_signal(&args->cond_array[voxel_index]) != 0) {
             fprintf(stderr, "Error signaling condition variable: %s\n", strerror(errno));
-            return NULL;
+            args->status = -3;
+            return;
+        }
+    }
+}
+
+// compute the voxel index of each point of the chunk
+static void voxel_key_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct voxel_key_worker_args_t *args = (struct voxel_key_worker_args_t *) arg;
+    const struct voxel_grid_t *grid = &args->grid;
+    (void) worker_id;
+
+    // chunks with a point outside the grid go through the generic loop, which reports it
+    if(args->kernel != NULL && args->kernel(args->point_cloud, grid, start, end, args->keys, args->point_indexes) == 0)
+        return;
+
+    for(unsigned long i = start; i < end; i++) {
+
+        double point[3];
+        point_cloud_view_get(args->point_cloud, i, point);
+        unsigned int voxel_x, voxel_y, voxel_z;
+        if(metric_to_voxel_space(point, grid->voxel_size, grid->len_x, grid->len_y, grid->len_z,
+                                grid->x_offset, grid->y_offset, grid->z_offset,
+                                &voxel_x, &voxel_y, &voxel_z) < 0) {
+            args->status = -1;
+            return;
+        }
+        if(voxel_pos_to_index(voxel_x, voxel_y, voxel_z, grid->len_x, grid->len_y, grid->len_z, &args->keys[i]) < 0) {
+            args->status = -2;
+            return;
+        }
+        args->point_indexes[i] = i;
+    }
+}
+
+// mark the voxel of each point of the chunk as occupied
+static void occupancy_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct occupancy_worker_args_t *args = (struct occupancy_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+
+        double point[3];
+        point_cloud_view_get(args->point_cloud, i, point);
+        unsigned int voxel_x, voxel_y, voxel_z;
+        if(metric_to_voxel_space(point, args->voxel_size, args->len_x, args->len_y, args->len_z,
+                                args->x_offset, args->y_offset, args->z_offset,
+                                &voxel_x, &voxel_y, &voxel_z) < 0) {
+            args->status = -1;
+            return;
+        }
+        unsigned long index;
+        if(voxel_pos_to_index(voxel_x, voxel_y, voxel_z, args->len_x, args->len_y, args->len_z, &index) < 0) {
+            args->status = -2;
+            return;
+        }
+
+        // only write the word when the bit is not set yet, so dense voxels do not bounce the cache line between workers
+        unsigned long bit = 1UL << (index % 64);
+        if((__atomic_load_n(&args->bitmap[index / 64], __ATOMIC_RELAXED) & bit) == 0)
+            __atomic_fetch_or(&args->bitmap[index / 64], bit, __ATOMIC_RELAXED);
+    }
+}
+
+// reduce the voxel runs of the chunk. each voxel run belongs to exactly one worker, so no locking is needed
+static void sort_reduce_worker(void *arg, unsigned long first_run, unsigned long last_run, unsigned int worker_id) {
+
+    struct sort_reduce_worker_args_t *args = (struct sort_reduce_worker_args_t *) arg;
+
+    if(args->kernel != NULL) {
+        unsigned int *class_counts = args->class_scratch != NULL ? &args->class_scratch[(unsigned long) worker_id * (args->num_classes + 1)] : NULL;
+        args->kernel(args->point_cloud, args->classes, args->num_classes, class_counts,
+                    args->keys, args->point_indexes, args->run_starts, first_run, last_run, args->compact, args->store);
+        return;
+    }
+
+    // count the classes on the arena slot of the run, or on the worker counters when only the most frequent class is kept
+    bool count_classes = args->classes != NULL && (args->class_arena != NULL || args->class_estimator == CLASS_ESTIMATOR_HISTOGRAM);
+    bool stream_classes = args->classes != NULL && !count_classes;
+    unsigned int *num_class_samples = NULL;
+
+    for(unsigned long r = first_run; r < last_run; r++) {
+
+        unsigned long start = args->run_starts[r];
+        unsigned long end = args->run_starts[r+1];
+        unsigned long index = args->keys[start];
+
+        // accumulate the voxel run locally
+        struct nd_moments_t moments;
+        nd_moments_init(&moments);
+        nd_moments_accumulate(&moments, args->point_cloud, &args->point_indexes[start], end - start);
+        if(count_classes) {
+            if(args->class_arena != NULL) {
+                num_class_samples = &args->class_arena[r * (args->num_classes + 1)];
+            } else {
+                num_class_samples = &args->class_scratch[(unsigned long) worker_id * (args->num_classes + 1)];
+                memset(num_class_samples, 0, (args->num_classes + 1) * sizeof(unsigned int));
+            }
+        }
+        // streaming majority vote state
+        unsigned short candidate_class = 0;
+        unsigned long candidate_votes = 0;
+
+        for(unsigned long i = start; i < end && args->classes != NULL; i++) {
+
+            unsigned long point_index = args->point_indexes[i];
+
+            if(count_classes) {
+                num_class_samples[args->classes[point_index]]++;
+            } else if(stream_classes) {
+                unsigned short point_class = args->classes[point_index];
+                if(candidate_votes == 0) {
+                    candidate_class = point_class;
+                    candidate_votes = 1;
+                } else if(point_class == candidate_class) {
+                    candidate_votes++;
+                } else {
+                    candidate_votes--;
+                }
+            }
+        }
+
+        // the voxel run is complete
+        unsigned short nd_class = candidate_class;
+        if(count_classes)
+            nd_class = majority_class(num_class_samples, args->num_classes);
+
+        if(args->store != NULL) {
+
+            // write the distribution to its store entry
+            struct nd_store_t *store = args->store;
+            unsigned long entry = args->compact ? r : index;
+            store->num_samples[entry] = moments.num_samples;
+            nd_moments_finalize(&moments, &store->mean[entry*3], &store->covariance[entry*9]);
+            store->index[entry] = index;
+            if(store->classes != NULL)
+                store->classes[entry] = nd_class;
+
+            // average the extra channels of the voxel run
+            for(unsigned short c = 0; c < store->num_channels; c++) {
+                double sum = 0;
+                for(unsigned long i = start; i < end; i++)
+                    sum += point_cloud_view_get_channel(args->point_cloud, args->point_indexes[i], c);
+                store->channels[entry * store->num_channels + c] = sum / (end - start);
+            }
+
+        } else {
+
+            // locate the distribution of the voxel run in the array
+            struct normal_distribution_t *nd;
+            if(args->compact) {
+                nd = &args->nd_array[r];
+                init_nd(nd, index);
+            } else {
+                nd = &args->nd_array[index];
+            }
+
+            moments_to_nd(&moments, nd);
+            if(num_class_samples != NULL) {
+                nd->num_class_samples = num_class_samples;
+                nd->class = nd_class;
+            }
+        }
+    }
+}
+
+// number the entries of a dense store by voxel index
+static void store_index_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct store_index_worker_args_t *args = (struct store_index_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        args->store->index[i] = i;
+    }
+}
+
+// copy the distributions of an array to the store entries at the same positions
+static void array_to_store_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct array_store_worker_args_t *args = (struct array_store_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        struct normal_distribution_t *nd = &args->nd_array[i];
+        args->store->num_samples[i] = nd->num_samples;
+        memcpy(&args->store->mean[i*3], nd->mean, 3 * sizeof(double));
+        memcpy(&args->store->covariance[i*9], nd->covariance, 9 * sizeof(double));
+        args->store->index[i] = nd->index;
+        if(args->store->classes != NULL)
+            args->store->classes[i] = nd->class;
+    }
+}
+
+// copy the store entries to the distributions of an array at the same positions
+static void store_to_array_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct array_store_worker_args_t *args = (struct array_store_worker_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long i = start; i < end; i++) {
+        struct normal_distribution_t *nd = &args->nd_array[i];
+        nd->index = args->store->index[i];
+        nd->num_samples = args->store->num_samples[i];
+        memcpy(nd->mean, &args->store->mean[i*3], 3 * sizeof(double));
+        memcpy(nd->old_mean, &args->store->mean[i*3], 3 * sizeof(double));
+        memcpy(nd->covariance, &args->store->covariance[i*9], 9 * sizeof(double));
+        for(int j = 0; j < 3; j++) {
+            nd->m2[j] = nd->covariance[j*3+j] * nd->num_samples;
+        }
+        nd->class = args->store->classes != NULL ? args->store->classes[i] : 0;
+        nd->num_class_samples = NULL;
+        nd->being_updated = false;
+    }
+}
+
+// voxelize a point cloud view with the locking engine
+static int estimate_ndt_view(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    struct normal_distribution_t *nd_array, double *channel_sums,
+                    unsigned long *num_nds, struct scratch_t *scratch) {
+
+    *num_nds = 0;
+
+    unsigned long grid_size = (unsigned long) len_x * len_y * len_z;
+
+    // initialize the normal distributions
+    init_nds(nd_array, grid_size);
+
+    // allocate the sufficient statistics of each voxel
+    struct nd_moments_t *moments_array = (struct nd_moments_t *) scratch_calloc(scratch, grid_size, sizeof(struct nd_moments_t));
+    if(moments_array == NULL) {
+        fprintf(stderr, "Error allocating memory for sufficient statistics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // allocate the class sample counters of the occupied voxels. there are at most as many as points
+    unsigned int *class_arena = NULL;
+    unsigned long next_class_slot = 0;
+    if(classes != NULL && num_points > 0) {
+        unsigned long max_occupied = num_points < grid_size ? num_points : grid_size;
+        class_arena = (unsigned int *) scratch_calloc(scratch, max_occupied * (num_classes + 1), sizeof(unsigned int));
+        if(class_arena == NULL) {
+            fprintf(stderr, "Error allocating memory for class samples: %s\n", strerror(errno));
+            scratch_free(scratch, moments_array);
+            return -1;
+        }
+    }
+
+    // create an array of mutexes and condition variables, one per voxel
+    pthread_mutex_t *mutex_array = (pthread_mutex_t *) scratch_alloc(scratch, grid_size * sizeof(pthread_mutex_t));
+    pthread_cond_t *cond_array = (pthread_cond_t *) scratch_alloc(scratch, grid_size * sizeof(pthread_cond_t));
+    if(mutex_array == NULL || cond_array == NULL) {
+        fprintf(stderr, "Error allocating memory for distribution mutexes: %s\n", strerror(errno));
+        scratch_free(scratch, mutex_array);
+        scratch_free(scratch, cond_array);
+        scratch_free(scratch, class_arena);
+        scratch_free(scratch, moments_array);
+        return -2;
+    }
+
+    // initialize the mutexes and condition variables
+    struct init_sync_worker_args_t sync_args;
+    sync_args.mutex_array = mutex_array;
+    sync_args.cond_array = cond_array;
+    sync_args.status = 0;
+    if(thread_pool_parallel_for(grid_size, PCL_CHUNK_SIZE, init_sync_worker, &sync_args) < 0 || sync_args.status < 0) {
+        fprintf(stderr, "Error initializing distribution mutexes!\n");
+        scratch_free(scratch, mutex_array);
+        scratch_free(scratch, cond_array);
+        scratch_free(scratch, class_arena);
+        scratch_free(scratch, moments_array);
+        return -3;
+    }
+
+    // update the distributions on the thread pool
+    struct pcl_worker_args_t args;
+    args.point_cloud = point_cloud;
+    args.num_points = num_points;
+    args.classes = classes;
+    args.num_classes = num_classes;
+    args.nd_array = nd_array;
+    args.mutex_array = mutex_array;
+    args.cond_array = cond_array;
+    args.moments_array = moments_array;
+    args.channel_sums = channel_sums;
+    args.voxel_size = voxel_size;
+    args.len_x = len_x;
+    args.len_y = len_y;
+    args.len_z = len_z;
+    args.x_offset = x_offset;
+    args.y_offset = y_offset;
+    args.z_offset = z_offset;
+    args.class_arena = class_arena;
+    args.next_class_slot = &next_class_slot;
+    args.status = 0;
+
+    int status = 0;
+    if(thread_pool_parallel_for(num_points, PCL_CHUNK_SIZE, pcl_worker, &args) < 0 || args.status < 0) {
+        fprintf(stderr, "Error updating normal distributions!\n");
+        status = -4;
+    }
+
+    // compute the mean, covariance and most frequent class of each occupied voxel
+    struct nd_finalize_worker_args_t finalize_args;
+    finalize_args.nd_array = nd_array;
+    finalize_args.moments_array = moments_array;
+    finalize_args.classes = classes;
+    finalize_args.num_classes = num_classes;
+    thread_pool_parallel_for(grid_size, PCL_CHUNK_SIZE, nd_finalize_worker, &finalize_args);
+    scratch_free(scratch, moments_array);
+
+    // the arena is owned by the array from now on, unless no voxel was occupied
+    if(next_class_slot == 0)
+        scratch_free(scratch, class_arena);
+
+    // destroy the mutexes and condition variables
+    for(unsigned long i = 0; i < grid_size; i++) {
+        pthread_mutex_destroy(&mutex_array[i]);
+        pthread_cond_destroy(&cond_array[i]);
+    }
+
+    // count the number of normal distributions
+    for(unsigned long i = 0; i < grid_size; i++) {
+        if(nd_array[i].num_samples > 0) {
+            (*num_nds)++;
         }
     }
+
+    // free the array of mutexes
+    scratch_free(scratch, mutex_array);
+
+    // free the array of condition variables
+    scratch_free(scratch, cond_array);
+
+    return status;
 }
 
 int estimate_ndt(double *point_cloud, unsigned long num_points,
@@ -144,144 +801,690 @@ int estimate_ndt(double *point_cloud, unsigned long num_points,
                     struct normal_distribution_t *nd_array,
                     unsigned long *num_nds) {
 
-    *num_nds = 0;
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud, POINT_TYPE_FLOAT64, 3, 0);
+    return estimate_ndt_view(&view, num_points, classes, num_classes, voxel_size,
+                            len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                            nd_array, NULL, num_nds, NULL);
+}
 
-    #pragma omp parallel for
-    for(int i = 0; i < len_x * len_y * len_z; i++) {
-        // initialize the normal distributions
-        nd_array[i].num_samples = 0;
-        nd_array[i].index = i;
-        nd_array[i].num_class_samples = NULL;
-        // if classes were provided, allocate memory for the number of samples per class
-        // initialize with zeross
-        if(classes != NULL) {
-            nd_array[i].num_class_samples = (unsigned int *) calloc((num_classes + 1), sizeof(unsigned int));
-            if(nd_array[i].num_class_samples == NULL) {
-                fprintf(stderr, "Error allocating memory for class samples: %s\n", strerror(errno));
-                return -1;
-            }
+// compute the voxel key of every point and sort the points by it. the sort is stable, so each voxel keeps the point cloud order
+static int sort_points_by_voxel(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    unsigned long **keys, unsigned long **point_indexes, struct scratch_t *scratch) {
+
+    // allocate the voxel keys and the point indexes that are sorted along with them
+    *keys = (unsigned long *) scratch_alloc(scratch, num_points * sizeof(unsigned long));
+    *point_indexes = (unsigned long *) scratch_alloc(scratch, num_points * sizeof(unsigned long));
+    if(*keys == NULL || *point_indexes == NULL) {
+        fprintf(stderr, "Error allocating memory for voxel keys: %s\n", strerror(errno));
+        scratch_free(scratch, *keys);
+        scratch_free(scratch, *point_indexes);
+        return -1;
+    }
+
+    // compute the voxel key of each point
+    struct voxel_key_worker_args_t args;
+    args.point_cloud = point_cloud;
+    args.grid.voxel_size = voxel_size;
+    args.grid.len_x = len_x;
+    args.grid.len_y = len_y;
+    args.grid.len_z = len_z;
+    args.grid.x_offset = x_offset;
+    args.grid.y_offset = y_offset;
+    args.grid.z_offset = z_offset;
+    args.kernel = kernels_select_voxel_keys(point_cloud);
+    args.keys = *keys;
+    args.point_indexes = *point_indexes;
+    args.status = 0;
+
+    int status = 0;
+    if(thread_pool_parallel_for(num_points, PCL_CHUNK_SIZE, voxel_key_worker, &args) < 0 || args.status < 0) {
+        fprintf(stderr, "Error computing voxel keys!\n");
+        status = -2;
+    }
+
+    // group the points by voxel
+    if(status == 0 && radix_sort_pairs(*keys, *point_indexes, num_points, (unsigned long) len_x * len_y * len_z - 1, scratch) < 0) {
+        fprintf(stderr, "Error sorting voxel keys!\n");
+        status = -5;
+    }
+
+    if(status < 0) {
+        scratch_free(scratch, *keys);
+        scratch_free(scratch, *point_indexes);
+    }
+
+    return status;
+}
+
+// count the voxel runs of a sorted key array
+static unsigned long count_voxel_runs(unsigned long *keys, unsigned long num_points) {
+
+    unsigned long num_runs = 0;
+    for(unsigned long i = 0; i < num_points; i++) {
+        if(i == 0 || keys[i] != keys[i-1])
+            num_runs++;
+    }
+
+    return num_runs;
+}
+
+// reduce the sorted voxel runs into distributions of an array or a store, either at their voxel index or compacted in voxel index order
+static int reduce_voxel_runs(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    enum class_estimator_t class_estimator,
+                    unsigned long *keys, unsigned long *point_indexes,
+                    struct normal_distribution_t *nd_array, struct nd_store_t *store, bool compact,
+                    unsigned long *num_nds, struct scratch_t *scratch) {
+
+    *num_nds = count_voxel_runs(keys, num_points);
+
+    // locate the voxel runs, so the pool can hand them out as independent items
+    unsigned long *run_starts = (unsigned long *) scratch_alloc(scratch, (*num_nds + 1) * sizeof(unsigned long));
+    if(run_starts == NULL) {
+        fprintf(stderr, "Error allocating memory for voxel runs: %s\n", strerror(errno));
+        return -1;
+    }
+    unsigned long num_runs = 0;
+    for(unsigned long i = 0; i < num_points; i++) {
+        if(i == 0 || keys[i] != keys[i-1])
+            run_starts[num_runs++] = i;
+    }
+    run_starts[num_runs] = num_points;
+
+    // arrays keep the class counters of each voxel run in a single arena, owned by the array
+    // stores only keep the most frequent class, so each worker reuses its counters for all of its voxel runs
+    unsigned int *class_arena = NULL;
+    unsigned int *class_scratch = NULL;
+    unsigned int num_workers = thread_pool_num_workers();
+    if(classes != NULL && nd_array != NULL) {
+        class_arena = (unsigned int *) scratch_calloc(scratch, num_runs * (num_classes + 1), sizeof(unsigned int));
+        if(class_arena == NULL) {
+            fprintf(stderr, "Error allocating memory for class samples: %s\n", strerror(errno));
+            scratch_free(scratch, run_starts);
+            return -1;
         }
-        for(int j = 0; j < 3; j++) {
-            nd_array[i].mean[j] = 0;
-            nd_array[i].m2[j] = 0;
-            for(int k = 0; k < 3; k++) {
-                nd_array[i].covariance[j*3+k] = 0;
-            }
+    } else if(classes != NULL && class_estimator == CLASS_ESTIMATOR_HISTOGRAM) {
+        class_scratch = (unsigned int *) scratch_alloc(scratch, (unsigned long) num_workers * (num_classes + 1) * sizeof(unsigned int));
+        if(class_scratch == NULL) {
+            fprintf(stderr, "Error allocating memory for class samples: %s\n", strerror(errno));
+            scratch_free(scratch, run_starts);
+            return -1;
         }
-        nd_array[i].being_updated = false;
     }
 
-    // create an array of mutexes, one per voxel
-    pthread_mutex_t *mutex_array = (pthread_mutex_t *) malloc(len_x * len_y * len_z * sizeof(pthread_mutex_t));
-    if(mutex_array == NULL) {
-        fprintf(stderr, "Error allocating memory for distribution mutexes: %s\n", strerror(errno));
+    struct sort_reduce_worker_args_t args;
+    args.point_cloud = point_cloud;
+    args.classes = classes;
+    args.num_classes = num_classes;
+    args.keys = keys;
+    args.point_indexes = point_indexes;
+    args.run_starts = run_starts;
+    args.nd_array = nd_array;
+    args.store = store;
+    args.compact = compact;
+    args.class_scratch = class_scratch;
+    args.class_arena = class_arena;
+    args.class_estimator = class_estimator;
+    args.kernel = store != NULL ? kernels_select_run_reduce(point_cloud, classes != NULL, class_estimator) : NULL;
+    args.status = 0;
+
+    int status = 0;
+    // the class counters are indexed by worker id, so the loop is bounded by the number they were sized for
+    if(thread_pool_parallel_for_bounded(num_runs, VOXEL_RUN_CHUNK_SIZE, num_workers, sort_reduce_worker, &args) < 0 || args.status < 0) {
+        fprintf(stderr, "Error reducing voxel runs!\n");
+        status = -2;
+    }
+
+    scratch_free(scratch, run_starts);
+    scratch_free(scratch, class_scratch);
+
+    return status;
+}
+
+int estimate_ndt_sort_reduce(double *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    struct normal_distribution_t *nd_array,
+                    unsigned long *num_nds) {
+
+    *num_nds = 0;
+
+    // initialize the normal distributions
+    init_nds(nd_array, (unsigned long) len_x * len_y * len_z);
+
+    if(num_points == 0)
+        return 0;
+
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud, POINT_TYPE_FLOAT64, 3, 0);
+    unsigned long *keys, *point_indexes;
+    if(sort_points_by_voxel(&view, num_points, voxel_size,
+                            len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                            &keys, &point_indexes, NULL) < 0) {
+        fprintf(stderr, "Error sorting points by voxel!\n");
         return -2;
     }
 
-    // initialize the mutexes
-    #pragma omp parallel for
-    for(int i = 0; i < len_x * len_y * len_z; i++) {
-        if(pthread_mutex_init(&mutex_array[i], NULL) != 0) {
-            fprintf(stderr, "Error initializing distribution mutex: %s\n", strerror(errno));
-            return -3;
-        }
+    int status = 0;
+    if(reduce_voxel_runs(&view, num_points, classes, num_classes, CLASS_ESTIMATOR_HISTOGRAM,
+                        keys, point_indexes, nd_array, NULL, false, num_nds, NULL) < 0) {
+        fprintf(stderr, "Error reducing voxel runs!\n");
+        status = -3;
+    }
+
+    free(keys);
+    free(point_indexes);
+
+    return status;
+}
+
+int estimate_ndt_sparse(double *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    struct normal_distribution_t **nd_array,
+                    unsigned long *num_nds) {
+
+    *nd_array = NULL;
+    *num_nds = 0;
+
+    if(num_points == 0)
+        return 0;
+
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud, POINT_TYPE_FLOAT64, 3, 0);
+    unsigned long *keys, *point_indexes;
+    if(sort_points_by_voxel(&view, num_points, voxel_size,
+                            len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                            &keys, &point_indexes, NULL) < 0) {
+        fprintf(stderr, "Error sorting points by voxel!\n");
+        return -1;
+    }
+
+    // allocate only the occupied voxels
+    unsigned long num_occupied = count_voxel_runs(keys, num_points);
+    *nd_array = (struct normal_distribution_t *) calloc(num_occupied, sizeof(struct normal_distribution_t));
+    if(*nd_array == NULL) {
+        fprintf(stderr, "Error allocating memory for normal distributions: %s\n", strerror(errno));
+        free(keys);
+        free(point_indexes);
+        return -2;
     }
 
-    // create an array of condition variables, one per voxel
-    pthread_cond_t *cond_array = (pthread_cond_t *) malloc(len_x * len_y * len_z * sizeof(pthread_cond_t));
-    if(cond_array == NULL) {
-        fprintf(stderr, "Error allocating memory for condition variables: %s\n", strerror(errno));
-        return -5;
+    int status = 0;
+    if(reduce_voxel_runs(&view, num_points, classes, num_classes, CLASS_ESTIMATOR_HISTOGRAM,
+                        keys, point_indexes, *nd_array, NULL, true, num_nds, NULL) < 0) {
+        fprintf(stderr, "Error reducing voxel runs!\n");
+        free_nds(*nd_array, num_occupied);
+        *nd_array = NULL;
+        *num_nds = 0;
+        status = -3;
     }
 
-    // initialize the condition variables
-    #pragma omp parallel for
-    for(int i = 0; i < len_x * len_y * len_z; i++) {
-        if(pthread_cond_init(&cond_array[i], NULL) != 0) {
-            fprintf(stderr, "Error initializing condition variable: %s\n", strerror(errno));
-            return -6;
+    free(keys);
+    free(point_indexes);
+
+    return status;
+}
+
+int count_occupied_voxels(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    unsigned long *num_occupied, struct scratch_t *scratch) {
+
+    *num_occupied = 0;
+    if(num_points == 0)
+        return 0;
+
+    unsigned long grid_size = (unsigned long) len_x * len_y * len_z;
+    unsigned long num_words = (grid_size + 63) / 64;
+
+    // the temporaries are reused by the next count
+    unsigned long mark = scratch_mark(scratch);
+
+    // huge grids count the runs of the sorted voxel keys instead
+    if(num_words > OCCUPANCY_BITMAP_MAX_BYTES / sizeof(unsigned long)) {
+        unsigned long *keys, *point_indexes;
+        if(sort_points_by_voxel(point_cloud, num_points, voxel_size,
+                                len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                                &keys, &point_indexes, scratch) < 0) {
+            fprintf(stderr, "Error sorting points by voxel!\n");
+            return -1;
         }
+        *num_occupied = count_voxel_runs(keys, num_points);
+        scratch_free(scratch, keys);
+        scratch_free(scratch, point_indexes);
+        scratch_release(scratch, mark);
+        return 0;
+    }
+
+    unsigned long *bitmap = (unsigned long *) scratch_calloc(scratch, num_words, sizeof(unsigned long));
+    if(bitmap == NULL) {
+        fprintf(stderr, "Error allocating memory for the occupancy bitmap: %s\n", strerror(errno));
+        return -2;
     }
 
-    // allocate a pool of threads
-    pthread_t *threads = (pthread_t *) malloc(NUM_PCL_WORKERS * sizeof(pthread_t));
-    if(threads == NULL) {
-        fprintf(stderr, "Error allocating memory for threads: %s\n", strerror(errno));
-        return -7;
+    struct occupancy_worker_args_t args;
+    args.point_cloud = point_cloud;
+    args.voxel_size = voxel_size;
+    args.len_x = len_x;
+    args.len_y = len_y;
+    args.len_z = len_z;
+    args.x_offset = x_offset;
+    args.y_offset = y_offset;
+    args.z_offset = z_offset;
+    args.bitmap = bitmap;
+    args.status = 0;
+
+    if(thread_pool_parallel_for(num_points, PCL_CHUNK_SIZE, occupancy_worker, &args) < 0 || args.status < 0) {
+        fprintf(stderr, "Error marking occupied voxels!\n");
+        scratch_free(scratch, bitmap);
+        scratch_release(scratch, mark);
+        return -3;
     }
 
-    // create an array of worker arguments
-    struct pcl_worker_args_t *args_array = (struct pcl_worker_args_t *) calloc(NUM_PCL_WORKERS, sizeof(struct pcl_worker_args_t));
-    if(args_array == NULL) {
-        fprintf(stderr, "Error allocating memory for worker arguments: %s\n", strerror(errno));
-        return -8;
+    for(unsigned long i = 0; i < num_words; i++)
+        *num_occupied += __builtin_popcountl(bitmap[i]);
+
+    scratch_free(scratch, bitmap);
+    scratch_release(scratch, mark);
+
+    return 0;
+}
+
+struct normal_distribution_t *find_nd(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                                        unsigned int len_x, unsigned int len_y, unsigned int len_z,
+                                        unsigned long index) {
+
+    // dense grid: the distribution is stored at its voxel index
+    if(num_nds == (unsigned long) len_x * len_y * len_z)
+        return index < num_nds ? &nd_array[index] : NULL;
+
+    // sparse grid: binary search the sorted voxel indexes
+    unsigned long lo = 0;
+    unsigned long hi = num_nds;
+    while(lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if(nd_array[mid].index < index)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    if(lo < num_nds && nd_array[lo].index == index)
+        return &nd_array[lo];
 
-    // create the threads
-    for(int i = 0; i < NUM_PCL_WORKERS; i++) {
+    return NULL;
+}
 
-        // create the worker arguments
-        struct pcl_worker_args_t *args = &args_array[i];
-        args->point_cloud = point_cloud;
-        args->num_points = num_points;
-        args->classes = classes;
-        args->num_classes = num_classes;
-        args->nd_array = nd_array;
-        args->mutex_array = mutex_array;
-        args->cond_array = cond_array;
-        args->voxel_size = voxel_size;
-        args->len_x = len_x;
-        args->len_y = len_y;
-        args->len_z = len_z;
-        args->x_offset = x_offset;
-        args->y_offset = y_offset;
-        args->z_offset = z_offset;
-        args->worker_id = i;
+void free_nd_class_samples(struct normal_distribution_t *nd_array, unsigned long num_nds) {
 
-        if(pthread_create(&threads[i], NULL, pcl_worker, (void *) args) != 0) {
-            fprintf(stderr, "Error creating thread: %s\n", strerror(errno));
-            return -9;
+    // the class samples of all the distributions share one arena, which starts at the lowest counter address
+    unsigned int *class_arena = NULL;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        if(nd_array[i].num_class_samples != NULL) {
+            if(class_arena == NULL || nd_array[i].num_class_samples < class_arena)
+                class_arena = nd_array[i].num_class_samples;
+            nd_array[i].num_class_samples = NULL;
         }
     }
 
-    // wait for the threads to finish
-    for(int i = 0; i < NUM_PCL_WORKERS; i++) {
-        if(pthread_join(threads[i], NULL) != 0) {
-            fprintf(stderr, "Error joining thread: %s\n", strerror(errno));
-            return -10;
+    free(class_arena);
+}
+
+void free_nds(struct normal_distribution_t *nd_array, unsigned long num_nds) {
+
+    if(nd_array == NULL)
+        return;
+
+    // free the class samples arena
+    free_nd_class_samples(nd_array, num_nds);
+
+    // free the normal distributions array
+    free(nd_array);
+
+    // assign the pointer to NULL for clarity
+    nd_array = NULL;
+}
+
+// allocate the columns of a store from a scratch memory, or from the heap
+static int alloc_nd_store_scratch(struct nd_store_t *store, unsigned long num_nds, bool with_classes, unsigned short num_channels,
+                                struct scratch_t *scratch) {
+
+    store->scratch = scratch;
+    store->num_nds = num_nds;
+    store->num_samples = (unsigned long *) scratch_calloc(scratch, num_nds, sizeof(unsigned long));
+    store->mean = (double *) scratch_calloc(scratch, num_nds * 3, sizeof(double));
+    store->covariance = (double *) scratch_calloc(scratch, num_nds * 9, sizeof(double));
+    store->index = (unsigned long *) scratch_alloc(scratch, num_nds * sizeof(unsigned long));
+    store->classes = with_classes ? (unsigned short *) scratch_calloc(scratch, num_nds, sizeof(unsigned short)) : NULL;
+    store->num_channels = num_channels;
+    store->channels = num_channels > 0 ? (double *) scratch_calloc(scratch, num_nds * num_channels, sizeof(double)) : NULL;
+    store->inverse_covariance = NULL;
+    store->log_determinant = NULL;
+    store->invertible = NULL;
+
+    if(num_nds > 0 && (store->num_samples == NULL || store->mean == NULL || store->covariance == NULL || store->index == NULL ||
+                        (with_classes && store->classes == NULL) || (num_channels > 0 && store->channels == NULL))) {
+        fprintf(stderr, "Error allocating memory for the normal distribution store: %s\n", strerror(errno));
+        free_nd_store(store);
+        return -1;
+    }
+
+    return 0;
+}
+
+int alloc_nd_store(struct nd_store_t *store, unsigned long num_nds, bool with_classes, unsigned short num_channels) {
+    return alloc_nd_store_scratch(store, num_nds, with_classes, num_channels, NULL);
+}
+
+void free_nd_store(struct nd_store_t *store) {
+
+    struct scratch_t *scratch = store->scratch;
+    scratch_free(scratch, store->num_samples);
+    scratch_free(scratch, store->mean);
+    scratch_free(scratch, store->covariance);
+    scratch_free(scratch, store->index);
+    scratch_free(scratch, store->classes);
+    scratch_free(scratch, store->channels);
+    scratch_free(scratch, store->inverse_covariance);
+    scratch_free(scratch, store->log_determinant);
+    scratch_free(scratch, store->invertible);
+
+    store->num_samples = NULL;
+    store->mean = NULL;
+    store->covariance = NULL;
+    store->index = NULL;
+    store->classes = NULL;
+    store->channels = NULL;
+    store->inverse_covariance = NULL;
+    store->log_determinant = NULL;
+    store->invertible = NULL;
+    store->num_channels = 0;
+    store->num_nds = 0;
+}
+
+// invert the covariances of the chunk from their cofactors
+static void factor_worker(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+
+    struct factor_worker_args_t *args = (struct factor_worker_args_t *) arg;
+    struct nd_store_t *store = args->store;
+    (void) worker_id;
+
+    for(unsigned long j = start; j < end; j++) {
+
+        unsigned long i = args->entries != NULL ? args->entries[j] : j;
+
+        const double *cov = &store->covariance[i*9];
+        double *inv = &store->inverse_covariance[i*9];
+
+        // cofactors of the symmetric covariance
+        double c00 = cov[4] * cov[8] - cov[5] * cov[5];
+        double c01 = cov[2] * cov[5] - cov[1] * cov[8];
+        double c02 = cov[1] * cov[5] - cov[2] * cov[4];
+        double c11 = cov[0] * cov[8] - cov[2] * cov[2];
+        double c12 = cov[1] * cov[2] - cov[0] * cov[5];
+        double c22 = cov[0] * cov[4] - cov[1] * cov[1];
+        double det = cov[0] * c00 + cov[1] * c01 + cov[2] * c02;
+
+        // covariances are positive semi-definite, so a non-positive determinant means a singular matrix
+        if(store->num_samples[i] <= 1 || !(det > 0)) {
+            memset(inv, 0, 9 * sizeof(double));
+            store->log_determinant[i] = 0;
+            store->invertible[i] = false;
+            continue;
         }
+
+        inv[0] = c00 / det;
+        inv[1] = inv[3] = c01 / det;
+        inv[2] = inv[6] = c02 / det;
+        inv[4] = c11 / det;
+        inv[5] = inv[7] = c12 / det;
+        inv[8] = c22 / det;
+        store->log_determinant[i] = log(det);
+        store->invertible[i] = true;
     }
+}
 
-    // destroy the mutexes
-    // destroy distribution mutexes
-    for(unsigned long i = 0; i < len_x * len_y * len_z; i++) {
-        if(pthread_mutex_destroy(&mutex_array[i]) < 0) {
-            fprintf(stderr, "Error destroying distribution mutex: %s\n", strerror(errno));
-            return -7;
+int factor_nd_store(struct nd_store_t *store) {
+
+    if(store->inverse_covariance == NULL) {
+        store->inverse_covariance = (double *) scratch_alloc(store->scratch, store->num_nds * 9 * sizeof(double));
+        store->log_determinant = (double *) scratch_alloc(store->scratch, store->num_nds * sizeof(double));
+        store->invertible = (bool *) scratch_alloc(store->scratch, store->num_nds * sizeof(bool));
+        if(store->num_nds > 0 && (store->inverse_covariance == NULL || store->log_determinant == NULL || store->invertible == NULL)) {
+            fprintf(stderr, "Error allocating memory for the covariance factors: %s\n", strerror(errno));
+            scratch_free(store->scratch, store->inverse_covariance);
+            scratch_free(store->scratch, store->log_determinant);
+            scratch_free(store->scratch, store->invertible);
+            store->inverse_covariance = NULL;
+            store->log_determinant = NULL;
+            store->invertible = NULL;
+            return -1;
         }
     }
 
-    // count the number of normal distributions
-    for(unsigned long i = 0; i < len_x * len_y * len_z; i++) {
-        if(nd_array[i].num_samples > 0) {
-            (*num_nds)++;
+    struct factor_worker_args_t args;
+    args.store = store;
+    args.entries = NULL;
+    if(thread_pool_parallel_for(store->num_nds, FACTOR_CHUNK_SIZE, factor_worker, &args) < 0) {
+        fprintf(stderr, "Error factoring the covariances!\n");
+        return -2;
+    }
+
+    return 0;
+}
+
+int factor_nd_store_entries(struct nd_store_t *store, const unsigned long *entries, unsigned long num_entries) {
+
+    if(num_entries > 0 && store->inverse_covariance == NULL) {
+        fprintf(stderr, "The store must be factored before refactoring its entries!\n");
+        return -1;
+    }
+
+    struct factor_worker_args_t args;
+    args.store = store;
+    args.entries = entries;
+    if(thread_pool_parallel_for(num_entries, FACTOR_CHUNK_SIZE, factor_worker, &args) < 0) {
+        fprintf(stderr, "Error factoring the covariances!\n");
+        return -2;
+    }
+
+    return 0;
+}
+
+// copy an array of normal distributions to a store allocated from a scratch memory, or from the heap
+static int nd_array_to_store_scratch(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                        unsigned int len_x, unsigned int len_y, unsigned int len_z,
+                        struct nd_store_t *store, struct scratch_t *scratch) {
+
+    memset(store, 0, sizeof(struct nd_store_t));
+    store->len_x = len_x;
+    store->len_y = len_y;
+    store->len_z = len_z;
+
+    // the class counts are only allocated when classes were provided
+    bool with_classes = false;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        if(nd_array[i].num_class_samples != NULL) {
+            with_classes = true;
+            break;
         }
     }
 
-    // free the array of mutexes
-    free(mutex_array);
+    if(alloc_nd_store_scratch(store, num_nds, with_classes, 0, scratch) < 0)
+        return -1;
+    store->dense = num_nds == (unsigned long) len_x * len_y * len_z;
 
-    // free the array of condition variables
-    free(cond_array);
+    struct array_store_worker_args_t args;
+    args.nd_array = nd_array;
+    args.store = store;
+    thread_pool_parallel_for(num_nds, PCL_CHUNK_SIZE, array_to_store_worker, &args);
+
+    return 0;
+}
+
+int estimate_nd_store(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                    unsigned short *classes, unsigned short num_classes,
+                    double voxel_size,
+                    int len_x, int len_y, int len_z,
+                    double x_offset, double y_offset, double z_offset,
+                    bool dense, enum voxelization_engine_t engine, enum class_estimator_t class_estimator,
+                    struct nd_store_t *store, unsigned long *num_occupied, struct scratch_t *scratch) {
+
+    memset(store, 0, sizeof(struct nd_store_t));
+    store->scratch = scratch;
+    store->dense = dense;
+    store->len_x = len_x;
+    store->len_y = len_y;
+    store->len_z = len_z;
+    *num_occupied = 0;
+
+    unsigned long grid_size = (unsigned long) len_x * len_y * len_z;
+
+    // the locking engine updates the voxels of a dense array in place, then the array is copied to the store
+    if(dense && engine == VOXELIZATION_LOCKING) {
+
+        struct normal_distribution_t *nd_array = (struct normal_distribution_t *) scratch_alloc(scratch, grid_size * sizeof(struct normal_distribution_t));
+        if(nd_array == NULL) {
+            fprintf(stderr, "Error allocating memory for normal distributions: %s\n", strerror(errno));
+            return -1;
+        }
+        double *channel_sums = NULL;
+        if(point_cloud->num_channels > 0) {
+            channel_sums = (double *) scratch_calloc(scratch, grid_size * point_cloud->num_channels, sizeof(double));
+            if(channel_sums == NULL) {
+                fprintf(stderr, "Error allocating memory for channels: %s\n", strerror(errno));
+                scratch_free(scratch, nd_array);
+                return -1;
+            }
+        }
+        // the class samples of a scratch array are scratch memory as well
+        if(estimate_ndt_view(point_cloud, num_points, classes, num_classes, voxel_size,
+                        len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                        nd_array, channel_sums, num_occupied, scratch) < 0) {
+            fprintf(stderr, "Error estimating normal distributions!\n");
+            if(scratch == NULL)
+                free_nds(nd_array, grid_size);
+            scratch_free(scratch, channel_sums);
+            return -2;
+        }
+        int status = nd_array_to_store_scratch(nd_array, grid_size, len_x, len_y, len_z, store, scratch) < 0 ? -3 : 0;
+        if(scratch == NULL)
+            free_nds(nd_array, grid_size);
+
+        // the channel sums become the channel means of the store
+        if(status == 0 && channel_sums != NULL) {
+            for(unsigned long i = 0; i < grid_size; i++) {
+                for(unsigned short c = 0; c < point_cloud->num_channels && store->num_samples[i] > 0; c++)
+                    channel_sums[i * point_cloud->num_channels + c] /= store->num_samples[i];
+            }
+            store->num_channels = point_cloud->num_channels;
+            store->channels = channel_sums;
+        } else {
+            scratch_free(scratch, channel_sums);
+        }
+        return status;
+    }
+
+    if(dense) {
+        // every voxel has an entry at its voxel index
+        if(alloc_nd_store_scratch(store, grid_size, classes != NULL, point_cloud->num_channels, scratch) < 0)
+            return -1;
+        store->dense = true;
+        struct store_index_worker_args_t index_args;
+        index_args.store = store;
+        thread_pool_parallel_for(grid_size, PCL_CHUNK_SIZE, store_index_worker, &index_args);
+    }
+
+    if(num_points == 0)
+        return 0;
+
+    unsigned long *keys, *point_indexes;
+    if(sort_points_by_voxel(point_cloud, num_points, voxel_size,
+                            len_x, len_y, len_z, x_offset, y_offset, z_offset,
+                            &keys, &point_indexes, scratch) < 0) {
+        fprintf(stderr, "Error sorting points by voxel!\n");
+        free_nd_store(store);
+        return -4;
+    }
+
+    // only the occupied voxels have an entry, in increasing voxel index order
+    if(!dense && alloc_nd_store_scratch(store, count_voxel_runs(keys, num_points), classes != NULL, point_cloud->num_channels, scratch) < 0) {
+        scratch_free(scratch, keys);
+        scratch_free(scratch, point_indexes);
+        return -1;
+    }
+
+    int status = 0;
+    if(reduce_voxel_runs(point_cloud, num_points, classes, num_classes, class_estimator,
+                        keys, point_indexes, NULL, store, !dense, num_occupied, scratch) < 0) {
+        fprintf(stderr, "Error reducing voxel runs!\n");
+        free_nd_store(store);
+        status = -5;
+    }
+
+    scratch_free(scratch, keys);
+    scratch_free(scratch, point_indexes);
+
+    return status;
+}
+
+int find_nd_store_entry(const struct nd_store_t *store, unsigned long index, unsigned long *entry) {
+
+    // dense store: the entry is the voxel index
+    if(store->dense) {
+        if(index >= store->num_nds)
+            return -1;
+        *entry = index;
+        return 0;
+    }
+
+    // sparse store: binary search the sorted voxel indexes
+    unsigned long lo = 0;
+    unsigned long hi = store->num_nds;
+    while(lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if(store->index[mid] < index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < store->num_nds && store->index[lo] == index) {
+        *entry = lo;
+        return 0;
+    }
 
-    // free the pool of threads
-    free(threads);
+    return -1;
+}
+
+int nd_array_to_store(struct normal_distribution_t *nd_array, unsigned long num_nds,
+                        unsigned int len_x, unsigned int len_y, unsigned int len_z,
+                        struct nd_store_t *store) {
+    return nd_array_to_store_scratch(nd_array, num_nds, len_x, len_y, len_z, store, NULL);
+}
+
+int nd_store_to_array(const struct nd_store_t *store, struct normal_distribution_t **nd_array) {
+
+    *nd_array = (struct normal_distribution_t *) malloc(store->num_nds * sizeof(struct normal_distribution_t));
+    if(*nd_array == NULL && store->num_nds > 0) {
+        fprintf(stderr, "Error allocating memory for normal distributions: %s\n", strerror(errno));
+        return -1;
+    }
 
-    // free the array of worker arguments
-    free(args_array);
+    struct array_store_worker_args_t args;
+    args.nd_array = *nd_array;
+    args.store = (struct nd_store_t *) store;
+    thread_pool_parallel_for(store->num_nds, PCL_CHUNK_SIZE, store_to_array_worker, &args);
 
-    // return 0 in case of success
-    return 0;  
+    return 0;
 }
 
 void print_nd(struct normal_distribution_t nd) {
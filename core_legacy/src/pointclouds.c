@@ -37,6 +37,44 @@ double absf(double n) {
     return n < 0 ? -n : n;
 }
 
+unsigned long point_type_size(enum point_type_t type) {
+    return type == POINT_TYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+}
+
+int point_cloud_view_init(struct point_cloud_view_t *point_cloud, const void *data, enum point_type_t type,
+                            unsigned short point_dim, unsigned short num_channels) {
+
+    if(point_dim < 3 + num_channels) {
+        fprintf(stderr, "Point dimension %d does not fit the xyz coordinates and %d channels!\n", point_dim, num_channels);
+        return -1;
+    }
+
+    unsigned long size = point_type_size(type);
+    point_cloud->x = data;
+    point_cloud->y = (const char *) data + size;
+    point_cloud->z = (const char *) data + 2 * size;
+    point_cloud->stride = point_dim * size;
+    point_cloud->type = type;
+    point_cloud->channels = num_channels > 0 ? (const char *) data + 3 * size : NULL;
+    point_cloud->channel_stride = size;
+    point_cloud->num_channels = num_channels;
+
+    return 0;
+}
+
+void point_cloud_view_init_columns(struct point_cloud_view_t *point_cloud, const void *x, const void *y, const void *z,
+                                    enum point_type_t type) {
+
+    point_cloud->x = x;
+    point_cloud->y = y;
+    point_cloud->z = z;
+    point_cloud->stride = point_type_size(type);
+    point_cloud->type = type;
+    point_cloud->channels = NULL;
+    point_cloud->channel_stride = 0;
+    point_cloud->num_channels = 0;
+}
+
 void get_pointcloud_limits(double *point_cloud, short point_dim, unsigned long num_points,
                         double *max_x, double *max_y, double *max_z,
                         double *min_x, double *min_y, double *min_z) {
@@ -63,4 +101,32 @@ void get_pointcloud_limits(double *point_cloud, short point_dim, unsigned long n
     }
 
     // printf("Limits [%f %f], [%f %f], [%f %f]\n", *min_x, *max_x, *min_y, *max_y, *min_z, *max_z);
+}
+
+void get_point_cloud_view_limits(const struct point_cloud_view_t *point_cloud, unsigned long num_points,
+                        double *max_x, double *max_y, double *max_z,
+                        double *min_x, double *min_y, double *min_z) {
+
+    *max_x = -DBL_MAX;
+    *max_y = -DBL_MAX;
+    *max_z = -DBL_MAX;
+    *min_x = DBL_MAX;
+    *min_y = DBL_MAX;
+    *min_z = DBL_MAX;
+
+    // iterate over the points
+    for(unsigned long i = 0; i < num_points; i++) {
+
+        double point[3];
+        point_cloud_view_get(point_cloud, i, point);
+
+        *max_x = maxf(point[0], *max_x);
+        *min_x = minf(point[0], *min_x);
+
+        *max_y = maxf(point[1], *max_y);
+        *min_y = minf(point[1], *min_y);
+
+        *max_z = maxf(point[2], *max_z);
+        *min_z = minf(point[2], *min_z);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include <ndnet_core/pruning.h>
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+
+// whether distribution "a" is removed before distribution "b". ties are broken by entry, for determinism
+static inline bool pruner_before(const struct kl_pruner_t *pruner, uint32_t a, uint32_t b) {
+    return pruner->scores[a] < pruner->scores[b] || (pruner->scores[a] == pruner->scores[b] && a < b);
+}
+
+static inline void pruner_place(struct kl_pruner_t *pruner, unsigned long position, uint32_t entry) {
+    pruner->heap[position] = entry;
+    pruner->heap_positions[entry] = (uint32_t) position;
+}
+
+// move a distribution down the heap until both children are removed after it
+static void pruner_sift_down(struct kl_pruner_t *pruner, unsigned long position) {
+
+    uint32_t entry = pruner->heap[position];
+    for(;;) {
+        unsigned long child = 2 * position + 1;
+        if(child >= pruner->heap_size)
+            break;
+        if(child + 1 < pruner->heap_size && pruner_before(pruner, pruner->heap[child+1], pruner->heap[child]))
+            child++;
+        if(!pruner_before(pruner, pruner->heap[child], entry))
+            break;
+        pruner_place(pruner, position, pruner->heap[child]);
+        position = child;
+    }
+    pruner_place(pruner, position, entry);
+}
+
+// smallest divergence of a distribution to its queued neighbors
+static double pruner_score(const struct kl_pruner_t *pruner, uint32_t entry) {
+
+    double score = INFINITY;
+    for(unsigned long e = pruner->edge_offsets[entry]; e < pruner->edge_offsets[entry+1]; e++) {
+        if(pruner->heap_positions[pruner->edge_neighbors[e]] == KL_PRUNER_NOT_QUEUED)
+            continue;
+        if(pruner->edge_divergences[e] < score)
+            score = pruner->edge_divergences[e];
+    }
+    return score;
+}
+
+int kl_pruner_init(struct kl_pruner_t *pruner, unsigned long num_nds, const unsigned long *num_samples,
+                    const struct kl_edge_t *kl_edges, unsigned long num_kl_edges, struct scratch_t *scratch) {
+
+    *pruner = (struct kl_pruner_t) {0};
+    pruner->scratch = scratch;
+
+    if(num_nds > KL_MAX_ENTRIES) {
+        fprintf(stderr, "Too many normal distributions to prune!\n");
+        return -1;
+    }
+    pruner->num_nds = num_nds;
+
+    pruner->edge_offsets = (unsigned long *) scratch_calloc(scratch, num_nds + 1, sizeof(unsigned long));
+    pruner->reverse_offsets = (unsigned long *) scratch_calloc(scratch, num_nds + 1, sizeof(unsigned long));
+    pruner->scores = (double *) scratch_alloc(scratch, num_nds * sizeof(double));
+    pruner->heap = (uint32_t *) scratch_alloc(scratch, num_nds * sizeof(uint32_t));
+    pruner->heap_positions = (uint32_t *) scratch_alloc(scratch, num_nds * sizeof(uint32_t));
+    if(pruner->edge_offsets == NULL || pruner->reverse_offsets == NULL ||
+        (num_nds > 0 && (pruner->scores == NULL || pruner->heap == NULL || pruner->heap_positions == NULL))) {
+        fprintf(stderr, "Error allocating memory for the pruner: %s\n", strerror(errno));
+        kl_pruner_free(pruner);
+        return -2;
+    }
+
+    // queue the valid distributions. the positions only flag them until the heap is built
+    for(unsigned long i = 0; i < num_nds; i++)
+        pruner->heap_positions[i] = num_samples[i] == 0 ? KL_PRUNER_NOT_QUEUED : 0;
+
+    // count the divergences between queued distributions, which may be given for a partially pruned array
+    unsigned long num_edges = 0;
+    for(unsigned long j = 0; j < num_kl_edges; j++) {
+        uint32_t p = kl_edges[j].p;
+        uint32_t q = kl_edges[j].q;
+        if(p >= num_nds || q >= num_nds) {
+            fprintf(stderr, "Divergence between distributions out of the array!\n");
+            kl_pruner_free(pruner);
+            return -3;
+        }
+        if(pruner->heap_positions[p] == KL_PRUNER_NOT_QUEUED || pruner->heap_positions[q] == KL_PRUNER_NOT_QUEUED ||
+            isnan(kl_edges[j].divergence))
+            continue;
+        pruner->edge_offsets[p+1]++;
+        pruner->reverse_offsets[q+1]++;
+        num_edges++;
+    }
+    for(unsigned long i = 0; i < num_nds; i++) {
+        pruner->edge_offsets[i+1] += pruner->edge_offsets[i];
+        pruner->reverse_offsets[i+1] += pruner->reverse_offsets[i];
+    }
+
+    // group the divergences by distribution, in both directions
+    pruner->edge_neighbors = (uint32_t *) scratch_alloc(scratch, num_edges * sizeof(uint32_t));
+    pruner->edge_divergences = (double *) scratch_alloc(scratch, num_edges * sizeof(double));
+    pruner->reverse_neighbors = (uint32_t *) scratch_alloc(scratch, num_edges * sizeof(uint32_t));
+    pruner->reverse_divergences = (double *) scratch_alloc(scratch, num_edges * sizeof(double));
+    unsigned long *edge_fill = (unsigned long *) scratch_alloc(scratch, num_nds * sizeof(unsigned long));
+    unsigned long *reverse_fill = (unsigned long *) scratch_alloc(scratch, num_nds * sizeof(unsigned long));
+    if((num_edges > 0 && (pruner->edge_neighbors == NULL || pruner->edge_divergences == NULL ||
+        pruner->reverse_neighbors == NULL || pruner->reverse_divergences == NULL)) ||
+        (num_nds > 0 && (edge_fill == NULL || reverse_fill == NULL))) {
+        fprintf(stderr, "Error allocating memory for the pruner divergences: %s\n", strerror(errno));
+        scratch_free(scratch, edge_fill);
+        scratch_free(scratch, reverse_fill);
+        kl_pruner_free(pruner);
+        return -2;
+    }
+    memcpy(edge_fill, pruner->edge_offsets, num_nds * sizeof(unsigned long));
+    memcpy(reverse_fill, pruner->reverse_offsets, num_nds * sizeof(unsigned long));
+    for(unsigned long j = 0; j < num_kl_edges; j++) {
+        uint32_t p = kl_edges[j].p;
+        uint32_t q = kl_edges[j].q;
+        if(pruner->heap_positions[p] == KL_PRUNER_NOT_QUEUED || pruner->heap_positions[q] == KL_PRUNER_NOT_QUEUED ||
+            isnan(kl_edges[j].divergence))
+            continue;
+        pruner->edge_neighbors[edge_fill[p]] = q;
+        pruner->edge_divergences[edge_fill[p]++] = kl_edges[j].divergence;
+        pruner->reverse_neighbors[reverse_fill[q]] = p;
+        pruner->reverse_divergences[reverse_fill[q]++] = kl_edges[j].divergence;
+    }
+    scratch_free(scratch, edge_fill);
+    scratch_free(scratch, reverse_fill);
+
+    // score the queued distributions and build the heap bottom-up
+    for(unsigned long i = 0; i < num_nds; i++) {
+        if(pruner->heap_positions[i] == KL_PRUNER_NOT_QUEUED)
+            continue;
+        pruner->scores[i] = pruner_score(pruner, (uint32_t) i);
+        pruner_place(pruner, pruner->heap_size++, (uint32_t) i);
+    }
+    for(unsigned long position = pruner->heap_size / 2; position-- > 0;)
+        pruner_sift_down(pruner, position);
+
+    return 0;
+}
+
+int kl_pruner_pop(struct kl_pruner_t *pruner, unsigned long *entry) {
+
+    if(pruner->heap_size == 0) {
+        fprintf(stderr, "No normal distributions left to prune!\n");
+        return -1;
+    }
+
+    // take the most redundant distribution out of the heap
+    uint32_t removed = pruner->heap[0];
+    pruner->heap_positions[removed] = KL_PRUNER_NOT_QUEUED;
+    pruner->heap_size--;
+    if(pruner->heap_size > 0) {
+        pruner_place(pruner, 0, pruner->heap[pruner->heap_size]);
+        pruner_sift_down(pruner, 0);
+    }
+
+    // only the neighbors whose score was the divergence to the removed distribution change score.
+    // a score is a minimum over the remaining neighbors, so it never decreases and only sifts down
+    for(unsigned long e = pruner->reverse_offsets[removed]; e < pruner->reverse_offsets[removed+1]; e++) {
+        uint32_t neighbor = pruner->reverse_neighbors[e];
+        uint32_t position = pruner->heap_positions[neighbor];
+        if(position == KL_PRUNER_NOT_QUEUED || pruner->reverse_divergences[e] > pruner->scores[neighbor])
+            continue;
+        double score = pruner_score(pruner, neighbor);
+        if(score != pruner->scores[neighbor]) {
+            pruner->scores[neighbor] = score;
+            pruner_sift_down(pruner, position);
+        }
+    }
+
+    *entry = removed;
+
+    return 0;
+}
+
+int kl_pruner_order(struct kl_pruner_t *pruner, uint32_t *order, uint32_t *ranks, unsigned long *num_ordered) {
+
+    for(unsigned long i = 0; i < pruner->num_nds; i++)
+        ranks[i] = KL_PRUNER_NOT_QUEUED;
+
+    *num_ordered = 0;
+    while(pruner->heap_size > 0) {
+        unsigned long entry;
+        if(kl_pruner_pop(pruner, &entry) < 0)
+            return -1;
+        order[*num_ordered] = (uint32_t) entry;
+        ranks[entry] = (uint32_t) *num_ordered;
+        (*num_ordered)++;
+    }
+
+    return 0;
+}
+
+void kl_pruner_free(struct kl_pruner_t *pruner) {
+    struct scratch_t *scratch = pruner->scratch;
+    scratch_free(scratch, pruner->edge_offsets);
+    scratch_free(scratch, pruner->edge_neighbors);
+    scratch_free(scratch, pruner->edge_divergences);
+    scratch_free(scratch, pruner->reverse_offsets);
+    scratch_free(scratch, pruner->reverse_neighbors);
+    scratch_free(scratch, pruner->reverse_divergences);
+    scratch_free(scratch, pruner->scores);
+    scratch_free(scratch, pruner->heap);
+    scratch_free(scratch, pruner->heap_positions);
+    *pruner = (struct kl_pruner_t) {0};
+}
@@ -0,0 +1,165 @@
+#include <ndnet_core/radix_sort.h>
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#define RADIX_SORT_MIN_PAIRS_PER_SLICE 4096 // below this, extra slices cost more than they save
+
+struct radix_sort_args_t {
+    unsigned long *src_keys; // keys of the current pass
+    unsigned long *src_values; // values of the current pass
+    unsigned long *dst_keys; // keys scattered by the current pass
+    unsigned long *dst_values; // values scattered by the current pass
+    unsigned long num_pairs; // number of key/value pairs
+    unsigned int num_slices; // number of slices the pairs are split into
+    unsigned int shift; // shift of the digit of the current pass
+    unsigned long *histograms; // per-slice digit histograms, turned into scatter offsets
+};
+
+// get the pair range of a slice. slices are fixed for all passes, which keeps the sort stable
+static void slice_range(struct radix_sort_args_t *args, unsigned long slice, unsigned long *start, unsigned long *end) {
+    unsigned long size = args->num_pairs / args->num_slices;
+    *start = slice * size;
+    *end = slice == args->num_slices - 1 ? args->num_pairs : *start + size;
+}
+
+// count the digits of each slice
+static void radix_count(void *arg, unsigned long first_slice, unsigned long last_slice, unsigned int worker_id) {
+
+    struct radix_sort_args_t *args = (struct radix_sort_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long s = first_slice; s < last_slice; s++) {
+        unsigned long *histogram = &args->histograms[s * RADIX_SORT_NUM_BUCKETS];
+        unsigned long start, end;
+        slice_range(args, s, &start, &end);
+
+        memset(histogram, 0, RADIX_SORT_NUM_BUCKETS * sizeof(unsigned long));
+        for(unsigned long i = start; i < end; i++) {
+            histogram[(args->src_keys[i] >> args->shift) & (RADIX_SORT_NUM_BUCKETS - 1)]++;
+        }
+    }
+}
+
+// scatter each slice to its final positions for the digit of the pass
+static void radix_scatter(void *arg, unsigned long first_slice, unsigned long last_slice, unsigned int worker_id) {
+
+    struct radix_sort_args_t *args = (struct radix_sort_args_t *) arg;
+    (void) worker_id;
+
+    for(unsigned long s = first_slice; s < last_slice; s++) {
+        unsigned long *histogram = &args->histograms[s * RADIX_SORT_NUM_BUCKETS];
+        unsigned long start, end;
+        slice_range(args, s, &start, &end);
+
+        for(unsigned long i = start; i < end; i++) {
+            unsigned long pos = histogram[(args->src_keys[i] >> args->shift) & (RADIX_SORT_NUM_BUCKETS - 1)]++;
+            args->dst_keys[pos] = args->src_keys[i];
+            args->dst_values[pos] = args->src_values[i];
+        }
+    }
+}
+
+int radix_sort_pairs(unsigned long *keys, unsigned long *values, unsigned long num_pairs, unsigned long max_key, struct scratch_t *scratch) {
+
+    // only sort the digits the largest key actually uses
+    unsigned int num_passes = 0;
+    for(unsigned long k = max_key; k > 0; k >>= RADIX_SORT_DIGIT_BITS) {
+        num_passes++;
+    }
+    if(num_pairs < 2 || num_passes == 0)
+        return 0;
+
+    // one slice per worker, unless the slices would be too small
+    unsigned long num_slices = num_pairs / RADIX_SORT_MIN_PAIRS_PER_SLICE;
+    if(num_slices < 1)
+        num_slices = 1;
+    if(num_slices > thread_pool_num_workers())
+        num_slices = thread_pool_num_workers();
+
+    // allocate the ping-pong buffers
+    unsigned long mark = scratch_mark(scratch);
+    unsigned long *tmp_keys = (unsigned long *) scratch_alloc(scratch, num_pairs * sizeof(unsigned long));
+    unsigned long *tmp_values = (unsigned long *) scratch_alloc(scratch, num_pairs * sizeof(unsigned long));
+    unsigned long *histograms = (unsigned long *) scratch_alloc(scratch, num_slices * RADIX_SORT_NUM_BUCKETS * sizeof(unsigned long));
+    if(tmp_keys == NULL || tmp_values == NULL || histograms == NULL) {
+        fprintf(stderr, "Error allocating memory for the radix sort: %s\n", strerror(errno));
+        scratch_free(scratch, tmp_keys);
+        scratch_free(scratch, tmp_values);
+        scratch_free(scratch, histograms);
+        scratch_release(scratch, mark);
+        return -1;
+    }
+
+    struct radix_sort_args_t args;
+    args.num_pairs = num_pairs;
+    args.num_slices = num_slices;
+    args.histograms = histograms;
+
+    int ret = 0;
+    for(unsigned int pass = 0; pass < num_passes && ret == 0; pass++) {
+
+        args.src_keys = pass % 2 == 0 ? keys : tmp_keys;
+        args.src_values = pass % 2 == 0 ? values : tmp_values;
+        args.dst_keys = pass % 2 == 0 ? tmp_keys : keys;
+        args.dst_values = pass % 2 == 0 ? tmp_values : values;
+        args.shift = pass * RADIX_SORT_DIGIT_BITS;
+
+        if(thread_pool_parallel_for(num_slices, 1, radix_count, &args) < 0) {
+            fprintf(stderr, "Error counting radix sort digits!\n");
+            ret = -2;
+            break;
+        }
+
+        // turn the histograms into exclusive offsets, ordered by digit and then by slice
+        unsigned long offset = 0;
+        for(unsigned int b = 0; b < RADIX_SORT_NUM_BUCKETS; b++) {
+            for(unsigned long s = 0; s < num_slices; s++) {
+                unsigned long count = histograms[s * RADIX_SORT_NUM_BUCKETS + b];
+                histograms[s * RADIX_SORT_NUM_BUCKETS + b] = offset;
+                offset += count;
+            }
+        }
+
+        if(thread_pool_parallel_for(num_slices, 1, radix_scatter, &args) < 0) {
+            fprintf(stderr, "Error scattering radix sort pairs!\n");
+            ret = -3;
+        }
+    }
+
+    // an odd number of passes leaves the result in the temporary buffers
+    if(ret == 0 && num_passes % 2 == 1) {
+        memcpy(keys, tmp_keys, num_pairs * sizeof(unsigned long));
+        memcpy(values, tmp_values, num_pairs * sizeof(unsigned long));
+    }
+
+    scratch_free(scratch, tmp_keys);
+    scratch_free(scratch, tmp_values);
+    scratch_free(scratch, histograms);
+    scratch_release(scratch, mark);
+
+    return ret;
+}
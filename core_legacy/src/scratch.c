@@ -0,0 +1,148 @@
+#include <ndnet_core/scratch.h>
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+// round a size up to the alignment
+static inline unsigned long scratch_align(unsigned long size) {
+    return (size + SCRATCH_ALIGNMENT - 1) & ~((unsigned long) SCRATCH_ALIGNMENT - 1);
+}
+
+// free the overflow blocks
+static void scratch_free_overflow(struct scratch_t *scratch) {
+    while(scratch->overflow != NULL) {
+        struct scratch_block_t *next = scratch->overflow->next;
+        free(scratch->overflow);
+        scratch->overflow = next;
+    }
+    scratch->overflow_bytes = 0;
+}
+
+void scratch_init(struct scratch_t *scratch) {
+    memset(scratch, 0, sizeof(struct scratch_t));
+}
+
+void scratch_destroy(struct scratch_t *scratch) {
+    scratch_free_overflow(scratch);
+    free(scratch->data);
+    scratch->data = NULL;
+    scratch->capacity = 0;
+    scratch->used = 0;
+    scratch->peak = 0;
+}
+
+int scratch_reserve(struct scratch_t *scratch, unsigned long capacity) {
+
+    scratch_free_overflow(scratch);
+    scratch->used = 0;
+    scratch->peak = 0;
+    if(capacity <= scratch->capacity)
+        return 0;
+
+    // the contents are discarded, so there is nothing to copy
+    capacity = scratch_align(capacity);
+    free(scratch->data);
+    scratch->data = (char *) aligned_alloc(SCRATCH_ALIGNMENT, capacity);
+    if(scratch->data == NULL) {
+        fprintf(stderr, "Error allocating scratch memory: %s\n", strerror(errno));
+        scratch->capacity = 0;
+        return -1;
+    }
+    scratch->capacity = capacity;
+    scratch->num_allocations++;
+
+    return 0;
+}
+
+int scratch_reset(struct scratch_t *scratch) {
+
+    // fit every allocation of the last run, at least doubling so that slowly growing runs settle quickly
+    if(scratch->overflow != NULL) {
+        unsigned long capacity = scratch->capacity * 2 > scratch->peak ? scratch->capacity * 2 : scratch->peak;
+        return scratch_reserve(scratch, capacity);
+    }
+    scratch->used = 0;
+    scratch->peak = 0;
+
+    return 0;
+}
+
+void *scratch_alloc(struct scratch_t *scratch, unsigned long size) {
+
+    if(scratch == NULL)
+        return malloc(size);
+
+    size = scratch_align(size > 0 ? size : 1);
+    if(size <= scratch->capacity - scratch->used) {
+        void *ptr = scratch->data + scratch->used;
+        scratch->used += size;
+        if(scratch->used + scratch->overflow_bytes > scratch->peak)
+            scratch->peak = scratch->used + scratch->overflow_bytes;
+        return ptr;
+    }
+
+    // the block header takes a whole alignment unit, so the memory after it stays aligned
+    struct scratch_block_t *block = (struct scratch_block_t *) aligned_alloc(SCRATCH_ALIGNMENT, SCRATCH_ALIGNMENT + size);
+    if(block == NULL)
+        return NULL;
+    block->next = scratch->overflow;
+    scratch->overflow = block;
+    scratch->overflow_bytes += size;
+    scratch->num_allocations++;
+    if(scratch->used + scratch->overflow_bytes > scratch->peak)
+        scratch->peak = scratch->used + scratch->overflow_bytes;
+
+    return (char *) block + SCRATCH_ALIGNMENT;
+}
+
+void *scratch_calloc(struct scratch_t *scratch, unsigned long count, unsigned long size) {
+
+    if(scratch == NULL)
+        return calloc(count, size);
+
+    if(size > 0 && count > ULONG_MAX / size)
+        return NULL;
+    void *ptr = scratch_alloc(scratch, count * size);
+    if(ptr != NULL)
+        memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+void scratch_free(struct scratch_t *scratch, void *ptr) {
+    if(scratch == NULL)
+        free(ptr);
+}
+
+unsigned long scratch_mark(const struct scratch_t *scratch) {
+    return scratch != NULL ? scratch->used : 0;
+}
+
+void scratch_release(struct scratch_t *scratch, unsigned long mark) {
+    // overflow blocks after the mark are kept until the next reset, which grows the memory to fit them
+    if(scratch != NULL && mark <= scratch->used)
+        scratch->used = mark;
+}
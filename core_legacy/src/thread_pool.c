@@ -0,0 +1,335 @@
+#include <ndnet_core/thread_pool.h>
+
+
+/*
+ MIT License
+
+ Copyright (c) 2024 Carlos Cabaço Tojal
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ */
+
+#include <stdatomic.h>
+
+#define THREAD_POOL_CACHE_LINE 64 // bytes per cache line, to keep the worker ranges apart
+
+// share of the items of a worker. other workers steal from it through the same cursor
+struct thread_pool_range_t {
+    _Atomic unsigned long next; // next item to take
+    unsigned long end; // one past the last item of the share
+    char padding[THREAD_POOL_CACHE_LINE - sizeof(unsigned long) * 2];
+};
+
+struct thread_pool_t {
+    pthread_t *threads; // background workers. the calling thread is worker 0
+    unsigned int num_workers; // number of workers, including the calling thread
+    struct thread_pool_range_t *ranges; // item share of each worker
+    pthread_mutex_t mutex; // protects the job state below
+    pthread_cond_t work_cond; // signaled when a job is posted or the pool shuts down
+    pthread_cond_t done_cond; // signaled when the last background worker finishes a job
+    unsigned long generation; // incremented for every posted job
+    unsigned int num_active; // background workers still running the current job
+    bool shutdown; // true when the workers must exit
+    void (*body)(void *, unsigned long, unsigned long, unsigned int); // body of the current job
+    void *arg; // argument of the current job
+    unsigned long chunk_size; // chunk size of the current job
+    unsigned int num_job_workers; // workers taking part in the current job, the first ones of the pool
+};
+
+static struct thread_pool_t pool;
+static bool pool_initialized = false;
+static pthread_mutex_t pool_init_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the pool lifetime
+static pthread_mutex_t pool_job_mutex = PTHREAD_MUTEX_INITIALIZER; // held while a loop runs on the pool. taken before the init mutex
+
+// id of the pool worker running on this thread, or -1 outside of the pool
+static __thread int current_worker_id = -1;
+
+static pthread_once_t pool_atfork_once = PTHREAD_ONCE_INIT;
+
+// a forked child only has the thread that called "fork", so it drops the pool of the parent and starts its own on demand.
+// the threads and the job state of the parent are gone, and its mutexes may have been held by them
+static void thread_pool_atfork_child(void) {
+
+    if(pool_initialized) {
+        free(pool.threads);
+        free(pool.ranges);
+        memset(&pool, 0, sizeof(struct thread_pool_t));
+    }
+    pool_initialized = false;
+    current_worker_id = -1;
+    pthread_mutex_init(&pool_init_mutex, NULL);
+    pthread_mutex_init(&pool_job_mutex, NULL);
+}
+
+static void thread_pool_register_atfork(void) {
+    if(pthread_atfork(NULL, NULL, thread_pool_atfork_child) != 0)
+        fprintf(stderr, "Error registering the thread pool fork handler!\n");
+}
+
+// run the chunks of the current job, starting with the own share and then stealing from the others
+static void run_job(unsigned int worker_id) {
+
+    for(unsigned int k = 0; k < pool.num_job_workers; k++) {
+        struct thread_pool_range_t *range = &pool.ranges[(worker_id + k) % pool.num_job_workers];
+        unsigned long start;
+        while((start = atomic_fetch_add(&range->next, pool.chunk_size)) < range->end) {
+            unsigned long end = start + pool.chunk_size;
+            if(end > range->end)
+                end = range->end;
+            pool.body(pool.arg, start, end, worker_id);
+        }
+    }
+}
+
+static void *thread_pool_worker(void *arg) {
+
+    unsigned int worker_id = (unsigned int) (unsigned long) arg;
+    current_worker_id = worker_id;
+
+    unsigned long seen_generation = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    while(true) {
+        // wait for a new job
+        while(pool.generation == seen_generation && !pool.shutdown) {
+            pthread_cond_wait(&pool.work_cond, &pool.mutex);
+        }
+        if(pool.shutdown)
+            break;
+        seen_generation = pool.generation;
+        bool in_job = worker_id < pool.num_job_workers;
+        pthread_mutex_unlock(&pool.mutex);
+
+        if(in_job)
+            run_job(worker_id);
+
+        pthread_mutex_lock(&pool.mutex);
+        if(--pool.num_active == 0)
+            pthread_cond_signal(&pool.done_cond);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return NULL;
+}
+
+// get the default number of workers, from the environment or the number of processors
+static unsigned int default_num_workers(void) {
+
+    char *env = getenv(THREAD_POOL_ENV);
+    if(env != NULL) {
+        long n = strtol(env, NULL, 10);
+        if(n > 0)
+            return n > THREAD_POOL_MAX_WORKERS ? THREAD_POOL_MAX_WORKERS : (unsigned int) n;
+        fprintf(stderr, "Ignoring invalid %s value \"%s\"!\n", THREAD_POOL_ENV, env);
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1)
+        return 1;
+    return n > THREAD_POOL_MAX_WORKERS ? THREAD_POOL_MAX_WORKERS : (unsigned int) n;
+}
+
+// stop and join the workers. the caller holds the init mutex
+static void shutdown_pool(void) {
+
+    if(!pool_initialized)
+        return;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for(unsigned int i = 1; i < pool.num_workers; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.work_cond);
+    pthread_cond_destroy(&pool.done_cond);
+    free(pool.threads);
+    free(pool.ranges);
+
+    pool_initialized = false;
+}
+
+// start the workers. the caller holds the init mutex
+static int start_pool(unsigned int num_workers) {
+
+    pthread_once(&pool_atfork_once, thread_pool_register_atfork);
+
+    if(num_workers == 0)
+        num_workers = default_num_workers();
+    if(num_workers > THREAD_POOL_MAX_WORKERS)
+        num_workers = THREAD_POOL_MAX_WORKERS;
+
+    memset(&pool, 0, sizeof(struct thread_pool_t));
+    pool.threads = (pthread_t *) malloc(num_workers * sizeof(pthread_t));
+    pool.ranges = (struct thread_pool_range_t *) aligned_alloc(THREAD_POOL_CACHE_LINE, num_workers * sizeof(struct thread_pool_range_t));
+    if(pool.threads == NULL || pool.ranges == NULL) {
+        fprintf(stderr, "Error allocating memory for the thread pool: %s\n", strerror(errno));
+        free(pool.threads);
+        free(pool.ranges);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.work_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+
+    // the calling thread is worker 0, start the others
+    pool.num_workers = 1;
+    for(unsigned int i = 1; i < num_workers; i++) {
+        if(pthread_create(&pool.threads[i], NULL, thread_pool_worker, (void *) (unsigned long) i) != 0) {
+            // keep running with the workers created so far
+            fprintf(stderr, "Error creating thread pool worker: %s\n", strerror(errno));
+            break;
+        }
+        pool.num_workers++;
+    }
+
+    pool_initialized = true;
+
+    return 0;
+}
+
+int thread_pool_init(unsigned int num_workers) {
+
+    if(current_worker_id >= 0) {
+        fprintf(stderr, "The thread pool can not be initialized from one of its workers!\n");
+        return -1;
+    }
+
+    // wait for a running loop before replacing the workers
+    pthread_mutex_lock(&pool_job_mutex);
+    pthread_mutex_lock(&pool_init_mutex);
+
+    int ret = 0;
+    unsigned int wanted = num_workers == 0 ? default_num_workers() : num_workers;
+    if(!pool_initialized || pool.num_workers != wanted) {
+        shutdown_pool();
+        ret = start_pool(wanted);
+    }
+
+    pthread_mutex_unlock(&pool_init_mutex);
+    pthread_mutex_unlock(&pool_job_mutex);
+
+    return ret;
+}
+
+void thread_pool_destroy(void) {
+
+    pthread_mutex_lock(&pool_job_mutex);
+    pthread_mutex_lock(&pool_init_mutex);
+    shutdown_pool();
+    pthread_mutex_unlock(&pool_init_mutex);
+    pthread_mutex_unlock(&pool_job_mutex);
+}
+
+unsigned int thread_pool_num_workers(void) {
+
+    pthread_mutex_lock(&pool_init_mutex);
+    if(!pool_initialized && start_pool(0) < 0) {
+        pthread_mutex_unlock(&pool_init_mutex);
+        return 1;
+    }
+    unsigned int num_workers = pool.num_workers;
+    pthread_mutex_unlock(&pool_init_mutex);
+
+    return num_workers;
+}
+
+int thread_pool_parallel_for(unsigned long num_items, unsigned long chunk_size,
+                            void (*body)(void *arg, unsigned long start, unsigned long end, unsigned int worker_id),
+                            void *arg) {
+    return thread_pool_parallel_for_bounded(num_items, chunk_size, THREAD_POOL_MAX_WORKERS, body, arg);
+}
+
+int thread_pool_parallel_for_bounded(unsigned long num_items, unsigned long chunk_size, unsigned int max_workers,
+                            void (*body)(void *arg, unsigned long start, unsigned long end, unsigned int worker_id),
+                            void *arg) {
+
+    if(num_items == 0)
+        return 0;
+    if(chunk_size == 0)
+        chunk_size = 1;
+
+    // nested loops run on the worker that started them
+    if(current_worker_id >= 0) {
+        body(arg, 0, num_items, current_worker_id);
+        return 0;
+    }
+
+    // not worth waking the workers
+    if(num_items <= chunk_size) {
+        body(arg, 0, num_items, 0);
+        return 0;
+    }
+
+    // if another thread is running a loop on the pool, run this one on the calling thread instead of waiting
+    if(pthread_mutex_trylock(&pool_job_mutex) != 0) {
+        body(arg, 0, num_items, 0);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool_init_mutex);
+    int ret = pool_initialized ? 0 : start_pool(0);
+    pthread_mutex_unlock(&pool_init_mutex);
+    // the pool may have grown since the caller sized its per-worker storage, so only the first workers take part
+    unsigned int num_job_workers = pool.num_workers < max_workers ? pool.num_workers : max_workers;
+    if(ret < 0 || num_job_workers <= 1) {
+        pthread_mutex_unlock(&pool_job_mutex);
+        body(arg, 0, num_items, 0);
+        return 0;
+    }
+
+    // split the items evenly between the workers
+    for(unsigned int i = 0; i < num_job_workers; i++) {
+        atomic_store(&pool.ranges[i].next, i * (num_items / num_job_workers));
+        pool.ranges[i].end = i == num_job_workers - 1 ? num_items : (i + 1) * (num_items / num_job_workers);
+    }
+
+    // post the job
+    pthread_mutex_lock(&pool.mutex);
+    pool.body = body;
+    pool.arg = arg;
+    pool.chunk_size = chunk_size;
+    pool.num_job_workers = num_job_workers;
+    pool.num_active = pool.num_workers - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    // take part as worker 0
+    current_worker_id = 0;
+    run_job(0);
+    current_worker_id = -1;
+
+    // wait for the other workers
+    pthread_mutex_lock(&pool.mutex);
+    while(pool.num_active > 0) {
+        pthread_cond_wait(&pool.done_cond, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    pthread_mutex_unlock(&pool_job_mutex);
+
+    return 0;
+}
@@ -25,6 +25,25 @@
 
  */
 
+const struct stencil_offset_t neighbor_stencil[NEIGHBORHOOD_MAX_LEN] = {
+    // faces
+    {1, 0, 0}, {-1, 0, 0},
+    {0, 1, 0}, {0, -1, 0},
+    {0, 0, 1}, {0, 0, -1},
+    // edges
+    {1, 1, 0}, {-1, -1, 0},
+    {-1, 1, 0}, {1, -1, 0},
+    {1, 0, 1}, {-1, 0, -1},
+    {-1, 0, 1}, {1, 0, -1},
+    {0, 1, 1}, {0, -1, -1},
+    {0, -1, 1}, {0, 1, -1},
+    // corners
+    {1, 1, 1}, {-1, -1, -1},
+    {-1, 1, 1}, {1, -1, -1},
+    {1, -1, 1}, {-1, 1, -1},
+    {-1, -1, 1}, {1, 1, -1}
+};
+
 void estimate_voxel_size(unsigned long num_desired_voxels,
                         double max_x, double max_y, double max_z,
                         double min_x, double min_y, double min_z,
@@ -61,7 +80,7 @@ void estimate_voxel_size(unsigned long num_desired_voxels,
 void estimate_voxel_grid(double max_x, double max_y, double max_z,
                         double min_x, double min_y, double min_z,
                         double voxel_size,
-                        int *len_x, int *len_y, int *len_z,
+                        unsigned int *len_x, unsigned int *len_y, unsigned int *len_z,
                         double *x_offset, double *y_offset, double *z_offset) {
 
     // calculate the lengths in each dimension
@@ -115,7 +134,7 @@ void voxel_to_metric_space(unsigned int voxel_x, unsigned int voxel_y, unsigned
 
 int get_neighbor_index(unsigned long index, unsigned int len_x, unsigned int len_y, unsigned int len_z, enum direction_t direction, unsigned long *neighbor_index) {
 
-    if(index < 0 || index >= len_x * len_y * len_z) {
+    if(index >= (unsigned long) len_x * len_y * len_z) {
         fprintf(stderr, "Invalid index for neighbor divergence!\n");
         return -1;
     }
@@ -174,6 +193,22 @@ int get_neighbor_index(unsigned long index, unsigned int len_x, unsigned int len
     return 0;
 }
 
+int stencil_index_offsets(enum neighborhood_t neighborhood, unsigned int len_x, unsigned int len_y, long *offsets) {
+
+    if(neighborhood != NEIGHBORHOOD_FACES && neighborhood != NEIGHBORHOOD_EDGES && neighborhood != NEIGHBORHOOD_CORNERS) {
+        fprintf(stderr, "Invalid neighborhood of %d voxels!\n", neighborhood);
+        return -1;
+    }
+
+    for(int s = 0; s < (int) neighborhood; s++) {
+        offsets[s] = neighbor_stencil[s].x +
+                        (long) neighbor_stencil[s].y * len_x +
+                        (long) neighbor_stencil[s].z * len_x * len_y;
+    }
+
+    return (int) neighborhood;
+}
+
 int voxel_pos_to_index(unsigned int voxel_x, unsigned int voxel_y, unsigned int voxel_z, int len_x, int len_y, int len_z, unsigned long *index) {
 
     if(voxel_x < 0 || voxel_x >= len_x ||
@@ -183,20 +218,20 @@ int voxel_pos_to_index(unsigned int voxel_x, unsigned int voxel_y, unsigned int
         return -1;
     }
 
-    *index = voxel_z * len_x * len_y + voxel_y * len_x + voxel_x;
+    *index = (unsigned long) voxel_z * len_x * len_y + (unsigned long) voxel_y * len_x + voxel_x;
 
     return 0;
 }
 
 int index_to_voxel_pos(unsigned long index, int len_x, int len_y, int len_z, unsigned int *voxel_x, unsigned int *voxel_y, unsigned int *voxel_z) {
 
-    if(index < 0 || index >= len_x * len_y * len_z) {
+    if(index >= (unsigned long) len_x * len_y * len_z) {
         fprintf(stderr, "Invalid index for voxel position!\n");
         return -1;
     }
 
-    *voxel_z = index / (len_x * len_y);
-    *voxel_y = (index % (len_x * len_y)) / len_x;
+    *voxel_z = index / ((unsigned long) len_x * len_y);
+    *voxel_y = (index % ((unsigned long) len_x * len_y)) / len_x;
     *voxel_x = index % len_x;
 
     return 0;
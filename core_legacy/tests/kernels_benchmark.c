@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ndnet_core/kernels.h>
+#include <ndnet_core/kullback_leibler.h>
+#include <ndnet_core/ndt.h>
+
+#define NUM_POINTS 400000
+#define NUM_CLASSES 20
+#define NUM_LOOPS 10
+#define VOXEL_SIZE 0.25
+#define GRID_LEN 64
+
+static double elapsed(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static void report(const char *name, double generic_time, double specialized_time, int same) {
+    printf("%-34s generic %8.3f ms  specialized %8.3f ms  speedup %5.2fx%s\n", name,
+            generic_time / NUM_LOOPS * 1e3, specialized_time / NUM_LOOPS * 1e3, generic_time / specialized_time,
+            same ? "" : "  OUTPUTS DIFFER");
+}
+
+static int same_stores(const struct nd_store_t *a, const struct nd_store_t *b) {
+    return a->num_nds == b->num_nds &&
+            memcmp(a->num_samples, b->num_samples, a->num_nds * sizeof(a->num_samples[0])) == 0 &&
+            memcmp(a->mean, b->mean, a->num_nds * 3 * sizeof(double)) == 0 &&
+            memcmp(a->covariance, b->covariance, a->num_nds * 9 * sizeof(double)) == 0 &&
+            (a->classes == NULL ? b->classes == NULL : memcmp(a->classes, b->classes, a->num_nds * sizeof(unsigned short)) == 0);
+}
+
+// estimate a store "NUM_LOOPS" times on either path. the last store is kept
+static double time_store(const struct point_cloud_view_t *view, unsigned short *classes, int dense,
+                        enum class_estimator_t class_estimator, int specialized, struct nd_store_t *store) {
+    kernels_set_enabled(specialized);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        unsigned long num_occupied;
+        if(l > 0)
+            free_nd_store(store);
+        if(estimate_nd_store(view, NUM_POINTS, classes, NUM_CLASSES, VOXEL_SIZE, GRID_LEN, GRID_LEN, GRID_LEN,
+                            0.0, 0.0, 0.0, dense, VOXELIZATION_SORT_REDUCE, class_estimator, store, &num_occupied, NULL) < 0) {
+            fprintf(stderr, "Error estimating the store!\n");
+            exit(-1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(start, end);
+}
+
+static void bench_store(const char *name, const struct point_cloud_view_t *view, unsigned short *classes, int dense,
+                        enum class_estimator_t class_estimator) {
+    struct nd_store_t generic, specialized;
+    double generic_time = time_store(view, classes, dense, class_estimator, 0, &generic);
+    double specialized_time = time_store(view, classes, dense, class_estimator, 1, &specialized);
+    report(name, generic_time, specialized_time, same_stores(&generic, &specialized));
+    free_nd_store(&generic);
+    free_nd_store(&specialized);
+}
+
+static double time_edges(const struct nd_store_t *store, enum neighborhood_t neighborhood, int specialized,
+                        struct kl_edge_t **kl_edges, unsigned long *num_kl_edges) {
+    kernels_set_enabled(specialized);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        unsigned long num_valid;
+        if(l > 0)
+            free_kl_edges(*kl_edges);
+        if(calculate_kl_edges(store, neighborhood, &num_valid, kl_edges, num_kl_edges) < 0) {
+            fprintf(stderr, "Error calculating the divergences!\n");
+            exit(-1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(start, end);
+}
+
+static void bench_edges(const char *name, const struct nd_store_t *store, enum neighborhood_t neighborhood) {
+    struct kl_edge_t *generic, *specialized;
+    unsigned long num_generic, num_specialized;
+    double generic_time = time_edges(store, neighborhood, 0, &generic, &num_generic);
+    double specialized_time = time_edges(store, neighborhood, 1, &specialized, &num_specialized);
+    report(name, generic_time, specialized_time,
+            num_generic == num_specialized && memcmp(generic, specialized, num_generic * sizeof(struct kl_edge_t)) == 0);
+    free_kl_edges(generic);
+    free_kl_edges(specialized);
+}
+
+static double time_export(const struct nd_store_t *store, const struct nd_output_t *output, int specialized) {
+    kernels_set_enabled(specialized);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        unsigned long num_points;
+        if(nd_store_export(store, output, &num_points) < 0) {
+            fprintf(stderr, "Error exporting the store!\n");
+            exit(-1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(start, end);
+}
+
+// export to model features, or to a legacy point cloud with classes when "num_labels" is 0 and the layout is full
+static void bench_export(const char *name, const struct nd_store_t *store, enum point_type_t type,
+                        enum covariance_layout_t covariance_layout, unsigned short num_labels, int features) {
+    unsigned long row_len = 12 + num_labels;
+    unsigned long num_bytes = store->num_nds * row_len * point_type_size(type);
+    char *rows[2] = {(char *) malloc(num_bytes), (char *) malloc(num_bytes)};
+    unsigned short *classes[2] = {(unsigned short *) malloc(store->num_nds * sizeof(unsigned short)),
+                                    (unsigned short *) malloc(store->num_nds * sizeof(unsigned short))};
+    if(rows[0] == NULL || rows[1] == NULL || classes[0] == NULL || classes[1] == NULL) {
+        fprintf(stderr, "Error allocating memory for the export!\n");
+        exit(-1);
+    }
+    double times[2];
+    for(int k = 0; k < 2; k++) {
+        memset(rows[k], 0, num_bytes);
+        memset(classes[k], 0, store->num_nds * sizeof(unsigned short));
+        struct nd_output_t output;
+        if(features)
+            nd_output_init_features(&output, type, rows[k], store->num_nds, covariance_layout, num_labels);
+        else
+            nd_output_init(&output, type, rows[k], rows[k] + store->num_nds * 3 * point_type_size(type), classes[k], NULL, 0);
+        times[k] = time_export(store, &output, k);
+    }
+    report(name, times[0], times[1],
+            memcmp(rows[0], rows[1], num_bytes) == 0 && memcmp(classes[0], classes[1], store->num_nds * sizeof(unsigned short)) == 0);
+    for(int k = 0; k < 2; k++) {
+        free(rows[k]);
+        free(classes[k]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    (void)argc;
+    (void)argv;
+
+    srand(0);
+
+    // clustered xyzi points over a 16 m cube, in either type and in separate columns
+    float *points_f32 = (float *) malloc(NUM_POINTS * 4 * sizeof(float));
+    double *points_f64 = (double *) malloc(NUM_POINTS * 3 * sizeof(double));
+    float *columns = (float *) malloc(NUM_POINTS * 3 * sizeof(float));
+    unsigned short *classes = (unsigned short *) malloc(NUM_POINTS * sizeof(unsigned short));
+    if(points_f32 == NULL || points_f64 == NULL || columns == NULL || classes == NULL) {
+        fprintf(stderr, "Error allocating memory for the benchmark!\n");
+        return -1;
+    }
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        unsigned long cluster = (unsigned long) rand() % 4096;
+        for(int k = 0; k < 3; k++) {
+            double center = (double) ((cluster * (k * 7 + 3)) % 61) * VOXEL_SIZE + 0.5;
+            double value = center + ((double) rand() / RAND_MAX - 0.5) * 0.6;
+            points_f32[i*4+k] = (float) value;
+            points_f64[i*3+k] = value;
+            columns[k * NUM_POINTS + i] = (float) value;
+        }
+        points_f32[i*4+3] = (float) rand() / RAND_MAX;
+        classes[i] = (unsigned short) (rand() % 4 == 0 ? (unsigned long) rand() % NUM_CLASSES : cluster % NUM_CLASSES);
+    }
+
+    struct point_cloud_view_t xyz_f64, xyzi_f32, xyz_columns;
+    point_cloud_view_init(&xyz_f64, points_f64, POINT_TYPE_FLOAT64, 3, 0);
+    point_cloud_view_init(&xyzi_f32, points_f32, POINT_TYPE_FLOAT32, 4, 0);
+    point_cloud_view_init_columns(&xyz_columns, columns, columns + NUM_POINTS, columns + 2 * NUM_POINTS, POINT_TYPE_FLOAT32);
+
+    printf("%lu points, %d^3 voxels, %d loops, averages per loop\n", (unsigned long) NUM_POINTS, GRID_LEN, NUM_LOOPS);
+
+    // voxelization: voxel keys and run reduction
+    bench_store("store f64 xyz, histogram", &xyz_f64, classes, 0, CLASS_ESTIMATOR_HISTOGRAM);
+    bench_store("store f32 xyzi, histogram", &xyzi_f32, classes, 0, CLASS_ESTIMATOR_HISTOGRAM);
+    bench_store("store f32 xyzi, streaming majority", &xyzi_f32, classes, 0, CLASS_ESTIMATOR_STREAMING_MAJORITY);
+    bench_store("store f32 xyzi, no classes", &xyzi_f32, NULL, 0, CLASS_ESTIMATOR_HISTOGRAM);
+    bench_store("store f32 columns, histogram", &xyz_columns, classes, 0, CLASS_ESTIMATOR_HISTOGRAM);
+    bench_store("dense store f32 xyzi, histogram", &xyzi_f32, classes, 1, CLASS_ESTIMATOR_HISTOGRAM);
+
+    // divergences and export on the sparse and the dense stores
+    for(int dense = 0; dense < 2; dense++) {
+        struct nd_store_t store;
+        unsigned long num_occupied;
+        if(estimate_nd_store(&xyzi_f32, NUM_POINTS, classes, NUM_CLASSES, VOXEL_SIZE, GRID_LEN, GRID_LEN, GRID_LEN,
+                            0.0, 0.0, 0.0, dense, VOXELIZATION_SORT_REDUCE, CLASS_ESTIMATOR_HISTOGRAM,
+                            &store, &num_occupied, NULL) < 0 || factor_nd_store(&store) < 0) {
+            fprintf(stderr, "Error estimating the store!\n");
+            return -1;
+        }
+        printf("%s store, %lu occupied voxels\n", dense ? "dense" : "sparse", num_occupied);
+
+        bench_edges("divergences, 6 neighbors", &store, NEIGHBORHOOD_FACES);
+        bench_edges("divergences, 18 neighbors", &store, NEIGHBORHOOD_EDGES);
+        bench_edges("divergences, 26 neighbors", &store, NEIGHBORHOOD_CORNERS);
+
+        bench_export("export f32 features, full", &store, POINT_TYPE_FLOAT32, COVARIANCE_FULL, 0, 1);
+        bench_export("export f32 features, upper + labels", &store, POINT_TYPE_FLOAT32, COVARIANCE_UPPER, NUM_CLASSES, 1);
+        bench_export("export f64 features, upper", &store, POINT_TYPE_FLOAT64, COVARIANCE_UPPER, 0, 1);
+        bench_export("export f64 point cloud + classes", &store, POINT_TYPE_FLOAT64, COVARIANCE_FULL, 0, 0);
+
+        free_nd_store(&store);
+    }
+
+    free(points_f32);
+    free(points_f64);
+    free(columns);
+    free(classes);
+
+    return 0;
+}
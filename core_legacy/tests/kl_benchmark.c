@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ndnet_core/kullback_leibler.h>
+
+#define NUM_NDS 4096
+#define NUM_LOOPS 50
+
+static double elapsed(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+
+    (void)argc;
+    (void)argv;
+
+    srand(0);
+
+    // random distributions with symmetric positive definite covariances
+    struct normal_distribution_t *nds = (struct normal_distribution_t *) calloc(NUM_NDS, sizeof(struct normal_distribution_t));
+    double *means = (double *) malloc(NUM_NDS * 3 * sizeof(double));
+    double *covariances = (double *) malloc(NUM_NDS * 9 * sizeof(double));
+    unsigned long *p = (unsigned long *) malloc(NUM_NDS * sizeof(unsigned long));
+    unsigned long *q = (unsigned long *) malloc(NUM_NDS * sizeof(unsigned long));
+    double *divergences = (double *) malloc(NUM_NDS * sizeof(double));
+    if(nds == NULL || means == NULL || covariances == NULL || p == NULL || q == NULL || divergences == NULL) {
+        fprintf(stderr, "Error allocating memory for the benchmark!\n");
+        return -1;
+    }
+    for(unsigned long i = 0; i < NUM_NDS; i++) {
+        double a[9];
+        for(int k = 0; k < 9; k++)
+            a[k] = (double) rand() / RAND_MAX - 0.5;
+        for(int r = 0; r < 3; r++) {
+            nds[i].mean[r] = (double) rand() / RAND_MAX;
+            for(int c = 0; c < 3; c++) {
+                double sum = r == c ? 0.01 : 0.0;
+                for(int k = 0; k < 3; k++)
+                    sum += a[r*3+k] * a[c*3+k];
+                nds[i].covariance[r*3+c] = sum;
+            }
+        }
+        nds[i].num_samples = 10;
+        memcpy(&means[i*3], nds[i].mean, 3 * sizeof(double));
+        memcpy(&covariances[i*9], nds[i].covariance, 9 * sizeof(double));
+        p[i] = i;
+        q[i] = (i + 1) % NUM_NDS;
+    }
+
+    struct timespec start, end;
+    double checksum[4] = {0, 0, 0, 0};
+
+    // GSL path
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        for(unsigned long i = 0; i < NUM_NDS; i++) {
+            double div;
+            kl_divergence_gsl(&nds[p[i]], &nds[q[i]], &div);
+            checksum[0] += div;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double gsl_time = elapsed(start, end);
+
+    // closed form, one pair at a time
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        for(unsigned long i = 0; i < NUM_NDS; i++) {
+            double div;
+            kl_divergence_3x3(&means[p[i]*3], &covariances[p[i]*9], &means[q[i]*3], &covariances[q[i]*9], &div);
+            checksum[1] += div;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double closed_form_time = elapsed(start, end);
+
+    // closed form, batched
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        kl_divergence_batch(means, covariances, p, q, NUM_NDS, divergences);
+        for(unsigned long i = 0; i < NUM_NDS; i++)
+            checksum[2] += divergences[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double batch_time = elapsed(start, end);
+
+    // closed form, batched with the factors cached once per distribution
+    struct nd_store_t store;
+    if(alloc_nd_store(&store, NUM_NDS, false, 0) < 0) {
+        fprintf(stderr, "Error allocating the store!\n");
+        return -1;
+    }
+    memcpy(store.mean, means, NUM_NDS * 3 * sizeof(double));
+    memcpy(store.covariance, covariances, NUM_NDS * 9 * sizeof(double));
+    for(unsigned long i = 0; i < NUM_NDS; i++) {
+        store.num_samples[i] = nds[i].num_samples;
+        store.index[i] = i;
+    }
+    // the factors are computed once per distribution, and shared by the pairs of up to "DIRECTION_LEN" neighbors
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    factor_nd_store(&store);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double factor_time = elapsed(start, end);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned int l = 0; l < NUM_LOOPS; l++) {
+        kl_divergence_batch_factored(store.mean, store.covariance, store.inverse_covariance, store.log_determinant,
+                                    p, q, NUM_NDS, divergences);
+        for(unsigned long i = 0; i < NUM_NDS; i++)
+            checksum[3] += divergences[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double factored_time = elapsed(start, end);
+    free_nd_store(&store);
+
+    unsigned long num_pairs = (unsigned long) NUM_NDS * NUM_LOOPS;
+    printf("GSL:         %8.2f ns/pair (checksum %f)\n", gsl_time / num_pairs * 1e9, checksum[0]);
+    printf("Closed form: %8.2f ns/pair (checksum %f)\n", closed_form_time / num_pairs * 1e9, checksum[1]);
+    printf("Batched:     %8.2f ns/pair (checksum %f)\n", batch_time / num_pairs * 1e9, checksum[2]);
+    printf("Factored:    %8.2f ns/pair (checksum %f), after %.2f ns/distribution of factoring\n",
+            factored_time / num_pairs * 1e9, checksum[3], factor_time / NUM_NDS * 1e9);
+
+    free(nds);
+    free(means);
+    free(covariances);
+    free(p);
+    free(q);
+    free(divergences);
+
+    return 0;
+}
@@ -40,9 +40,10 @@ int main(int argc, char *argv[]) {
         double offset_x, offset_y, offset_z;
         double voxel_size;
         struct normal_distribution_t *nd_array = NULL;
+        unsigned long num_nds;
         unsigned long num_valid_nds;
-        struct kl_divergence_t *kl_divergences;
-        unsigned long num_kl_divergences;
+        struct kl_edge_t *kl_edges;
+        unsigned long num_kl_edges;
         
         if(ndt_downsample(pointcloud, POINT_DIM, NUM_POINTS,
                         &len_x, &len_y, &len_z,
@@ -53,15 +54,15 @@ int main(int argc, char *argv[]) {
                         downsampled, &num_downsampled_points,
                         covariances,
                         NULL,
-                        &nd_array, &num_valid_nds,
-                        &kl_divergences, &num_kl_divergences) < 0) {
+                        &nd_array, &num_nds, &num_valid_nds,
+                        &kl_edges, &num_kl_edges) < 0) {
             fprintf(stderr, "Error downsampling the point cloud!\n");
             return -1;
         }
 
         // free the normal distributions
-        free_nds(nd_array, len_x * len_y * len_z);
-        free_kl_divergences(kl_divergences);
+        free_nds(nd_array, num_nds);
+        free_kl_edges(kl_edges);
     }
 
     return 0;
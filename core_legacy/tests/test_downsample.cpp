@@ -0,0 +1,339 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/ndt.h>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#define NUM_POINTS 30000
+#define NUM_DESIRED_POINTS 600
+#define NUM_FRAMES 8
+
+// points on a ground plane and two walls, moved a little every frame like consecutive sweeps
+static void sweep(std::vector<double> &point_cloud, int frame) {
+    srand(frame + 1);
+    point_cloud.resize(NUM_POINTS * 3);
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        double u = (double) rand() / RAND_MAX * 40.0;
+        double v = (double) rand() / RAND_MAX * 4.0;
+        double noise = ((double) rand() / RAND_MAX - 0.5) * 0.05;
+        double *point = &point_cloud[i*3];
+        if(i % 3 == 0) {
+            point[0] = u + 0.3 * frame; point[1] = v * 5.0; point[2] = noise;
+        } else if(i % 3 == 1) {
+            point[0] = u + 0.3 * frame; point[1] = noise; point[2] = v;
+        } else {
+            point[0] = 0.3 * frame + noise; point[1] = u * 0.5; point[2] = v;
+        }
+    }
+}
+
+static int downsample(const std::vector<double> &point_cloud, struct voxel_size_solver_t *solver, unsigned long *num_downsampled_points) {
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    std::vector<double> downsampled(NUM_DESIRED_POINTS * 3), covariances(NUM_DESIRED_POINTS * 9);
+    unsigned int len_x, len_y, len_z;
+    double offset_x, offset_y, offset_z, voxel_size;
+    unsigned long num_nds, num_valid_nds, num_kl_divergences;
+    return ndt_downsample_view(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                NULL, 0, NUM_DESIRED_POINTS, POINT_TYPE_FLOAT64,
+                                downsampled.data(), num_downsampled_points, covariances.data(), NULL, NULL,
+                                solver, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences);
+}
+
+TEST(DownsampleTests, WarmSolverConvergesQuickly) {
+    struct voxel_size_solver_t solver;
+    voxel_size_solver_init(&solver);
+
+    std::vector<double> point_cloud;
+    unsigned int warm_evaluations = 0;
+    for(int frame = 0; frame < NUM_FRAMES; frame++) {
+        sweep(point_cloud, frame);
+        unsigned long num_downsampled_points;
+        ASSERT_EQ(downsample(point_cloud, &solver, &num_downsampled_points), 0);
+        EXPECT_EQ(num_downsampled_points, NUM_DESIRED_POINTS);
+        EXPECT_TRUE(solver.warm);
+        if(frame > 0)
+            warm_evaluations += solver.num_evaluations;
+    }
+
+    // consecutive frames start next to the solution
+    EXPECT_LE(warm_evaluations, 2 * (NUM_FRAMES - 1));
+}
+
+TEST(DownsampleTests, SolverMatchesBisection) {
+    std::vector<double> point_cloud;
+    sweep(point_cloud, 0);
+
+    unsigned long num_bisection, num_solver;
+    struct voxel_size_solver_t solver;
+    voxel_size_solver_init(&solver);
+    ASSERT_EQ(downsample(point_cloud, NULL, &num_bisection), 0);
+    ASSERT_EQ(downsample(point_cloud, &solver, &num_solver), 0);
+    EXPECT_EQ(num_solver, num_bisection);
+}
+
+TEST(DownsampleTests, OutputFillsBatchRows) {
+    std::vector<double> point_cloud;
+    sweep(point_cloud, 0);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    unsigned int len_x, len_y, len_z;
+    double offset_x, offset_y, offset_z, voxel_size;
+    unsigned long num_points, num_nds, num_valid_nds, num_kl_divergences;
+    ASSERT_EQ(thread_pool_init(4), 0);
+
+    // reference in separate contiguous arrays
+    std::vector<float> points(NUM_DESIRED_POINTS * 3), covariances(NUM_DESIRED_POINTS * 9);
+    ASSERT_EQ(ndt_downsample_view(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                NULL, 0, NUM_DESIRED_POINTS, POINT_TYPE_FLOAT32,
+                                points.data(), &num_points, covariances.data(), NULL, NULL,
+                                NULL, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), 0);
+    ASSERT_EQ(num_points, (unsigned long) NUM_DESIRED_POINTS);
+
+    // the second sample of a (3, N, 12) batch, with the covariance after the mean of each row
+    const float sentinel = -7.0f;
+    std::vector<float> batch(3 * NUM_DESIRED_POINTS * 12, sentinel);
+    struct nd_output_t output = {};
+    output.type = POINT_TYPE_FLOAT32;
+    output.points = batch.data();
+    output.point_stride = 12 * sizeof(float);
+    output.covariances = batch.data() + 3;
+    output.covariance_stride = 12 * sizeof(float);
+    output.first_row = NUM_DESIRED_POINTS;
+    output.num_rows = NUM_DESIRED_POINTS;
+    ASSERT_EQ(ndt_downsample_output(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                NULL, 0, NUM_DESIRED_POINTS, &output, &num_points,
+                                NULL, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), 0);
+    ASSERT_EQ(num_points, (unsigned long) NUM_DESIRED_POINTS);
+    for(unsigned long r = 0; r < 3 * NUM_DESIRED_POINTS; r++) {
+        const float *row = &batch[r * 12];
+        bool written = r >= NUM_DESIRED_POINTS && r < 2 * NUM_DESIRED_POINTS;
+        for(int k = 0; k < 12; k++) {
+            unsigned long n = r - NUM_DESIRED_POINTS;
+            float expected = !written ? sentinel : (k < 3 ? points[n * 3 + k] : covariances[n * 9 + k - 3]);
+            ASSERT_EQ(row[k], expected);
+        }
+    }
+
+    // the desired points must fit the rows of the output
+    output.num_rows = NUM_DESIRED_POINTS - 1;
+    EXPECT_LT(ndt_downsample_output(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                NULL, 0, NUM_DESIRED_POINTS, &output, &num_points,
+                                NULL, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), 0);
+
+    thread_pool_destroy();
+}
+
+TEST(DownsampleTests, FeaturesArePackedAndPadded) {
+    // two distributions with samples around an empty one. the second has a non-finite variance
+    struct normal_distribution_t nds[3] = {};
+    for(int i = 0; i < 3; i++) {
+        for(int k = 0; k < 3; k++)
+            nds[i].mean[k] = i + 0.1 * k;
+        for(int k = 0; k < 9; k++)
+            nds[i].covariance[k] = 10 * i + k;
+        nds[i].num_samples = i == 1 ? 0 : 5;
+        nds[i].class_ = i;
+    }
+    nds[2].covariance[4] = NAN;
+    ASSERT_EQ(thread_pool_init(2), 0);
+
+    // 3 + 6 covariance + 3 labels, with room for two padding rows
+    const unsigned long num_rows = 4;
+    std::vector<float> features(num_rows * 12, -7.0f);
+    struct nd_output_t output;
+    ASSERT_EQ(nd_output_init_features(&output, POINT_TYPE_FLOAT32, features.data(), num_rows, COVARIANCE_UPPER, 3), 12ul);
+    unsigned long num_written;
+    ASSERT_EQ(nds_export(nds, 3, &output, &num_written), 0);
+    ASSERT_EQ(num_written, 2ul);
+    const int upper[6] = {0, 1, 2, 4, 5, 8};
+    for(unsigned long r = 0; r < 2; r++) {
+        const struct normal_distribution_t &nd = nds[2 * r];
+        const float *row = &features[r * 12];
+        for(int k = 0; k < 3; k++)
+            EXPECT_EQ(row[k], (float) nd.mean[k]);
+        for(int k = 0; k < 6; k++)
+            EXPECT_EQ(row[3 + k], std::isfinite(nd.covariance[upper[k]]) ? (float) nd.covariance[upper[k]] : 0.0f);
+        for(int k = 0; k < 3; k++)
+            EXPECT_EQ(row[9 + k], k == nd.class_ ? 1.0f : 0.0f);
+    }
+    for(unsigned long k = 2 * 12; k < num_rows * 12; k++)
+        EXPECT_EQ(features[k], 0.0f);
+
+    // repeated padding cycles through the written rows
+    output.padding = PADDING_REPEAT;
+    ASSERT_EQ(nds_export(nds, 3, &output, &num_written), 0);
+    for(unsigned long r = 2; r < num_rows; r++)
+        for(int k = 0; k < 12; k++)
+            EXPECT_EQ(features[r * 12 + k], features[(r % 2) * 12 + k]);
+
+    thread_pool_destroy();
+}
+
+TEST(DownsampleTests, ContextReusesMemory) {
+    struct ndt_context_t *context = ndt_context_create(NULL, 0);
+    ASSERT_NE(context, nullptr);
+    struct voxel_size_solver_t solver;
+    voxel_size_solver_init(&solver);
+
+    std::vector<double> point_cloud;
+    std::vector<float> expected(NUM_DESIRED_POINTS * 12), features(NUM_DESIRED_POINTS * 12);
+    unsigned long num_allocations = 0;
+    for(int frame = 0; frame < NUM_FRAMES; frame++) {
+        sweep(point_cloud, frame);
+        struct point_cloud_view_t view;
+        point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+        unsigned int len_x, len_y, len_z;
+        double offset_x, offset_y, offset_z, voxel_size;
+        unsigned long num_expected, num_points, num_nds, num_valid_nds, num_kl_divergences;
+
+        // the same frames downsampled on the heap
+        struct nd_output_t output;
+        nd_output_init_features(&output, POINT_TYPE_FLOAT32, expected.data(), NUM_DESIRED_POINTS, COVARIANCE_FULL, 0);
+        ASSERT_EQ(ndt_downsample_output(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                    NULL, 0, NUM_DESIRED_POINTS, &output, &num_expected,
+                                    &solver, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), 0);
+
+        nd_output_init_features(&output, POINT_TYPE_FLOAT32, features.data(), NUM_DESIRED_POINTS, COVARIANCE_FULL, 0);
+        ASSERT_EQ(ndt_context_downsample(context, &view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                    NULL, 0, NUM_DESIRED_POINTS, &output, &num_points), 0);
+        ASSERT_EQ(num_points, num_expected);
+        EXPECT_EQ(features, expected);
+
+        // the memory fits every frame after the first ones
+        unsigned long capacity, frame_allocations;
+        ndt_context_memory(context, &capacity, &frame_allocations);
+        if(frame >= 2) {
+            EXPECT_EQ(frame_allocations, num_allocations);
+        }
+        num_allocations = frame_allocations;
+    }
+
+    // trimming only releases the memory
+    ndt_context_trim(context);
+    unsigned long capacity;
+    ndt_context_memory(context, &capacity, &num_allocations);
+    EXPECT_EQ(capacity, 0ul);
+
+    ndt_context_destroy(context);
+}
+
+TEST(DownsampleTests, BatchMatchesSingleClouds) {
+    ASSERT_EQ(thread_pool_init(4), 0);
+    struct ndt_context_t *context = ndt_context_create(NULL, 0);
+    ASSERT_NE(context, nullptr);
+
+    // clouds of every size packed one after the other. the biggest one is split across the pool
+    const unsigned long num_clouds = 6;
+    std::vector<std::vector<double>> clouds(num_clouds);
+    std::vector<double> batch;
+    std::vector<unsigned long> cloud_offsets(1, 0), num_desired_points, row_offsets(1, 0);
+    for(unsigned long b = 0; b < num_clouds; b++) {
+        sweep(clouds[b], b);
+        clouds[b].resize((NUM_POINTS - b * 5000) * 3);
+        batch.insert(batch.end(), clouds[b].begin(), clouds[b].end());
+        cloud_offsets.push_back(batch.size() / 3);
+        num_desired_points.push_back(NUM_DESIRED_POINTS - b * 100);
+        row_offsets.push_back(row_offsets.back() + num_desired_points.back());
+    }
+
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, batch.data(), POINT_TYPE_FLOAT64, 3, 0);
+    std::vector<float> features(row_offsets.back() * 12);
+    struct nd_output_t output;
+    nd_output_init_features(&output, POINT_TYPE_FLOAT32, features.data(), row_offsets.back(), COVARIANCE_FULL, 0);
+    std::vector<unsigned long> num_downsampled_points(num_clouds);
+    ASSERT_EQ(ndt_context_downsample_batch(context, &view, cloud_offsets.data(), num_clouds, NULL, 0,
+                                        num_desired_points.data(), &output, num_downsampled_points.data(), NULL), 0);
+
+    // every cloud gets the rows it would get on its own
+    for(unsigned long b = 0; b < num_clouds; b++) {
+        struct voxel_size_solver_t solver;
+        voxel_size_solver_init(&solver);
+        struct point_cloud_view_t cloud_view;
+        point_cloud_view_init(&cloud_view, clouds[b].data(), POINT_TYPE_FLOAT64, 3, 0);
+        std::vector<float> expected(num_desired_points[b] * 12);
+        nd_output_init_features(&output, POINT_TYPE_FLOAT32, expected.data(), num_desired_points[b], COVARIANCE_FULL, 0);
+        unsigned int len_x, len_y, len_z;
+        double offset_x, offset_y, offset_z, voxel_size;
+        unsigned long num_expected, num_nds, num_valid_nds, num_kl_divergences;
+        ASSERT_EQ(ndt_downsample_output(&cloud_view, clouds[b].size() / 3, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                    NULL, 0, num_desired_points[b], &output, &num_expected,
+                                    &solver, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), 0);
+        EXPECT_EQ(num_downsampled_points[b], num_expected);
+        EXPECT_EQ(std::vector<float>(features.begin() + row_offsets[b] * 12, features.begin() + row_offsets[b+1] * 12), expected);
+    }
+
+    ndt_context_destroy(context);
+    thread_pool_destroy();
+}
+
+TEST(DownsampleTests, UnreachableOccupancyFails) {
+    std::vector<double> point_cloud;
+    sweep(point_cloud, 0);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    struct ndt_config_t config;
+    ndt_get_config(&config);
+    struct ndt_config_t search_config = config;
+
+    // more distributions than points, which no voxel size reaches, in both voxel searches
+    const unsigned long num_desired_points = NUM_POINTS + 1;
+    std::vector<float> features(num_desired_points * 12);
+    enum voxel_search_t searches[2] = {VOXEL_SEARCH_COUNT, VOXEL_SEARCH_FULL};
+    for(int s = 0; s < 2; s++) {
+        search_config.voxel_search = searches[s];
+        ndt_set_config(&search_config);
+        struct nd_output_t output;
+        nd_output_init_features(&output, POINT_TYPE_FLOAT32, features.data(), num_desired_points, COVARIANCE_FULL, 0);
+        unsigned int len_x, len_y, len_z;
+        double offset_x, offset_y, offset_z, voxel_size;
+        unsigned long num_points, num_nds, num_valid_nds, num_kl_divergences;
+        EXPECT_EQ(ndt_downsample_output(&view, NUM_POINTS, &len_x, &len_y, &len_z, &offset_x, &offset_y, &offset_z, &voxel_size,
+                                    NULL, 0, num_desired_points, &output, &num_points,
+                                    NULL, NULL, &num_nds, &num_valid_nds, NULL, &num_kl_divergences), -3);
+    }
+
+    ndt_set_config(&config);
+}
+
+TEST(DownsampleTests, FailedCloudOnlyPadsItsRows) {
+    struct ndt_context_t *context = ndt_context_create(NULL, 0);
+    ASSERT_NE(context, nullptr);
+
+    // the second cloud has less points than its desired distributions
+    std::vector<double> batch, cloud;
+    sweep(cloud, 0);
+    batch.insert(batch.end(), cloud.begin(), cloud.end());
+    batch.insert(batch.end(), cloud.begin(), cloud.begin() + 100 * 3);
+    sweep(cloud, 1);
+    batch.insert(batch.end(), cloud.begin(), cloud.end());
+    std::vector<unsigned long> cloud_offsets = {0, NUM_POINTS, NUM_POINTS + 100, 2 * NUM_POINTS + 100};
+    std::vector<unsigned long> num_desired_points(3, NUM_DESIRED_POINTS);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, batch.data(), POINT_TYPE_FLOAT64, 3, 0);
+
+    std::vector<float> features(3 * NUM_DESIRED_POINTS * 12, -1.0f), expected(features.size(), -1.0f);
+    struct nd_output_t output;
+    std::vector<unsigned long> num_downsampled_points(3);
+    std::vector<int> statuses(3);
+    nd_output_init_features(&output, POINT_TYPE_FLOAT32, features.data(), features.size() / 12, COVARIANCE_FULL, 0);
+    ASSERT_EQ(ndt_context_downsample_batch(context, &view, cloud_offsets.data(), 3, NULL, 0,
+                                        num_desired_points.data(), &output, num_downsampled_points.data(), statuses.data()), 0);
+    EXPECT_EQ(statuses, std::vector<int>({0, -3, 0}));
+    EXPECT_EQ(num_downsampled_points[1], 0UL);
+
+    // the other clouds are written, and the failed one is padded
+    std::vector<unsigned long> expected_points(3);
+    nd_output_init_features(&output, POINT_TYPE_FLOAT32, expected.data(), expected.size() / 12, COVARIANCE_FULL, 0);
+    EXPECT_EQ(ndt_context_downsample_batch(context, &view, cloud_offsets.data(), 3, NULL, 0,
+                                        num_desired_points.data(), &output, expected_points.data(), NULL), -4);
+    EXPECT_EQ(expected_points, num_downsampled_points);
+    EXPECT_EQ(num_downsampled_points[0], (unsigned long) NUM_DESIRED_POINTS);
+    EXPECT_EQ(num_downsampled_points[2], (unsigned long) NUM_DESIRED_POINTS);
+    EXPECT_EQ(features, expected);
+    for(unsigned long i = NUM_DESIRED_POINTS * 12; i < 2 * NUM_DESIRED_POINTS * 12; i++)
+        ASSERT_EQ(features[i], 0.0f);
+
+    ndt_context_destroy(context);
+}
@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/kernels.hpp>
+#include <ndnet_core/kullback_leibler.h>
+#include <ndnet_core/ndt.h>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define NUM_POINTS 6000
+#define NUM_CLASSES 5
+
+// float32 xyzi points spread over most of the grid, so the voxels hold several samples and have occupied neighbors
+static void random_cloud_f32(std::vector<float> &point_cloud, std::vector<unsigned short> &classes) {
+    srand(23);
+    point_cloud.resize(NUM_POINTS * 4);
+    classes.resize(NUM_POINTS);
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        for(int k = 0; k < 4; k++) {
+            point_cloud[i*4+k] = (float) rand() / RAND_MAX * (k < 3 ? 3.6f : 1.0f);
+        }
+        unsigned short region = (unsigned short) (point_cloud[i*4] / 0.9f);
+        classes[i] = (unsigned short) (rand() % 3 == 0 ? rand() % NUM_CLASSES : region % NUM_CLASSES);
+    }
+}
+
+static void estimate(const struct point_cloud_view_t *view, std::vector<unsigned short> &classes, bool dense,
+                    enum class_estimator_t class_estimator, bool specialized, struct nd_store_t *store) {
+    kernels_set_enabled(specialized);
+    unsigned long num_occupied;
+    ASSERT_EQ(estimate_nd_store(view, NUM_POINTS, classes.empty() ? NULL : classes.data(), NUM_CLASSES, 0.45,
+                                9, 9, 9, 0.0, 0.0, 0.0, dense, VOXELIZATION_SORT_REDUCE, class_estimator,
+                                store, &num_occupied, NULL), 0);
+    kernels_set_enabled(true);
+}
+
+static void expect_same_store(const struct nd_store_t *a, const struct nd_store_t *b) {
+    ASSERT_EQ(a->num_nds, b->num_nds);
+    EXPECT_EQ(memcmp(a->index, b->index, a->num_nds * sizeof(a->index[0])), 0);
+    EXPECT_EQ(memcmp(a->num_samples, b->num_samples, a->num_nds * sizeof(a->num_samples[0])), 0);
+    EXPECT_EQ(memcmp(a->mean, b->mean, a->num_nds * 3 * sizeof(double)), 0);
+    EXPECT_EQ(memcmp(a->covariance, b->covariance, a->num_nds * 9 * sizeof(double)), 0);
+    ASSERT_EQ(a->classes == NULL, b->classes == NULL);
+    if(a->classes != NULL) {
+        EXPECT_EQ(memcmp(a->classes, b->classes, a->num_nds * sizeof(unsigned short)), 0);
+    }
+}
+
+TEST(KernelsTests, StencilMatchesVoxelStencil) {
+    for(int s = 0; s < NEIGHBORHOOD_MAX_LEN; s++) {
+        EXPECT_EQ(ndnet::kernels::stencil_offsets[s][0], neighbor_stencil[s].x);
+        EXPECT_EQ(ndnet::kernels::stencil_offsets[s][1], neighbor_stencil[s].y);
+        EXPECT_EQ(ndnet::kernels::stencil_offsets[s][2], neighbor_stencil[s].z);
+    }
+}
+
+TEST(KernelsTests, StoresMatchGenericLoops) {
+    std::vector<float> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud_f32(point_cloud, classes);
+
+    // interleaved xyzi points and separate columns of the same coordinates
+    std::vector<float> x(NUM_POINTS), y(NUM_POINTS), z(NUM_POINTS);
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        x[i] = point_cloud[i*4];
+        y[i] = point_cloud[i*4+1];
+        z[i] = point_cloud[i*4+2];
+    }
+    struct point_cloud_view_t views[2];
+    point_cloud_view_init(&views[0], point_cloud.data(), POINT_TYPE_FLOAT32, 4, 0);
+    point_cloud_view_init_columns(&views[1], x.data(), y.data(), z.data(), POINT_TYPE_FLOAT32);
+
+    std::vector<unsigned short> no_classes;
+    enum class_estimator_t estimators[2] = {CLASS_ESTIMATOR_HISTOGRAM, CLASS_ESTIMATOR_STREAMING_MAJORITY};
+    for(int v = 0; v < 2; v++) {
+        for(int d = 0; d < 2; d++) {
+            for(int c = 0; c < 3; c++) {
+                struct nd_store_t generic, specialized;
+                std::vector<unsigned short> &labels = c == 2 ? no_classes : classes;
+                estimate(&views[v], labels, d == 1, estimators[c % 2], false, &generic);
+                estimate(&views[v], labels, d == 1, estimators[c % 2], true, &specialized);
+                expect_same_store(&generic, &specialized);
+                free_nd_store(&generic);
+                free_nd_store(&specialized);
+            }
+        }
+    }
+}
+
+TEST(KernelsTests, EdgesAndExportMatchGenericLoops) {
+    std::vector<float> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud_f32(point_cloud, classes);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT32, 4, 0);
+
+    enum neighborhood_t neighborhoods[3] = {NEIGHBORHOOD_FACES, NEIGHBORHOOD_EDGES, NEIGHBORHOOD_CORNERS};
+    for(int d = 0; d < 2; d++) {
+        struct nd_store_t store;
+        estimate(&view, classes, d == 1, CLASS_ESTIMATOR_HISTOGRAM, true, &store);
+        ASSERT_EQ(factor_nd_store(&store), 0);
+
+        for(int n = 0; n < 3; n++) {
+            struct kl_edge_t *edges[2];
+            unsigned long num_valid[2], num_edges[2];
+            for(int k = 0; k < 2; k++) {
+                kernels_set_enabled(k == 1);
+                ASSERT_EQ(calculate_kl_edges(&store, neighborhoods[n], &num_valid[k], &edges[k], &num_edges[k]), 0);
+            }
+            kernels_set_enabled(true);
+            EXPECT_GT(num_edges[0], 0UL);
+            ASSERT_EQ(num_edges[0], num_edges[1]);
+            EXPECT_EQ(num_valid[0], num_valid[1]);
+            EXPECT_EQ(memcmp(edges[0], edges[1], num_edges[0] * sizeof(struct kl_edge_t)), 0);
+            free_kl_edges(edges[0]);
+            free_kl_edges(edges[1]);
+        }
+
+        // model features in either covariance layout, with and without labels, and legacy point clouds
+        for(int f = 0; f < 5; f++) {
+            std::vector<float> rows[2];
+            std::vector<unsigned short> row_classes[2];
+            unsigned long num_points[2];
+            for(int k = 0; k < 2; k++) {
+                struct nd_output_t output;
+                if(f < 4) {
+                    rows[k].assign(store.num_nds * (12 + NUM_CLASSES), -1.0f);
+                    nd_output_init_features(&output, POINT_TYPE_FLOAT32, rows[k].data(), store.num_nds,
+                                            f % 2 ? COVARIANCE_UPPER : COVARIANCE_FULL, f / 2 ? NUM_CLASSES : 0);
+                } else {
+                    rows[k].assign(store.num_nds * 12, -1.0f);
+                    row_classes[k].assign(store.num_nds, 0xFFFF);
+                    nd_output_init(&output, POINT_TYPE_FLOAT32, rows[k].data(), rows[k].data() + store.num_nds * 3,
+                                    row_classes[k].data(), NULL, 0);
+                }
+                kernels_set_enabled(k == 1);
+                ASSERT_EQ(nd_store_export(&store, &output, &num_points[k]), 0);
+            }
+            kernels_set_enabled(true);
+            EXPECT_EQ(num_points[0], num_points[1]);
+            EXPECT_EQ(memcmp(rows[0].data(), rows[1].data(), rows[0].size() * sizeof(float)), 0);
+            EXPECT_EQ(row_classes[0], row_classes[1]);
+        }
+        free_nd_store(&store);
+    }
+}
@@ -0,0 +1,299 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/kullback_leibler.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// random distribution with a symmetric positive definite covariance (a * a' + diagonal)
+static void random_nd(struct normal_distribution_t *nd) {
+    memset(nd, 0, sizeof(*nd));
+    double a[9];
+    for(int i = 0; i < 9; i++) {
+        a[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    for(int r = 0; r < 3; r++) {
+        nd->mean[r] = (double) rand() / RAND_MAX * 4.0;
+        for(int c = 0; c < 3; c++) {
+            double sum = r == c ? 0.01 : 0.0;
+            for(int k = 0; k < 3; k++) {
+                sum += a[r*3+k] * a[c*3+k];
+            }
+            nd->covariance[r*3+c] = sum;
+        }
+    }
+    nd->num_samples = 10;
+}
+
+TEST(KullbackLeiblerTests, ClosedFormMatchesGSL) {
+    srand(11);
+
+    const unsigned long num_nds = 200;
+    std::vector<struct normal_distribution_t> nds(num_nds);
+    std::vector<double> means(num_nds * 3), covariances(num_nds * 9);
+    for(unsigned long i = 0; i < num_nds; i++) {
+        random_nd(&nds[i]);
+        memcpy(&means[i*3], nds[i].mean, 3 * sizeof(double));
+        memcpy(&covariances[i*9], nds[i].covariance, 9 * sizeof(double));
+    }
+
+    // pair each distribution with the next one, and the first with itself
+    std::vector<unsigned long> p(num_nds), q(num_nds);
+    for(unsigned long i = 0; i < num_nds; i++) {
+        p[i] = i;
+        q[i] = i == 0 ? 0 : (i + 1) % num_nds;
+    }
+    std::vector<double> batch(num_nds);
+    kl_divergence_batch(means.data(), covariances.data(), p.data(), q.data(), num_nds, batch.data());
+
+    for(unsigned long i = 0; i < num_nds; i++) {
+        double reference, closed_form;
+        ASSERT_EQ(kl_divergence_gsl(&nds[p[i]], &nds[q[i]], &reference), 0);
+        ASSERT_EQ(kl_divergence(&nds[p[i]], &nds[q[i]], &closed_form), 0);
+        EXPECT_NEAR(closed_form, reference, 1e-9 * (1.0 + fabs(reference)));
+        EXPECT_NEAR(batch[i], reference, 1e-9 * (1.0 + fabs(reference)));
+        EXPECT_GE(closed_form, -1e-9);
+    }
+    EXPECT_NEAR(batch[0], 0.0, 1e-12);
+
+    // the inputs are left untouched
+    for(unsigned long i = 0; i < num_nds; i++) {
+        ASSERT_EQ(memcmp(&covariances[i*9], nds[i].covariance, 9 * sizeof(double)), 0);
+    }
+}
+
+TEST(KullbackLeiblerTests, KnownValueAndSingular) {
+    // p = N(0, I), q = N((1, 0, 0), 2I): 0.5 * (3/2 + 1/2 - 3 + 3 ln 2)
+    double p_mean[3] = {0, 0, 0};
+    double q_mean[3] = {1, 0, 0};
+    double p_cov[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    double q_cov[9] = {2, 0, 0, 0, 2, 0, 0, 0, 2};
+    double div;
+    ASSERT_EQ(kl_divergence_3x3(p_mean, p_cov, q_mean, q_cov, &div), 0);
+    EXPECT_NEAR(div, 0.5 * (-1.0 + 3.0 * log(2.0)), 1e-12);
+
+    // a planar distribution has a singular covariance
+    double planar[9] = {1, 0, 0, 0, 1, 0, 0, 0, 0};
+    EXPECT_EQ(kl_divergence_3x3(p_mean, p_cov, q_mean, planar, &div), -2);
+    EXPECT_EQ(kl_divergence_3x3(p_mean, planar, q_mean, q_cov, &div), -2);
+
+    double means[6] = {0, 0, 0, 1, 0, 0};
+    double covariances[18];
+    memcpy(covariances, p_cov, sizeof(p_cov));
+    memcpy(&covariances[9], planar, sizeof(planar));
+    unsigned long p[2] = {0, 1}, q[2] = {0, 0};
+    double divergences[2];
+    kl_divergence_batch(means, covariances, p, q, 2, divergences);
+    EXPECT_NEAR(divergences[0], 0.0, 1e-12);
+    EXPECT_TRUE(std::isnan(divergences[1]));
+}
+
+TEST(KullbackLeiblerTests, FactoredStoreMatchesClosedForm) {
+    srand(12);
+
+    const unsigned long num_nds = 100;
+    struct nd_store_t store;
+    ASSERT_EQ(alloc_nd_store(&store, num_nds, false, 0), 0);
+    for(unsigned long i = 0; i < num_nds; i++) {
+        struct normal_distribution_t nd;
+        random_nd(&nd);
+        memcpy(&store.mean[i*3], nd.mean, 3 * sizeof(double));
+        memcpy(&store.covariance[i*9], nd.covariance, 9 * sizeof(double));
+        store.num_samples[i] = nd.num_samples;
+        store.index[i] = i;
+    }
+    // a planar distribution and a distribution with a single sample are not invertible
+    memset(&store.covariance[3*9+6], 0, 3 * sizeof(double));
+    memset(&store.covariance[3*9+2], 0, sizeof(double));
+    memset(&store.covariance[3*9+5], 0, sizeof(double));
+    store.num_samples[4] = 1;
+
+    ASSERT_EQ(factor_nd_store(&store), 0);
+    EXPECT_FALSE(store.invertible[3]);
+    EXPECT_FALSE(store.invertible[4]);
+
+    std::vector<unsigned long> p, q;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        if(!store.invertible[i] || !store.invertible[(i + 7) % num_nds])
+            continue;
+        p.push_back(i);
+        q.push_back((i + 7) % num_nds);
+    }
+    EXPECT_EQ(p.size(), num_nds - 4);
+    std::vector<double> divergences(p.size());
+    kl_divergence_batch_factored(store.mean, store.covariance, store.inverse_covariance, store.log_determinant,
+                                p.data(), q.data(), p.size(), divergences.data());
+    for(unsigned long k = 0; k < p.size(); k++) {
+        double expected;
+        ASSERT_EQ(kl_divergence_3x3(&store.mean[p[k]*3], &store.covariance[p[k]*9],
+                                    &store.mean[q[k]*3], &store.covariance[q[k]*9], &expected), 0);
+        EXPECT_NEAR(divergences[k], expected, 1e-9 * (1.0 + fabs(expected)));
+    }
+
+    // both directions at once match the two directions evaluated separately
+    std::vector<double> reversed(p.size()), divergences_pq(p.size()), divergences_qp(p.size());
+    kl_divergence_batch_factored(store.mean, store.covariance, store.inverse_covariance, store.log_determinant,
+                                q.data(), p.data(), p.size(), reversed.data());
+    kl_divergence_batch_symmetric(store.mean, store.covariance, store.inverse_covariance, store.log_determinant,
+                                p.data(), q.data(), p.size(), divergences_pq.data(), divergences_qp.data());
+    for(unsigned long k = 0; k < p.size(); k++) {
+        EXPECT_EQ(divergences_pq[k], divergences[k]);
+        EXPECT_EQ(divergences_qp[k], reversed[k]);
+    }
+
+    free_nd_store(&store);
+}
+
+TEST(KullbackLeiblerTests, RankingIsDeterministic) {
+    srand(13);
+
+    // dense 12x10x9 grid with empty, singular and single sample voxels. single samples tie at a null divergence
+    const unsigned int len_x = 12, len_y = 10, len_z = 9;
+    const unsigned long num_nds = len_x * len_y * len_z;
+    struct nd_store_t store;
+    ASSERT_EQ(alloc_nd_store(&store, num_nds, false, 0), 0);
+    store.dense = true;
+    store.len_x = len_x;
+    store.len_y = len_y;
+    store.len_z = len_z;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        struct normal_distribution_t nd;
+        random_nd(&nd);
+        if(i % 5 == 0)
+            nd = (struct normal_distribution_t) {};
+        memcpy(&store.mean[i*3], nd.mean, 3 * sizeof(double));
+        memcpy(&store.covariance[i*9], nd.covariance, 9 * sizeof(double));
+        store.num_samples[i] = i % 37 == 0 ? 0 : (i % 11 == 0 ? 1 : 10);
+        store.index[i] = i;
+    }
+    ASSERT_EQ(factor_nd_store(&store), 0);
+
+    struct kl_edge_t *reference, *edges;
+    unsigned long num_valid, num_edges, reference_valid, reference_edges;
+    ASSERT_EQ(thread_pool_init(1), 0);
+    ASSERT_EQ(calculate_kl_edges(&store, NEIGHBORHOOD_FACES, &reference_valid, &reference, &reference_edges), 0);
+    ASSERT_GT(reference_edges, 0u);
+    EXPECT_LT(reference_edges, num_nds * DIRECTION_LEN);
+    EXPECT_EQ(reference[reference_edges-1].divergence, 0.0);
+
+    // largest divergence first, ties in entry and direction order
+    for(unsigned long j = 1; j < reference_edges; j++) {
+        ASSERT_GE(reference[j-1].divergence, reference[j].divergence);
+        if(reference[j-1].divergence == reference[j].divergence) {
+            ASSERT_LE(reference[j-1].p, reference[j].p);
+        }
+    }
+
+    for(unsigned int num_workers : {2u, 5u, 16u}) {
+        ASSERT_EQ(thread_pool_init(num_workers), 0);
+        ASSERT_EQ(calculate_kl_edges(&store, NEIGHBORHOOD_FACES, &num_valid, &edges, &num_edges), 0);
+        EXPECT_EQ(num_valid, reference_valid);
+        ASSERT_EQ(num_edges, reference_edges);
+        for(unsigned long j = 0; j < num_edges; j++) {
+            ASSERT_EQ(edges[j].divergence, reference[j].divergence);
+            ASSERT_EQ(edges[j].p, reference[j].p);
+            ASSERT_EQ(edges[j].q, reference[j].q);
+        }
+        free_kl_edges(edges);
+    }
+
+    free_kl_edges(reference);
+    thread_pool_destroy();
+    free_nd_store(&store);
+}
+
+TEST(KullbackLeiblerTests, NeighborhoodStencils) {
+    srand(18);
+
+    // each even offset is followed by its opposite, and leads to a larger voxel index
+    for(int s = 0; s < NEIGHBORHOOD_MAX_LEN; s += 2) {
+        EXPECT_EQ(neighbor_stencil[s].x, -neighbor_stencil[s+1].x);
+        EXPECT_EQ(neighbor_stencil[s].y, -neighbor_stencil[s+1].y);
+        EXPECT_EQ(neighbor_stencil[s].z, -neighbor_stencil[s+1].z);
+        EXPECT_GT(neighbor_stencil[s].x + 3 * neighbor_stencil[s].y + 9 * neighbor_stencil[s].z, 0);
+    }
+
+    // the same half-occupied 7x6x5 grid in a dense and in a sparse store
+    const unsigned int len_x = 7, len_y = 6, len_z = 5;
+    const unsigned long grid_size = len_x * len_y * len_z;
+    std::vector<unsigned long> occupied;
+    for(unsigned long i = 0; i < grid_size; i++) {
+        if(rand() % 2 == 0)
+            occupied.push_back(i);
+    }
+    struct nd_store_t dense, sparse;
+    ASSERT_EQ(alloc_nd_store(&dense, grid_size, false, 0), 0);
+    ASSERT_EQ(alloc_nd_store(&sparse, occupied.size(), false, 0), 0);
+    for(struct nd_store_t *store : {&dense, &sparse}) {
+        store->dense = store == &dense;
+        store->len_x = len_x;
+        store->len_y = len_y;
+        store->len_z = len_z;
+    }
+    for(unsigned long i = 0; i < grid_size; i++) {
+        dense.index[i] = i;
+        dense.num_samples[i] = 0;
+    }
+    for(unsigned long k = 0; k < occupied.size(); k++) {
+        struct normal_distribution_t nd;
+        random_nd(&nd);
+        for(struct nd_store_t *store : {&dense, &sparse}) {
+            unsigned long entry = store == &dense ? occupied[k] : k;
+            memcpy(&store->mean[entry*3], nd.mean, 3 * sizeof(double));
+            memcpy(&store->covariance[entry*9], nd.covariance, 9 * sizeof(double));
+            store->num_samples[entry] = nd.num_samples;
+            store->index[entry] = occupied[k];
+        }
+    }
+    ASSERT_EQ(factor_nd_store(&dense), 0);
+    ASSERT_EQ(factor_nd_store(&sparse), 0);
+    ASSERT_EQ(thread_pool_init(3), 0);
+
+    for(enum neighborhood_t neighborhood : {NEIGHBORHOOD_FACES, NEIGHBORHOOD_EDGES, NEIGHBORHOOD_CORNERS}) {
+
+        // every pair of occupied voxels within the neighborhood, in both directions
+        unsigned long expected = 0;
+        for(unsigned long a : occupied) {
+            for(unsigned long b : occupied) {
+                long dx = (long) (b % len_x) - (long) (a % len_x);
+                long dy = (long) (b / len_x % len_y) - (long) (a / len_x % len_y);
+                long dz = (long) (b / (len_x * len_y)) - (long) (a / (len_x * len_y));
+                long changed = (dx != 0) + (dy != 0) + (dz != 0);
+                bool adjacent = labs(dx) <= 1 && labs(dy) <= 1 && labs(dz) <= 1 && changed > 0;
+                if(adjacent && (neighborhood != NEIGHBORHOOD_FACES || changed == 1) && (neighborhood != NEIGHBORHOOD_EDGES || changed <= 2))
+                    expected++;
+            }
+        }
+
+        struct kl_edge_t *dense_edges, *sparse_edges;
+        unsigned long dense_valid, sparse_valid, num_dense_edges, num_sparse_edges;
+        ASSERT_EQ(calculate_kl_edges(&dense, neighborhood, &dense_valid, &dense_edges, &num_dense_edges), 0);
+        ASSERT_EQ(calculate_kl_edges(&sparse, neighborhood, &sparse_valid, &sparse_edges, &num_sparse_edges), 0);
+        EXPECT_EQ(dense_valid, occupied.size());
+        EXPECT_EQ(sparse_valid, occupied.size());
+        ASSERT_EQ(num_dense_edges, expected);
+        ASSERT_EQ(num_sparse_edges, expected);
+
+        // both stores rank the same pairs of voxels, with the closed form divergences
+        for(unsigned long j = 0; j < expected; j++) {
+            EXPECT_EQ(dense_edges[j].divergence, sparse_edges[j].divergence);
+            EXPECT_EQ(dense.index[dense_edges[j].p], sparse.index[sparse_edges[j].p]);
+            EXPECT_EQ(dense.index[dense_edges[j].q], sparse.index[sparse_edges[j].q]);
+            double divergence;
+            unsigned long p = dense_edges[j].p, q = dense_edges[j].q;
+            ASSERT_EQ(kl_divergence_3x3(&dense.mean[p*3], &dense.covariance[p*9], &dense.mean[q*3], &dense.covariance[q*9], &divergence), 0);
+            EXPECT_NEAR(dense_edges[j].divergence, divergence, 1e-9 * (1.0 + fabs(divergence)));
+        }
+
+        free_kl_edges(dense_edges);
+        free_kl_edges(sparse_edges);
+    }
+
+    struct kl_edge_t *edges;
+    unsigned long num_valid, num_edges;
+    EXPECT_LT(calculate_kl_edges(&dense, (enum neighborhood_t) 8, &num_valid, &edges, &num_edges), 0);
+
+    thread_pool_destroy();
+    free_nd_store(&dense);
+    free_nd_store(&sparse);
+}
@@ -0,0 +1,238 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/nd_map.h>
+#include <ndnet_core/ndt.h>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#define FRAME_POINTS 3000
+#define WINDOW_LEN 3
+
+// sweep "f" of a sensor moving along "x": points over a 4 m slab around the sensor, below the world origin in "z"
+static void random_frame(unsigned int f, std::vector<double> &frame) {
+    srand(100 + f);
+    frame.resize(FRAME_POINTS * 3);
+    for(unsigned long i = 0; i < FRAME_POINTS; i++) {
+        frame[i*3] = f * 0.7 + (double) rand() / RAND_MAX * 4.0;
+        frame[i*3+1] = (double) rand() / RAND_MAX * 2.0 - 1.0;
+        frame[i*3+2] = -0.2 - (double) rand() / RAND_MAX * 0.8;
+    }
+}
+
+static int insert_frame(struct nd_map_t *map, std::vector<double> &frame, bool remove) {
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, frame.data(), POINT_TYPE_FLOAT64, 3, 0);
+    return remove ? nd_map_remove(map, &view, FRAME_POINTS) : nd_map_insert(map, &view, FRAME_POINTS);
+}
+
+// divergences of a map, by the voxel keys of their distributions. voxels with less than 4 samples have exactly singular
+// covariances, which rounding may leave invertible or not, so their divergences are skipped
+static std::map<std::pair<unsigned long, unsigned long>, double> map_edges(const struct nd_map_t *map, unsigned long *num_valid) {
+    struct kl_edge_t *kl_edges;
+    unsigned long num_kl_edges;
+    std::map<std::pair<unsigned long, unsigned long>, double> edges;
+    if(nd_map_kl_edges(map, num_valid, &kl_edges, &num_kl_edges) < 0)
+        return edges;
+    for(unsigned long i = 0; i < num_kl_edges; i++) {
+        if(map->store.num_samples[kl_edges[i].p] < 4 || map->store.num_samples[kl_edges[i].q] < 4)
+            continue;
+        edges[{map->store.index[kl_edges[i].p], map->store.index[kl_edges[i].q]}] = kl_edges[i].divergence;
+    }
+    free_kl_edges(kl_edges);
+    return edges;
+}
+
+TEST(NDMapTests, SlidingWindowMatchesRebuild) {
+    std::vector<std::vector<double>> frames(12);
+    for(unsigned int f = 0; f < frames.size(); f++)
+        random_frame(f, frames[f]);
+
+    // slide a window of sweeps, inserting each new sweep and removing the expired one
+    struct nd_map_t window;
+    ASSERT_EQ(nd_map_init(&window, 0.25, NULL, NEIGHBORHOOD_EDGES), 0);
+    for(unsigned int f = 0; f < frames.size(); f++) {
+        ASSERT_EQ(insert_frame(&window, frames[f], false), 0);
+        if(f >= WINDOW_LEN) {
+            ASSERT_EQ(insert_frame(&window, frames[f - WINDOW_LEN], true), 0);
+        }
+
+        // only the voxels of the inserted and the removed sweeps are updated
+        std::set<std::vector<long>> touched;
+        for(unsigned int g = 0; g <= f; g++) {
+            if(g != f && g + WINDOW_LEN != f)
+                continue;
+            for(unsigned long i = 0; i < FRAME_POINTS; i++)
+                touched.insert({(long) floor(frames[g][i*3] / 0.25), (long) floor(frames[g][i*3+1] / 0.25), (long) floor(frames[g][i*3+2] / 0.25)});
+        }
+        unsigned long num_updated;
+        ASSERT_EQ(nd_map_update(&window, &num_updated), 0);
+        EXPECT_EQ(num_updated, touched.size());
+    }
+
+    // rebuild the last window from scratch
+    struct nd_map_t rebuilt;
+    ASSERT_EQ(nd_map_init(&rebuilt, 0.25, NULL, NEIGHBORHOOD_EDGES), 0);
+    for(unsigned int f = frames.size() - WINDOW_LEN; f < frames.size(); f++)
+        ASSERT_EQ(insert_frame(&rebuilt, frames[f], false), 0);
+    ASSERT_EQ(nd_map_update(&rebuilt, NULL), 0);
+
+    // the same voxels have the same distributions, up to the rounding of the removals
+    unsigned long num_valid = 0;
+    for(unsigned long i = 0; i < rebuilt.store.num_nds; i++) {
+        unsigned long entry;
+        ASSERT_EQ(nd_map_find(&window, &rebuilt.store.mean[i*3], &entry), 0);
+        EXPECT_EQ(window.store.index[entry], rebuilt.store.index[i]);
+        ASSERT_EQ(window.store.num_samples[entry], rebuilt.store.num_samples[i]);
+        for(int k = 0; k < 3; k++)
+            EXPECT_NEAR(window.store.mean[entry*3+k], rebuilt.store.mean[i*3+k], 1e-12);
+        for(int k = 0; k < 9; k++)
+            EXPECT_NEAR(window.store.covariance[entry*9+k], rebuilt.store.covariance[i*9+k], 1e-12);
+        num_valid++;
+    }
+    for(unsigned long i = 0; i < window.store.num_nds; i++)
+        num_valid -= window.store.num_samples[i] > 0;
+    EXPECT_EQ(num_valid, 0UL);
+
+    // the incrementally updated divergences are the divergences of the rebuilt map
+    unsigned long num_valid_window, num_valid_rebuilt;
+    std::map<std::pair<unsigned long, unsigned long>, double> window_edges = map_edges(&window, &num_valid_window);
+    std::map<std::pair<unsigned long, unsigned long>, double> rebuilt_edges = map_edges(&rebuilt, &num_valid_rebuilt);
+    EXPECT_EQ(num_valid_window, num_valid_rebuilt);
+    ASSERT_GT(rebuilt_edges.size(), 0UL);
+    ASSERT_EQ(window_edges.size(), rebuilt_edges.size());
+    for(const auto &edge : rebuilt_edges) {
+        ASSERT_EQ(window_edges.count(edge.first), 1UL);
+        EXPECT_NEAR(window_edges[edge.first], edge.second, 1e-6 * (1.0 + fabs(edge.second)));
+    }
+
+    // the map exports as a store, skipping the emptied voxels
+    std::vector<double> points(window.store.num_nds * 3), covariances(window.store.num_nds * 9);
+    struct nd_output_t output;
+    nd_output_init(&output, POINT_TYPE_FLOAT64, points.data(), covariances.data(), NULL, NULL, 0);
+    unsigned long num_points;
+    ASSERT_EQ(nd_store_export(&window.store, &output, &num_points), 0);
+    EXPECT_EQ(num_points, num_valid_window);
+
+    nd_map_free(&window);
+    nd_map_free(&rebuilt);
+}
+
+TEST(NDMapTests, InvalidBatchesLeaveTheMap) {
+    std::vector<double> frame, other;
+    random_frame(0, frame);
+    random_frame(20, other);
+
+    struct nd_map_t map;
+    double origin[3] = {0.1, 0.1, 0.1};
+    ASSERT_EQ(nd_map_init(&map, 0.5, origin, NEIGHBORHOOD_FACES), 0);
+    ASSERT_EQ(insert_frame(&map, frame, false), 0);
+    ASSERT_EQ(nd_map_update(&map, NULL), 0);
+    unsigned long num_entries = map.store.num_nds;
+    std::vector<unsigned long> num_samples(map.store.num_samples, map.store.num_samples + num_entries);
+
+    // points that were never inserted, and points outside the voxel coordinates, are rejected as a whole
+    EXPECT_EQ(insert_frame(&map, other, true), -3);
+    other[0] = NAN;
+    EXPECT_EQ(insert_frame(&map, other, false), -1);
+    other[0] = 1e12;
+    EXPECT_EQ(insert_frame(&map, other, false), -1);
+    EXPECT_EQ(map.num_changed, 0UL);
+    ASSERT_EQ(map.store.num_nds, num_entries);
+    for(unsigned long i = 0; i < num_entries; i++)
+        EXPECT_EQ(map.store.num_samples[i], num_samples[i]);
+
+    // the voxels are anchored at the origin of the map, below it too
+    double point[3] = {0.1 - 1e-9, 0.6, -0.4};
+    unsigned long entry;
+    ASSERT_EQ(nd_map_find(&map, point, &entry), 0);
+    long coords[3] = {-1, 1, -1};
+    for(int k = 0; k < 3; k++) {
+        unsigned long mask = (1UL << ND_MAP_COORD_BITS) - 1;
+        EXPECT_EQ((long) ((map.store.index[entry] >> (k * ND_MAP_COORD_BITS)) & mask) - ND_MAP_COORD_LIMIT, coords[k]);
+    }
+
+    // removing every point empties the map
+    ASSERT_EQ(insert_frame(&map, frame, true), 0);
+    ASSERT_EQ(nd_map_update(&map, NULL), 0);
+    unsigned long num_valid, num_kl_edges;
+    struct kl_edge_t *kl_edges;
+    ASSERT_EQ(nd_map_kl_edges(&map, &num_valid, &kl_edges, &num_kl_edges), 0);
+    EXPECT_EQ(num_valid, 0UL);
+    EXPECT_EQ(num_kl_edges, 0UL);
+    free_kl_edges(kl_edges);
+    for(unsigned long i = 0; i < map.store.num_nds; i++) {
+        EXPECT_EQ(map.store.num_samples[i], 0UL);
+        EXPECT_EQ(map.store.mean[i*3], 0.0);
+    }
+
+    nd_map_free(&map);
+}
+
+TEST(NDMapTests, FullMapKeepsItsEntries) {
+    std::vector<double> expired, kept;
+    random_frame(0, expired);
+    random_frame(10, kept);
+
+    // the voxels of the expired sweep are emptied, so the next reserve compacts them away
+    struct nd_map_t map;
+    ASSERT_EQ(nd_map_init(&map, 0.25, NULL, NEIGHBORHOOD_EDGES), 0);
+    ASSERT_EQ(insert_frame(&map, expired, false), 0);
+    ASSERT_EQ(insert_frame(&map, kept, false), 0);
+    ASSERT_EQ(nd_map_update(&map, NULL), 0);
+    ASSERT_EQ(insert_frame(&map, expired, true), 0);
+    ASSERT_EQ(nd_map_update(&map, NULL), 0);
+    std::vector<unsigned long> keys(FRAME_POINTS), num_samples(FRAME_POINTS);
+    unsigned long num_valid = 0;
+    for(unsigned long i = 0; i < FRAME_POINTS; i++) {
+        unsigned long entry;
+        ASSERT_EQ(nd_map_find(&map, &kept[i*3], &entry), 0);
+        keys[i] = map.store.index[entry];
+        num_samples[i] = map.store.num_samples[entry];
+    }
+    for(unsigned long i = 0; i < map.store.num_nds; i++)
+        num_valid += map.store.num_samples[i] > 0;
+
+    // one point in each voxel of a block past the capacity of the map
+    std::vector<double> block;
+    for(int x = 0; x < 40; x++) {
+        for(int y = 0; y < 40; y++) {
+            for(int z = 0; z < 4; z++) {
+                block.push_back(20.0 + x * 0.25 + 0.1);
+                block.push_back(y * 0.25 + 0.1);
+                block.push_back(z * 0.25 + 0.1);
+            }
+        }
+    }
+    unsigned long num_block = block.size() / 3;
+    ASSERT_GT(map.store.num_nds + num_block, map.capacity);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, block.data(), POINT_TYPE_FLOAT64, 3, 0);
+
+    // the new voxels do not fit, and the kept voxels are still found
+    map.max_entries = num_valid + num_block - 1;
+    EXPECT_EQ(nd_map_insert(&map, &view, num_block), -2);
+    EXPECT_EQ(map.num_changed, 0UL);
+    for(unsigned long i = 0; i < FRAME_POINTS; i++) {
+        unsigned long entry;
+        ASSERT_EQ(nd_map_find(&map, &kept[i*3], &entry), 0);
+        EXPECT_EQ(map.store.index[entry], keys[i]);
+        EXPECT_EQ(map.store.num_samples[entry], num_samples[i]);
+    }
+
+    // exactly enough room compacts the expired voxels away
+    map.max_entries++;
+    ASSERT_EQ(nd_map_insert(&map, &view, num_block), 0);
+    EXPECT_EQ(map.store.num_nds, map.max_entries);
+    for(unsigned long i = 0; i < FRAME_POINTS; i++) {
+        unsigned long entry;
+        ASSERT_EQ(nd_map_find(&map, &kept[i*3], &entry), 0);
+        EXPECT_EQ(map.store.index[entry], keys[i]);
+        EXPECT_EQ(map.store.num_samples[entry], num_samples[i]);
+    }
+    ASSERT_EQ(nd_map_update(&map, NULL), 0);
+
+    nd_map_free(&map);
+}
@@ -0,0 +1,386 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/normal_distributions.h>
+#include <ndnet_core/radix_sort.h>
+#include <cstdlib>
+#include <vector>
+
+#define NUM_POINTS 20000
+#define NUM_CLASSES 5
+
+static void random_cloud(std::vector<double> &point_cloud, std::vector<unsigned short> &classes) {
+    srand(0);
+    point_cloud.resize(NUM_POINTS * 3);
+    classes.resize(NUM_POINTS);
+    for(unsigned long i = 0; i < NUM_POINTS * 3; i++) {
+        point_cloud[i] = (double) rand() / RAND_MAX * 4.0;
+    }
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        classes[i] = rand() % (NUM_CLASSES + 1);
+    }
+}
+
+TEST(NormalDistributionTests, RadixSortIsStable) {
+    std::vector<unsigned long> keys(50000), values(50000);
+    srand(0);
+    for(unsigned long i = 0; i < keys.size(); i++) {
+        keys[i] = rand() % 70000;
+        values[i] = i;
+    }
+    ASSERT_EQ(radix_sort_pairs(keys.data(), values.data(), keys.size(), 69999, NULL), 0);
+    for(unsigned long i = 1; i < keys.size(); i++) {
+        ASSERT_LE(keys[i-1], keys[i]);
+        if(keys[i-1] == keys[i]) {
+            ASSERT_LT(values[i-1], values[i]);
+        }
+    }
+}
+
+TEST(NormalDistributionTests, SortReduceMatchesLocking) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    int len_x = 9, len_y = 9, len_z = 9;
+    double voxel_size = 0.45;
+    unsigned long grid_size = len_x * len_y * len_z;
+
+    std::vector<struct normal_distribution_t> locking(grid_size), sorted(grid_size);
+    unsigned long num_locking, num_sorted;
+    ASSERT_EQ(estimate_ndt(point_cloud.data(), NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, locking.data(), &num_locking), 0);
+    ASSERT_EQ(estimate_ndt_sort_reduce(point_cloud.data(), NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, sorted.data(), &num_sorted), 0);
+
+    EXPECT_EQ(num_locking, num_sorted);
+    for(unsigned long i = 0; i < grid_size; i++) {
+        ASSERT_EQ(locking[i].num_samples, sorted[i].num_samples);
+        if(sorted[i].num_samples == 0)
+            continue;
+        EXPECT_EQ(locking[i].class_, sorted[i].class_);
+        for(int j = 0; j < 3; j++) {
+            EXPECT_NEAR(locking[i].mean[j], sorted[i].mean[j], 1e-9);
+            EXPECT_NEAR(locking[i].covariance[j*3+j], sorted[i].covariance[j*3+j], 1e-9);
+        }
+        for(int c = 0; c <= NUM_CLASSES; c++) {
+            EXPECT_EQ(locking[i].num_class_samples[c], sorted[i].num_class_samples[c]);
+        }
+    }
+    free_nd_class_samples(locking.data(), grid_size);
+    free_nd_class_samples(sorted.data(), grid_size);
+}
+
+TEST(NormalDistributionTests, SparseMatchesDense) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    int len_x = 9, len_y = 9, len_z = 9;
+    double voxel_size = 0.45;
+    unsigned long grid_size = len_x * len_y * len_z;
+
+    std::vector<struct normal_distribution_t> dense(grid_size);
+    unsigned long num_dense;
+    ASSERT_EQ(estimate_ndt_sort_reduce(point_cloud.data(), NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, dense.data(), &num_dense), 0);
+
+    struct normal_distribution_t *sparse = NULL;
+    unsigned long num_sparse;
+    ASSERT_EQ(estimate_ndt_sparse(point_cloud.data(), NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, &sparse, &num_sparse), 0);
+    ASSERT_EQ(num_dense, num_sparse);
+
+    unsigned long j = 0;
+    for(unsigned long i = 0; i < grid_size; i++) {
+        struct normal_distribution_t *found = find_nd(sparse, num_sparse, len_x, len_y, len_z, i);
+        if(dense[i].num_samples == 0) {
+            EXPECT_EQ(found, nullptr);
+        } else {
+            ASSERT_EQ(found, &sparse[j]);
+            EXPECT_EQ(sparse[j].index, i);
+            EXPECT_EQ(sparse[j].num_samples, dense[i].num_samples);
+            EXPECT_EQ(sparse[j].class_, dense[i].class_);
+            for(int k = 0; k < 9; k++) {
+                EXPECT_EQ(sparse[j].covariance[k], dense[i].covariance[k]);
+            }
+            j++;
+        }
+        EXPECT_EQ(find_nd(dense.data(), grid_size, len_x, len_y, len_z, i), &dense[i]);
+    }
+    free_nd_class_samples(dense.data(), grid_size);
+    free_nds(sparse, num_sparse);
+}
+
+TEST(NormalDistributionTests, StoreMatchesArray) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    int len_x = 9, len_y = 9, len_z = 9;
+    double voxel_size = 0.45;
+    unsigned long grid_size = len_x * len_y * len_z;
+
+    std::vector<struct normal_distribution_t> dense(grid_size);
+    unsigned long num_dense;
+    ASSERT_EQ(estimate_ndt_sort_reduce(point_cloud.data(), NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, dense.data(), &num_dense), 0);
+
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    for(int d = 0; d < 2; d++) {
+        struct nd_store_t store;
+        unsigned long num_occupied;
+        ASSERT_EQ(estimate_nd_store(&view, NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                                len_x, len_y, len_z, 0.0, 0.0, 0.0, d == 1, VOXELIZATION_SORT_REDUCE,
+                                CLASS_ESTIMATOR_HISTOGRAM, &store, &num_occupied, NULL), 0);
+        EXPECT_EQ(num_occupied, num_dense);
+        EXPECT_EQ(store.num_nds, d == 1 ? grid_size : num_dense);
+
+        for(unsigned long i = 0; i < grid_size; i++) {
+            unsigned long entry;
+            int found = find_nd_store_entry(&store, i, &entry);
+            if(dense[i].num_samples == 0 && d == 0) {
+                EXPECT_EQ(found, -1);
+                continue;
+            }
+            ASSERT_EQ(found, 0);
+            EXPECT_EQ(store.index[entry], i);
+            ASSERT_EQ(store.num_samples[entry], dense[i].num_samples);
+            if(dense[i].num_samples == 0)
+                continue;
+            EXPECT_EQ(store.classes[entry], dense[i].class_);
+            for(int k = 0; k < 3; k++) {
+                EXPECT_EQ(store.mean[entry*3+k], dense[i].mean[k]);
+            }
+            for(int k = 0; k < 9; k++) {
+                EXPECT_EQ(store.covariance[entry*9+k], dense[i].covariance[k]);
+            }
+        }
+        free_nd_store(&store);
+    }
+
+    free_nd_class_samples(dense.data(), grid_size);
+}
+
+TEST(NormalDistributionTests, StreamingMajorityFindsMajority) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    // give each voxel of the 4x4x4 grid a class that holds more than half of its points
+    int len_x = 4, len_y = 4, len_z = 4;
+    double voxel_size = 1.0;
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        if(i % 3 != 0) {
+            unsigned long voxel = (unsigned long) point_cloud[i*3] + 4 * (unsigned long) point_cloud[i*3+1] + 16 * (unsigned long) point_cloud[i*3+2];
+            classes[i] = voxel % (NUM_CLASSES + 1);
+        }
+    }
+
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    struct nd_store_t histogram, streaming;
+    unsigned long num_histogram, num_streaming;
+    ASSERT_EQ(estimate_nd_store(&view, NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, false, VOXELIZATION_SORT_REDUCE,
+                            CLASS_ESTIMATOR_HISTOGRAM, &histogram, &num_histogram, NULL), 0);
+    ASSERT_EQ(estimate_nd_store(&view, NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, false, VOXELIZATION_SORT_REDUCE,
+                            CLASS_ESTIMATOR_STREAMING_MAJORITY, &streaming, &num_streaming, NULL), 0);
+
+    ASSERT_EQ(num_histogram, num_streaming);
+    for(unsigned long i = 0; i < histogram.num_nds; i++) {
+        EXPECT_EQ(histogram.classes[i], histogram.index[i] % (NUM_CLASSES + 1));
+        EXPECT_EQ(streaming.classes[i], histogram.classes[i]);
+    }
+
+    free_nd_store(&histogram);
+    free_nd_store(&streaming);
+}
+
+TEST(NormalDistributionTests, MomentsMatchTwoPass) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    // move the cloud far from the origin, where plain sums of squares lose the spread
+    std::vector<unsigned long> point_indexes;
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        point_cloud[i*3] += 1e6;
+        point_cloud[i*3+1] -= 1e6;
+        if(i % 7 != 0)
+            point_indexes.push_back(i);
+    }
+    unsigned long n = point_indexes.size();
+
+    // two-pass reference, with the running mean and variances of the previous per-point update
+    double mean[3] = {0, 0, 0}, welford_mean[3] = {0, 0, 0}, m2[3] = {0, 0, 0};
+    for(unsigned long i = 0; i < n; i++) {
+        for(int j = 0; j < 3; j++) {
+            double x = point_cloud[point_indexes[i]*3+j];
+            mean[j] += x / n;
+            double old_mean = welford_mean[j];
+            welford_mean[j] += (x - old_mean) / (i + 1);
+            m2[j] += (x - old_mean) * (x - welford_mean[j]);
+        }
+    }
+    double covariance[9] = {0};
+    for(unsigned long i = 0; i < n; i++) {
+        const double *point = &point_cloud[point_indexes[i]*3];
+        for(int j = 0; j < 3; j++) {
+            for(int k = 0; k < 3; k++) {
+                covariance[j*3+k] += (point[j] - mean[j]) * (point[k] - mean[k]) / n;
+            }
+        }
+    }
+
+    // accumulate in uneven batches, mixing the block kernel and single points
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    struct nd_moments_t moments;
+    nd_moments_init(&moments);
+    nd_moments_add(&moments, &point_cloud[point_indexes[0]*3]);
+    nd_moments_accumulate(&moments, &view, &point_indexes[1], 100);
+    nd_moments_accumulate(&moments, &view, &point_indexes[101], n - 101);
+    ASSERT_EQ(moments.num_samples, n);
+
+    double moments_mean[3], moments_covariance[9];
+    nd_moments_finalize(&moments, moments_mean, moments_covariance);
+    for(int j = 0; j < 3; j++) {
+        EXPECT_NEAR(moments_mean[j], mean[j], 1e-8);
+        EXPECT_NEAR(moments_mean[j], welford_mean[j], 1e-8);
+        EXPECT_NEAR(moments_covariance[j*3+j], m2[j] / n, 1e-9);
+    }
+    for(int k = 0; k < 9; k++) {
+        EXPECT_NEAR(moments_covariance[k], covariance[k], 1e-9);
+    }
+    EXPECT_EQ(moments_covariance[1], moments_covariance[3]);
+}
+
+TEST(NormalDistributionTests, Float32MatchesFloat64) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    // round the cloud to single precision, so both types hold the same coordinates
+    std::vector<float> point_cloud_f32(point_cloud.begin(), point_cloud.end());
+    for(unsigned long i = 0; i < point_cloud.size(); i++) {
+        point_cloud[i] = point_cloud_f32[i];
+    }
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    struct point_cloud_view_t view_f32;
+    point_cloud_view_init(&view_f32, point_cloud_f32.data(), POINT_TYPE_FLOAT32, 3, 0);
+
+    int len_x = 9, len_y = 9, len_z = 9;
+    double voxel_size = 0.45;
+    struct nd_store_t store, store_f32;
+    unsigned long num_occupied, num_occupied_f32;
+    ASSERT_EQ(estimate_nd_store(&view, NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, false, VOXELIZATION_SORT_REDUCE,
+                            CLASS_ESTIMATOR_HISTOGRAM, &store, &num_occupied, NULL), 0);
+    ASSERT_EQ(estimate_nd_store(&view_f32, NUM_POINTS, classes.data(), NUM_CLASSES, voxel_size,
+                            len_x, len_y, len_z, 0.0, 0.0, 0.0, false, VOXELIZATION_SORT_REDUCE,
+                            CLASS_ESTIMATOR_HISTOGRAM, &store_f32, &num_occupied_f32, NULL), 0);
+
+    // the single precision points are accumulated in double, so the distributions are identical
+    ASSERT_EQ(num_occupied, num_occupied_f32);
+    for(unsigned long i = 0; i < store.num_nds; i++) {
+        EXPECT_EQ(store.index[i], store_f32.index[i]);
+        EXPECT_EQ(store.num_samples[i], store_f32.num_samples[i]);
+        EXPECT_EQ(store.classes[i], store_f32.classes[i]);
+        for(int k = 0; k < 3; k++) {
+            EXPECT_EQ(store.mean[i*3+k], store_f32.mean[i*3+k]);
+        }
+        for(int k = 0; k < 9; k++) {
+            EXPECT_EQ(store.covariance[i*9+k], store_f32.covariance[i*9+k]);
+        }
+    }
+
+    free_nd_store(&store);
+    free_nd_store(&store_f32);
+}
+
+TEST(NormalDistributionTests, ViewLayoutsMatchPacked) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+
+    // the same points as xyz + intensity + ring and as separate columns
+    std::vector<double> xyzir(NUM_POINTS * 5), x(NUM_POINTS), y(NUM_POINTS), z(NUM_POINTS);
+    for(unsigned long i = 0; i < NUM_POINTS; i++) {
+        for(int j = 0; j < 3; j++)
+            xyzir[i*5+j] = point_cloud[i*3+j];
+        xyzir[i*5+3] = (double) (i % 100);
+        xyzir[i*5+4] = -1.0;
+        x[i] = point_cloud[i*3];
+        y[i] = point_cloud[i*3+1];
+        z[i] = point_cloud[i*3+2];
+    }
+    struct point_cloud_view_t packed, interleaved, columns;
+    point_cloud_view_init(&packed, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+    ASSERT_EQ(point_cloud_view_init(&interleaved, xyzir.data(), POINT_TYPE_FLOAT64, 5, 2), 0);
+    ASSERT_LT(point_cloud_view_init(&columns, xyzir.data(), POINT_TYPE_FLOAT64, 4, 2), 0);
+    point_cloud_view_init_columns(&columns, x.data(), y.data(), z.data(), POINT_TYPE_FLOAT64);
+
+    int len_x = 9, len_y = 9, len_z = 9;
+    double voxel_size = 0.45;
+    enum voxelization_engine_t engines[2] = {VOXELIZATION_SORT_REDUCE, VOXELIZATION_LOCKING};
+    for(int e = 0; e < 2; e++) {
+        struct nd_store_t stores[3];
+        const struct point_cloud_view_t *views[3] = {&packed, &interleaved, &columns};
+        for(int v = 0; v < 3; v++) {
+            unsigned long num_occupied;
+            ASSERT_EQ(estimate_nd_store(views[v], NUM_POINTS, NULL, 0, voxel_size,
+                                    len_x, len_y, len_z, 0.0, 0.0, 0.0, true, engines[e],
+                                    CLASS_ESTIMATOR_HISTOGRAM, &stores[v], &num_occupied, NULL), 0);
+        }
+
+        // average the intensity of each voxel by hand
+        unsigned long grid_size = len_x * len_y * len_z;
+        std::vector<double> intensity(grid_size, 0.0);
+        for(unsigned long i = 0; i < NUM_POINTS; i++) {
+            unsigned long voxel = (unsigned long) (x[i] / voxel_size) + len_x * (unsigned long) (y[i] / voxel_size) +
+                                    len_x * len_y * (unsigned long) (z[i] / voxel_size);
+            intensity[voxel] += xyzir[i*5+3];
+        }
+
+        ASSERT_EQ(stores[1].num_channels, 2);
+        ASSERT_EQ(stores[0].channels, nullptr);
+        for(unsigned long i = 0; i < grid_size; i++) {
+            for(int v = 1; v < 3; v++) {
+                EXPECT_EQ(stores[v].num_samples[i], stores[0].num_samples[i]);
+                for(int k = 0; k < 3; k++)
+                    EXPECT_NEAR(stores[v].mean[i*3+k], stores[0].mean[i*3+k], 1e-12);
+                for(int k = 0; k < 9; k++)
+                    EXPECT_NEAR(stores[v].covariance[i*9+k], stores[0].covariance[i*9+k], 1e-12);
+            }
+            if(stores[1].num_samples[i] > 0) {
+                EXPECT_NEAR(stores[1].channels[i*2], intensity[i] / stores[1].num_samples[i], 1e-9);
+                EXPECT_EQ(stores[1].channels[i*2+1], -1.0);
+            }
+        }
+
+        for(int v = 0; v < 3; v++)
+            free_nd_store(&stores[v]);
+    }
+}
+
+TEST(NormalDistributionTests, CountMatchesEstimate) {
+    std::vector<double> point_cloud;
+    std::vector<unsigned short> classes;
+    random_cloud(point_cloud, classes);
+    struct point_cloud_view_t view;
+    point_cloud_view_init(&view, point_cloud.data(), POINT_TYPE_FLOAT64, 3, 0);
+
+    double voxel_sizes[3] = {0.05, 0.45, 1.5};
+    for(int v = 0; v < 3; v++) {
+        int len = (int) (4.0 / voxel_sizes[v]) + 1;
+        struct nd_store_t store;
+        unsigned long num_occupied, num_counted;
+        ASSERT_EQ(estimate_nd_store(&view, NUM_POINTS, NULL, 0, voxel_sizes[v], len, len, len, 0.0, 0.0, 0.0,
+                                false, VOXELIZATION_SORT_REDUCE, CLASS_ESTIMATOR_HISTOGRAM, &store, &num_occupied, NULL), 0);
+        ASSERT_EQ(count_occupied_voxels(&view, NUM_POINTS, voxel_sizes[v], len, len, len, 0.0, 0.0, 0.0, &num_counted, NULL), 0);
+        EXPECT_EQ(num_counted, num_occupied);
+        free_nd_store(&store);
+    }
+}
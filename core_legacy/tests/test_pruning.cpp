@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/pruning.h>
+#include <ndnet_core/ndt.h>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+// random divergences in both directions between neighbors of a 1D chain with a few skip links
+static std::vector<struct kl_edge_t> random_edges(unsigned long num_nds) {
+    std::vector<struct kl_edge_t> edges;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        for(unsigned long step : {1ul, 7ul}) {
+            if(i + step >= num_nds || (step == 7 && i % 3 != 0))
+                continue;
+            // few distinct values, so ties are common
+            double pq = (double) (rand() % 20) / 4.0;
+            double qp = (double) (rand() % 20) / 4.0;
+            edges.push_back({pq, (uint32_t) i, (uint32_t) (i + step)});
+            edges.push_back({qp, (uint32_t) (i + step), (uint32_t) i});
+        }
+    }
+    return edges;
+}
+
+TEST(PruningTests, MatchesExhaustiveSearch) {
+    srand(16);
+
+    const unsigned long num_nds = 300;
+    std::vector<struct kl_edge_t> edges = random_edges(num_nds);
+    std::vector<unsigned long> num_samples(num_nds, 10);
+    for(unsigned long i = 0; i < num_nds; i += 13)
+        num_samples[i] = 0;
+
+    struct kl_pruner_t pruner;
+    ASSERT_EQ(kl_pruner_init(&pruner, num_nds, num_samples.data(), edges.data(), edges.size(), NULL), 0);
+
+    // reference: scan every remaining distribution for the smallest divergence to a remaining neighbor
+    std::vector<bool> remaining(num_nds);
+    unsigned long num_remaining = 0;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        remaining[i] = num_samples[i] > 0;
+        num_remaining += remaining[i];
+    }
+    for(; num_remaining > 0; num_remaining--) {
+        std::vector<double> scores(num_nds, INFINITY);
+        for(const struct kl_edge_t &edge : edges) {
+            if(remaining[edge.p] && remaining[edge.q])
+                scores[edge.p] = std::fmin(scores[edge.p], edge.divergence);
+        }
+        unsigned long expected = num_nds;
+        for(unsigned long i = 0; i < num_nds; i++) {
+            if(remaining[i] && (expected == num_nds || scores[i] < scores[expected]))
+                expected = i;
+        }
+
+        unsigned long entry;
+        ASSERT_EQ(kl_pruner_pop(&pruner, &entry), 0);
+        ASSERT_EQ(entry, expected);
+        remaining[entry] = false;
+    }
+    unsigned long entry;
+    EXPECT_LT(kl_pruner_pop(&pruner, &entry), 0);
+
+    kl_pruner_free(&pruner);
+}
+
+TEST(PruningTests, PruningInStepsMatchesOneStep) {
+    srand(17);
+
+    const unsigned long num_nds = 500;
+    std::vector<struct kl_edge_t> edges = random_edges(num_nds);
+    std::vector<struct normal_distribution_t> once(num_nds), steps;
+    unsigned long num_valid = 0;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        once[i] = (struct normal_distribution_t) {};
+        once[i].num_samples = i % 17 == 0 ? 0 : 10;
+        num_valid += once[i].num_samples > 0;
+    }
+    steps = once;
+
+    unsigned long valid_once = num_valid, valid_steps = num_valid;
+    ASSERT_EQ(prune_nds(once.data(), num_nds, 100, &valid_once, edges.data(), edges.size()), 0);
+    // the divergences are left as they are, and reused by the second call
+    ASSERT_EQ(prune_nds(steps.data(), num_nds, 300, &valid_steps, edges.data(), edges.size()), 0);
+    EXPECT_EQ(valid_steps, 300u);
+    ASSERT_EQ(prune_nds(steps.data(), num_nds, 100, &valid_steps, edges.data(), edges.size()), 0);
+    EXPECT_EQ(valid_once, 100u);
+    EXPECT_EQ(valid_steps, 100u);
+    for(unsigned long i = 0; i < num_nds; i++) {
+        EXPECT_EQ(steps[i].num_samples, once[i].num_samples);
+    }
+
+    // more than the valid distributions can not be desired
+    EXPECT_EQ(prune_nds(steps.data(), num_nds, 101, &valid_steps, edges.data(), edges.size()), -1);
+}
+
+TEST(PruningTests, RemovalOrderSelectsAnyTarget) {
+    srand(18);
+
+    const unsigned long num_nds = 400;
+    std::vector<struct kl_edge_t> edges = random_edges(num_nds);
+    std::vector<struct normal_distribution_t> nds(num_nds);
+    unsigned long num_valid = 0;
+    for(unsigned long i = 0; i < num_nds; i++) {
+        nds[i] = (struct normal_distribution_t) {};
+        nds[i].num_samples = i % 19 == 0 ? 0 : 2 + i % 5;
+        num_valid += nds[i].num_samples > 0;
+    }
+    const std::vector<struct normal_distribution_t> original = nds;
+
+    struct nd_removal_order_t removal_order;
+    ASSERT_EQ(order_nds(nds.data(), num_nds, edges.data(), edges.size(), &removal_order), 0);
+    ASSERT_EQ(removal_order.num_ordered, num_valid);
+
+    // shrinking and growing back match pruning the original array from scratch
+    for(unsigned long num_kept : {200ul, 50ul, 300ul, num_valid, 0ul}) {
+        unsigned long selected_valid, pruned_valid = num_valid;
+        std::vector<struct normal_distribution_t> pruned = original;
+        ASSERT_EQ(select_nds(nds.data(), &removal_order, num_kept, &selected_valid), 0);
+        ASSERT_EQ(prune_nds(pruned.data(), num_nds, num_kept, &pruned_valid, edges.data(), edges.size()), 0);
+        EXPECT_EQ(selected_valid, num_kept);
+        for(unsigned long i = 0; i < num_nds; i++) {
+            ASSERT_EQ(nds[i].num_samples, pruned[i].num_samples);
+        }
+    }
+    EXPECT_EQ(select_nds(nds.data(), &removal_order, num_valid + 1, &num_valid), -1);
+
+    free_nd_removal_order(&removal_order);
+}
@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+#include <ndnet_core/thread_pool.h>
+#include <atomic>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void count_items(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+    std::vector<std::atomic<int>> *visits = (std::vector<std::atomic<int>> *) arg;
+    EXPECT_LT(worker_id, thread_pool_num_workers());
+    for(unsigned long i = start; i < end; i++) {
+        (*visits)[i]++;
+    }
+}
+
+static void count_first_workers(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+    std::vector<std::atomic<int>> *visits = (std::vector<std::atomic<int>> *) arg;
+    EXPECT_LT(worker_id, 2u);
+    for(unsigned long i = start; i < end; i++) {
+        (*visits)[i]++;
+    }
+}
+
+static void nested_loop(void *arg, unsigned long start, unsigned long end, unsigned int worker_id) {
+    (void) worker_id;
+    std::vector<std::atomic<int>> *visits = (std::vector<std::atomic<int>> *) arg;
+    for(unsigned long i = start; i < end; i++) {
+        EXPECT_EQ(thread_pool_parallel_for(10, 1, count_items, &visits[i]), 0);
+    }
+}
+
+TEST(ThreadPoolTests, VisitsEachItemOnce) {
+    ASSERT_EQ(thread_pool_init(4), 0);
+    EXPECT_EQ(thread_pool_num_workers(), 4u);
+
+    std::vector<std::atomic<int>> visits(100003);
+    EXPECT_EQ(thread_pool_parallel_for(visits.size(), 7, count_items, &visits), 0);
+    for(unsigned long i = 0; i < visits.size(); i++) {
+        ASSERT_EQ(visits[i], 1);
+    }
+
+    thread_pool_destroy();
+}
+
+TEST(ThreadPoolTests, BoundedLoopsKeepTheWorkerIds) {
+    ASSERT_EQ(thread_pool_init(4), 0);
+
+    // per-worker storage sized for a smaller pool
+    std::vector<std::atomic<int>> visits(100003);
+    EXPECT_EQ(thread_pool_parallel_for_bounded(visits.size(), 7, 2, count_first_workers, &visits), 0);
+    for(unsigned long i = 0; i < visits.size(); i++) {
+        ASSERT_EQ(visits[i], 1);
+    }
+
+    thread_pool_destroy();
+}
+
+TEST(ThreadPoolTests, NestedLoopsRunInline) {
+    ASSERT_EQ(thread_pool_init(3), 0);
+
+    std::vector<std::vector<std::atomic<int>>> visits(64);
+    for(unsigned long i = 0; i < visits.size(); i++) {
+        visits[i] = std::vector<std::atomic<int>>(10);
+    }
+    EXPECT_EQ(thread_pool_parallel_for(visits.size(), 1, nested_loop, visits.data()), 0);
+    for(unsigned long i = 0; i < visits.size(); i++) {
+        for(unsigned long j = 0; j < 10; j++) {
+            ASSERT_EQ(visits[i][j], 1);
+        }
+    }
+
+    thread_pool_destroy();
+}
+
+TEST(ThreadPoolTests, ForkedChildStartsItsOwnPool) {
+    ASSERT_EQ(thread_pool_init(4), 0);
+    std::vector<std::atomic<int>> visits(10007);
+    EXPECT_EQ(thread_pool_parallel_for(visits.size(), 7, count_items, &visits), 0);
+
+    // the child has none of the workers of the parent. the alarm ends it if the loop waits for them
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if(pid == 0) {
+        alarm(10);
+        std::vector<std::atomic<int>> child_visits(10007);
+        thread_pool_parallel_for(child_visits.size(), 7, count_items, &child_visits);
+        if(thread_pool_init(4) < 0)
+            _exit(2);
+        thread_pool_parallel_for(child_visits.size(), 7, count_items, &child_visits);
+        for(unsigned long i = 0; i < child_visits.size(); i++) {
+            if(child_visits[i] != 2)
+                _exit(1);
+        }
+        thread_pool_destroy();
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    // the parent keeps its pool
+    EXPECT_EQ(thread_pool_num_workers(), 4u);
+    EXPECT_EQ(thread_pool_parallel_for(visits.size(), 7, count_items, &visits), 0);
+    thread_pool_destroy();
+}
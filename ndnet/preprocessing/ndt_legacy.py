@@ -1,5 +1,7 @@
 import numpy as np
 import ctypes
+import ctypes.util
+import os
 
 # C structure for the normal distribution
 class normal_distribution_t(ctypes.Structure):
@@ -16,16 +18,72 @@ class normal_distribution_t(ctypes.Structure):
     ]
 
 
-# C structure for the Kullback-Leibler divergence
-class kl_divergence_t(ctypes.Structure):
-    __fields__ = [
-        {"divergence": ctypes.c_double},
-        {"p": ctypes.POINTER(normal_distribution_t)},
-        {"q": ctypes.POINTER(normal_distribution_t)}
+# C structure for the Kullback-Leibler divergence between two normal distributions, by their positions in the array
+class kl_edge_t(ctypes.Structure):
+    _fields_ = [
+        ("divergence", ctypes.c_double),
+        ("p", ctypes.c_uint32),
+        ("q", ctypes.c_uint32)
+    ]
+
+# C structure for the order in which the normal distributions are pruned
+class nd_removal_order_t(ctypes.Structure):
+    _fields_ = [
+        ("num_nds", ctypes.c_ulong),
+        ("num_ordered", ctypes.c_ulong),
+        ("order", ctypes.POINTER(ctypes.c_uint32)),
+        ("ranks", ctypes.POINTER(ctypes.c_uint32)),
+        ("num_samples", ctypes.POINTER(ctypes.c_ulong))
     ]
 
-# import the core_legacy shared library
-core = ctypes.cdll.LoadLibrary('/usr/local/lib/libndnet.so')
+# types of the point cloud values
+POINT_TYPE_FLOAT64 = 0
+POINT_TYPE_FLOAT32 = 1
+
+# covariance layouts and padding policies of the packed outputs
+COVARIANCE_FULL = 0
+COVARIANCE_UPPER = 1
+PADDING_NONE = 0
+PADDING_ZERO = 1
+PADDING_REPEAT = 2
+
+# C structure for a read-only view of a point cloud
+class point_cloud_view_t(ctypes.Structure):
+    _fields_ = [
+        ("x", ctypes.c_void_p),
+        ("y", ctypes.c_void_p),
+        ("z", ctypes.c_void_p),
+        ("stride", ctypes.c_ulong),
+        ("type", ctypes.c_int),
+        ("channels", ctypes.c_void_p),
+        ("channel_stride", ctypes.c_ulong),
+        ("num_channels", ctypes.c_ushort)
+    ]
+
+# C structure for the rows the downsampled normal distributions are written to
+class nd_output_t(ctypes.Structure):
+    _fields_ = [
+        ("type", ctypes.c_int),
+        ("points", ctypes.c_void_p),
+        ("point_stride", ctypes.c_ulong),
+        ("covariances", ctypes.c_void_p),
+        ("covariance_stride", ctypes.c_ulong),
+        ("classes", ctypes.POINTER(ctypes.c_ushort)),
+        ("class_stride", ctypes.c_ulong),
+        ("channels", ctypes.c_void_p),
+        ("channel_stride", ctypes.c_ulong),
+        ("first_row", ctypes.c_ulong),
+        ("num_rows", ctypes.c_ulong),
+        ("covariance_layout", ctypes.c_int),
+        ("one_hot", ctypes.c_void_p),
+        ("one_hot_stride", ctypes.c_ulong),
+        ("num_labels", ctypes.c_ushort),
+        ("sanitize", ctypes.c_bool),
+        ("padding", ctypes.c_int)
+    ]
+
+# import the core_legacy shared library, from "NDNET_CORE_LIB", the library path or the install location
+core = ctypes.cdll.LoadLibrary(os.environ.get('NDNET_CORE_LIB') or ctypes.util.find_library('ndnet') or '/usr/local/lib/libndnet.so')
 
 # set the argument types
 core.ndt_downsample.argtypes = [
@@ -38,9 +96,260 @@ core.ndt_downsample.argtypes = [
     ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_ulong),
     ctypes.POINTER(ctypes.c_double),
     ctypes.POINTER(ctypes.c_ushort),
-    ctypes.POINTER(ctypes.POINTER(normal_distribution_t)), ctypes.POINTER(ctypes.c_ulong),
-    ctypes.POINTER(ctypes.POINTER(kl_divergence_t)), ctypes.POINTER(ctypes.c_ulong)
+    ctypes.POINTER(ctypes.POINTER(normal_distribution_t)), ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.POINTER(kl_edge_t)), ctypes.POINTER(ctypes.c_ulong)
+]
+core.ndt_downsample_f32.argtypes = [
+    ctypes.POINTER(ctypes.c_float), ctypes.c_ushort, ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint),
+    ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_ushort), ctypes.c_ushort,
+    ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.c_float),
+    ctypes.POINTER(ctypes.c_ushort),
+    ctypes.POINTER(ctypes.POINTER(normal_distribution_t)), ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.POINTER(kl_edge_t)), ctypes.POINTER(ctypes.c_ulong)
+]
+core.point_cloud_view_init.argtypes = [
+    ctypes.POINTER(point_cloud_view_t), ctypes.c_void_p, ctypes.c_int,
+    ctypes.c_ushort, ctypes.c_ushort
+]
+core.nd_output_init_features.argtypes = [
+    ctypes.POINTER(nd_output_t), ctypes.c_int, ctypes.c_void_p, ctypes.c_ulong,
+    ctypes.c_int, ctypes.c_ushort
+]
+core.nd_output_init_features.restype = ctypes.c_ulong
+core.ndt_downsample_output.argtypes = [
+    ctypes.POINTER(point_cloud_view_t), ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint),
+    ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_ushort), ctypes.c_ushort,
+    ctypes.c_ulong,
+    ctypes.POINTER(nd_output_t), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.POINTER(normal_distribution_t)), ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.POINTER(kl_edge_t)), ctypes.POINTER(ctypes.c_ulong)
 ]
+core.ndt_context_create.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+core.ndt_context_create.restype = ctypes.c_void_p
+core.ndt_context_destroy.argtypes = [ctypes.c_void_p]
+core.ndt_context_trim.argtypes = [ctypes.c_void_p]
+core.ndt_context_memory.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_ulong)]
+core.ndt_context_downsample.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(point_cloud_view_t), ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint), ctypes.POINTER(ctypes.c_uint),
+    ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_ushort), ctypes.c_ushort,
+    ctypes.c_ulong,
+    ctypes.POINTER(nd_output_t), ctypes.POINTER(ctypes.c_ulong)
+]
+core.ndt_context_downsample_batch.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(point_cloud_view_t), ctypes.POINTER(ctypes.c_ulong), ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_ushort), ctypes.c_ushort,
+    ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(nd_output_t), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.c_int)
+]
+core.order_nds.argtypes = [
+    ctypes.POINTER(normal_distribution_t), ctypes.c_ulong,
+    ctypes.POINTER(kl_edge_t), ctypes.c_ulong,
+    ctypes.POINTER(nd_removal_order_t)
+]
+core.select_nds.argtypes = [
+    ctypes.POINTER(normal_distribution_t), ctypes.POINTER(nd_removal_order_t),
+    ctypes.c_ulong, ctypes.POINTER(ctypes.c_ulong)
+]
+core.free_nd_removal_order.argtypes = [ctypes.POINTER(nd_removal_order_t)]
+core.to_point_cloud.argtypes = [
+    ctypes.POINTER(normal_distribution_t), ctypes.c_ulong,
+    ctypes.c_uint, ctypes.c_uint, ctypes.c_uint,
+    ctypes.c_double, ctypes.c_double, ctypes.c_double,
+    ctypes.c_double,
+    ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.c_double),
+    ctypes.POINTER(ctypes.c_ushort)
+]
+core.to_point_cloud_f32.argtypes = [
+    ctypes.POINTER(normal_distribution_t), ctypes.c_ulong,
+    ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_ulong),
+    ctypes.POINTER(ctypes.c_float),
+    ctypes.POINTER(ctypes.c_ushort)
+]
+
+class NDT_Context:
+    """Downsamples a sequence of point clouds, such as the samples of consecutive batches, reusing the memory and the voxel size of the previous one."""
+
+    def __init__(self, num_threads: int = 0) -> None:
+        """
+        Initializes the NDT_Context class.
+
+        Args:
+            num_threads (int, optional): Number of workers of the library thread pool. Defaults to 0, leaving the pool as is.
+
+        Returns:
+            None
+        """
+        self.context = core.ndt_context_create(None, num_threads)
+        if not self.context:
+            raise RuntimeError("Error creating the NDT context!")
+
+
+    def close(self) -> None:
+        """Releases the context and its memory."""
+        if self.context:
+            core.ndt_context_destroy(self.context)
+            self.context = None
+
+
+    def __del__(self) -> None:
+        self.close()
+
+
+    def trim(self) -> None:
+        """Releases the memory of the context, which grows again on the next downsample."""
+        core.ndt_context_trim(self.context)
+
+
+    def memory(self) -> tuple[int, int]:
+        """
+        Gets the memory use of the context.
+
+        Returns:
+            tuple[int, int]: The size of the reused memory in bytes, and the number of heap allocations done so far.
+        """
+        capacity = ctypes.c_ulong(0)
+        num_allocations = ctypes.c_ulong(0)
+        core.ndt_context_memory(self.context, ctypes.byref(capacity), ctypes.byref(num_allocations))
+        return capacity.value, num_allocations.value
+
+
+    def downsample_into(self, pointcloud: np.ndarray, num_desired_points: int, out: np.ndarray,
+                        classes: np.ndarray = None, num_classes: int = 0, num_labels: int = 0,
+                        covariance_layout: int = COVARIANCE_FULL, padding: int = PADDING_ZERO) -> int:
+        """
+        Downsamples a point cloud into the rows of a caller buffer, as "NDT_Sampler.downsample_into".
+
+        Args:
+            pointcloud (np.ndarray): The point cloud to downsample, with the xyz coordinates in the first 3 columns. float32 clouds are read without copies.
+            num_desired_points (int): The number of desired points in the downsampled point cloud.
+            out (np.ndarray): float32 or float64 buffer with at least "num_desired_points" rows of the feature width, contiguous.
+            classes (np.ndarray, optional): uint16 class of each point. Defaults to None.
+            num_classes (int, optional): Number of classes. Defaults to 0.
+            num_labels (int, optional): Number of one-hot class columns. Defaults to 0.
+            covariance_layout (int, optional): COVARIANCE_FULL or COVARIANCE_UPPER. Defaults to COVARIANCE_FULL.
+            padding (int, optional): PADDING_NONE, PADDING_ZERO or PADDING_REPEAT. Defaults to PADDING_ZERO.
+
+        Returns:
+            int: The number of downsampled rows, without the padding.
+        """
+
+        width = 3 + (6 if covariance_layout == COVARIANCE_UPPER else 9) + num_labels
+        if out.dtype not in (np.float32, np.float64) or out.ndim != 2 or out.shape[1] != width or out.shape[0] < num_desired_points or not out.flags.c_contiguous:
+            raise ValueError(f"Expected a contiguous float buffer of at least ({num_desired_points}, {width})!")
+
+        # float32 clouds stay in single precision, anything else is read in double
+        if pointcloud.dtype != np.float32:
+            pointcloud = np.ascontiguousarray(pointcloud, dtype=np.float64)
+        pointcloud = np.ascontiguousarray(pointcloud)
+        point_type = POINT_TYPE_FLOAT32 if pointcloud.dtype == np.float32 else POINT_TYPE_FLOAT64
+        view = point_cloud_view_t()
+        core.point_cloud_view_init(ctypes.byref(view), pointcloud.ctypes.data, point_type, pointcloud.shape[1], 0)
+
+        output = nd_output_t()
+        core.nd_output_init_features(ctypes.byref(output), POINT_TYPE_FLOAT32 if out.dtype == np.float32 else POINT_TYPE_FLOAT64,
+                                     out.ctypes.data, out.shape[0], covariance_layout, num_labels)
+        output.padding = padding
+
+        classes_ptr = None
+        if classes is not None:
+            classes = np.ascontiguousarray(classes, dtype=np.uint16)
+            classes_ptr = classes.ctypes.data_as(ctypes.POINTER(ctypes.c_ushort))
+
+        len_x, len_y, len_z = ctypes.c_uint(0), ctypes.c_uint(0), ctypes.c_uint(0)
+        offset_x, offset_y, offset_z = ctypes.c_double(0.0), ctypes.c_double(0.0), ctypes.c_double(0.0)
+        voxel_size = ctypes.c_double(0.0)
+        num_downsampled_points = ctypes.c_ulong(0)
+        if core.ndt_context_downsample(self.context, ctypes.byref(view), len(pointcloud),
+                                       ctypes.byref(len_x), ctypes.byref(len_y), ctypes.byref(len_z),
+                                       ctypes.byref(offset_x), ctypes.byref(offset_y), ctypes.byref(offset_z),
+                                       ctypes.byref(voxel_size),
+                                       classes_ptr, num_classes,
+                                       num_desired_points,
+                                       ctypes.byref(output), ctypes.byref(num_downsampled_points)) < 0:
+            raise RuntimeError("Error downsampling the point cloud!")
+
+        return num_downsampled_points.value
+
+
+    def downsample_batch(self, points: np.ndarray, offsets: np.ndarray, num_desired_points: np.ndarray, out: np.ndarray,
+                         classes: np.ndarray = None, num_classes: int = 0, num_labels: int = 0,
+                         covariance_layout: int = COVARIANCE_FULL, padding: int = PADDING_ZERO) -> np.ndarray:
+        """
+        Downsamples a batch of point clouds with a single call, into consecutive rows of a caller buffer.
+        Small clouds are downsampled concurrently, one per worker of the thread pool, and big ones are split across the pool.
+
+        Args:
+            points (np.ndarray): The points of every cloud, one cloud after the other, with the xyz coordinates in the first 3 columns.
+            offsets (np.ndarray): First point of each cloud, with one more offset ending the last cloud.
+            num_desired_points (np.ndarray): The number of desired points of each cloud. Each cloud owns that many rows of "out", after the rows of the previous clouds.
+            out (np.ndarray): float32 or float64 buffer with at least "sum(num_desired_points)" rows of the feature width, contiguous.
+            classes (np.ndarray, optional): uint16 class of each point. Defaults to None.
+            num_classes (int, optional): Number of classes. Defaults to 0.
+            num_labels (int, optional): Number of one-hot class columns. Defaults to 0.
+            covariance_layout (int, optional): COVARIANCE_FULL or COVARIANCE_UPPER. Defaults to COVARIANCE_FULL.
+            padding (int, optional): PADDING_NONE, PADDING_ZERO or PADDING_REPEAT. Defaults to PADDING_ZERO.
+
+        Returns:
+            np.ndarray: The number of downsampled rows of each cloud, without the padding. A cloud that can not be downsampled, such as one with less points than desired, gets 0 rows and only padding.
+        """
+
+        offsets = np.ascontiguousarray(offsets, dtype=np.uint64)
+        num_desired_points = np.ascontiguousarray(num_desired_points, dtype=np.uint64)
+        num_clouds = len(num_desired_points)
+        if len(offsets) != num_clouds + 1 or offsets[-1] > len(points):
+            raise ValueError(f"Expected {num_clouds + 1} offsets into the {len(points)} points!")
+        width = 3 + (6 if covariance_layout == COVARIANCE_UPPER else 9) + num_labels
+        num_rows = int(num_desired_points.sum())
+        if out.dtype not in (np.float32, np.float64) or out.ndim != 2 or out.shape[1] != width or out.shape[0] < num_rows or not out.flags.c_contiguous:
+            raise ValueError(f"Expected a contiguous float buffer of at least ({num_rows}, {width})!")
+
+        # float32 clouds stay in single precision, anything else is read in double
+        if points.dtype != np.float32:
+            points = np.ascontiguousarray(points, dtype=np.float64)
+        points = np.ascontiguousarray(points)
+        point_type = POINT_TYPE_FLOAT32 if points.dtype == np.float32 else POINT_TYPE_FLOAT64
+        view = point_cloud_view_t()
+        core.point_cloud_view_init(ctypes.byref(view), points.ctypes.data, point_type, points.shape[1], 0)
+
+        output = nd_output_t()
+        core.nd_output_init_features(ctypes.byref(output), POINT_TYPE_FLOAT32 if out.dtype == np.float32 else POINT_TYPE_FLOAT64,
+                                     out.ctypes.data, out.shape[0], covariance_layout, num_labels)
+        output.padding = padding
+
+        classes_ptr = None
+        if classes is not None:
+            classes = np.ascontiguousarray(classes, dtype=np.uint16)
+            classes_ptr = classes.ctypes.data_as(ctypes.POINTER(ctypes.c_ushort))
+
+        num_downsampled_points = np.zeros(num_clouds, dtype=np.uint64)
+        statuses = np.zeros(num_clouds, dtype=np.intc)
+        if core.ndt_context_downsample_batch(self.context, ctypes.byref(view),
+                                             offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_ulong)), num_clouds,
+                                             classes_ptr, num_classes,
+                                             num_desired_points.ctypes.data_as(ctypes.POINTER(ctypes.c_ulong)),
+                                             ctypes.byref(output),
+                                             num_downsampled_points.ctypes.data_as(ctypes.POINTER(ctypes.c_ulong)),
+                                             statuses.ctypes.data_as(ctypes.POINTER(ctypes.c_int))) < 0:
+            raise RuntimeError("Error downsampling the batch!")
+
+        return num_downsampled_points
+
 
 class NDT_Sampler:
     """A class to downsample point clouds using the Normal Distribution Transform (NDT) algorithm."""
@@ -50,18 +359,22 @@ class NDT_Sampler:
         Initializes the NDT_Sampler class.
 
         Args:
-            pointcloud (np.ndarray): The point cloud to downsample.
+            pointcloud (np.ndarray): The point cloud to downsample, with the xyz coordinates in the first 3 columns. float32 clouds are downsampled in single precision, without copies.
             classes (np.ndarray, optional): The classes of the points in the point cloud. Defaults to None.
 
         Returns:
             None
         """
-        self.pointcloud: np.ndarray = pointcloud
+        # float32 clouds stay in single precision, anything else is downsampled in double
+        if pointcloud.dtype != np.float32:
+            pointcloud = np.ascontiguousarray(pointcloud, dtype=np.float64)
+        self.pointcloud: np.ndarray = np.ascontiguousarray(pointcloud)
         self.covariances: np.ndarray = None
         self.classes: np.ndarray = classes
         self.num_classes: int = num_classes if num_classes is not None else 0
         self.num_points: int = len(pointcloud)
 
+        self.num_nds: ctypes.POINTER = ctypes.pointer(ctypes.c_ulong(0))
         self.num_valid_nds: ctypes.POINTER = ctypes.pointer(ctypes.c_ulong(0))
 
         self.len_x = ctypes.pointer(ctypes.c_uint(0))
@@ -75,19 +388,25 @@ class NDT_Sampler:
         self.voxel_size = ctypes.pointer(ctypes.c_double(0.0))
 
         self.nd_array_ptr: ctypes.POINTER = ctypes.POINTER(normal_distribution_t)()
-        self.kl_divergences_ptr: ctypes.POINTER = ctypes.POINTER(kl_divergence_t)()
+        self.kl_edges_ptr: ctypes.POINTER = ctypes.POINTER(kl_edge_t)()
         self.num_kl_divergences: ctypes.POINTER = ctypes.pointer(ctypes.c_ulong(0))
 
+        # removal order of the downsampled normal distributions, computed by the first prune
+        self._order: nd_removal_order_t = None
+
         self.destroyed = False
 
 
     def cleanup(self) -> None:
 
         # free the normal distribution array
-        core.free_nds(self.nd_array_ptr, int(self.len_x.contents.value) * int(self.len_y.contents.value) * int(self.len_z.contents.value))
+        core.free_nds(self.nd_array_ptr, ctypes.c_ulong(self.num_nds.contents.value))
 
         # free the Kullback-Leibler divergence array
-        core.free_kl_divergences(self.kl_divergences_ptr)
+        core.free_kl_edges(self.kl_edges_ptr)
+
+        # free the removal order
+        self._free_removal_order()
 
         self.destroyed = True
 
@@ -108,6 +427,32 @@ class NDT_Sampler:
             ctypes.cast(self.pcl_ptr, ctypes.POINTER(ctypes.c_double)).release()
     
     
+    def _types(self) -> tuple[type, type]:
+        """
+        Gets the numpy and C types of the point cloud coordinates.
+
+        Returns:
+            tuple[type, type]: np.float32 and ctypes.c_float for float32 clouds, np.float64 and ctypes.c_double otherwise.
+        """
+
+        if self.pointcloud.dtype == np.float32:
+            return np.float32, ctypes.c_float
+        return np.float64, ctypes.c_double
+
+
+    def _free_removal_order(self) -> None:
+        """
+        Frees the removal order, if any.
+
+        Returns:
+            None
+        """
+
+        if self._order is not None:
+            core.free_nd_removal_order(ctypes.byref(self._order))
+            self._order = None
+
+
     def downsample(self, num_desired_points: int) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
         """
         Downsamples the point cloud using the NDT algorithm.
@@ -119,12 +464,15 @@ class NDT_Sampler:
             tuple[np.ndarray, np.ndarray, np.ndarray]: The downsampled point cloud, the covariances, and the classes.
         """
 
+        # single precision clouds go in and come out as float32
+        dtype, c_type = self._types()
+
         # create the point cloud pointer
-        pcl_ptr = self.pointcloud.ctypes.data_as(ctypes.POINTER(ctypes.c_double))
+        pcl_ptr = self.pointcloud.ctypes.data_as(ctypes.POINTER(c_type))
 
         # create a new point cloud array
-        new_pcl = np.zeros((num_desired_points, 3), dtype=np.float64)
-        new_pcl_ptr = new_pcl.ctypes.data_as(ctypes.POINTER(ctypes.c_double))
+        new_pcl = np.zeros((num_desired_points, 3), dtype=dtype)
+        new_pcl_ptr = new_pcl.ctypes.data_as(ctypes.POINTER(c_type))
 
         # create a pointer to store the number of downsampled points
         num_downsampled_points = ctypes.pointer(ctypes.c_ulong(0))
@@ -139,18 +487,23 @@ class NDT_Sampler:
         new_classes_ptr = new_classes.ctypes.data_as(ctypes.POINTER(ctypes.c_ushort))
 
         # create a pointer for the covariance
-        covariances = np.zeros((num_desired_points, 9), dtype=np.float64)
-        covariances_ptr = covariances.ctypes.data_as(ctypes.POINTER(ctypes.c_double))
+        covariances = np.zeros((num_desired_points, 9), dtype=dtype)
+        covariances_ptr = covariances.ctypes.data_as(ctypes.POINTER(c_type))
         
+        # the removal order belongs to the previous normal distributions
+        self._free_removal_order()
+
         # create a normal distribution array pointer reference
         nd_array_ptr_ref = ctypes.pointer(self.nd_array_ptr)
 
 
         # create a divergence array pointer reference
-        kl_divergences_ptr_ref = ctypes.pointer(self.kl_divergences_ptr)
+        kl_edges_ptr_ref = ctypes.pointer(self.kl_edges_ptr)
 
         # downsample the point cloud
-        core.ndt_downsample(pcl_ptr, 3, self.num_points,
+        downsample = core.ndt_downsample_f32 if dtype == np.float32 else core.ndt_downsample
+        # extra columns such as intensity are skipped in place, without repacking the cloud
+        downsample(pcl_ptr, self.pointcloud.shape[1], self.num_points,
                             self.len_x, self.len_y, self.len_z,
                             self.offset_x, self.offset_y, self.offset_z,
                             self.voxel_size,
@@ -159,8 +512,8 @@ class NDT_Sampler:
                             new_pcl_ptr, num_downsampled_points,
                             covariances_ptr,
                             new_classes_ptr,
-                            nd_array_ptr_ref, self.num_valid_nds,
-                            kl_divergences_ptr_ref, self.num_kl_divergences)
+                            nd_array_ptr_ref, self.num_nds, self.num_valid_nds,
+                            kl_edges_ptr_ref, self.num_kl_divergences)
         
         self.num_points = num_desired_points
 
@@ -170,67 +523,169 @@ class NDT_Sampler:
         
         return new_pcl, covariances, new_classes
 
-    def prune(self, new_desired_points: int) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+    def divergences(self) -> np.ndarray:
+        """
+        Gets a copy of the Kullback-Leibler divergences, from the largest to the smallest.
+
+        Returns:
+            np.ndarray: Structured array with the "divergence" and the "p" and "q" positions of the normal distributions in the array.
         """
-        Prunes the downsampled point cloud to the desired number of points based on its Kullback-Leibler divergences.
-        TODO: needs refactoring.
+
+        dtype = np.dtype([("divergence", np.float64), ("p", np.uint32), ("q", np.uint32)])
+        num_kl_divergences = self.num_kl_divergences.contents.value
+        if not self.kl_edges_ptr or num_kl_divergences == 0:
+            return np.zeros(0, dtype=dtype)
+        buffer = ctypes.cast(self.kl_edges_ptr, ctypes.POINTER(kl_edge_t * num_kl_divergences)).contents
+        return np.frombuffer(buffer, dtype=dtype).copy()
+
+    def downsample_into(self, num_desired_points: int, out: np.ndarray, num_labels: int = 0,
+                        covariance_layout: int = COVARIANCE_FULL, padding: int = PADDING_ZERO) -> int:
+        """
+        Downsamples the point cloud using the NDT algorithm, writing model-ready features straight into the rows of a caller buffer such as a sample of a batch.
+
+        Each row holds the mean, the covariance (9 values, or the 6 of the upper triangle) and the one-hot class. Non-finite values are written as zeros and the rows after the downsampled points follow the padding policy.
 
         Args:
-            new_desired_points (int): The number of desired points in the pruned point cloud.
+            num_desired_points (int): The number of desired points in the downsampled point cloud.
+            out (np.ndarray): float32 or float64 buffer with at least "num_desired_points" rows of the feature width, contiguous.
+            num_labels (int, optional): Number of one-hot class columns. Defaults to 0.
+            covariance_layout (int, optional): COVARIANCE_FULL or COVARIANCE_UPPER. Defaults to COVARIANCE_FULL.
+            padding (int, optional): PADDING_NONE, PADDING_ZERO or PADDING_REPEAT. Defaults to PADDING_ZERO.
+
+        Returns:
+            int: The number of downsampled rows, without the padding.
+        """
+
+        width = 3 + (6 if covariance_layout == COVARIANCE_UPPER else 9) + num_labels
+        if out.dtype not in (np.float32, np.float64) or out.ndim != 2 or out.shape[1] != width or out.shape[0] < num_desired_points or not out.flags.c_contiguous:
+            raise ValueError(f"Expected a contiguous float buffer of at least ({num_desired_points}, {width})!")
+
+        # read the point cloud in place, skipping the extra columns
+        dtype, _ = self._types()
+        point_type = POINT_TYPE_FLOAT32 if dtype == np.float32 else POINT_TYPE_FLOAT64
+        view = point_cloud_view_t()
+        core.point_cloud_view_init(ctypes.byref(view), self.pointcloud.ctypes.data, point_type, self.pointcloud.shape[1], 0)
+
+        # the features may have a different type than the point cloud
+        output = nd_output_t()
+        core.nd_output_init_features(ctypes.byref(output), POINT_TYPE_FLOAT32 if out.dtype == np.float32 else POINT_TYPE_FLOAT64,
+                                     out.ctypes.data, out.shape[0], covariance_layout, num_labels)
+        output.padding = padding
+
+        classes_ptr = None
+        if self.classes is not None:
+            classes_ptr = self.classes.ctypes.data_as(ctypes.POINTER(ctypes.c_ushort))
+
+        # the removal order belongs to the previous normal distributions
+        self._free_removal_order()
+
+        num_downsampled_points = ctypes.pointer(ctypes.c_ulong(0))
+        if core.ndt_downsample_output(ctypes.byref(view), self.num_points,
+                                      self.len_x, self.len_y, self.len_z,
+                                      self.offset_x, self.offset_y, self.offset_z,
+                                      self.voxel_size,
+                                      classes_ptr, self.num_classes,
+                                      num_desired_points,
+                                      ctypes.byref(output), num_downsampled_points,
+                                      None,
+                                      ctypes.pointer(self.nd_array_ptr), self.num_nds, self.num_valid_nds,
+                                      ctypes.pointer(self.kl_edges_ptr), self.num_kl_divergences) < 0:
+            raise RuntimeError("Error downsampling the point cloud!")
+
+        self.num_points = num_desired_points
+
+        return num_downsampled_points.contents.value
+
+
+    def removal_order(self) -> tuple[np.ndarray, np.ndarray]:
+        """
+        Gets the order in which the downsampled normal distributions are pruned, computing it on the first call.
+        Keeping "k" points keeps the last "k" normal distributions of the order, so the pruned point clouds are nested.
+
+        Returns:
+            tuple[np.ndarray, np.ndarray]: Copies of the array positions in removal order, and of the removal rank of each position (2^32 - 1 for empty voxels).
+        """
+
+        if self._order is None:
+            removal_order = nd_removal_order_t()
+            if core.order_nds(self.nd_array_ptr, self.num_nds.contents.value,
+                              self.kl_edges_ptr, self.num_kl_divergences.contents.value,
+                              ctypes.byref(removal_order)) < 0:
+                raise RuntimeError("Error ordering the normal distributions!")
+            self._order = removal_order
+
+        num_ordered = self._order.num_ordered
+        num_nds = self._order.num_nds
+        order = np.ctypeslib.as_array(self._order.order, shape=(num_ordered,)).copy() if num_ordered > 0 else np.zeros(0, dtype=np.uint32)
+        ranks = np.ctypeslib.as_array(self._order.ranks, shape=(num_nds,)).copy() if num_nds > 0 else np.zeros(0, dtype=np.uint32)
+        return order, ranks
+
+
+    def _select(self, new_desired_points: int) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+        """
+        Keeps the desired number of normal distributions following the removal order and converts them to a point cloud.
+
+        Args:
+            new_desired_points (int): The number of desired points, at most the number of downsampled points.
 
         Returns:
             tuple[np.ndarray, np.ndarray, np.ndarray]: The pruned point cloud, the covariances, and the classes.
         """
 
-        # set the argument types
-        core.prune_nds.argtypes = [
-            ctypes.POINTER(normal_distribution_t),
-            ctypes.c_uint, ctypes.c_uint, ctypes.c_uint,
-            ctypes.c_ulong, ctypes.POINTER(ctypes.c_ulong),
-            ctypes.POINTER(kl_divergence_t), ctypes.POINTER(ctypes.c_ulong)
-        ]
-        
-        # prune the normal distributions with the lowest Kullback-Leibler divergences
-        core.prune_nds(self.nd_array_ptr,
-                       self.len_x.contents.value, self.len_y.contents.value, self.len_z.contents.value,
-                       new_desired_points, self.num_valid_nds,
-                       self.kl_divergences_ptr, self.num_kl_divergences)
+        # the divergences and the order are computed once, selecting a number of points only relabels the voxels
+        self.removal_order()
+        if core.select_nds(self.nd_array_ptr, ctypes.byref(self._order),
+                           new_desired_points, self.num_valid_nds) < 0:
+            raise ValueError(f"Can not keep {new_desired_points} of {self._order.num_ordered} points!")
 
         # convert the normal distribution array to a point cloud
-        new_pcl = np.zeros((new_desired_points, 3))
-        new_pcl_ptr = new_pcl.ctypes.data_as(ctypes.POINTER(ctypes.c_double))
+        dtype, c_type = self._types()
+        new_pcl = np.zeros((new_desired_points, 3), dtype=dtype)
+        new_pcl_ptr = new_pcl.ctypes.data_as(ctypes.POINTER(c_type))
 
         # create a pointer for the number of points
         num_points_ptr = ctypes.pointer(ctypes.c_ulong(0))
 
         # create a pointer for the covariance
-        covariances = np.zeros((new_desired_points, 9), dtype=np.float64)
-        covariances_ptr = covariances.ctypes.data_as(ctypes.POINTER(ctypes.c_double))
+        covariances = np.zeros((new_desired_points, 9), dtype=dtype)
+        covariances_ptr = covariances.ctypes.data_as(ctypes.POINTER(c_type))
 
         # create a pointer for the new classes
         new_classes = np.zeros(new_desired_points, dtype=np.int16)
         new_classes_ptr = new_classes.ctypes.data_as(ctypes.POINTER(ctypes.c_ushort))
 
-        # set the argument types
-        core.to_point_cloud.argtypes = [
-            ctypes.POINTER(normal_distribution_t),
-            ctypes.c_uint, ctypes.c_uint, ctypes.c_uint,
-            ctypes.c_double, ctypes.c_double, ctypes.c_double,
-            ctypes.c_double,
-            ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_ulong),
-            ctypes.POINTER(ctypes.c_double),
-            ctypes.POINTER(ctypes.c_ushort)
-        ]
-
         # convert the normal distributions to a point cloud
-        core.to_point_cloud(self.nd_array_ptr,
-                            self.len_x.contents.value, self.len_y.contents.value, self.len_z.contents.value,
-                            self.offset_x.contents.value, self.offset_y.contents.value, self.offset_z.contents.value,
-                            self.voxel_size.contents.value,
-                            new_pcl_ptr, num_points_ptr,
-                            covariances_ptr, 
-                            new_classes_ptr)
-        
+        if dtype == np.float32:
+            core.to_point_cloud_f32(self.nd_array_ptr, self.num_nds.contents.value,
+                                new_pcl_ptr, num_points_ptr,
+                                covariances_ptr,
+                                new_classes_ptr)
+        else:
+            core.to_point_cloud(self.nd_array_ptr, self.num_nds.contents.value,
+                                self.len_x.contents.value, self.len_y.contents.value, self.len_z.contents.value,
+                                self.offset_x.contents.value, self.offset_y.contents.value, self.offset_z.contents.value,
+                                self.voxel_size.contents.value,
+                                new_pcl_ptr, num_points_ptr,
+                                covariances_ptr, 
+                                new_classes_ptr)
+
+        return new_pcl, covariances, new_classes
+
+
+    def prune(self, new_desired_points: int) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+        """
+        Prunes the downsampled point cloud to the desired number of points based on its Kullback-Leibler divergences.
+        Later calls reuse the removal order, and can also grow back up to the number of downsampled points.
+
+        Args:
+            new_desired_points (int): The number of desired points in the pruned point cloud.
+
+        Returns:
+            tuple[np.ndarray, np.ndarray, np.ndarray]: The pruned point cloud, the covariances, and the classes.
+        """
+
+        new_pcl, covariances, new_classes = self._select(new_desired_points)
+
         self.num_points = new_desired_points
         
         self.pointcloud = new_pcl
@@ -238,4 +693,19 @@ class NDT_Sampler:
         self.classes = new_classes
 
         return new_pcl, covariances, new_classes
+
+
+    def prune_many(self, targets: list[int]) -> list[tuple[np.ndarray, np.ndarray, np.ndarray]]:
+        """
+        Prunes the downsampled point cloud to several numbers of points at once, from a single removal order.
+        The pruned point clouds are nested: each one contains those with fewer points.
+
+        Args:
+            targets (list[int]): The numbers of desired points, in any order.
+
+        Returns:
+            list[tuple[np.ndarray, np.ndarray, np.ndarray]]: The pruned point cloud, the covariances, and the classes of each target.
+        """
+
+        return [self._select(target) for target in targets]
         
@@ -1,7 +1,18 @@
+import threading
 import torch
 from typing import Tuple
 import numpy as np
-from ..preprocessing.ndt_legacy import NDT_Sampler
+
+try:
+    # the extension module built with "-DNDNET_BUILD_PYTHON=ON" reads the tensors without copies and releases the GIL
+    # while it downsamples, so threads calling "ndt_preprocessing" with their own contexts run concurrently
+    import _ndnet_core
+except ImportError:
+    _ndnet_core = None
+
+# one context per thread, reused by its calls so consecutive batches downsample without allocating.
+# a context serializes its callers, so threads sharing one would wait for each other
+_contexts = threading.local()
 
 def ndt_preprocessing(num_nds: int, points: torch.Tensor, classes: torch.Tensor = None, num_classes: int = None)-> Tuple[torch.Tensor, torch.Tensor]:
     """
@@ -15,59 +26,48 @@ def ndt_preprocessing(num_nds: int, points: torch.Tensor, classes: torch.Tensor
         Tuple[torch.Tensor, torch.Tensor]: normal distribution centers and its classes
     """
 
-    # create the empty tensors
-    points_new = torch.empty((points.shape[0], num_nds, 3), dtype=torch.float32).to(points.device)
-    covs_new = torch.empty((points.shape[0], num_nds, 9), dtype=torch.float32).to(points.device)
-    if classes is not None:
-        classes_new = torch.empty((points.shape[0], num_nds, num_classes+1), dtype=torch.float32).to(points.device)
-    else:
-        classes_new = None
+    # every sample is downsampled straight into its rows of the batch: the mean, the covariance and the one-hot class.
+    # the core writes zeros for non-finite values and for the rows after the downsampled points.
+    # the samples are downsampled with a single call, packed one after the other
+    num_labels = num_classes + 1 if classes is not None else 0
+    batch_size, num_points = points.shape[0], points.shape[1]
+
+    _context = getattr(_contexts, 'context', None)
+    if _ndnet_core is not None:
+        if _context is None:
+            _context = _contexts.context = _ndnet_core.Context()
 
-    # iterate the batch dimension
-    for b in range(points.shape[0]):
+        # the points are read in place, float32 without conversion
+        points_flat = points.detach().reshape(batch_size * num_points, -1).cpu()
+        classes_flat = torch.argmax(classes, dim=2).reshape(-1).to(torch.int16).cpu() if classes is not None else None
+        features, _ = _context.downsample_batch(points_flat, [b * num_points for b in range(batch_size + 1)], [num_nds] * batch_size,
+                                                classes=classes_flat, num_classes=num_classes if num_classes is not None else 0,
+                                                num_labels=num_labels)
+        batch_t = torch.from_dlpack(features).view(batch_size, num_nds, -1)
 
-        # convert the points tensor to a numpy array
-        points_np = points[b].cpu().numpy().astype(np.float64)
+    else:
+        from ..preprocessing.ndt_legacy import NDT_Context
+        if _context is None:
+            _context = _contexts.context = NDT_Context()
+
+        batch = np.empty((batch_size, num_nds, 12 + num_labels), dtype=np.float32)
+        points_np = points.reshape(batch_size * num_points, -1).cpu().numpy()
+        offsets = np.arange(batch_size + 1, dtype=np.uint64) * num_points
 
         # convert classes tensor from one-hot encoding to class tags only and then to a numpy array
         if classes is not None:
-            classes_np = torch.argmax(classes[b], dim=1).cpu().numpy().astype(np.uint16)
+            classes_np = torch.argmax(classes, dim=2).reshape(-1).cpu().numpy().astype(np.uint16)
         else:
             classes_np = None
 
-        # create the NDT sampler
-        sampler = NDT_Sampler(points_np, classes_np, num_classes)
-
-        # downsample the point cloud
-        points_new_np, covs_new_np, classes_new_np = sampler.downsample(num_nds)
-
-        # destroy the sampler
-        sampler.cleanup()
+        _context.downsample_batch(points_np, offsets, np.full(batch_size, num_nds, dtype=np.uint64), batch.reshape(batch_size * num_nds, -1),
+                                  classes_np, num_classes if num_classes is not None else 0, num_labels)
+        batch_t = torch.from_numpy(batch)
 
-        # convert the numpy arrays to tensors
-        points_n = torch.from_numpy(points_new_np).to(points.device)
-        covs_n = torch.from_numpy(covs_new_np).to(points.device)
-        if classes is not None:
-            classes_n = torch.from_numpy(classes_new_np).to(points.device)
-
-        if classes is not None:
-            # convert the classes to one-hot encoding
-            classes_oh = torch.zeros((num_nds, num_classes+1)).float()
-            for ndi in range(num_nds):
-                classes_oh[ndi, int(classes_n[ndi])] = 1
-
-        # add the new tensors to the batch
-        points_new[b] = points_n
-        covs_new[b] = covs_n
-        if classes is not None:
-            classes_new[b] = classes_oh
-
-    # replace nan values with zeros
-    points_new = torch.nan_to_num(points_new, nan=0.0, posinf=0.0, neginf=0.0)
-    covs_new = torch.nan_to_num(covs_new, nan=0.0, posinf=0.0, neginf=0.0)
-    if classes is not None:
-        classes_new = torch.nan_to_num(classes_new, nan=0.0, posinf=0.0, neginf=0.0)
-    else:
-        classes_new = None
+    # split the batch rows into the points, the covariances and the classes, without copies
+    batch_t = batch_t.to(points.device)
+    points_new = batch_t[:, :, :3]
+    covs_new = batch_t[:, :, 3:12]
+    classes_new = batch_t[:, :, 12:] if classes is not None else None
 
     return points_new, covs_new, classes_new
@@ -0,0 +1,95 @@
+# Python extension module integration tests
+
+import array
+import sys
+import threading
+import unittest
+
+sys.path.insert(0, 'core_legacy/build')
+try:
+    import _ndnet_core
+except ImportError:
+    _ndnet_core = None
+
+# points on a ground plane and a wall, as a (num_points, 3) float64 buffer
+def make_points(num_points: int) -> memoryview:
+    values = array.array('d')
+    for i in range(num_points):
+        u, v = (i * 7919 % 4000) / 100.0, (i * 104729 % 400) / 100.0
+        values.extend([u, v * 5.0, 0.0] if i % 2 == 0 else [u, 0.0, v])
+    return memoryview(values).cast('B').cast('d', (num_points, 3))
+
+@unittest.skipIf(_ndnet_core is None, "built with -DNDNET_BUILD_PYTHON=ON only")
+class TestExtensionModule(unittest.TestCase):
+
+    def test_downsample_owns_features(self):
+        context = _ndnet_core.Context()
+        features, num_points = context.downsample(make_points(10000), 200)
+        self.assertEqual(features.shape, (200, 12))
+        self.assertEqual(num_points, 200)
+        self.assertEqual(memoryview(features).format, 'f')
+
+    def test_batch_matches_single_clouds(self):
+        points = make_points(10000)
+        features, counts = _ndnet_core.Context().downsample_batch(points, [0, 4000, 10000], [100, 150])
+        self.assertEqual(features.shape, (250, 12))
+        single, num_points = _ndnet_core.Context().downsample(points[4000:], 150)
+        self.assertEqual(memoryview(counts).tolist()[1], num_points)
+        self.assertEqual(memoryview(features).tolist()[100:], memoryview(single).tolist())
+
+    def test_threads_share_a_context(self):
+        context = _ndnet_core.Context()
+        points = make_points(5000)
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(context.downsample(points, 100)[1])) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(results, [100] * 4)
+
+    def test_invalid_arguments_are_rejected(self):
+        context = _ndnet_core.Context()
+        points = make_points(1000)
+        classes = array.array('h', [i % 5 for i in range(1000)])
+        self.assertEqual(context.downsample(points, 50, classes=classes, num_classes=4)[1], 50)
+        with self.assertRaises(ValueError):
+            context.downsample(points, 50, classes=classes, num_classes=3)
+        classes[10] = -1
+        with self.assertRaises(ValueError):
+            context.downsample(points, 50, classes=classes, num_classes=4)
+        with self.assertRaises(ValueError):
+            context.downsample_batch(points, [0, 1000], [50], classes=classes, num_classes=4)
+        with self.assertRaises(ValueError):
+            context.downsample(points, 50, covariance_layout=2)
+        with self.assertRaises(ValueError):
+            context.downsample_into(points, 50, bytearray(50 * 12 * 4), padding=-1)
+
+    def test_batch_takes_integer_arrays(self):
+        # offsets and targets given as integer arrays, as numpy arrays are, instead of lists of ints
+        class Index:
+            def __init__(self, value):
+                self.value = value
+            def __index__(self):
+                return self.value
+        points = make_points(10000)
+        expected, expected_counts = _ndnet_core.Context().downsample_batch(points, [0, 4000, 10000], [100, 150])
+        features, counts = _ndnet_core.Context().downsample_batch(points, array.array('q', [0, 4000, 10000]), [Index(100), Index(150)])
+        self.assertEqual(memoryview(counts).tolist(), memoryview(expected_counts).tolist())
+        self.assertEqual(memoryview(features).tolist(), memoryview(expected).tolist())
+        try:
+            import numpy as np
+        except ImportError:
+            return
+        features, counts = _ndnet_core.Context().downsample_batch(points, np.array([0, 4000, 10000]), np.array([100, 150], dtype=np.uint32))
+        self.assertEqual(memoryview(counts).tolist(), memoryview(expected_counts).tolist())
+
+    def test_failed_cloud_keeps_the_batch(self):
+        # the middle cloud has less points than desired, and only gets padding
+        points = make_points(10000)
+        features, counts = _ndnet_core.Context().downsample_batch(points, [0, 4000, 4050, 10000], [100, 100, 150])
+        self.assertEqual(memoryview(counts).tolist(), [100, 0, 150])
+        rows = memoryview(features).tolist()
+        self.assertTrue(all(value == 0.0 for row in rows[100:200] for value in row))
+        single, _ = _ndnet_core.Context().downsample(points[4050:], 150)
+        self.assertEqual(rows[200:], memoryview(single).tolist())
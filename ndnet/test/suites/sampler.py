@@ -0,0 +1,43 @@
+# NDT sampler integration tests
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, '.')
+os.environ.setdefault('NDNET_CORE_LIB', 'core_legacy/build/libndnet.so')
+try:
+    import numpy as np
+    from ndnet.preprocessing.ndt_legacy import NDT_Sampler
+except (ImportError, OSError):
+    NDT_Sampler = None
+
+@unittest.skipIf(NDT_Sampler is None, "needs numpy and the built core library")
+class TestSampler(unittest.TestCase):
+
+    def setUp(self):
+        # points on a ground plane and a wall
+        rng = np.random.default_rng(0)
+        u, v = rng.uniform(0.0, 40.0, 10000), rng.uniform(0.0, 4.0, 10000)
+        ground = np.stack([u, v * 5.0, rng.normal(0.0, 0.02, 10000)], axis=1)
+        wall = np.stack([u, rng.normal(0.0, 0.02, 10000), v], axis=1)
+        self.points = np.concatenate([ground, wall])
+
+    def test_prune_reuses_the_removal_order(self):
+        sampler = NDT_Sampler(self.points)
+        sampler.downsample(400)
+
+        # pruning twice, growing back to more points, keeps nested point clouds
+        small, _, _ = sampler.prune(100)
+        large, covariances, classes = sampler.prune(250)
+        self.assertEqual(small.shape, (100, 3))
+        self.assertEqual(large.shape, (250, 3))
+        self.assertEqual(covariances.shape, (250, 9))
+        self.assertEqual(classes.shape, (250,))
+        kept = {tuple(point) for point in large}
+        self.assertTrue(all(tuple(point) in kept for point in small))
+
+        # several targets at once match the single prunes
+        pruned = sampler.prune_many([250, 100])
+        np.testing.assert_array_equal(pruned[0][0], large)
+        np.testing.assert_array_equal(pruned[1][0], small)
@@ -1,5 +1,7 @@
 import unittest
 from suites.libs import TestSharedLibraries
+from suites.extension import TestExtensionModule
+from suites.sampler import TestSampler
 
 if __name__ == '__main__':
     unittest.main()